@@ -1,5 +1,17 @@
 #include "libklr.h"
 
+/* Matrix products go through an internal blocked kernel, parallelized with
+   OpenMP, unless LIBKLR_USE_CBLAS is defined. Define LIBKLR_USE_CBLAS when
+   linking against a multithreaded BLAS. */
+#if !defined(LIBKLR_USE_CBLAS) && (defined(__APPLE__) || !defined(_OPENMP))
+#define LIBKLR_USE_CBLAS
+#endif
+
+/* Row, column and depth block sizes of the internal gemm kernel */
+#define GEMM_MB 8
+#define GEMM_NB 64
+#define GEMM_KB 256
+
 LIBKLR_API int nlibklr=0;
 
 LIBKLR_API int fnlibklr(void)
@@ -24,16 +36,141 @@ Clibklr::Clibklr(int c, int n)
   for(int i = 0; i < sample_num; i++){
     weight[i] = 1.0/(double)sample_num;
   }
+
+  work_c = work_n = 0;
+  Vtemp = dV = L = Ltemp = Gamma = Kones = prob = mKtrain = Y = NULL;
+  R = Rtemp = Q = Qtemp = W = RR = QQ = means = NULL;
   return;
 }
 
+Clibklr::~Clibklr()
+{
+  free_work();
+  free(weight);
+  free(Vparam);
+}
+
+void Clibklr::alloc_work(void){
+
+  int c = class_num;
+  int n = sample_num;
+
+  /* Buffers are sized by c*n, c*c and n: all must match to reuse them */
+  if(work_c == c && work_n == n){
+    return;
+  }
+  free_work();
+
+  Vtemp = malloc_double(c*n);
+  dV    = malloc_double(c*n);
+  L     = malloc_double(c*n);
+  Ltemp = malloc_double(c*n);
+  Gamma = malloc_double(c*c);
+  Kones = malloc_double(c*c);
+  prob  = malloc_double(c*n);
+  mKtrain = malloc_double(n);
+  Y     = malloc_double(c*n);
+
+  R     = malloc_double(c*n);
+  Rtemp = malloc_double(c*n);
+  means = malloc_double( n );
+  Q     = malloc_double(c*n);
+  Qtemp = malloc_double(c*n);
+  W     = malloc_double(c*n);
+  RR    = malloc_double(c*n);
+  QQ    = malloc_double(c*n);
+
+  work_c = c;
+  work_n = n;
+}
+
+void Clibklr::free_work(void){
+
+  free(Vtemp);
+  free(dV);
+  free(L);
+  free(Ltemp);
+  free(Gamma);
+  free(Kones);
+  free(prob);
+  free(mKtrain);
+  free(Y);
+  free(R);
+  free(Rtemp);
+  free(means);
+  free(Q);
+  free(Qtemp);
+  free(W);
+  free(RR);
+  free(QQ);
+
+  Vtemp = dV = L = Ltemp = Gamma = Kones = prob = mKtrain = Y = NULL;
+  R = Rtemp = Q = Qtemp = W = RR = QQ = means = NULL;
+  work_c = work_n = 0;
+}
+
+void Clibklr::gemm(bool transB, int m, int n, int k, double alpha,
+                   const double *A, int lda, const double *B, int ldb,
+                   double beta, double *C, int ldc){
+
+#ifdef LIBKLR_USE_CBLAS
+  cblas_dgemm(CblasColMajor, CblasNoTrans, transB ? CblasTrans : CblasNoTrans,
+              m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+#else
+  /* Each thread computes a block of GEMM_NB columns of C. The depth is
+     split into blocks of GEMM_KB, so that the panel of A that multiplies
+     the block stays in cache. Here, m is the number of classes: A is short
+     and wide, and GEMM_MB rows of a column of C fit in registers. */
+  int nBlocks = (n + GEMM_NB - 1) / GEMM_NB;
+#pragma omp parallel for schedule(static)
+  for(int jb = 0; jb < nBlocks; jb++){
+    int j0 = jb*GEMM_NB;
+    int j1 = (j0 + GEMM_NB < n) ? j0 + GEMM_NB : n;
+
+    for(int j = j0; j < j1; j++){
+      for(int i = 0; i < m; i++){
+        C[i+j*ldc] = (beta == 0.0) ? 0.0 : beta*C[i+j*ldc];
+      }
+    }
+
+    for(int l0 = 0; l0 < k; l0 += GEMM_KB){
+      int l1 = (l0 + GEMM_KB < k) ? l0 + GEMM_KB : k;
+      for(int j = j0; j < j1; j++){
+        for(int i0 = 0; i0 < m; i0 += GEMM_MB){
+          int mb = (i0 + GEMM_MB < m) ? GEMM_MB : m - i0;
+          double acc[GEMM_MB] = { 0 };
+          if(mb == 2){
+            /* Two classes, the common case */
+            for(int l = l0; l < l1; l++){
+              double b = transB ? B[j+l*ldb] : B[l+j*ldb];
+              acc[0] += A[i0+l*lda]*b;
+              acc[1] += A[i0+1+l*lda]*b;
+            }
+          }else{
+            for(int l = l0; l < l1; l++){
+              double b = transB ? B[j+l*ldb] : B[l+j*ldb];
+              for(int i = 0; i < mb; i++){
+                acc[i] += A[i0+i+l*lda]*b;
+              }
+            }
+          }
+          for(int i = 0; i < mb; i++){
+            C[i0+i+j*ldc] += alpha*acc[i];
+          }
+        }
+      }
+    }
+  }
+#endif
+}
+
 
 double* Clibklr::test(double *Ktest, int n_test, double *V, int c, int n_train){
   
   double *prob;
   
   prob = malloc_double(c*n_test);
-  cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n_test, n_train, 1.0, V, c,Ktest, n_train, 0.0, prob, c);
+  gemm(false, c, n_test, n_train, 1.0, V, c, Ktest, n_train, 0.0, prob, c);
   mlogistic(prob,c,n_test);    
   
   return prob;
@@ -41,63 +178,52 @@ double* Clibklr::test(double *Ktest, int n_test, double *V, int c, int n_train){
 
 void Clibklr::train(double *Ktrain, int *label){
   
-  int i,j,k;
   int c = class_num;
   int n = sample_num;
-  double val,mval;
+  double mval;
 	
-  double *Gamma;
-  double *prob;
-  double *Vtemp;
-  double *Vnew;
-  double *dV;
-  double *L;
-  double *Ltemp;
-  double *Kones;
-  double *mKtrain;
-  //double *Ytemp;
   double alpha0;
   double kmax;
   double kmax2;
-  double *Y;
   
-  Vtemp = malloc_double(c*n);
-  Vnew  = malloc_double(c*n);
-  dV    = malloc_double(c*n);
-  L     = malloc_double(c*n);
-  Ltemp = malloc_double(c*n);
-  Gamma = malloc_double(c*c);
-  Kones = malloc_double(c*c);
-  prob  = malloc_double(c*n);
-  mKtrain = malloc_double(n);
-  //Ytemp = malloc_double(c*n);
-  Y     = malloc_double(c*n); 
+  alloc_work();
   
   yconst(label,Y,c,n);
   
-  for(i = 0; i < c*c; i++){
+  for(int i = 0; i < c*c; i++){
     Gamma[i] = 0.0;
   }
   
   /* Gamma = delta/n*Y*Y'; */
-  cblas_dgemm(CblasColMajor, CblasNoTrans, CblasTrans, c, c, n, delta/(double)n, Y, c, Y, c, 0.0, Gamma, c);
+  gemm(true, c, c, n, delta/(double)n, Y, c, Y, c, 0.0, Gamma, c);
+
+  /* Largest absolute row sum of Ktrain */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int i = 0; i < n; i++){
+    double val = 0.0;
+    for(int j = 0; j < n; j++){
+      val += fabs(MAT(Ktrain,n,i,j));
+    }
+    mKtrain[i] = val;
+  }
   
   mval = -1.0;
-  for(i = 0; i < n; i++){
-    val = 0.0;
-    for(j = 0; j < n; j++){
-      val += abs(MAT(Ktrain,n,i,j));
-    }
-    if(val > mval){
-      mval = val;
+  for(int i = 0; i < n; i++){
+    if(mKtrain[i] > mval){
+      mval = mKtrain[i];
     }
   }
   
   alpha0 = 1/mval;
 	
   /**  V and prob Initialization  **/
-  for (i = 0; i < c; i++){
-    for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int j = 0; j < n; j++){
+    for (int i = 0; i < c; i++){
       MAT(Vparam,c,i,j) = alpha0*(MAT(Y,c,i,j)*weight[j] - 1.0/(double)c);
       MAT(Vtemp,c,i,j) = 0.0;
       MAT(prob,c,i,j) = 0.0;
@@ -105,45 +231,45 @@ void Clibklr::train(double *Ktrain, int *label){
   }
   
   /** V Estimation by Gradient Method **/
-  for(k = 0; k < itrKLR0; k++){
-    cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, n, 1.0, Vparam, c,Ktrain, n, 0.0, prob, c);
+  for(int k = 0; k < itrKLR0; k++){
+    gemm(false, c, n, n, 1.0, Vparam, c, Ktrain, n, 0.0, prob, c);
     mlogistic(prob,c,n);
     
-    cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, c, 1.0, Gamma, c,Vparam, c, 0.0, Vtemp, c);
+    gemm(false, c, n, c, 1.0, Gamma, c, Vparam, c, 0.0, Vtemp, c);
     
-    for(i = 0; i < c; i++){
-      for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int j = 0; j < n; j++){
+      for(int i = 0; i < c; i++){
         MAT(Vparam,c,i,j) = MAT(Vparam,c,i,j) - alpha0*((MAT(prob,c,i,j) - MAT(Y,c,i,j))*weight[j] + MAT(Vtemp,c,i,j));
       }
     }
   }
   
-  cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, n, 1.0, Vparam, c, Ktrain, n, 0.0, prob, c);
+  gemm(false, c, n, n, 1.0, Vparam, c, Ktrain, n, 0.0, prob, c);
 	
   mlogistic(prob,c,n);
   
   /** V estimation using Conjugate Gradient (CG) method **/
-  for(i = 0; i < c; i++){
-    for(j =0; j < c; j++){
+  for(int i = 0; i < c; i++){
+    for(int j =0; j < c; j++){
       MAT(Kones,c,i,j) = 1.0;
     }
   }
   
-  for (i = 0; i < c; i++){
-    for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int j = 0; j < n; j++){
+    for (int i = 0; i < c; i++){
       MAT(Ltemp,c,i,j) = MAT(prob,c,i,j)*MAT(Y,c,i,j);
     }
   }
   
-  for(i = 0; i < n; i++){
-    mKtrain[i] = 0.0;
-    for(j = 0; j < n; j++){
-      mKtrain[i] += abs(MAT(Ktrain,n,i,j));
-    }
-  }
-  
+  /* mKtrain holds the absolute row sums computed above */
   kmax = mKtrain[0];
-  for(i = 1; i < n; i++){
+  for(int i = 1; i < n; i++){
     if(kmax < mKtrain[i]){
       kmax = mKtrain[i];
     }
@@ -151,117 +277,112 @@ void Clibklr::train(double *Ktrain, int *label){
   
   kmax2 = pow(kmax,2);
   
-  cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, c, 1.0, Kones, c,Ltemp, c, 0.0, L, c);
+  gemm(false, c, n, c, 1.0, Kones, c, Ltemp, c, 0.0, L, c);
   
-  for (i = 0; i < c; i++){
-    for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int j = 0; j < n; j++){
+    for (int i = 0; i < c; i++){
       MAT(L,c,i,j) = -2.0/kmax2*(MAT(Y,c,i,j) - 1.0/(double)c)/MAT(L,c,i,j);
     }
   }
   
-  cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, n, 1.0, L, c,
-              Ktrain, n, 0.0, dV, c);
+  gemm(false, c, n, n, 1.0, L, c, Ktrain, n, 0.0, dV, c);
   
   /*Conjugate Gradient estimation;*/
-  for(k = 0; k < itrNewton; k++){
+  for(int k = 0; k < itrNewton; k++){
     CG(prob,Ktrain,Y,Gamma,c,n,dV,itrCG);	
     
-    for(i = 0; i < c; i++){
-      for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int j = 0; j < n; j++){
+      for(int i = 0; i < c; i++){
         MAT(Vparam,c,i,j) = MAT(Vparam,c,i,j) - 1.0*MAT(dV,c,i,j);
       }
     }
     
-    cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, n, 1.0, Vparam, c, Ktrain, n, 0.0, prob, c);
+    gemm(false, c, n, n, 1.0, Vparam, c, Ktrain, n, 0.0, prob, c);
     mlogistic(prob,c,n);
   }
-  
-  
-  free(Gamma);
-  free(prob);
-  free(Vtemp);
-  free(Vnew);
-  free(dV);
-  free(L);
-  free(Ltemp);
-  free(Kones);
-  free(mKtrain);
 }
 
 void Clibklr::CG(double *prob,double *Ktrain, double *Y,double *Gamma,int c,int n,double *dV,int itrCG){
   
-  int i,j,k;
-  double *R;
-  double *Rtemp;
-  double *Q;
-  double *Qtemp;
-  double *W;
-  double *RR;
-  double *QQ;
-  double *means;
   double normRR  = 0.0;
   double normRRtmp = 0.0;
   double normQQ   = 0.0;
   double alpha  = 0.0;
   double beta   = 0.0;
-  //double normR  = 0.0;
   double tparam_temp = 0.0;
   int  itrcount = 0;
 	
-  R     = malloc_double(c*n);
-  Rtemp = malloc_double(c*n);
-  means = malloc_double( n );
-  Q     = malloc_double(c*n);
-  Qtemp = malloc_double(c*n);
-  W     = malloc_double(c*n);
-  RR   = malloc_double(c*n);
-  QQ    = malloc_double(c*n);
+  alloc_work();
   
-  cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, c, 1.0, Gamma, c,Vparam, c, 0.0, R, c);
+  gemm(false, c, n, c, 1.0, Gamma, c, Vparam, c, 0.0, R, c);
 	
-  for(i = 0; i < c; i++){
-    for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int j = 0; j < n; j++){
+    for(int i = 0; i < c; i++){
       MAT(R,c,i,j) = weight[j]*(MAT(prob,c,i,j) - MAT(Y,c,i,j)) + MAT(R,c,i,j);
     }
   }
   
-  cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, n, 1.0, dV, c,Ktrain, n, 0.0, W, c);
+  gemm(false, c, n, n, 1.0, dV, c, Ktrain, n, 0.0, W, c);
   
-  for(i = 0; i < n; i++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int i = 0; i < n; i++){
     means[i] = 0.0;
-    for(j = 0; j < c; j++){
+    for(int j = 0; j < c; j++){
       means[i] += MAT(prob,c,j,i)*MAT(W,c,j,i);
     }
   }
   
-  cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, c, 1.0, Gamma, c,dV, c, 0.0, Rtemp, c);
+  gemm(false, c, n, c, 1.0, Gamma, c, dV, c, 0.0, Rtemp, c);
   
-  for(i = 0; i < c; i++){
-    for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int j = 0; j < n; j++){
+    for(int i = 0; i < c; i++){
       MAT(R,c,i,j) = MAT(R,c,i,j) - weight[j]*(MAT(W,c,i,j) - means[j])*MAT(prob,c,i,j) - MAT(Rtemp,c,i,j);
     }
   }
   
-  for(i = 0; i < n; i++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int i = 0; i < n; i++){
     means[i] = 0.0;
-    for(j = 0; j < c; j++){
+    for(int j = 0; j < c; j++){
       means[i] += MAT(prob,c,j,i)*MAT(R,c,j,i);
     }
   }
   
-  for(i = 0; i < c; i++){
-    for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int j = 0; j < n; j++){
+    for(int i = 0; i < c; i++){
       MAT(W,c,i,j) = weight[j]*(MAT(R,c,i,j) - means[j])*MAT(prob,c,i,j);
     }
   }
   
-  cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, n, 1.0, W, c,Ktrain, n, 0.0, Q, c);
+  gemm(false, c, n, n, 1.0, W, c, Ktrain, n, 0.0, Q, c);
   
-  cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, c, 1.0, Gamma, c,R, c, 0.0, Qtemp, c);
+  gemm(false, c, n, c, 1.0, Gamma, c, R, c, 0.0, Qtemp, c);
   
   normRR = 0.0;
-  for(i = 0; i < c; i++){
-    for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+:normRR)
+#endif
+  for(int j = 0; j < n; j++){
+    for(int i = 0; i < c; i++){
       MAT(Q,c,i,j) = MAT(Q,c,i,j) + MAT(Qtemp,c,i,j);
       normRR += pow(MAT(Q,c,i,j),2);
     }
@@ -271,23 +392,28 @@ void Clibklr::CG(double *prob,double *Ktrain, double *Y,double *Gamma,int c,int
   
 	
   itrcount = 0;
-  for(k = 0; k < itrCG; k++){
-    //normR = norm(R,c,n);
+  for(int k = 0; k < itrCG; k++){
     itrcount++;
     
-    cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, n, 1.0, Q, c, Ktrain, n, 0.0, W, c);
+    gemm(false, c, n, n, 1.0, Q, c, Ktrain, n, 0.0, W, c);
     
-    for(i = 0; i < n; i++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int i = 0; i < n; i++){
       means[i] = 0.0;
-      for(j = 0; j < c; j++){
+      for(int j = 0; j < c; j++){
         means[i] += MAT(prob,c,j,i)*MAT(W,c,j,i);
       }
     }
     
-    cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, c, 1.0, Gamma, c, Q, c, 0.0, Qtemp, c);
+    gemm(false, c, n, c, 1.0, Gamma, c, Q, c, 0.0, Qtemp, c);
     
-    for(i = 0; i < c; i++){
-      for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int j = 0; j < n; j++){
+      for(int i = 0; i < c; i++){
         MAT(QQ,c,i,j) = weight[j]*(MAT(W,c,i,j) - means[j])*MAT(prob,c,i,j) + MAT(Qtemp,c,i,j);
       }
     }
@@ -297,8 +423,11 @@ void Clibklr::CG(double *prob,double *Ktrain, double *Y,double *Gamma,int c,int
     alpha = pow(normRR/normQQ,2);
     
     tparam_temp = 0.0;
-    for(i = 0; i < c; i++){
-      for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+:tparam_temp)
+#endif
+    for(int j = 0; j < n; j++){
+      for(int i = 0; i < c; i++){
         MAT(dV,c,i,j) = MAT(dV,c,i,j) + alpha*MAT(Q,c,i,j);
         MAT(R,c,i,j)  = MAT(R,c,i,j) - alpha*MAT(QQ,c,i,j);
         tparam_temp += pow(alpha*MAT(Q,c,i,j),2);
@@ -311,27 +440,36 @@ void Clibklr::CG(double *prob,double *Ktrain, double *Y,double *Gamma,int c,int
       break;
     }
     
-    for(i = 0; i < n; i++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int i = 0; i < n; i++){
       means[i] = 0.0;
-      for(j = 0; j < c; j++){
+      for(int j = 0; j < c; j++){
         means[i] += MAT(prob,c,j,i)*MAT(R,c,j,i);
       }
     }
     
-    for(i = 0; i < c; i++){
-      for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int j = 0; j < n; j++){
+      for(int i = 0; i < c; i++){
         MAT(W,c,i,j) = weight[j]*(MAT(R,c,i,j) - means[j])*MAT(prob,c,i,j);
       }
     }
     
-    cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, n, 1.0, W, c,Ktrain, n, 0.0, RR, c);
+    gemm(false, c, n, n, 1.0, W, c, Ktrain, n, 0.0, RR, c);
     
     
-    cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, c, n, c, 1.0, Gamma, c,R, c, 0.0, Qtemp, c);
+    gemm(false, c, n, c, 1.0, Gamma, c, R, c, 0.0, Qtemp, c);
     
     normRRtmp = 0.0;
-    for(i = 0; i < c; i++){
-      for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+:normRRtmp)
+#endif
+    for(int j = 0; j < n; j++){
+      for(int i = 0; i < c; i++){
         MAT(RR,c,i,j) = MAT(RR,c,i,j) + MAT(Qtemp,c,i,j);
         normRRtmp += pow(MAT(RR,c,i,j),2);
       }
@@ -341,31 +479,27 @@ void Clibklr::CG(double *prob,double *Ktrain, double *Y,double *Gamma,int c,int
     beta = pow(normRRtmp/normRR,2);
     normRR = normRRtmp;
     
-    for(i = 0; i < c; i++){
-      for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int j = 0; j < n; j++){
+      for(int i = 0; i < c; i++){
         MAT(Q,c,i,j)  = MAT(RR,c,i,j) + beta*MAT(Q,c,i,j);
       }
     }
   }
-	
-  free(R);
-  free(Rtemp);
-  free(Q);
-  free(Qtemp);
-  free(W);
-  free(RR);
-  free(QQ);
-  free(means);
 }
 
 
 double Clibklr::norm(double *input,int c, int n){
   
-  int i,j;
   double val = 0.0;
   
-  for(i = 0; i < c; i++){
-    for(j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+:val)
+#endif
+  for(int j = 0; j < n; j++){
+    for(int i = 0; i < c; i++){
       val += pow(MAT(input,c,i,j),2);
     }
   }
@@ -377,25 +511,24 @@ double Clibklr::norm(double *input,int c, int n){
 
 void Clibklr::mlogistic(double *prob, int c, int n){
   
-  int i,j;
-  double mtemp = 0.0;
-  double stemp = 0.0;
-  
-  for(i = 0; i < n; i++){
-    mtemp = MAT(prob,c,0,i);
-    for(j = 1; j < c; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int i = 0; i < n; i++){
+    double mtemp = MAT(prob,c,0,i);
+    for(int j = 1; j < c; j++){
       if(MAT(prob,c,j,i) > mtemp){
         mtemp = MAT(prob,c,j,i);
       }
     }
     
-    stemp = 0.0;
-    for(j = 0; j < c; j++){
+    double stemp = 0.0;
+    for(int j = 0; j < c; j++){
       MAT(prob,c,j,i) = exp(MAT(prob,c,j,i) - mtemp);
       stemp += MAT(prob,c,j,i);
     }
 	  
-    for(j = 0; j < c; j++){
+    for(int j = 0; j < c; j++){
       MAT(prob,c,j,i) = MAT(prob,c,j,i)/stemp;
     }
   }
@@ -403,10 +536,11 @@ void Clibklr::mlogistic(double *prob, int c, int n){
 
 void Clibklr::yconst(int *label, double *Y, int c, int n){
   
-  int i,j;
-  
-  for (i = 0; i < c; i++){
-    for (j = 0; j < n; j++){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (int j = 0; j < n; j++){
+    for (int i = 0; i < c; i++){
       if((label[j]-1) == i){
         MAT(Y,c,i,j) = 1;
       }else{
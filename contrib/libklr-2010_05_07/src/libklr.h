@@ -35,8 +35,20 @@ class LIBKLR_API Clibklr {
   double *weight;       /* Importance Weight*/
   double delta;         /* Generalization parameter for KLR*/
   double *Vparam;       /* KLR parameter*/
+  
+  /* Work buffers, allocated once by alloc_work and reused by train and CG */
+  int work_c, work_n;   /* class_num and sample_num the buffers are sized for */
+  double *Vtemp, *dV, *L, *Ltemp, *Gamma, *Kones, *prob, *mKtrain, *Y;
+  double *R, *Rtemp, *Q, *Qtemp, *W, *RR, *QQ, *means;
+  void alloc_work(void);
+  void free_work(void);
+  
+  /* Not copyable: the work buffers are owned and freed by ~Clibklr */
+  Clibklr(const Clibklr&);
+  Clibklr& operator=(const Clibklr&);
 public:
 	Clibklr(int c, int n);
+	~Clibklr();
 
 	void set_class_num(int temp){class_num = temp;}
 	void set_sample_num(int temp){sample_num = temp;}
@@ -80,6 +92,10 @@ public:
 	void mlogistic(double*, int, int);
 	/* Norm computation */
 	double norm(double *input, int c, int n);
+	/* C = alpha*A*op(B) + beta*C, column-major, op(B) = B or B' */
+	static void gemm(bool transB, int m, int n, int k, double alpha,
+	                 const double *A, int lda, const double *B, int ldb,
+	                 double beta, double *C, int ldc);
 	int* malloc_int(int n);
 	double* malloc_double(int n);
 	int display_array(double*, const int, const int);
@@ -61,14 +61,29 @@ const TYPE VAR = initConst<TYPE>("NUKLEI_" #VAR, VAL)
   
   defConst(std::string, SERIALIZATION_DEFAULT_BOOST_ARCHIVE, "bxmlc");
 
+  // Relative to the largest side of the bounding box.
+  defConst(double, PACKED_POSITION_TOLERANCE, 1e-6);
+
   defConst(unsigned, IMAGE_PROJECTION_RADIUS, 3);
 
+  defConst(bool, PARTIAL_VIEW_DEPTH_BUFFER, false);
+  defConst(unsigned, DEPTH_BUFFER_RESOLUTION, 1024);
+
+  // Empty: no mesh cache.
+  defConst(std::string, MESH_CACHE_DIR, "");
+
+  // Relative to the largest weight of the model.
+  defConst(double, KLR_PRUNING_TOLERANCE, 1e-6);
+
 #ifdef __APPLE__
   defConst(std::string, PARALLELIZATION, "single");
 #else
   defConst(std::string, PARALLELIZATION, "openmp");
 #endif
 
+  // Threads of the parallelizer pool. 0: one per core.
+  defConst(unsigned, PARALLELIZATION_POOL_THREADS, 0);
+
   defConst(bool, ENABLE_CONSOLE_BACKSPACE, true);
   
   defConst(unsigned, LOG_LEVEL, 0);
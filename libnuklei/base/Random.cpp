@@ -14,6 +14,7 @@
 #include <nuklei/Random.h>
 #include <nuklei/Common.h>
 #include <nuklei/Log.h>
+#include <nuklei/parallelizer_decl.h>
 
 #include <boost/random.hpp>
 
@@ -34,8 +35,17 @@ namespace nuklei {
 
 #ifdef _OPENMP
 #include <omp.h>
+  static inline int nuklei_max_threads();
   static inline int nuklei_thread_num()
   {
+    // Workers of the thread pool get generators of their own, placed after
+    // those of the OpenMP threads. Within an OpenMP region, generators are
+    // those of the OpenMP threads.
+    if (!omp_in_parallel())
+    {
+      int slot = thread_pool::worker_slot();
+      if (slot >= 0) return nuklei_max_threads() + slot;
+    }
     return omp_get_thread_num();
   }
   static inline int nuklei_max_threads()
@@ -52,7 +62,7 @@ namespace nuklei {
 #else
   static inline int nuklei_thread_num()
   {
-    return 0;
+    return thread_pool::worker_slot() + 1;
   }
   static inline int nuklei_max_threads()
   {
@@ -60,6 +70,11 @@ namespace nuklei {
   }
 #endif
 
+  static inline int nuklei_random_gens()
+  {
+    return nuklei_max_threads() + thread_pool::MAX_WORKERS;
+  }
+
   
   // bRandGens must be a pointer. If not, its construtor may be called after
   // init() is called, which will destroy the bRandGens setup in init().
@@ -81,7 +96,7 @@ namespace nuklei {
     if (envValPara != NULL)
     {
       std::string para(envValPara);
-      if (para == "single" || para == "openmp")
+      if (para == "single" || para == "openmp" || para == "pool")
       {
         // all ok
       }
@@ -119,13 +134,13 @@ namespace nuklei {
         seed = time(NULL)*getpid(); // Unsigned don't overflow, they wrap around
     }
     
-    bRandGens = new std::vector<boost::mt19937>(nuklei_max_threads());
-    gRandGens = new std::vector<gsl_rng*>(nuklei_max_threads(), NULL);
-    for (int i = 0; i < nuklei_max_threads(); i++)
+    bRandGens = new std::vector<boost::mt19937>(nuklei_random_gens());
+    gRandGens = new std::vector<gsl_rng*>(nuklei_random_gens(), NULL);
+    for (int i = 0; i < nuklei_random_gens(); i++)
       gRandGens->at(i) = gsl_rng_alloc(gsl_rng_mt19937);
     
     mutexes = new std::vector<boost::shared_ptr<boost::mutex> >();
-    for (int i = 0; i < nuklei_max_threads(); i++)
+    for (int i = 0; i < nuklei_random_gens(); i++)
       mutexes->push_back(boost::shared_ptr<boost::mutex>(new boost::mutex()));
     
     Random::seed(seed);
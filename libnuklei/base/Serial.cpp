@@ -7,6 +7,7 @@
 #include <nuklei/Serial.h>
 #include <nuklei/Types.h>
 #include <nuklei/KernelCollection.h>
+#include <nuklei/KernelLogisticRegressor.h>
 #include <nuklei/SerialDefinitions.h>
 
 
@@ -17,6 +18,48 @@ namespace nuklei
   { "bxml", "bxmlc",
     "bbin", "bbinc" };
   
+  Serial::Type Serial::detectType(const std::string& filename)
+  {
+    NUKLEI_TRACE_BEGIN();
+    const std::streamsize headSize = 64;
+    char head[headSize];
+    std::streamsize n = 0;
+    bool compressed = false;
+    {
+      std::ifstream ifs(filename.c_str(), std::ios::in | std::ios::binary);
+      if (!ifs.is_open()) return UNKNOWN;
+      ifs.read(head, 2);
+      compressed = ifs.gcount() == 2 &&
+        (unsigned char)head[0] == 0x1f && (unsigned char)head[1] == 0x8b;
+      if (!compressed)
+      {
+        ifs.read(head + 2, headSize - 2);
+        n = 2 + ifs.gcount();
+      }
+    }
+    if (compressed)
+    {
+      try {
+        boost::iostreams::filtering_istream ifs;
+        ifs.push(boost::iostreams::gzip_decompressor());
+        ifs.push(boost::iostreams::file_source(filename));
+        ifs.read(head, headSize);
+        n = ifs.gcount();
+      } catch (std::exception &e) {
+        return UNKNOWN;
+      }
+    }
+    
+    std::string s(head, n);
+    if (s.find("<boost_serialization") != std::string::npos ||
+        s.compare(0, 5, "<?xml") == 0)
+      return compressed ? BOOSTXML_COMPRESSED : BOOSTXML;
+    if (s.find("serialization::archive") != std::string::npos)
+      return compressed ? BOOSTBIN_COMPRESSED : BOOSTBIN;
+    return UNKNOWN;
+    NUKLEI_TRACE_END();
+  }
+  
   // Template instantiations
   
   template
@@ -43,6 +86,19 @@ namespace nuklei
                 const std::string &typeName,
                 const int precision);
   
+  template
+  void Serial::readObject
+  <KernelLogisticRegressor>(KernelLogisticRegressor &object,
+                            const std::string& filename,
+                            const std::string& typeName);
+  
+  template
+  void Serial::writeObject
+  <KernelLogisticRegressor>(const KernelLogisticRegressor &object,
+                            const std::string& filename,
+                            const std::string &typeName,
+                            const int precision);
+  
   template
   void Serial::readObject
   <RGBColor>(RGBColor &object,
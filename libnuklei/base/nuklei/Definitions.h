@@ -54,9 +54,23 @@ namespace nuklei {
   // For object IO.
   extern const std::string SERIALIZATION_DEFAULT_BOOST_ARCHIVE;
 
+  // Position error allowed in packed point-cloud files.
+  extern const double PACKED_POSITION_TOLERANCE;
+
   extern const unsigned IMAGE_PROJECTION_RADIUS;
 
+  // Partial views: depth buffer instead of one ray query per point.
+  extern const bool PARTIAL_VIEW_DEPTH_BUFFER;
+  extern const unsigned DEPTH_BUFFER_RESOLUTION;
+
+  // Directory where buildMesh() caches meshes.
+  extern const std::string MESH_CACHE_DIR;
+
+  // Kernels of negligible weight are dropped from saved KLR models.
+  extern const double KLR_PRUNING_TOLERANCE;
+
   extern const std::string PARALLELIZATION;
+  extern const unsigned PARALLELIZATION_POOL_THREADS;
 
   extern const bool ENABLE_CONSOLE_BACKSPACE;
   
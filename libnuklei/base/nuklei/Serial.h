@@ -51,6 +51,14 @@ namespace nuklei {
       formats.push_back("bbin");
       formats.push_back("bxml");
       
+      // The detected format is tried first, the others only if it fails.
+      Type detected = detectType(filename);
+      if (detected != UNKNOWN)
+      {
+        formats.remove(TypeNames[detected]);
+        formats.push_front(TypeNames[detected]);
+      }
+      
       for (std::list<std::string>::const_iterator i = formats.begin();
            i != formats.end(); ++i)
       {
@@ -76,6 +84,15 @@ namespace nuklei {
       UNKNOWN } Type;
     static const Type defaultType = BOOSTBIN_COMPRESSED;
     static const std::string TypeNames[];
+    
+    /**
+     * @brief Guesses the archive type of @p filename from its first bytes.
+     *
+     * Compressed archives are recognized from their gzip header, and the
+     * first bytes of their decompressed contents tell XML archives from
+     * binary ones. Returns UNKNOWN if the file is not a Boost archive.
+     */
+    static Type detectType(const std::string& filename);
   };
   
 }
@@ -157,6 +157,114 @@ namespace nuklei {
     return retv;
   }
   
+  template<typename R, typename Callable, typename PrintAccessor>
+  std::vector<R> parallelizer::run_pool(Callable callable,
+                                        PrintAccessor pa) const
+  {
+    std::vector<R> retv(n_);
+    pool_wrapper<R, Callable> body(callable, retv);
+    parallel_for(0, n_, body, 1);
+    for (int i = 0; i < n_; ++i)
+      NUKLEI_INFO("Finished pool task " << i << " with value "
+                  << pa(retv.at(i)) << ".");
+    return retv;
+  }
+  
+  namespace parallel_detail {
+    
+    inline int grain_size(const int n, const int grain,
+                          const thread_pool& pool)
+    {
+      if (grain > 0) return grain;
+      return std::max(1, n / int(8*pool.concurrency()));
+    }
+    
+    template<typename Body>
+    class range_task : public thread_pool::task
+    {
+    public:
+      range_task(Body& body, const int begin, const int end) :
+        body_(body), begin_(begin), end_(end) {}
+      void run() { body_(begin_, end_); }
+    private:
+      Body& body_;
+      const int begin_;
+      const int end_;
+    };
+    
+    template<typename T, typename Body>
+    class reduce_task : public thread_pool::task
+    {
+    public:
+      reduce_task(Body& body, const int begin, const int end,
+                  const T& identity, T& result) :
+        body_(body), begin_(begin), end_(end),
+        identity_(identity), result_(result) {}
+      void run() { result_ = body_(begin_, end_, identity_); }
+    private:
+      Body& body_;
+      const int begin_;
+      const int end_;
+      const T& identity_;
+      T& result_;
+    };
+    
+    inline void run_tasks(const boost::ptr_vector<thread_pool::task>& tasks,
+                          thread_pool& pool)
+    {
+      std::vector<thread_pool::task*> tp;
+      tp.reserve(tasks.size());
+      for (boost::ptr_vector<thread_pool::task>::const_iterator
+           i = tasks.begin(); i != tasks.end(); ++i)
+        tp.push_back(const_cast<thread_pool::task*>(&*i));
+      pool.run(tp);
+    }
+    
+  }
+  
+  template<typename Body>
+  void parallel_for(const int first, const int last, Body& body,
+                    const int grain, thread_pool& pool)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (last <= first) return;
+    const int g = parallel_detail::grain_size(last-first, grain, pool);
+    if (last-first <= g || pool.concurrency() == 1)
+    {
+      body(first, last);
+      return;
+    }
+    boost::ptr_vector<thread_pool::task> tasks;
+    for (int b = first; b < last; b += std::min(g, last-b))
+      tasks.push_back(new parallel_detail::range_task<Body>
+                      (body, b, b + std::min(g, last-b)));
+    parallel_detail::run_tasks(tasks, pool);
+    NUKLEI_TRACE_END();
+  }
+  
+  template<typename T, typename Body, typename Join>
+  T parallel_reduce(const int first, const int last, const T& identity,
+                    Body& body, Join join,
+                    const int grain, thread_pool& pool)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (last <= first) return identity;
+    const int g = parallel_detail::grain_size(last-first, grain, pool);
+    const int n = (last-first + g-1) / g;
+    std::vector<T> partials(n, identity);
+    boost::ptr_vector<thread_pool::task> tasks;
+    for (int i = 0; i < n; ++i)
+      tasks.push_back(new parallel_detail::reduce_task<T, Body>
+                      (body, first + i*g, std::min(first + (i+1)*g, last),
+                       identity, partials.at(i)));
+    parallel_detail::run_tasks(tasks, pool);
+    T result = partials.front();
+    for (int i = 1; i < n; ++i)
+      result = join(result, partials.at(i));
+    return result;
+    NUKLEI_TRACE_END();
+  }
+  
 }
 
 #endif
@@ -12,15 +12,106 @@
 #include <nuklei/BoostSerialization.h>
 
 #include <cstdlib>
+#include <deque>
 #include <boost/filesystem.hpp>
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 
 namespace nuklei {
   
+  /**
+   * @brief Persistent pool of worker threads, used by the @c POOL backend of
+   * parallelizer, and by parallel_for() and parallel_reduce().
+   *
+   * Each worker owns a deque of tasks. It runs tasks from the back of its
+   * own deque, and when that deque is empty, it steals tasks from the front
+   * of the other deques. The thread that submits tasks with run() runs tasks
+   * too until all of its tasks are done, which makes it safe for a task to
+   * submit tasks of its own.
+   *
+   * Each worker has its own random generator (see Random), which OpenMP
+   * threads do not share.
+   */
+  class thread_pool : boost::noncopyable
+  {
+  public:
+    /** @brief Largest number of workers, over all pools. */
+    static const unsigned MAX_WORKERS = 256;
+    
+    /** @brief Unit of work run by a pool. */
+    class task
+    {
+    public:
+      virtual ~task() {}
+      virtual void run() = 0;
+    };
+    
+    /**
+     * @brief Starts @p nWorkers workers. Threads that call run() come in
+     * addition to these.
+     */
+    explicit thread_pool(const unsigned nWorkers);
+    /** @brief Stops the workers once the submitted tasks are done. */
+    ~thread_pool();
+    
+    /**
+     * @brief Returns the pool shared by the library.
+     *
+     * It is created on first use. Together with the thread that calls
+     * run(), it runs PARALLELIZATION_POOL_THREADS threads, or one per core
+     * if that constant is 0.
+     */
+    static thread_pool& instance();
+    
+    /** @brief Number of threads that run tasks, the caller of run() included. */
+    unsigned concurrency() const { return deques_.size() + 1; }
+    
+    /**
+     * @brief Runs @p tasks, and returns once they are all done.
+     *
+     * If tasks throw, the message of the first exception is rethrown as an
+     * Error once all tasks are done.
+     */
+    void run(const std::vector<task*>& tasks);
+    
+    /**
+     * @brief Returns a number that identifies the calling worker among the
+     * workers of all pools, or -1 if the caller is not a pool worker.
+     */
+    static int worker_slot();
+    
+  private:
+    struct batch;
+    struct queued_task
+    {
+      task* t;
+      batch* b;
+    };
+    struct task_deque
+    {
+      boost::mutex mutex;
+      std::deque<queued_task> tasks;
+    };
+    
+    bool pop(const int worker, queued_task& q);
+    void execute(const queued_task& q);
+    void work(const unsigned worker, const int slot);
+    
+    boost::ptr_vector<task_deque> deques_;
+    std::vector<int> slots_;
+    boost::thread_group workers_;
+    boost::mutex mutex_;
+    boost::condition_variable wakeup_;
+    // Tasks pushed and not yet popped. Incremented before tasks are pushed,
+    // so that it is never lower than the number of tasks in the deques.
+    long queued_;
+    bool stop_;
+  };
+  
   struct parallelizer
   {
-    typedef enum { OPENMP = 0, FORK, PTHREAD, SINGLE, UNKNOWN } Type;
+    typedef enum { OPENMP = 0, FORK, PTHREAD, SINGLE, POOL, UNKNOWN } Type;
     static const Type defaultType = OPENMP;
     static const std::string TypeNames[];
     
@@ -78,6 +169,9 @@ namespace nuklei {
         case SINGLE:
           return run_single<R>(callable, pa);
           break;
+        case POOL:
+          return run_pool<R>(callable, pa);
+          break;
         default:
           NUKLEI_THROW("Unknown parallelization method.");
       }
@@ -114,6 +208,25 @@ namespace nuklei {
     std::vector<R> run_single(Callable callable,
                               PrintAccessor pa) const;
     
+    template<typename R, typename Callable>
+    struct pool_wrapper
+    {
+      pool_wrapper(Callable callable, std::vector<R>& retv) :
+        callable_(callable), retv_(retv) {}
+      void operator()(const int begin, const int end)
+      {
+        for (int i = begin; i < end; ++i)
+          retv_.at(i) = callable_();
+      }
+    private:
+      Callable callable_;
+      std::vector<R>& retv_;
+    };
+    
+    template<typename R, typename Callable, typename PrintAccessor>
+    std::vector<R> run_pool(Callable callable,
+                            PrintAccessor pa) const;
+    
     static void reap();
     
     int n_;
@@ -121,6 +234,34 @@ namespace nuklei {
     unsigned long seed_;
   };
   
+  /**
+   * @brief Calls @p body(b, e) on consecutive subranges @f$ [b, e) @f$ of
+   * @f$ [first, last) @f$, on the threads of @p pool.
+   *
+   * Subranges hold @p grain indices (except the last one). If @p grain is
+   * not positive, it is chosen to make about eight subranges per thread.
+   * All calls go to the same @p body object, concurrently.
+   */
+  template<typename Body>
+  void parallel_for(const int first, const int last, Body& body,
+                    const int grain = 0,
+                    thread_pool& pool = thread_pool::instance());
+  
+  /**
+   * @brief Reduces @f$ [first, last) @f$ on the threads of @p pool.
+   *
+   * Subranges are formed as in parallel_for(). Each subrange @f$ [b, e) @f$
+   * is reduced to @p body(b, e, identity), which must return a @c T.
+   * The results of the subranges are then combined with @p join(x, y), in
+   * the order of the subranges, which makes the result independent of the
+   * scheduling.
+   */
+  template<typename T, typename Body, typename Join>
+  T parallel_reduce(const int first, const int last, const T& identity,
+                    Body& body, Join join,
+                    const int grain = 0,
+                    thread_pool& pool = thread_pool::instance());
+  
 }
 
 #endif
@@ -10,7 +10,7 @@
 
 namespace nuklei {
   
-  const std::string parallelizer::TypeNames[] = { "openmp", "fork", "pthread", "single" };
+  const std::string parallelizer::TypeNames[] = { "openmp", "fork", "pthread", "single", "pool" };
   
   void parallelizer::reap()
   {
@@ -19,4 +19,230 @@ namespace nuklei {
     while (::waitpid(-1, &status, WNOHANG) > 0) {}
   }
   
+  
+  struct thread_pool::batch
+  {
+    batch(const std::size_t n) : pending(n) {}
+    boost::mutex mutex;
+    boost::condition_variable done;
+    std::size_t pending;
+    std::string error;
+  };
+  
+  namespace {
+    
+    struct worker_info
+    {
+      worker_info(const thread_pool* p, const unsigned w, const int s) :
+        pool(p), worker(w), slot(s) {}
+      const thread_pool* pool;
+      unsigned worker;
+      int slot;
+    };
+    
+    boost::thread_specific_ptr<worker_info>& current_worker()
+    {
+      static boost::thread_specific_ptr<worker_info> info;
+      return info;
+    }
+    
+    // Worker slots in use, over all pools. Slots index the random
+    // generators of the workers (see Random.cpp).
+    boost::mutex& slot_mutex()
+    {
+      static boost::mutex m;
+      return m;
+    }
+    
+    std::vector<bool>& used_slots()
+    {
+      static std::vector<bool> used(thread_pool::MAX_WORKERS, false);
+      return used;
+    }
+    
+  }
+  
+  thread_pool::thread_pool(const unsigned nWorkers) :
+    queued_(0), stop_(false)
+  {
+    NUKLEI_TRACE_BEGIN();
+    {
+      boost::unique_lock<boost::mutex> lock(slot_mutex());
+      std::vector<bool>& used = used_slots();
+      for (unsigned s = 0; s < used.size() && slots_.size() < nWorkers; ++s)
+      {
+        if (used.at(s)) continue;
+        used.at(s) = true;
+        slots_.push_back(s);
+      }
+    }
+    if (slots_.size() < nWorkers)
+      NUKLEI_WARN("Thread pool limited to " << slots_.size() << " workers.");
+    for (unsigned w = 0; w < slots_.size(); ++w)
+      deques_.push_back(new task_deque);
+    for (unsigned w = 0; w < slots_.size(); ++w)
+      workers_.create_thread(boost::bind(&thread_pool::work, this,
+                                         w, slots_.at(w)));
+    NUKLEI_TRACE_END();
+  }
+  
+  thread_pool::~thread_pool()
+  {
+    {
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wakeup_.notify_all();
+    workers_.join_all();
+    boost::unique_lock<boost::mutex> lock(slot_mutex());
+    for (std::vector<int>::const_iterator i = slots_.begin();
+         i != slots_.end(); ++i)
+      used_slots().at(*i) = false;
+  }
+  
+  thread_pool& thread_pool::instance()
+  {
+    // Never deleted: workers may still be needed by static destructors.
+    static thread_pool* pool = NULL;
+    static boost::once_flag flag = BOOST_ONCE_INIT;
+    struct creator
+    {
+      static void create()
+      {
+        unsigned n = PARALLELIZATION_POOL_THREADS;
+        if (n == 0) n = boost::thread::hardware_concurrency();
+        pool = new thread_pool(n > 1 ? n-1 : 0);
+      }
+    };
+    boost::call_once(&creator::create, flag);
+    return *pool;
+  }
+  
+  int thread_pool::worker_slot()
+  {
+    worker_info* info = current_worker().get();
+    return info == NULL ? -1 : info->slot;
+  }
+  
+  void thread_pool::run(const std::vector<task*>& tasks)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (tasks.empty()) return;
+    batch b(tasks.size());
+    
+    if (deques_.empty())
+    {
+      for (std::vector<task*>::const_iterator i = tasks.begin();
+           i != tasks.end(); ++i)
+      {
+        queued_task q = { *i, &b };
+        execute(q);
+      }
+    }
+    else
+    {
+      worker_info* info = current_worker().get();
+      // Workers push to their own deque, and other threads spread their
+      // tasks over all deques.
+      const int self = (info != NULL && info->pool == this) ?
+        int(info->worker) : -1;
+      {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        queued_ += tasks.size();
+      }
+      for (std::size_t i = 0; i < tasks.size(); ++i)
+      {
+        task_deque& d = deques_.at(self >= 0 ? self : i % deques_.size());
+        queued_task q = { tasks.at(i), &b };
+        boost::unique_lock<boost::mutex> lock(d.mutex);
+        d.tasks.push_back(q);
+      }
+      wakeup_.notify_all();
+      
+      // Help until the tasks of this batch are done. When no task is left to
+      // steal, the remaining tasks of the batch are running on other threads.
+      for (;;)
+      {
+        queued_task q;
+        if (pop(self, q))
+          execute(q);
+        else
+          break;
+        boost::unique_lock<boost::mutex> lock(b.mutex);
+        if (b.pending == 0) break;
+      }
+      boost::unique_lock<boost::mutex> lock(b.mutex);
+      while (b.pending != 0)
+        b.done.wait(lock);
+    }
+    
+    if (!b.error.empty())
+      NUKLEI_THROW(b.error);
+    NUKLEI_TRACE_END();
+  }
+  
+  bool thread_pool::pop(const int worker, queued_task& q)
+  {
+    // Own deque first, from the back, then the others, from the front.
+    const int n = deques_.size();
+    for (int k = 0; k < n; ++k)
+    {
+      const int w = (worker < 0 ? 0 : worker) + k;
+      task_deque& d = deques_.at(w % n);
+      boost::unique_lock<boost::mutex> lock(d.mutex);
+      if (d.tasks.empty()) continue;
+      if (k == 0 && worker >= 0)
+      {
+        q = d.tasks.back();
+        d.tasks.pop_back();
+      }
+      else
+      {
+        q = d.tasks.front();
+        d.tasks.pop_front();
+      }
+      lock.unlock();
+      boost::unique_lock<boost::mutex> poolLock(mutex_);
+      --queued_;
+      return true;
+    }
+    return false;
+  }
+  
+  void thread_pool::execute(const queued_task& q)
+  {
+    std::string error;
+    try {
+      q.t->run();
+    } catch (std::exception& e) {
+      error = e.what();
+    } catch (...) {
+      error = "Unknown error in thread pool task.";
+    }
+    boost::unique_lock<boost::mutex> lock(q.b->mutex);
+    if (!error.empty() && q.b->error.empty())
+      q.b->error = error;
+    if (--q.b->pending == 0)
+      q.b->done.notify_all();
+  }
+  
+  void thread_pool::work(const unsigned worker, const int slot)
+  {
+    current_worker().reset(new worker_info(this, worker, slot));
+    for (;;)
+    {
+      queued_task q;
+      if (pop(worker, q))
+      {
+        execute(q);
+        continue;
+      }
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      while (!stop_ && queued_ == 0)
+        wakeup_.wait(lock);
+      if (stop_ && queued_ == 0)
+        return;
+    }
+  }
+  
 }
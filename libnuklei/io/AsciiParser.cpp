@@ -0,0 +1,454 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <functional>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+
+#include <nuklei/AsciiParser.h>
+#include <nuklei/ObservationIO.h>
+
+namespace nuklei {
+
+  namespace {
+
+    // Inputs are split into chunks of about this many bytes, which are
+    // parsed concurrently.
+    const size_t CHUNK_SIZE = 1 << 20;
+
+    const int MAX_DIGITS = 19;
+    const int MAX_EXACT_POW10 = 22;
+
+    const double POW10[MAX_EXACT_POW10+1] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    inline bool isSpace(const char c)
+    {
+      return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    inline bool isDelimiter(const char* p, const char* end)
+    {
+      return p == end || isSpace(*p) || *p == '\n';
+    }
+
+    inline const char* skipSpaces(const char* p, const char* end)
+    {
+      while (p != end && isSpace(*p)) ++p;
+      return p;
+    }
+
+    inline const char* endOfLine(const char* p, const char* end)
+    {
+      const char* eol =
+        static_cast<const char*>(std::memchr(p, '\n', end - p));
+      return eol == NULL ? end : eol;
+    }
+
+    // Conversion of the token [p, end) through strtod, which needs a
+    // null-terminated string.
+    bool slowParse(const char* &p, const char* end, coord_t &value)
+    {
+      const char* tokenEnd = p;
+      while (!isDelimiter(tokenEnd, end)) ++tokenEnd;
+      std::string token(p, tokenEnd);
+      char* parsedEnd = NULL;
+      double v = std::strtod(token.c_str(), &parsedEnd);
+      if (token.empty() || parsedEnd != token.c_str() + token.size())
+        return false;
+      value = v;
+      p = tokenEnd;
+      return true;
+    }
+
+    // Splits [begin, end) into ranges of about CHUNK_SIZE bytes that start
+    // at the beginning of a line.
+    std::vector<const char*> chunkBoundaries(const char* begin,
+                                             const char* end)
+    {
+      std::vector<const char*> bounds;
+      bounds.push_back(begin);
+      const char* p = begin;
+      while (end - p > ptrdiff_t(CHUNK_SIZE))
+      {
+        p = endOfLine(p + CHUNK_SIZE, end);
+        if (p != end) ++p;
+        if (p == end) break;
+        bounds.push_back(p);
+      }
+      bounds.push_back(end);
+      return bounds;
+    }
+
+    struct TableChunk
+    {
+      TableChunk() : firstBlank(NULL), lastRow(NULL), error(NULL) {}
+      std::vector<coord_t> values;
+      std::vector<unsigned char> widths;
+      // First blank line, and beginning of the last non-blank line.
+      const char* firstBlank;
+      const char* lastRow;
+      const char* error;
+      std::string message;
+    };
+
+    void parseTableChunk(TableChunk &c, const char* begin, const char* end,
+                         const unsigned minColumns, const unsigned maxColumns,
+                         const bool ignoreExtraColumns)
+    {
+      // Typical lines hold one number per 8 to 20 bytes.
+      c.values.reserve((end - begin) / 8);
+      c.widths.reserve((end - begin) / (8 * std::max(minColumns, 1u)));
+      const char* line = begin;
+      while (line != end)
+      {
+        const char* eol = endOfLine(line, end);
+        const char* p = skipSpaces(line, eol);
+        if (p == eol)
+        {
+          if (c.firstBlank == NULL) c.firstBlank = line;
+        }
+        else
+        {
+          unsigned width = 0;
+          while (p != eol && width < maxColumns)
+          {
+            coord_t v;
+            if (!parseAsciiNumber(p, eol, v))
+            {
+              c.error = line;
+              c.message = "Parsing error on token `" +
+                std::string(p, std::find_if(p, eol, std::ptr_fun(isSpace))) +
+                "'.";
+              return;
+            }
+            c.values.push_back(v);
+            ++width;
+            p = skipSpaces(p, eol);
+          }
+          if (p != eol && !ignoreExtraColumns)
+          {
+            c.error = line;
+            c.message = "Too many tokens on line (expected at most " +
+              stringify(maxColumns) + ").";
+            return;
+          }
+          if (width < minColumns)
+          {
+            c.error = line;
+            c.message = "Too few tokens on line (" + stringify(width) +
+              ", expected at least " + stringify(minColumns) + ").";
+            return;
+          }
+          c.widths.push_back(width);
+          c.lastRow = line;
+        }
+        line = (eol == end) ? end : eol + 1;
+      }
+    }
+
+    struct NumberChunk
+    {
+      NumberChunk() : error(NULL) {}
+      std::vector<coord_t> values;
+      const char* error;
+    };
+
+    void parseNumberChunk(NumberChunk &c, const char* begin, const char* end)
+    {
+      c.values.reserve((end - begin) / 8);
+      const char* p = begin;
+      for (;;)
+      {
+        while (p != end && (isSpace(*p) || *p == '\n')) ++p;
+        if (p == end) break;
+        coord_t v;
+        if (!parseAsciiNumber(p, end, v))
+        {
+          c.error = p;
+          return;
+        }
+        c.values.push_back(v);
+      }
+    }
+
+    // Number of lines in [begin, p), plus one.
+    size_t lineNumber(const char* begin, const char* p)
+    {
+      return std::count(begin, p, '\n') + 1;
+    }
+
+  }
+
+
+  void AsciiFile::open(const std::string &fileName)
+  {
+    NUKLEI_TRACE_BEGIN();
+    close();
+    // Empty files cannot be mapped.
+    boost::system::error_code ec;
+    boost::uintmax_t size = boost::filesystem::file_size(fileName, ec);
+    if (!ec && size == 0)
+    {
+      isEmpty_ = true;
+      return;
+    }
+    try {
+      file_.open(fileName);
+    } catch (std::exception &e) {
+      throw ObservationIOError(std::string("Could not open file ") +
+                               fileName + " for reading.");
+    }
+    begin_ = file_.data();
+    end_ = begin_ + file_.size();
+    cursor_ = begin_;
+    NUKLEI_TRACE_END();
+  }
+
+  void AsciiFile::close()
+  {
+    if (file_.is_open()) file_.close();
+    isEmpty_ = false;
+    begin_ = end_ = cursor_ = NULL;
+  }
+
+  bool AsciiFile::getLine(std::string &line)
+  {
+    if (cursor_ == end_) return false;
+    const char* eol = endOfLine(cursor_, end_);
+    const char* lineEnd = eol;
+    if (lineEnd != cursor_ && *(lineEnd-1) == '\r') --lineEnd;
+    line.assign(cursor_, lineEnd);
+    cursor_ = (eol == end_) ? end_ : eol + 1;
+    return true;
+  }
+
+  bool AsciiFile::getToken(std::string &token)
+  {
+    while (cursor_ != end_ && (isSpace(*cursor_) || *cursor_ == '\n'))
+      ++cursor_;
+    if (cursor_ == end_) return false;
+    const char* tokenEnd = cursor_;
+    while (!isDelimiter(tokenEnd, end_)) ++tokenEnd;
+    token.assign(cursor_, tokenEnd);
+    cursor_ = tokenEnd;
+    return true;
+  }
+
+
+  bool parseAsciiNumber(const char* &p, const char* end, coord_t &value)
+  {
+    const char* s = p;
+    bool negative = false;
+    if (s != end && (*s == '-' || *s == '+'))
+    {
+      negative = (*s == '-');
+      ++s;
+    }
+
+    boost::uint64_t mantissa = 0;
+    int nDigits = 0, exponent = 0;
+    bool anyDigit = false, truncated = false;
+    for (; s != end && *s >= '0' && *s <= '9'; ++s)
+    {
+      anyDigit = true;
+      if (nDigits < MAX_DIGITS)
+      {
+        mantissa = 10*mantissa + (*s - '0');
+        if (mantissa != 0) ++nDigits;
+      }
+      else
+      {
+        ++exponent;
+        truncated = true;
+      }
+    }
+    if (s != end && *s == '.')
+    {
+      ++s;
+      for (; s != end && *s >= '0' && *s <= '9'; ++s)
+      {
+        anyDigit = true;
+        if (nDigits < MAX_DIGITS)
+        {
+          mantissa = 10*mantissa + (*s - '0');
+          if (mantissa != 0) ++nDigits;
+          --exponent;
+        }
+        else truncated = true;
+      }
+    }
+    // nan, inf, hexadecimal floats...
+    if (!anyDigit) return slowParse(p, end, value);
+
+    if (s != end && (*s == 'e' || *s == 'E'))
+    {
+      ++s;
+      bool negativeExponent = false;
+      if (s != end && (*s == '-' || *s == '+'))
+      {
+        negativeExponent = (*s == '-');
+        ++s;
+      }
+      if (s == end || *s < '0' || *s > '9') return false;
+      int e = 0;
+      for (; s != end && *s >= '0' && *s <= '9'; ++s)
+        if (e < 100000) e = 10*e + (*s - '0');
+      exponent += negativeExponent ? -e : e;
+    }
+    if (!isDelimiter(s, end)) return false;
+
+    if (truncated || exponent < -MAX_EXACT_POW10 || exponent > MAX_EXACT_POW10)
+      return slowParse(p, end, value);
+
+    double v;
+    if (mantissa < (boost::uint64_t(1) << 53))
+    {
+      // Both operands are exact, the result is correctly rounded.
+      v = double(mantissa);
+      if (exponent < 0) v /= POW10[-exponent];
+      else v *= POW10[exponent];
+    }
+    else
+    {
+#if LDBL_MANT_DIG >= 64
+      // The mantissa is exact in extended precision. The product (or
+      // quotient) is rounded once to 64 bits, then to 53. That second
+      // rounding is only wrong if the first one landed exactly halfway
+      // between two doubles.
+      long double r = (long double)(mantissa);
+      if (exponent < 0) r /= POW10[-exponent];
+      else r *= POW10[exponent];
+      int e;
+      boost::uint64_t bits =
+        boost::uint64_t(std::ldexp(std::frexp(r, &e), 64));
+      if ((bits & 0x7ff) == 0x400) return slowParse(p, end, value);
+      v = double(r);
+#else
+      return slowParse(p, end, value);
+#endif
+    }
+    value = negative ? -v : v;
+    p = s;
+    return true;
+  }
+
+
+  void parseAsciiNumbers(std::vector<coord_t> &values,
+                         const char* begin, const char* end)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (begin == end) return;
+    std::vector<const char*> bounds = chunkBoundaries(begin, end);
+    int nChunks = bounds.size() - 1;
+    std::vector<NumberChunk> chunks(nChunks);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < nChunks; ++i)
+      parseNumberChunk(chunks[i], bounds[i], bounds[i+1]);
+
+    size_t n = values.size();
+    for (int i = 0; i < nChunks; ++i)
+    {
+      if (chunks[i].error != NULL)
+        throw ObservationIOError("Parsing error on line " +
+                                 stringify(lineNumber(begin, chunks[i].error)) +
+                                 ".");
+      n += chunks[i].values.size();
+    }
+    values.reserve(n);
+    for (int i = 0; i < nChunks; ++i)
+      values.insert(values.end(),
+                    chunks[i].values.begin(), chunks[i].values.end());
+    NUKLEI_TRACE_END();
+  }
+
+
+  void AsciiTable::parse(const char* begin, const char* end,
+                         const unsigned minColumns, const unsigned maxColumns,
+                         const bool ignoreExtraColumns)
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_ASSERT(minColumns <= maxColumns);
+    NUKLEI_ASSERT(maxColumns <= std::numeric_limits<unsigned char>::max());
+    clear();
+    if (begin == end) return;
+
+    std::vector<const char*> bounds = chunkBoundaries(begin, end);
+    int nChunks = bounds.size() - 1;
+    std::vector<TableChunk> chunks(nChunks);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < nChunks; ++i)
+      parseTableChunk(chunks[i], bounds[i], bounds[i+1],
+                      minColumns, maxColumns, ignoreExtraColumns);
+
+    size_t nValues = 0, nRows = 0;
+    const char* firstBlank = NULL;
+    for (int i = 0; i < nChunks; ++i)
+    {
+      const TableChunk &c = chunks[i];
+      if (c.error != NULL)
+        throw ObservationIOError(c.message + " (line " +
+                                 stringify(lineNumber(begin, c.error)) + ")");
+      if (firstBlank == NULL) firstBlank = c.firstBlank;
+      if (firstBlank != NULL && c.lastRow != NULL && c.lastRow > firstBlank)
+        throw ObservationIOError("Unexpected empty line (line " +
+                                 stringify(lineNumber(begin, firstBlank)) +
+                                 ").");
+      nValues += c.values.size();
+      nRows += c.widths.size();
+    }
+
+    values_.reserve(nValues);
+    widths_.reserve(nRows);
+    for (int i = 0; i < nChunks; ++i)
+    {
+      values_.insert(values_.end(),
+                     chunks[i].values.begin(), chunks[i].values.end());
+      widths_.insert(widths_.end(),
+                     chunks[i].widths.begin(), chunks[i].widths.end());
+    }
+    NUKLEI_TRACE_END();
+  }
+
+  bool AsciiTable::isUniform() const
+  {
+    for (size_t i = 1; i < widths_.size(); ++i)
+      if (widths_[i] != widths_.front()) return false;
+    return true;
+  }
+
+
+  const char* skipAsciiLines(const char* begin, const char* end,
+                             const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    const char* p = begin;
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (p == end)
+        throw ObservationIOError("Unexpected end of file.");
+      p = endOfLine(p, end);
+      if (p != end) ++p;
+    }
+    return p;
+    NUKLEI_TRACE_END();
+  }
+
+}
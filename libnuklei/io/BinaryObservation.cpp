@@ -0,0 +1,21 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <nuklei/BinaryObservation.h>
+
+
+namespace nuklei {
+  
+  BinaryObservation::BinaryObservation()
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_TRACE_END();
+  }
+
+  BinaryObservation::BinaryObservation(const kernel::base& k) : k_(k)
+  {}
+
+}
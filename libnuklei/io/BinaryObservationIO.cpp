@@ -0,0 +1,446 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <boost/filesystem.hpp>
+
+#include <nuklei/BinaryObservationIO.h>
+#include <nuklei/BinaryObservation.h>
+
+namespace nuklei {
+
+  unsigned BinaryFileHeader::width(const Field field,
+                                   const kernel::base::Type type)
+  {
+    switch (field)
+    {
+      case LOC: return 3;
+      case ORI:
+        if (type == kernel::base::SE3) return 4;
+        if (type == kernel::base::R3XS2 || type == kernel::base::R3XS2P)
+          return 3;
+        return 0;
+      case LOC_H: return 1;
+      case ORI_H: return type == kernel::base::R3 ? 0 : 1;
+      case WEIGHT: return 1;
+      case COLOR: return 3;
+      default: NUKLEI_THROW("Unknown field.");
+    }
+  }
+
+
+  BinaryReader::BinaryReader(const std::string &observationFileName) :
+    observationFileName_(observationFileName), idx_(0), inited_(false)
+  {
+    std::memset(&header_, 0, sizeof(header_));
+    std::fill(fields_, fields_ + BinaryFileHeader::N_FIELDS,
+              static_cast<const coord_t*>(NULL));
+  }
+
+  BinaryReader::~BinaryReader()
+  {
+  }
+
+  void BinaryReader::init_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    typedef BinaryFileHeader H;
+
+    inited_ = false;
+    if (file_.is_open()) file_.close();
+    try {
+      file_.open(observationFileName_);
+    } catch (std::exception &e) {
+      throw ObservationIOError(std::string("Could not open file ") +
+                               observationFileName_ + " for reading.");
+    }
+
+    if (file_.size() < sizeof(H))
+      throw ObservationIOError("Input does not look like Nuklei binary (too short).");
+    std::memcpy(&header_, file_.data(), sizeof(H));
+    if (!std::equal(header_.magic_, header_.magic_ + H::MAGIC_SIZE, H::magic()))
+      throw ObservationIOError("Input does not look like Nuklei binary (no magic).");
+    if (header_.byteOrder != H::BYTE_ORDER_MARK)
+      throw ObservationIOError("Nuklei binary file written with a different byte order.");
+    if (header_.version != H::VERSION)
+      throw ObservationIOError("Unsupported Nuklei binary version " +
+                               stringify(header_.version) + ".");
+    if (header_.kernelType > kernel::base::SE3)
+      throw ObservationIOError("Unknown kernel type in Nuklei binary file.");
+    if (header_.count > std::numeric_limits<unsigned>::max())
+      throw ObservationIOError("Too many points in Nuklei binary file.");
+
+    kernel::base::Type type = kernel::base::Type(header_.kernelType);
+    for (int f = 0; f < H::N_FIELDS; ++f)
+    {
+      fields_[f] = NULL;
+      unsigned width = H::width(H::Field(f), type);
+      boost::uint64_t offset = header_.offsets[f];
+      if (offset == 0)
+      {
+        if (width != 0 && f != H::COLOR)
+          throw ObservationIOError("Missing field in Nuklei binary file.");
+        continue;
+      }
+      // count is bounded above, so the field size cannot overflow, but a
+      // corrupt offset could make offset + size wrap around.
+      if (width == 0 || offset % H::ALIGNMENT != 0 ||
+          offset > file_.size() ||
+          header_.count*width*sizeof(coord_t) > file_.size() - offset)
+        throw ObservationIOError("Corrupted Nuklei binary file.");
+      fields_[f] = reinterpret_cast<const coord_t*>(file_.data() + offset);
+    }
+
+    idx_ = 0;
+    inited_ = true;
+    NUKLEI_TRACE_END();
+  }
+
+  void BinaryReader::reset()
+  {
+    NUKLEI_TRACE_BEGIN();
+    init();
+    NUKLEI_TRACE_END();
+  }
+
+  Vector3 BinaryReader::boundingBoxMin() const
+  {
+    return Vector3(header_.bboxMin[0], header_.bboxMin[1], header_.bboxMin[2]);
+  }
+
+  Vector3 BinaryReader::boundingBoxMax() const
+  {
+    return Vector3(header_.bboxMax[0], header_.bboxMax[1], header_.bboxMax[2]);
+  }
+
+  std::auto_ptr<kernel::base> BinaryReader::kernelAt(const boost::uint64_t i) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    typedef BinaryFileHeader H;
+
+    const coord_t* loc = fields_[H::LOC] + 3*i;
+    const coord_t* ori = fields_[H::ORI];
+    coord_t locH = fields_[H::LOC_H][i];
+    coord_t oriH = fields_[H::ORI_H] ? fields_[H::ORI_H][i] : 0;
+
+    std::auto_ptr<kernel::base> k;
+    switch (header_.kernelType)
+    {
+      case kernel::base::R3:
+      {
+        std::auto_ptr<kernel::r3> r(new kernel::r3);
+        r->loc_ = Vector3(loc[0], loc[1], loc[2]);
+        r->loc_h_ = locH;
+        k = r;
+        break;
+      }
+      case kernel::base::R3XS2:
+      {
+        std::auto_ptr<kernel::r3xs2> r(new kernel::r3xs2);
+        r->loc_ = Vector3(loc[0], loc[1], loc[2]);
+        r->dir_ = Vector3(ori[3*i], ori[3*i+1], ori[3*i+2]);
+        r->loc_h_ = locH;
+        r->dir_h_ = oriH;
+        k = r;
+        break;
+      }
+      case kernel::base::R3XS2P:
+      {
+        std::auto_ptr<kernel::r3xs2p> r(new kernel::r3xs2p);
+        r->loc_ = Vector3(loc[0], loc[1], loc[2]);
+        r->dir_ = Vector3(ori[3*i], ori[3*i+1], ori[3*i+2]);
+        r->loc_h_ = locH;
+        r->dir_h_ = oriH;
+        k = r;
+        break;
+      }
+      case kernel::base::SE3:
+      {
+        std::auto_ptr<kernel::se3> r(new kernel::se3);
+        r->loc_ = Vector3(loc[0], loc[1], loc[2]);
+        r->ori_ = Quaternion(ori[4*i], ori[4*i+1], ori[4*i+2], ori[4*i+3]);
+        r->loc_h_ = locH;
+        r->ori_h_ = oriH;
+        k = r;
+        break;
+      }
+      default:
+        NUKLEI_THROW("Unknown kernel type.");
+    }
+
+    k->setWeight(fields_[H::WEIGHT][i]);
+    if (fields_[H::COLOR])
+    {
+      const coord_t* c = fields_[H::COLOR] + 3*i;
+      ColorDescriptor d;
+      d.setColor(RGBColor(c[0], c[1], c[2]));
+      k->setDescriptor(d);
+    }
+    return k;
+    NUKLEI_TRACE_END();
+  }
+
+  std::auto_ptr<Observation> BinaryReader::readObservation_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!inited_) NUKLEI_THROW("Reader does not seem inited.");
+    if (idx_ >= header_.count)
+      return std::auto_ptr<Observation>();
+    std::auto_ptr<kernel::base> k = kernelAt(idx_++);
+    return std::auto_ptr<Observation>(new BinaryObservation(*k));
+    NUKLEI_TRACE_END();
+  }
+
+  size_t BinaryReader::readKernels_(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!inited_) NUKLEI_THROW("Reader does not seem inited.");
+    size_t i = 0;
+    for (; i < n && idx_ < header_.count; ++i, ++idx_)
+    {
+      const coord_t* loc = fields_[BinaryFileHeader::LOC] + 3*idx_;
+      if (accepts(Vector3(loc[0], loc[1], loc[2]),
+                  fields_[BinaryFileHeader::WEIGHT][idx_]))
+        keep(kernelAt(idx_), batch);
+    }
+    return i;
+    NUKLEI_TRACE_END();
+  }
+
+
+  BinaryWriter::BinaryWriter(const std::string &observationFileName) :
+    observationFileName_(observationFileName), kernelType_(-1), count_(0),
+    hasColor_(true)
+  {
+    std::fill(bboxMin_, bboxMin_ + 3, coord_t(0));
+    std::fill(bboxMax_, bboxMax_ + 3, coord_t(0));
+  }
+
+  BinaryWriter::~BinaryWriter()
+  {
+    removeFieldFiles();
+  }
+
+  void BinaryWriter::removeFieldFiles()
+  {
+    for (int f = 0; f < BinaryFileHeader::N_FIELDS; ++f)
+    {
+      if (fieldFiles_[f].is_open()) fieldFiles_[f].close();
+      if (!fieldFileNames_[f].empty())
+      {
+        boost::system::error_code ec;
+        boost::filesystem::remove(fieldFileNames_[f], ec);
+        fieldFileNames_[f].clear();
+      }
+    }
+  }
+
+  void BinaryWriter::init()
+  {
+    NUKLEI_TRACE_BEGIN();
+    kernelType_ = -1;
+    count_ = 0;
+    hasColor_ = true;
+    std::fill(bboxMin_, bboxMin_ + 3, coord_t(0));
+    std::fill(bboxMax_, bboxMax_ + 3, coord_t(0));
+
+    removeFieldFiles();
+    const std::string stem = observationFileName_ +
+      boost::filesystem::unique_path(".%%%%-%%%%").string();
+    for (int f = 0; f < BinaryFileHeader::N_FIELDS; ++f)
+    {
+      fieldFileNames_[f] = stem + "." + stringify(f) + ".tmp";
+      fieldFiles_[f].open(fieldFileNames_[f].c_str(),
+                          std::ios::out | std::ios::trunc | std::ios::binary);
+      if (!fieldFiles_[f].is_open())
+        throw ObservationIOError(std::string("Could not open file ") +
+                                 fieldFileNames_[f] + " for writing.");
+    }
+    NUKLEI_TRACE_END();
+  }
+
+  void BinaryWriter::reset()
+  {
+    NUKLEI_TRACE_BEGIN();
+    init();
+    NUKLEI_TRACE_END();
+  }
+
+  void BinaryWriter::append(const BinaryFileHeader::Field field,
+                            const coord_t value)
+  {
+    fieldFiles_[field].write(reinterpret_cast<const char*>(&value),
+                             sizeof(coord_t));
+  }
+
+  void BinaryWriter::readField(const BinaryFileHeader::Field field,
+                               std::vector<coord_t> &values)
+  {
+    NUKLEI_TRACE_BEGIN();
+    values.clear();
+    if (!fieldFiles_[field].is_open()) return;
+    if (!fieldFiles_[field].flush())
+      throw ObservationIOError("Error writing `" + fieldFileNames_[field] + "'.");
+    const kernel::base::Type type = kernel::base::Type
+      (kernelType_ < 0 ? kernel::base::R3 : kernelType_);
+    values.resize(count_ * BinaryFileHeader::width(field, type));
+    if (values.empty()) return;
+    std::ifstream ifs(fieldFileNames_[field].c_str(), std::ios::binary);
+    ifs.read(reinterpret_cast<char*>(&values.front()),
+             values.size() * sizeof(coord_t));
+    if (!ifs)
+      throw ObservationIOError("Error reading `" + fieldFileNames_[field] + "'.");
+    NUKLEI_TRACE_END();
+  }
+
+  void BinaryWriter::writeObservation(const Observation &o)
+  {
+    NUKLEI_TRACE_BEGIN();
+    typedef BinaryFileHeader H;
+
+    if (!fieldFiles_[H::LOC].is_open())
+      NUKLEI_THROW("Writer does not seem inited.");
+
+    kernel::base::ptr k = o.getKernel();
+
+    if (kernelType_ < 0) kernelType_ = k->polyType();
+    else if (kernelType_ != k->polyType())
+      NUKLEI_THROW("Nuklei binary files hold a single kernel type.");
+
+    Vector3 loc = k->getLoc();
+    for (int d = 0; d < 3; ++d)
+    {
+      bboxMin_[d] = count_ == 0 ? loc[d] : std::min(bboxMin_[d], loc[d]);
+      bboxMax_[d] = count_ == 0 ? loc[d] : std::max(bboxMax_[d], loc[d]);
+      append(H::LOC, loc[d]);
+    }
+
+    switch (k->polyType())
+    {
+      case kernel::base::R3:
+        break;
+      case kernel::base::R3XS2:
+      case kernel::base::R3XS2P:
+      {
+        Vector3 dir = k->polyType() == kernel::base::R3XS2 ?
+          static_cast<const kernel::r3xs2&>(*k).dir_ :
+          static_cast<const kernel::r3xs2p&>(*k).dir_;
+        append(H::ORI, dir.X());
+        append(H::ORI, dir.Y());
+        append(H::ORI, dir.Z());
+        break;
+      }
+      case kernel::base::SE3:
+      {
+        const Quaternion& q = static_cast<const kernel::se3&>(*k).ori_;
+        append(H::ORI, q.W());
+        append(H::ORI, q.X());
+        append(H::ORI, q.Y());
+        append(H::ORI, q.Z());
+        break;
+      }
+      default:
+        NUKLEI_THROW("Unknown kernel type.");
+    }
+
+    append(H::LOC_H, k->getLocH());
+    if (k->polyType() != kernel::base::R3)
+      append(H::ORI_H, k->getOriH());
+    append(H::WEIGHT, k->getWeight());
+
+    if (hasColor_ && k->hasDescriptor() &&
+        dynamic_cast<const ColorDescriptor*>(&k->getDescriptor()) != NULL)
+    {
+      RGBColor c(dynamic_cast<const ColorDescriptor&>
+                 (k->getDescriptor()).getColor());
+      append(H::COLOR, c.R());
+      append(H::COLOR, c.G());
+      append(H::COLOR, c.B());
+    }
+    else if (hasColor_)
+    {
+      // One kernel without color drops the field for the whole file.
+      hasColor_ = false;
+      fieldFiles_[H::COLOR].close();
+      fieldFiles_[H::COLOR].open(fieldFileNames_[H::COLOR].c_str(),
+                                 std::ios::out | std::ios::trunc |
+                                 std::ios::binary);
+      fieldFiles_[H::COLOR].close();
+    }
+
+    count_++;
+    NUKLEI_TRACE_END();
+  }
+
+  void BinaryWriter::writeBuffer()
+  {
+    NUKLEI_TRACE_BEGIN();
+    typedef BinaryFileHeader H;
+
+    if (!fieldFiles_[H::LOC].is_open())
+      NUKLEI_THROW("Writer does not seem inited.");
+
+    H header;
+    std::memset(&header, 0, sizeof(header));
+    std::copy(H::magic(), H::magic() + H::MAGIC_SIZE, header.magic_);
+    header.version = H::VERSION;
+    header.byteOrder = H::BYTE_ORDER_MARK;
+    header.kernelType = kernelType_ < 0 ? kernel::base::R3 : kernelType_;
+    header.count = count_;
+    // An empty file has a zero bounding box.
+    std::copy(bboxMin_, bboxMin_ + 3, header.bboxMin);
+    std::copy(bboxMax_, bboxMax_ + 3, header.bboxMax);
+
+    boost::uint64_t offset = sizeof(H);
+    kernel::base::Type type = kernel::base::Type(header.kernelType);
+    boost::uint64_t sizes[H::N_FIELDS] = { 0 };
+    for (int f = 0; f < H::N_FIELDS; ++f)
+    {
+      if (H::width(H::Field(f), type) == 0) continue;
+      if (f == H::COLOR && !hasColor_) continue;
+      offset = (offset + H::ALIGNMENT - 1) / H::ALIGNMENT * H::ALIGNMENT;
+      header.offsets[f] = offset;
+      sizes[f] = count_ * H::width(H::Field(f), type) * sizeof(coord_t);
+      offset += sizes[f];
+    }
+
+    std::ofstream ofs(observationFileName_.c_str(), std::ios::binary);
+    if (!ofs.is_open())
+      throw ObservationIOError(std::string("Could not open file ") +
+                               observationFileName_ + " for writing.");
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    boost::uint64_t position = sizeof(H);
+    std::vector<char> chunk(1 << 20);
+    for (int f = 0; f < H::N_FIELDS; ++f)
+    {
+      if (header.offsets[f] == 0) continue;
+      const char zeros[H::ALIGNMENT] = { 0 };
+      ofs.write(zeros, header.offsets[f] - position);
+
+      if (!fieldFiles_[f].flush())
+        throw ObservationIOError("Error writing `" + fieldFileNames_[f] + "'.");
+      std::ifstream ifs(fieldFileNames_[f].c_str(), std::ios::binary);
+      for (boost::uint64_t left = sizes[f]; left > 0; )
+      {
+        const std::streamsize n =
+          std::streamsize(std::min(left, boost::uint64_t(chunk.size())));
+        if (!ifs.read(&chunk.front(), n))
+          throw ObservationIOError("Error reading `" +
+                                   fieldFileNames_[f] + "'.");
+        ofs.write(&chunk.front(), n);
+        left -= n;
+      }
+      position = header.offsets[f] + sizes[f];
+    }
+    if (!ofs)
+      throw ObservationIOError("Error writing `" + observationFileName_ + "'.");
+    NUKLEI_TRACE_END();
+  }
+
+}
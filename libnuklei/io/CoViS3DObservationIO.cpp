@@ -36,11 +36,6 @@ namespace nuklei {
     CoViS3DReader(observationFileName)
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_USE_TICPP
-    in_ = boost::shared_ptr<ticpp::Document>(new ticpp::Document(observationFileName));
-#else
-    NUKLEI_THROW("This function requires TICPP.");
-#endif
     NUKLEI_TRACE_END();
   }
 
@@ -87,19 +82,13 @@ namespace nuklei {
   void CoViS3DXMLReader::init_()
   {
     NUKLEI_TRACE_BEGIN();    
-#ifdef NUKLEI_USE_TICPP
-    try {
-      in_->LoadFile();
-      ticpp::Element* scene = in_->FirstChildElement( "Scene" );
-      NUKLEI_ASSERT(scene != NULL);
-      e_ = boost::shared_ptr<ElementIterator>(new ElementIterator( "Primitive3D" ));
-      *e_ = e_->begin(scene);
-    } catch (ticpp::Exception& e) {
-      throw ObservationIOError(e.what());
+    parser_.open(observationFileName);
+    if (parser_.next() != XmlPullParser::START_ELEMENT ||
+        parser_.name() != "Scene")
+    {
+      parser_.close();
+      throw ObservationIOError("Cannot find element Scene");
     }
-#else
-    NUKLEI_THROW("This function requires TICPP.");
-#endif
     NUKLEI_TRACE_END();
   }
 
@@ -153,143 +142,106 @@ namespace nuklei {
     NUKLEI_TRACE_END();
   }
   
-  std::auto_ptr<Observation> CoViS3DXMLReader::readObservation_()
+  // Parses the descendants of a Primitive3D element, up to and including
+  // its end tag. Elements are identified by their name, their parent, and
+  // their depth relative to Primitive3D.
+  std::auto_ptr<Observation> CoViS3DXMLReader::parsePrimitive()
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_USE_TICPP
-    if (!e_) NUKLEI_THROW("Reader does not seem inited.");
+    std::auto_ptr<CoViS3DObservation> observation(new CoViS3DObservation);
     
-    typedef ticpp::Element* ElementPtr;
+    const unsigned depth = parser_.depth();
+    bool hasLoc = false, hasCov = false, hasDir = false, hasGamma = false;
+    bool hasLeft = false, hasRight = false;
     
-    while (*e_ != e_->end())
+    for (;;)
     {
-      ElementIterator primitive = *e_;
-      ++*e_;
-      
-      std::auto_ptr<CoViS3DObservation> observation(new CoViS3DObservation);
-      
-      ElementIterator primitiveElement;
-      primitiveElement = primitiveElement.begin(&*primitive);
-      NUKLEI_ASSERT(primitiveElement != primitiveElement.end());
-      
-      while (primitiveElement->Value() != "Location")
+      XmlPullParser::Event e = parser_.next();
+      if (e == XmlPullParser::END_ELEMENT)
       {
-        primitiveElement++; NUKLEI_ASSERT(primitiveElement != primitiveElement.end());
+        if (parser_.depth() < depth) break;
+        continue;
       }
       
+      const std::string& name = parser_.name();
+      const std::string& parent = parser_.parentName();
+      const unsigned level = parser_.depth() - depth;
+      
+      if (level == 2 && parent == "Location" && name == "Cartesian3D")
       {
-        NUKLEI_ASSERT(primitiveElement->Value() == "Location");
-        {
-          ticpp::Element* el = primitiveElement->FirstChildElement("Cartesian3D");
-          Vector3 l;
-          el->GetAttribute("x", &l[0]);
-          el->GetAttribute("y", &l[1]);
-          el->GetAttribute("z", &l[2]);
-          observation->setLoc(l);
-        }
-        {
-          ticpp::Element* el = primitiveElement->FirstChildElement("Cartesian3DCovariance");
-          Matrix3 cov;
-          std::string covString;
-          el->GetText(&covString);
-          std::istringstream iss(covString);
-          for (int i = 0; i < 3; ++i) for (int j = 0; j < 3; ++j)
-            NUKLEI_ASSERT(iss >> cov(i,j));
-          observation->setCovMatrix(cov);
-        }
+        observation->setLoc(Vector3(parser_.numericAttribute("x"),
+                                    parser_.numericAttribute("y"),
+                                    parser_.numericAttribute("z")));
+        hasLoc = true;
       }
-      
-      primitiveElement++; NUKLEI_ASSERT(primitiveElement != primitiveElement.end());
-      
-      while (primitiveElement->Value() != "Orientation")
+      else if (level == 2 && parent == "Location" &&
+               name == "Cartesian3DCovariance")
       {
-        primitiveElement++; NUKLEI_ASSERT(primitiveElement != primitiveElement.end());
+        coord_t v[9];
+        parser_.readNumbers(v, 9);
+        Matrix3 cov;
+        for (int i = 0; i < 3; ++i) for (int j = 0; j < 3; ++j)
+          cov(i,j) = v[3*i+j];
+        observation->setCovMatrix(cov);
+        hasCov = true;
       }
-
+      else if (level == 4 && parent == "Direction" && name == "Spherical")
       {
-        NUKLEI_ASSERT(primitiveElement->Value() == "Orientation");
-        ElementPtr dirGamma = primitiveElement->FirstChildElement("DirGammaOrientation");
-        {
-          ElementPtr el = dirGamma->FirstChildElement("Direction");
-          el = el->FirstChildElement("Spherical");
-          coord_t phi, psi;
-          el->GetAttribute("phi", &phi);
-          el->GetAttribute("psi", &psi);
-          observation->setPhiPsi(phi, psi);
-        }
-        {
-          ElementPtr el = dirGamma->FirstChildElement("GammaVector");
-          el = el->FirstChildElement("Cartesian3D");
-          Vector3 l;
-          el->GetAttribute("x", &l[0]);
-          el->GetAttribute("y", &l[1]);
-          el->GetAttribute("z", &l[2]);
-          observation->setGamma(l);
-        }
+        observation->setPhiPsi(parser_.numericAttribute("phi"),
+                               parser_.numericAttribute("psi"));
+        hasDir = true;
       }
-      
-      primitiveElement++; NUKLEI_ASSERT(primitiveElement != primitiveElement.end());
-      
-      //IntrinsicDimensionality
-      
-      primitiveElement++; NUKLEI_ASSERT(primitiveElement != primitiveElement.end());
-      
-      //Source2D?
-      
-      if (primitiveElement->Value() == "Source2D")
-        primitiveElement++; NUKLEI_ASSERT(primitiveElement != primitiveElement.end());
-      
-      if (false)
+      else if (level == 4 && parent == "GammaVector" && name == "Cartesian3D")
       {
-        NUKLEI_ASSERT(primitiveElement->Value() == "Phase");
-        ticpp::Element* el = primitiveElement->FirstChildElement("Angle");
-        appear_t phase;
-        el->GetText(&phase);
-        //observation->setPhase(phase);
+        observation->setGamma(Vector3(parser_.numericAttribute("x"),
+                                      parser_.numericAttribute("y"),
+                                      parser_.numericAttribute("z")));
+        hasGamma = true;
       }
-      
-      primitiveElement++; NUKLEI_ASSERT(primitiveElement != primitiveElement.end());
-      
+      else if (level == 3 && name == "RGB" &&
+               (parent == "Left" || parent == "Right"))
       {
-        NUKLEI_ASSERT(primitiveElement->Value() == "Colors");
-        RGBColor::ptr color(new RGBColor);
-        {
-          ElementPtr el = primitiveElement->FirstChildElement("Left");
-          el = el->FirstChildElement("RGB");
-          el->GetAttribute("r", &color->R());
-          el->GetAttribute("g", &color->G());
-          el->GetAttribute("b", &color->B());
-          observation->setLeftColor(*color);
-        }
+        RGBColor color;
+        color.R() = parser_.numericAttribute("r");
+        color.G() = parser_.numericAttribute("g");
+        color.B() = parser_.numericAttribute("b");
+        if (parent == "Left")
         {
-          ElementPtr el = primitiveElement->FirstChildElement("Right");
-          el = el->FirstChildElement("RGB");
-          el->GetAttribute("r", &color->R());
-          el->GetAttribute("g", &color->G());
-          el->GetAttribute("b", &color->B());
-          observation->setRightColor(*color);
+          observation->setLeftColor(color);
+          hasLeft = true;
         }
-        if (false)
+        else
         {
-          ElementPtr el = primitiveElement->FirstChildElement("Middle");
-          el = el->FirstChildElement("RGB");
-          el->GetAttribute("r", &color->R());
-          el->GetAttribute("g", &color->G());
-          el->GetAttribute("b", &color->B());
-          //observation->setMiddleColor(color);
+          observation->setRightColor(color);
+          hasRight = true;
         }
       }
-            
-      oc.incLabel("input");
-      
-      return std::auto_ptr<Observation>(observation);
-   }
+    }
     
-    // End of file reached.
-    return std::auto_ptr<Observation>();
-#else
-    NUKLEI_THROW("This function requires TICPP.");
-#endif
+    if (!(hasLoc && hasCov && hasDir && hasGamma && hasLeft && hasRight))
+      throw ObservationIOError("Incomplete Primitive3D element in " +
+                               observationFileName);
+    
+    return std::auto_ptr<Observation>(observation);
+    NUKLEI_TRACE_END();
+  }
+  
+  std::auto_ptr<Observation> CoViS3DXMLReader::readObservation_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!parser_.isOpen()) NUKLEI_THROW("Reader does not seem inited.");
+    
+    for (;;)
+    {
+      XmlPullParser::Event e = parser_.next();
+      // End of file reached.
+      if (e == XmlPullParser::END_DOCUMENT)
+        return std::auto_ptr<Observation>();
+      if (e != XmlPullParser::START_ELEMENT) continue;
+      if (parser_.depth() == 2 && parser_.name() == "Primitive3D")
+        return parsePrimitive();
+      parser_.skipElement();
+    }
     NUKLEI_TRACE_END();
   }
 
@@ -18,7 +18,7 @@ namespace nuklei {
 
 
   CrdReader::CrdReader(const std::string &observationFileName) :
-    observationFileName(observationFileName)
+    observationFileName(observationFileName), row_(-1), value_(0)
   {
   }
 
@@ -30,26 +30,20 @@ namespace nuklei {
 
   void CrdReader::init_()
   {
-    NUKLEI_ASSERT(!in_.is_open());
-    in_.open(observationFileName.c_str(), std::ios::in);
-    if (!in_.is_open())
-      throw ObservationIOError(std::string("Could not open file ") +
-                                   observationFileName + " for reading.");
+    NUKLEI_TRACE_BEGIN();
+    file_.open(observationFileName);
     
     int count = -1;
-    bool syncpc = false;
     // In a CRD file, the first line shows the number of points in the file.
     // To be compatible with SYNCPC, if the first line is syncpc, it is ignored.
     {
       std::string firstline;
-      if (! std::getline(in_, firstline) )
+      if (! file_.getLine(firstline) )
         throw ObservationIOError("Input does not look like CRD (file read error).");
-      cleanLine(firstline);
       if (firstline == "syncpc")
       {
-        if (! std::getline(in_, firstline) )
+        if (! file_.getLine(firstline) )
           throw ObservationIOError("Input does not look like CRD (file read error).");
-        syncpc = true;
       }
       try {
         count = numify<int>(firstline);        
@@ -60,71 +54,83 @@ namespace nuklei {
       if (!(count >= 0))
         throw ObservationIOError("Input does not look like CRD (no point count).");
     }
-    //if (! (in_ >> count) || ! (count >= 0) )
-    //  throw ObservationIOError("Input does not look like CRD.");
-    in_.close();
     
+    // Each line holds a position, optionally followed by image coordinates
+    // and an RGB color.
     // Since starting with an int is a pretty weak file signature,
-    // we run a thourough line count.
-    
-    in_.open(observationFileName.c_str(), std::ios::in);
-    int lcount = 0; std::string dump;
-    while (std::getline(in_, dump)) lcount++;
-    if (lcount != count+1 + (syncpc?1:0))
+    // we check that the number of lines matches the count.
+    table_.parse(file_.cursor(), file_.end(), 3, 8, true);
+    file_.close();
+    if (table_.rows() != size_t(count))
       throw ObservationIOError("Input does not look like CRD (wrong count).");
-    in_.close();
-    
-    in_.open(observationFileName.c_str(), std::ios::in);
-    std::string line;
-    std::getline(in_, line);
-    if (syncpc) std::getline(in_, line);
+
+    row_ = 0;
+    value_ = 0;
+    NUKLEI_TRACE_END();
   }
 
 
   void CrdReader::reset()
   {
-    in_.close();
     init();
   }
 
 
-  std::auto_ptr<Observation> CrdReader::readObservation_()
+  std::auto_ptr<kernel::r3> CrdReader::nextKernel()
   {
-    if (!in_.is_open()) NUKLEI_THROW("Reader does not seem inited.");
+    NUKLEI_TRACE_BEGIN();
+    if (row_ < 0) NUKLEI_THROW("Reader does not seem inited.");
 
-    if (!in_.good()) return std::auto_ptr<Observation>();
-    
-    std::string line;
+    // End of file reached.
+    if (size_t(row_) >= table_.rows()) return std::auto_ptr<kernel::r3>();
+
+    const coord_t* v = table_.values() + value_;
+    unsigned w = table_.width(row_);
+    row_++;
+    value_ += w;
+
+    std::auto_ptr<kernel::r3> k(new kernel::r3);
+    k->loc_ = Vector3(v[0], v[1], v[2]);
+    ColorDescriptor d;
+    if (w == 8)
+      d.setColor(RGBColor(Vector3(v[5], v[6], v[7])/255.));
+    else
+      d.setColor(RGBColor(.5,.5,.5));
+    k->setDescriptor(d);
     
-    while (std::getline(in_, line))
+    return k;
+    NUKLEI_TRACE_END();
+  }
+
+
+  std::auto_ptr<Observation> CrdReader::readObservation_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    std::auto_ptr<kernel::r3> k = nextKernel();
+    if (k.get() == NULL) return std::auto_ptr<Observation>();
+    return std::auto_ptr<Observation>(new CrdObservation(*k));
+    NUKLEI_TRACE_END();
+  }
+
+
+  size_t CrdReader::readKernels_(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (row_ < 0) NUKLEI_THROW("Reader does not seem inited.");
+    size_t i = 0;
+    for (; i < n && size_t(row_) < table_.rows(); ++i)
     {
-      cleanLine(line);
-      std::istringstream iss(line);
-      
-      std::auto_ptr<CrdObservation> observation(new CrdObservation);
-      
-      Vector3 loc;
-      if ( ! (iss >> loc[0] >> loc[1] >> loc[2]) ) return std::auto_ptr<Observation>();
-      observation->setLoc(loc);
-      
-      Vector3 rgbColor(.5,.5,.5);
-      coord_t ix(0), iy(0);
-      if ( (iss >> ix >> iy >> rgbColor[0] >> rgbColor[1] >> rgbColor[2]) )
-      {
-        RGBColor c(rgbColor/255.);
-        observation->setColor(c);
-      }
+      const coord_t* v = table_.values() + value_;
+      if (accepts(Vector3(v[0], v[1], v[2]), 1))
+        keep(std::auto_ptr<kernel::base>(nextKernel()), batch);
       else
       {
-        RGBColor c(.5,.5,.5);
-        observation->setColor(c);
+        value_ += table_.width(row_);
+        row_++;
       }
-      
-      return std::auto_ptr<Observation>(observation);
     }
-    
-    // End of file reached.
-    return std::auto_ptr<Observation>();
+    return i;
+    NUKLEI_TRACE_END();
   }
 
   
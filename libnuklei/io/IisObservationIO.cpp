@@ -25,11 +25,6 @@ namespace nuklei {
   observationFileName_(observationFileName)
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_USE_TICPP
-    in_ = boost::shared_ptr<ticpp::Document>(new ticpp::Document(observationFileName));
-#else
-    NUKLEI_THROW("This function requires TICPP.");
-#endif
     NUKLEI_TRACE_END();
   }
   
@@ -41,19 +36,13 @@ namespace nuklei {
   void IisReader::init_()
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_USE_TICPP
-    try {
-      in_->LoadFile();
-      ticpp::Element* kc = in_->FirstChildElement( "grasps" );
-      NUKLEI_ASSERT(kc != NULL);
-      e_ = boost::shared_ptr<ElementIterator>(new ElementIterator( "grasp" ));
-      *e_ = e_->begin(kc);
-    } catch (ticpp::Exception& e) {
-      throw ObservationIOError(e.what());
+    parser_.open(observationFileName_);
+    if (parser_.next() != XmlPullParser::START_ELEMENT ||
+        parser_.name() != "grasps")
+    {
+      parser_.close();
+      throw ObservationIOError("Cannot find element grasps");
     }
-#else
-    NUKLEI_THROW("This function requires TICPP.");
-#endif
     NUKLEI_TRACE_END();
   }
   
@@ -64,92 +53,96 @@ namespace nuklei {
     NUKLEI_TRACE_END();
   }
   
-  std::auto_ptr<Observation> IisReader::readObservation_()
+  // Parses the descendants of a grasp element, up to and including its end
+  // tag. The pose is read from grasp/pose/position and
+  // grasp/pose/orientation.
+  std::auto_ptr<Observation> IisReader::parseGrasp()
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_USE_TICPP
-    if (!e_) NUKLEI_THROW("Reader does not seem inited.");
+    std::auto_ptr<IisObservation> observation(new IisObservation);
     
-    typedef ticpp::Element* ElementPtr;
+    kernel::se3 k;
+    const unsigned depth = parser_.depth();
+    bool hasPosition = false, hasQuaternion = false, hasMatrix = false;
+    Matrix3 m;
     
-    while (*e_ != e_->end())
+    for (;;)
     {
-      ElementIterator grasp = *e_;
-      ++*e_;
-      
-      std::auto_ptr<IisObservation> observation(new IisObservation);
-      
-      ElementIterator graspElement;
-      graspElement = graspElement.begin(&*grasp);
-      NUKLEI_ASSERT(graspElement != graspElement.end());
-      
-      
-      
-      while (graspElement->Value() != "pose")
+      XmlPullParser::Event e = parser_.next();
+      if (e == XmlPullParser::END_ELEMENT)
       {
-        if (graspElement == graspElement.end())
-          NUKLEI_THROW("Pose element not found.");
-        graspElement++;
+        if (parser_.depth() < depth) break;
+        continue;
       }
       
-      kernel::se3 k;
+      const std::string& name = parser_.name();
+      const std::string& parent = parser_.parentName();
+      const unsigned level = parser_.depth() - depth;
+      std::string attribute;
       
+      if (level == 2 && parent == "pose" && name == "position")
       {
-        ElementIterator pi;
-        pi = pi.begin(&*graspElement);        
-        NUKLEI_ASSERT(pi != pi.end());
-        {
-          ticpp::Element* el = pi.Get();
-          NUKLEI_ASSERT(el->Value() == "position");
-          NUKLEI_ASSERT(el->GetAttribute("domain") == "R3");
-          el = el->FirstChildElement("euclidean");
-          std::string ls;
-          el->GetText(&ls);
-          k.loc_ = numify<Vector3>(ls);
-        }
-        pi++;
-        NUKLEI_ASSERT(pi != pi.end())
-        {
-          ticpp::Element* el = pi.Get();
-          NUKLEI_ASSERT(el->Value() == "orientation");
-          NUKLEI_ASSERT(el->GetAttribute("domain") == "SO3");
-          
-          ticpp::Element* quat = el->FirstChildElement("quaternion", false);
-          if (quat != NULL)
-          {
-            NUKLEI_ASSERT(quat->GetAttribute("format") == "wxyz");
-            std::string os;
-            quat->GetText(&os);
-            k.ori_ = la::normalized(numify<Quaternion>(os));
-          }
-          else
-          {
-            ticpp::Element* mat = el->FirstChildElement("rotmatrix");
-            std::string os;
-            mat->GetText(&os);
-            std::istringstream iss(os);
-            Matrix3 m;
-            NUKLEI_ASSERT(iss
-                          >> m(0,0) >> m(0,1) >> m(0,2)
-                          >> m(1,0) >> m(1,1) >> m(1,2)
-                          >> m(2,0) >> m(2,1) >> m(2,2));
-            k.ori_ = la::quaternionCopy(la::normalized(m));
-          }
-        }
+        if (!parser_.attribute("domain", attribute) || attribute != "R3")
+          throw ObservationIOError("Position domain must be R3");
+      }
+      else if (level == 2 && parent == "pose" && name == "orientation")
+      {
+        if (!parser_.attribute("domain", attribute) || attribute != "SO3")
+          throw ObservationIOError("Orientation domain must be SO3");
+      }
+      else if (level == 3 && parent == "position" && name == "euclidean")
+      {
+        coord_t v[3];
+        parser_.readNumbers(v, 3);
+        k.loc_ = Vector3(v[0], v[1], v[2]);
+        hasPosition = true;
+      }
+      else if (level == 3 && parent == "orientation" && name == "quaternion")
+      {
+        if (!parser_.attribute("format", attribute) || attribute != "wxyz")
+          throw ObservationIOError("Quaternion format must be wxyz");
+        coord_t v[4];
+        parser_.readNumbers(v, 4);
+        k.ori_ = la::normalized(Quaternion(v[0], v[1], v[2], v[3]));
+        hasQuaternion = true;
+      }
+      else if (level == 3 && parent == "orientation" && name == "rotmatrix")
+      {
+        coord_t v[9];
+        parser_.readNumbers(v, 9);
+        for (int i = 0; i < 3; ++i) for (int j = 0; j < 3; ++j)
+          m(i,j) = v[3*i+j];
+        hasMatrix = true;
       }
-      
-      observation->setKernel(k);
-      
-      oc.incLabel("input");
-      
-      return std::auto_ptr<Observation>(observation);
     }
     
-    // End of file reached.
-    return std::auto_ptr<Observation>();
-#else
-    NUKLEI_THROW("This function requires TICPP.");
-#endif
+    if (!hasPosition || !(hasQuaternion || hasMatrix))
+      NUKLEI_THROW("Pose element not found.");
+    if (!hasQuaternion)
+      k.ori_ = la::quaternionCopy(la::normalized(m));
+    
+    observation->setKernel(k);
+    
+    return std::auto_ptr<Observation>(observation);
+    NUKLEI_TRACE_END();
+  }
+  
+  std::auto_ptr<Observation> IisReader::readObservation_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!parser_.isOpen()) NUKLEI_THROW("Reader does not seem inited.");
+    
+    for (;;)
+    {
+      XmlPullParser::Event e = parser_.next();
+      // End of file reached.
+      if (e == XmlPullParser::END_DOCUMENT)
+        return std::auto_ptr<Observation>();
+      if (e != XmlPullParser::START_ELEMENT) continue;
+      if (parser_.depth() == 2 && parser_.name() == "grasp")
+        return parseGrasp();
+      parser_.skipElement();
+    }
     NUKLEI_TRACE_END();
   }
   
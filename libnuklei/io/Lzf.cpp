@@ -0,0 +1,152 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <cstring>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+
+#include <nuklei/Lzf.h>
+#include <nuklei/ObservationIO.h>
+
+// An LZF stream is a sequence of literal runs and back references. A control
+// byte below 32 introduces a run of (control + 1) literal bytes. Otherwise,
+// its top 3 bits hold (length - 2) of a back reference, 7 meaning that an
+// extra byte must be added to it, and its low 5 bits and the next byte hold
+// (distance - 1).
+
+namespace nuklei {
+
+  namespace {
+
+    const unsigned HASH_LOG = 14;
+    const size_t MAX_LITERAL = 32;
+    const size_t MAX_DISTANCE = 1 << 13;
+    const size_t MAX_MATCH = 2 + 7 + 255;
+
+    inline size_t hash(const unsigned char* p)
+    {
+      const boost::uint32_t v = (boost::uint32_t(p[0]) << 16) |
+        (boost::uint32_t(p[1]) << 8) | p[2];
+      return boost::uint32_t(v * 2654435761u) >> (32 - HASH_LOG);
+    }
+
+  }
+
+  size_t lzfCompress(const char* in, const size_t n, std::vector<char> &out)
+  {
+    NUKLEI_TRACE_BEGIN();
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(in);
+    out.clear();
+    out.reserve(n + n / MAX_LITERAL + 1);
+    // Position + 1 of the last occurrence of each hashed triplet.
+    std::vector<size_t> table(size_t(1) << HASH_LOG, 0);
+
+    size_t i = 0, literals = 0, control = 0;
+    while (i < n)
+    {
+      size_t ref = 0;
+      bool match = false;
+      if (i + 2 < n)
+      {
+        size_t& entry = table[hash(ip + i)];
+        if (entry != 0)
+        {
+          ref = entry - 1;
+          match = i - ref <= MAX_DISTANCE &&
+            std::memcmp(ip + ref, ip + i, 3) == 0;
+        }
+        entry = i + 1;
+      }
+
+      if (match)
+      {
+        const size_t maxLength = std::min(n - i, MAX_MATCH);
+        size_t length = 3;
+        while (length < maxLength && ip[ref + length] == ip[i + length])
+          ++length;
+
+        if (literals > 0)
+        {
+          out[control] = char(literals - 1);
+          literals = 0;
+        }
+        const size_t distance = i - ref - 1;
+        const size_t l = length - 2;
+        if (l < 7)
+          out.push_back(char((l << 5) | (distance >> 8)));
+        else
+        {
+          out.push_back(char((7 << 5) | (distance >> 8)));
+          out.push_back(char(l - 7));
+        }
+        out.push_back(char(distance & 0xff));
+
+        for (size_t j = i + 1; j < i + length && j + 2 < n; ++j)
+          table[hash(ip + j)] = j + 1;
+        i += length;
+      }
+      else
+      {
+        if (literals == 0)
+        {
+          control = out.size();
+          out.push_back(0);
+        }
+        out.push_back(in[i++]);
+        if (++literals == MAX_LITERAL)
+        {
+          out[control] = char(literals - 1);
+          literals = 0;
+        }
+      }
+    }
+    if (literals > 0) out[control] = char(literals - 1);
+    return out.size();
+    NUKLEI_TRACE_END();
+  }
+
+  void lzfDecompress(const char* in, const size_t n,
+                     char* out, const size_t outSize)
+  {
+    NUKLEI_TRACE_BEGIN();
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(in);
+    const unsigned char* ipEnd = ip + n;
+    size_t o = 0;
+    while (ip < ipEnd)
+    {
+      const unsigned control = *ip++;
+      if (control < MAX_LITERAL)
+      {
+        const size_t length = control + 1;
+        if (size_t(ipEnd - ip) < length || outSize - o < length)
+          throw ObservationIOError("Corrupt LZF data.");
+        std::memcpy(out + o, ip, length);
+        ip += length;
+        o += length;
+      }
+      else
+      {
+        size_t length = control >> 5;
+        if (length == 7)
+        {
+          if (ip == ipEnd) throw ObservationIOError("Corrupt LZF data.");
+          length += *ip++;
+        }
+        length += 2;
+        if (ip == ipEnd) throw ObservationIOError("Corrupt LZF data.");
+        const size_t distance = ((control & 0x1f) << 8) + *ip++ + 1;
+        if (distance > o || outSize - o < length)
+          throw ObservationIOError("Corrupt LZF data.");
+        // References may overlap the bytes they produce.
+        for (const char* r = out + o - distance; length > 0; --length)
+          out[o++] = *r++;
+      }
+    }
+    if (o != outSize) throw ObservationIOError("Corrupt LZF data.");
+    NUKLEI_TRACE_END();
+  }
+
+}
@@ -28,11 +28,6 @@ namespace nuklei {
   observationFileName_(observationFileName)
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_USE_TICPP
-    in_ = boost::shared_ptr<ticpp::Document>(new ticpp::Document(observationFileName));
-#else
-    in_ = boost::shared_ptr<tt::XMLDocument>(new tt::XMLDocument());
-#endif
     NUKLEI_TRACE_END();
   }
   
@@ -44,25 +39,13 @@ namespace nuklei {
   void NukleiReader::init_()
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_USE_TICPP
-    try {
-      in_->LoadFile();
-      ticpp::Element* kc = in_->FirstChildElement( "kernelCollection" );
-      NUKLEI_ASSERT(kc != NULL);
-      e_ = boost::shared_ptr<ElementIterator>(new ElementIterator( "kernel" ));
-      *e_ = e_->begin(kc);
-    } catch (ticpp::Exception& e) {
-      throw ObservationIOError(e.what());
-    }
-#else
-    in_->LoadFile(observationFileName_.c_str());
-    if (in_->ErrorID() != 0)
-      throw ObservationIOError("Error parsing with TinyXML-2");
-    tt::XMLElement* kc = in_->FirstChildElement( "kernelCollection" );
-    if (kc == NULL)
+    parser_.open(observationFileName_);
+    if (parser_.next() != XmlPullParser::START_ELEMENT ||
+        parser_.name() != "kernelCollection")
+    {
+      parser_.close();
       throw ObservationIOError("Cannot find element kernelCollection");
-    e_ = kc->FirstChildElement( "kernel" );
-#endif
+    }
     NUKLEI_TRACE_END();
   }
   
@@ -73,324 +56,174 @@ namespace nuklei {
     NUKLEI_TRACE_END();
   }
   
-  std::auto_ptr<Observation> NukleiReader::readObservation_()
+  // Parses the children of a kernel element, up to and including its end
+  // tag. If filter is true and accepts() rejects the kernel, returns NULL
+  // without building it.
+  std::auto_ptr<kernel::base> NukleiReader::parseKernel(const bool filter)
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_USE_TICPP
-    if (!e_) NUKLEI_THROW("Reader does not seem inited.");
+    weight_t w = 1;
+    Vector3 loc;
+    coord_t loc_h = 0;
+    bool hasLoc = false;
+    std::string domain;
+    coord_t ori[4];
+    unsigned oriSize = 0;
+    coord_t ori_h = 0;
+    bool hasOriH = false;
     
-    typedef ticpp::Element* ElementPtr;
-    
-    while (*e_ != e_->end())
+    while (parser_.next() == XmlPullParser::START_ELEMENT)
     {
-      ElementIterator kernel = *e_;
-      ++*e_;
-      
-      std::auto_ptr<NukleiObservation> observation(new NukleiObservation);
-      
-      ElementIterator kernelElement;
-      kernelElement = kernelElement.begin(&*kernel);
-      NUKLEI_ASSERT(kernelElement != kernelElement.end());
-      
-      weight_t w = 1;
-      
-      if (kernelElement->Value() == "weight")
-      {
-        kernelElement->GetText(&w);
-        kernelElement++; NUKLEI_ASSERT(kernelElement != kernelElement.end());
-      }
-      
-      Vector3 loc;
-      coord_t loc_h = 0;
-      
+      if (parser_.name() == "weight")
+        w = parser_.readNumber();
+      else if (parser_.name() == "location")
       {
-        NUKLEI_ASSERT(kernelElement->Value() == "location");
-        ElementIterator li;
-        li = li.begin(&*kernelElement);        
-        NUKLEI_ASSERT(li != li.end());
+        while (parser_.next() == XmlPullParser::START_ELEMENT)
         {
-          ticpp::Element* el = li.Get();
-          NUKLEI_ASSERT(el->Value() == "vector3");
-          std::string ls;
-          el->GetText(&ls);
-          loc = numify<Vector3>(ls);
-        }
-        li++;
-        if (li != li.end())
-        {
-          ticpp::Element* el = li.Get();
-          NUKLEI_ASSERT(el->Value() == "width");
-          std::string ws;
-          el->GetText(&ws);
-          loc_h = numify<coord_t>(ws);
-          li++;
-          NUKLEI_ASSERT(li == li.end());
+          if (parser_.name() == "vector3")
+          {
+            coord_t v[3];
+            parser_.readNumbers(v, 3);
+            loc = Vector3(v[0], v[1], v[2]);
+            hasLoc = true;
+          }
+          else if (parser_.name() == "width")
+            loc_h = parser_.readNumber();
+          else
+            throw ObservationIOError("Unexpected element `" +
+                                     parser_.name() + "' in location");
         }
       }
-      
-      kernel::base::ptr k;
-      
-      kernelElement++;
-      
-      if (kernelElement != kernelElement.end())
+      else if (parser_.name() == "orientation")
       {
-        NUKLEI_ASSERT(kernelElement->Value() == "orientation");
-        std::string domain = kernelElement->GetAttribute("domain");
-        // domain == "se3" is to support files wirtten with a buggy Nuklei build.
-        if (domain == "se3" || domain == "so3")
+        if (!parser_.attribute("domain", domain))
+          throw ObservationIOError("Orientation has no domain");
+        while (parser_.next() == XmlPullParser::START_ELEMENT)
         {
-          kernel::se3 se3k;
-          se3k.loc_ = loc;
-          se3k.loc_h_ = loc_h;
-          
-          ElementIterator oi;
-          oi = oi.begin(&*kernelElement);
-          NUKLEI_ASSERT(oi != oi.end());
+          if (parser_.name() == "quaternion")
           {
-            ticpp::Element* el = &*oi;
-            NUKLEI_ASSERT(el->Value() == "quaternion");
-            std::string os;
-            el->GetText(&os);
-            se3k.ori_ = la::normalized(numify<Quaternion>(os));
+            parser_.readNumbers(ori, 4);
+            oriSize = 4;
           }
-          oi++;
-          if (oi != oi.end())
+          else if (parser_.name() == "vector3")
           {
-            ticpp::Element* el = &*oi;
-            NUKLEI_ASSERT(el->Value() == "width");
-            std::string ws;
-            el->GetText(&ws);
-            se3k.ori_h_ = numify<coord_t>(ws);
-            oi++;
-            NUKLEI_ASSERT(oi == oi.end());
+            parser_.readNumbers(ori, 3);
+            oriSize = 3;
           }
-          k.reset(new kernel::se3(se3k));
-        }
-        else if (domain == "s2p")
-        {
-          kernel::r3xs2p r3xs2pk;
-          r3xs2pk.loc_ = loc;
-          r3xs2pk.loc_h_ = loc_h;
-          
-          ElementIterator oi;
-          oi = oi.begin(&*kernelElement);
-          NUKLEI_ASSERT(oi != oi.end());
+          else if (parser_.name() == "width")
           {
-            ticpp::Element* el = &*oi;
-            NUKLEI_ASSERT(el->Value() == "vector3");
-            std::string os;
-            el->GetText(&os);
-            r3xs2pk.dir_ = la::normalized(numify<Vector3>(os));
+            ori_h = parser_.readNumber();
+            hasOriH = true;
           }
-          oi++;
-          if (oi != oi.end())
-          {
-            ticpp::Element* el = &*oi;
-            NUKLEI_ASSERT(el->Value() == "width");
-            std::string ws;
-            el->GetText(&ws);
-            r3xs2pk.dir_h_ = numify<coord_t>(ws);
-            oi++;
-            NUKLEI_ASSERT(oi == oi.end());
-          }
-          k.reset(new kernel::r3xs2p(r3xs2pk));
-        }
-        else if (domain == "s2")
-        {
-          kernel::r3xs2 r3xs2k;
-          r3xs2k.loc_ = loc;
-          r3xs2k.loc_h_ = loc_h;
-          
-          ElementIterator oi;
-          oi = oi.begin(&*kernelElement);
-          NUKLEI_ASSERT(oi != oi.end());
-          {
-            ticpp::Element* el = &*oi;
-            NUKLEI_ASSERT(el->Value() == "vector3");
-            std::string os;
-            el->GetText(&os);
-            r3xs2k.dir_ = la::normalized(numify<Vector3>(os));
-          }
-          oi++;
-          if (oi != oi.end())
-          {
-            ticpp::Element* el = &*oi;
-            NUKLEI_ASSERT(el->Value() == "width");
-            std::string ws;
-            el->GetText(&ws);
-            r3xs2k.dir_h_ = numify<coord_t>(ws);
-            oi++;
-            NUKLEI_ASSERT(oi == oi.end());
-          }
-          k.reset(new kernel::r3xs2(r3xs2k));
+          else
+            throw ObservationIOError("Unexpected element `" +
+                                     parser_.name() + "' in orientation");
         }
       }
       else
-      {
-        kernel::r3 r3k;
-        r3k.loc_ = loc;
-        r3k.loc_h_ = loc_h;
-        k.reset(new kernel::r3(r3k));
-      }
-      k->setWeight(w);
-      
-      //TwoFingerDescriptor d;
-      //k->setDescriptor(d);
-      
-      observation->setKernel(*k);
-      
-      oc.incLabel("input");
-      
-      return std::auto_ptr<Observation>(observation);
+        throw ObservationIOError("Unexpected element `" +
+                                 parser_.name() + "' in kernel");
     }
     
-    // End of file reached.
-    return std::auto_ptr<Observation>();
-#else
-    if (!in_->RootElement()) NUKLEI_THROW("Reader does not seem inited.");
+    if (!hasLoc) throw ObservationIOError("Kernel has no location");
     
-    using namespace tt;
-    while (e_)
+    // domain == "se3" is to support files wirtten with a buggy Nuklei build.
+    if (!domain.empty())
     {
-      XMLElement* kernel = e_;
-      e_ = kernel->NextSiblingElement( "kernel" );
-      
-      std::auto_ptr<NukleiObservation> observation(new NukleiObservation);
-
-      XMLElement* kernelIter = kernel->FirstChildElement();
-      NUKLEI_ASSERT(kernelIter);
-      
-      weight_t w = 1;
-      
-      if (std::string(kernelIter->Name()) == "weight")
-      {
-        NUKLEI_ASSERT(kernelIter->QueryDoubleText(&w) == 0);
-        kernelIter = kernelIter->NextSiblingElement();
-        NUKLEI_ASSERT(kernelIter);
-      }
-      
-      Vector3 loc;
-      coord_t loc_h = 0;
-      
-      {
-        NUKLEI_ASSERT(std::string(kernelIter->Name()) == "location");
-        XMLElement* li = kernelIter->FirstChildElement();
-        NUKLEI_ASSERT(li);
-        {
-          NUKLEI_ASSERT(std::string(li->Name()) == "vector3");
-          loc = numify<Vector3>(li->GetText());
-        }
-        li = li->NextSiblingElement();
-        if (li)
-        {
-          NUKLEI_ASSERT(std::string(li->Name()) == "width");
-          NUKLEI_ASSERT(li->QueryDoubleText(&loc_h) == 0);
-          NUKLEI_ASSERT(li->NextSiblingElement() == NULL);
-        }
-      }
-      
-      kernel::base::ptr k;
-      
-      kernelIter = kernelIter->NextSiblingElement();
-      
-      if (kernelIter)
-      {
-        NUKLEI_ASSERT(std::string(kernelIter->Value()) == "orientation");
-        std::string domain;
-        {
-          const char* tmp = kernelIter->Attribute("domain");
-          NUKLEI_ASSERT(tmp);
-          domain = tmp;
-        }
-        // domain == "se3" is to support files wirtten with a buggy Nuklei build.
-        if (domain == "se3" || domain == "so3")
-        {
-          kernel::se3 se3k;
-          se3k.loc_ = loc;
-          se3k.loc_h_ = loc_h;
-          
-          XMLElement* oi = kernelIter->FirstChildElement();
-          NUKLEI_ASSERT(oi);
-          {
-            NUKLEI_ASSERT(std::string(oi->Name()) == "quaternion");
-            se3k.ori_ = la::normalized(numify<Quaternion>(oi->GetText()));
-          }
-          oi = oi->NextSiblingElement();
-          if (oi)
-          {
-            NUKLEI_ASSERT(std::string(oi->Name()) == "width");
-            NUKLEI_ASSERT(oi->QueryDoubleText(&se3k.ori_h_) == 0);
-            NUKLEI_ASSERT(oi->NextSiblingElement() == NULL);
-          }
-          
-          k.reset(new kernel::se3(se3k));
-        }
-        else if (domain == "s2p")
-        {
-          kernel::r3xs2p r3xs2pk;
-          r3xs2pk.loc_ = loc;
-          r3xs2pk.loc_h_ = loc_h;
-          
-          XMLElement* oi = kernelIter->FirstChildElement();
-          NUKLEI_ASSERT(oi);
-          {
-            NUKLEI_ASSERT(std::string(oi->Name()) == "vector3");
-            r3xs2pk.dir_ = la::normalized(numify<Vector3>(oi->GetText()));
-          }
-          oi = oi->NextSiblingElement();
-          if (oi)
-          {
-            NUKLEI_ASSERT(std::string(oi->Name()) == "width");
-            NUKLEI_ASSERT(oi->QueryDoubleText(&r3xs2pk.dir_h_) == 0);
-            NUKLEI_ASSERT(oi->NextSiblingElement() == NULL);
-          }
-          
-          k.reset(new kernel::r3xs2p(r3xs2pk));
-        }
-        else if (domain == "s2")
-        {
-          kernel::r3xs2 r3xs2k;
-          r3xs2k.loc_ = loc;
-          r3xs2k.loc_h_ = loc_h;
-          
-          XMLElement* oi = kernelIter->FirstChildElement();
-          NUKLEI_ASSERT(oi);
-          {
-            NUKLEI_ASSERT(std::string(oi->Name()) == "vector3");
-            r3xs2k.dir_ = la::normalized(numify<Vector3>(oi->GetText()));
-          }
-          oi = oi->NextSiblingElement();
-          if (oi)
-          {
-            NUKLEI_ASSERT(std::string(oi->Name()) == "width");
-            NUKLEI_ASSERT(oi->QueryDoubleText(&r3xs2k.dir_h_) == 0);
-            NUKLEI_ASSERT(oi->NextSiblingElement() == NULL);
-          }
-
-          k.reset(new kernel::r3xs2(r3xs2k));
-        }
-      }
-      else
-      {
-        kernel::r3 r3k;
-        r3k.loc_ = loc;
-        r3k.loc_h_ = loc_h;
-        k.reset(new kernel::r3(r3k));
-      }
-      k->setWeight(w);
-      
-      //TwoFingerDescriptor d;
-      //k->setDescriptor(d);
-      
-      observation->setKernel(*k);
-      
-      oc.incLabel("input");
-      
-      return std::auto_ptr<Observation>(observation);
+      unsigned expectedSize = 0;
+      if (domain == "se3" || domain == "so3") expectedSize = 4;
+      else if (domain == "s2p" || domain == "s2") expectedSize = 3;
+      else throw ObservationIOError("Unknown orientation domain " + domain);
+      if (oriSize != expectedSize)
+        throw ObservationIOError(std::string("Expected a ") +
+                                 (expectedSize == 4 ? "quaternion" : "vector3") +
+                                 " in domain " + domain);
     }
-    // End of file reached.
-    return std::auto_ptr<Observation>();
-#endif
+    
+    if (filter && !accepts(loc, w)) return std::auto_ptr<kernel::base>();
+    
+    std::auto_ptr<kernel::base> k;
+    
+    if (domain.empty())
+    {
+      std::auto_ptr<kernel::r3> r3k(new kernel::r3);
+      k = r3k;
+    }
+    else if (domain == "se3" || domain == "so3")
+    {
+      std::auto_ptr<kernel::se3> se3k(new kernel::se3);
+      se3k->ori_ = la::normalized(Quaternion(ori[0], ori[1], ori[2], ori[3]));
+      if (hasOriH) se3k->ori_h_ = ori_h;
+      k = se3k;
+    }
+    else if (domain == "s2p")
+    {
+      std::auto_ptr<kernel::r3xs2p> r3xs2pk(new kernel::r3xs2p);
+      r3xs2pk->dir_ = la::normalized(Vector3(ori[0], ori[1], ori[2]));
+      if (hasOriH) r3xs2pk->dir_h_ = ori_h;
+      k = r3xs2pk;
+    }
+    else
+    {
+      std::auto_ptr<kernel::r3xs2> r3xs2k(new kernel::r3xs2);
+      r3xs2k->dir_ = la::normalized(Vector3(ori[0], ori[1], ori[2]));
+      if (hasOriH) r3xs2k->dir_h_ = ori_h;
+      k = r3xs2k;
+    }
+    
+    k->setLoc(loc);
+    k->setLocH(loc_h);
+    k->setWeight(w);
+    return k;
+    NUKLEI_TRACE_END();
+  }
+  
+  bool NukleiReader::nextKernelElement()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!parser_.isOpen()) NUKLEI_THROW("Reader does not seem inited.");
+    
+    for (;;)
+    {
+      XmlPullParser::Event e = parser_.next();
+      // End of file reached.
+      if (e == XmlPullParser::END_DOCUMENT) return false;
+      if (e != XmlPullParser::START_ELEMENT) continue;
+      if (parser_.depth() == 2 && parser_.name() == "kernel") return true;
+      parser_.skipElement();
+    }
+    NUKLEI_TRACE_END();
+  }
+  
+  std::auto_ptr<kernel::base> NukleiReader::nextKernel()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!nextKernelElement()) return std::auto_ptr<kernel::base>();
+    return parseKernel(false);
+    NUKLEI_TRACE_END();
+  }
+  
+  std::auto_ptr<Observation> NukleiReader::readObservation_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    std::auto_ptr<kernel::base> k = nextKernel();
+    if (k.get() == NULL) return std::auto_ptr<Observation>();
+    std::auto_ptr<NukleiObservation> observation(new NukleiObservation);
+    observation->setKernel(*k);
+    return std::auto_ptr<Observation>(observation);
+    NUKLEI_TRACE_END();
+  }
+  
+  size_t NukleiReader::readKernels_(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    size_t i = 0;
+    for (; i < n && nextKernelElement(); ++i)
+    {
+      std::auto_ptr<kernel::base> k = parseKernel(true);
+      if (k.get() != NULL) keep(k, batch);
+    }
+    return i;
     NUKLEI_TRACE_END();
   }
   
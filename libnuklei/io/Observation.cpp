@@ -9,6 +9,6 @@
 namespace nuklei {
   
   const std::string Observation::TypeNames[] = {
-    "serial", "nuklei", "covis3d", "osutxt", "pcd", "ply", "rif", "crd", "off", "builtinvtk", "txt", "iis", "unknown" }; 
+    "serial", "nuklei", "covis3d", "osutxt", "pcd", "ply", "rif", "crd", "off", "builtinvtk", "txt", "iis", "binary", "packed", "unknown" }; 
 
 }
@@ -4,6 +4,11 @@
 
 /** @file */
 
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
 #include <nuklei/ObservationIO.h>
 #include <nuklei/CoViS3DObservationIO.h>
 #include <nuklei/NukleiObservationIO.h>
@@ -18,9 +23,84 @@
 #include <nuklei/KernelCollection.h>
 #include <nuklei/TxtObservationIO.h>
 #include <nuklei/IisObservationIO.h>
+#include <nuklei/BinaryObservationIO.h>
+#include <nuklei/PackedObservationIO.h>
+#include <nuklei/SubsamplingPolicy.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace nuklei {
 
+  namespace {
+
+    // Number of kernels moved at once from a reader to a KernelCollection.
+    const size_t KERNEL_BATCH_SIZE = 4096;
+
+    // Number of bytes read by ObservationReader::detectType().
+    const std::string::size_type DETECT_HEAD_SIZE = 4096;
+
+    std::vector<std::string> tokenize(const std::string &line)
+    {
+      std::vector<std::string> tokens;
+      std::istringstream iss(line);
+      std::string token;
+      while (iss >> token) tokens.push_back(token);
+      return tokens;
+    }
+
+    bool isNumber(const std::string &token)
+    {
+      char* end = NULL;
+      std::strtod(token.c_str(), &end);
+      return end != token.c_str() && *end == 0;
+    }
+
+    // Name of the first element of the XML document that starts at @p pos.
+    std::string xmlRootName(const std::string &head,
+                            std::string::size_type pos)
+    {
+      while ((pos = head.find('<', pos)) != std::string::npos)
+      {
+        if (head.compare(pos, 4, "<!--") == 0)
+          pos = head.find("-->", pos);
+        else if (head.compare(pos, 2, "<?") == 0)
+          pos = head.find("?>", pos);
+        else if (head.compare(pos, 2, "<!") == 0)
+          pos = head.find('>', pos);
+        else
+        {
+          std::string::size_type end =
+            head.find_first_of(" \t\r\n/>", pos + 1);
+          if (end == std::string::npos) return "";
+          return head.substr(pos + 1, end - pos - 1);
+        }
+        if (pos == std::string::npos) return "";
+      }
+      return "";
+    }
+
+    Observation::Type typeFromExtension(const std::string &fileName)
+    {
+      std::string::size_type dot = fileName.find_last_of("./");
+      if (dot == std::string::npos || fileName[dot] != '.')
+        return Observation::UNKNOWN;
+      std::string ext = fileName.substr(dot + 1);
+      for (std::string::iterator i = ext.begin(); i != ext.end(); ++i)
+        *i = std::tolower(*i);
+      if (ext == "pcd") return Observation::PCD;
+      if (ext == "ply") return Observation::PLY;
+      if (ext == "off") return Observation::OFF;
+      if (ext == "crd") return Observation::CRD;
+      if (ext == "rif") return Observation::RIF;
+      if (ext == "vtk") return Observation::BUILTINVTK;
+      if (ext == "txt") return Observation::TXT;
+      return Observation::UNKNOWN;
+    }
+
+  }
+
   ObservationReader::~ObservationReader()
   {
     if (!oc.empty())
@@ -57,12 +137,70 @@ namespace nuklei {
     NUKLEI_TRACE_BEGIN();
     kc.clear();
     
-    std::auto_ptr<Observation> o;
-    while ( (o = readObservation()).get() != NULL )
+    nullable<unsigned> n = nObservations();
+    if (n.isDefined()) kc.reserve(*n);
+
+    KernelBatch batch;
+    while (readKernels(batch, KERNEL_BATCH_SIZE) > 0)
+      kc.transfer(batch);
+    kc.transfer(batch);
+    
+    NUKLEI_TRACE_END();
+  }
+
+  size_t ObservationReader::readKernels(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    nInROI_ = 0;
+    const size_t nRead = readKernels_(batch, n);
+    oc.incLabel("input", nRead);
+    oc.incLabel("inROI", nInROI_);
+    if (nRead == 0 && policy_) policy_->flush(batch);
+    return nRead;
+    NUKLEI_TRACE_END();
+  }
+
+  size_t ObservationReader::readKernels_(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    size_t i = 0;
+    for (; i < n; ++i)
     {
-      kc.add(*o->getKernel());
+      std::auto_ptr<Observation> o = readObservation_();
+      if (o.get() == NULL) break;
+      // Observations only expose their data through a kernel, so this
+      // generic path builds the kernels of dropped observations too.
+      std::auto_ptr<kernel::base> k = o->getKernel();
+      if (accepts(k->getLoc(), k->getWeight())) keep(k, batch);
     }
-    
+    return i;
+    NUKLEI_TRACE_END();
+  }
+
+  bool ObservationReader::accepts(const Vector3 &loc, const weight_t w)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (roi_ && !roi_->contains(loc)) return false;
+    nInROI_++;
+    return !policy_ || policy_->offer(loc, w);
+    NUKLEI_TRACE_END();
+  }
+
+  void ObservationReader::keep(std::auto_ptr<kernel::base> k,
+                               KernelBatch &batch)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (policy_) policy_->keep(k, batch);
+    else batch.push_back(k.release());
+    NUKLEI_TRACE_END();
+  }
+
+  void ObservationReader::init()
+  {
+    NUKLEI_TRACE_BEGIN();
+    registerType(*this);
+    if (policy_) policy_->reset();
+    init_();
     NUKLEI_TRACE_END();
   }
 
@@ -80,7 +218,8 @@ namespace nuklei {
     NUKLEI_TRACE_END();
   }
 
-  void ObservationReader::Counter::incLabel(const std::string &label)
+  void ObservationReader::Counter::incLabel(const std::string &label,
+                                            const unsigned n)
   {
     NUKLEI_TRACE_BEGIN();
     map_t::iterator i;
@@ -90,7 +229,7 @@ namespace nuklei {
       i = counts_.insert(std::make_pair(label, unsigned(0))).first;
     }
     else i = counts_.find(label);
-    ++(i->second);
+    i->second += n;
     NUKLEI_TRACE_END();
   }
     
@@ -111,6 +250,13 @@ namespace nuklei {
     NUKLEI_TRACE_END();
   }
 
+  void ObservationReader::setSubsamplingPolicy(boost::shared_ptr<SubsamplingPolicy> policy)
+  {
+    NUKLEI_TRACE_BEGIN();
+    policy_ = policy;
+    NUKLEI_TRACE_END();
+  }
+
   std::auto_ptr<ObservationReader>
   ObservationReader::createReader(const std::string& arg)
   {
@@ -120,99 +266,141 @@ namespace nuklei {
     std::string errorsCat = std::string("Error in ObservationReader::createReader.") +
       "\nErrors at each format attempt were:";
 
-#ifdef NUKLEI_USE_TICPP
-    try {
-      reader = createReader(arg, Observation::COVIS3D);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
-    }
-#endif
-    
-    try {
-      reader = createReader(arg, Observation::NUKLEI);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
-    }
-    
-#ifdef NUKLEI_USE_TICPP
-    try {
-      reader = createReader(arg, Observation::IIS);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
-    }
-#endif
-    
-    try {
-      reader = createReader(arg, Observation::OSUTXT);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
+    // Dispatch directly to the reader of the detected format, so that a
+    // large file does not go through several failed parses first.
+    const Observation::Type detected = detectType(arg);
+    if (detected != Observation::UNKNOWN)
+    {
+      try {
+        reader = createReader(arg, detected);
+        return reader;
+      } catch (ObservationIOError &e) {
+        errorsCat += "\n" + std::string(e.what());
+      }
     }
 
-    try {
-      reader = createReader(arg, Observation::PCD);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
-    }
+    // Cheap header checks come first, full-file checks last.
+    const Observation::Type order[] = {
+      Observation::BINARY, Observation::PACKED, Observation::COVIS3D,
+      Observation::NUKLEI, Observation::IIS, Observation::OSUTXT,
+      Observation::PCD, Observation::PLY, Observation::RIF,
+      Observation::SERIAL, Observation::CRD, Observation::OFF,
+      Observation::BUILTINVTK, Observation::TXT
+    };
 
-    try {
-      reader = createReader(arg, Observation::PLY);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
+    for (unsigned i = 0; i < sizeof(order)/sizeof(order[0]); ++i)
+    {
+      if (order[i] == detected) continue;
+      try {
+        reader = createReader(arg, order[i]);
+        return reader;
+      } catch (ObservationIOError &e) {
+        errorsCat += "\n" + std::string(e.what());
+      }
     }
 
-    try {
-      reader = createReader(arg, Observation::RIF);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
-    }
+    throw ObservationIOError
+      ("Error loading observations with automatic type detection. "
+       "Maybe the filename `" + arg + "' is incorrect. "
+       "Else please try again with a defined type.");
+    return reader;
+    NUKLEI_TRACE_END();
+  }
 
-    try {
-      reader = createReader(arg, Observation::SERIAL);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
+  Observation::Type ObservationReader::detectType(const std::string& fileName)
+  {
+    NUKLEI_TRACE_BEGIN();
+    std::string head;
+    {
+      std::ifstream ifs(fileName.c_str(), std::ios::in | std::ios::binary);
+      if (!ifs.is_open()) return Observation::UNKNOWN;
+      head.resize(DETECT_HEAD_SIZE);
+      ifs.read(&head[0], head.size());
+      head.resize(ifs.gcount());
+      // The last line may have been cut.
+      if (head.size() == DETECT_HEAD_SIZE)
+      {
+        std::string::size_type eol = head.find_last_of('\n');
+        if (eol != std::string::npos) head.resize(eol + 1);
+      }
     }
 
-    try {
-      reader = createReader(arg, Observation::CRD);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
+    // Binary formats.
+    if (head.compare(0, BinaryFileHeader::MAGIC_SIZE,
+                     BinaryFileHeader::magic()) == 0)
+      return Observation::BINARY;
+    if (head.compare(0, PackedFileHeader::MAGIC_SIZE,
+                     PackedFileHeader::magic()) == 0)
+      return Observation::PACKED;
+    // Compressed or binary Boost archives.
+    if (head.size() >= 2 && (unsigned char)head[0] == 0x1f &&
+        (unsigned char)head[1] == 0x8b)
+      return Observation::SERIAL;
+    if (head.substr(0, 64).find("serialization::archive") != std::string::npos)
+      return Observation::SERIAL;
+
+    std::string::size_type start = 0;
+    if (head.compare(0, 3, "\xEF\xBB\xBF") == 0) start = 3;
+    start = head.find_first_not_of(" \t\r\n", start);
+    if (start == std::string::npos) return typeFromExtension(fileName);
+
+    if (head[start] == '<')
+    {
+      std::string root = xmlRootName(head, start);
+      if (root == "kernelCollection") return Observation::NUKLEI;
+      if (root == "Scene") return Observation::COVIS3D;
+      if (root == "grasps") return Observation::IIS;
+      if (root == "boost_serialization") return Observation::SERIAL;
+      return typeFromExtension(fileName);
     }
 
-    try {
-      reader = createReader(arg, Observation::OFF);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
-    }
+    std::istringstream lines(head.substr(start));
+    std::string line;
+    std::getline(lines, line);
+    cleanLine(line);
+    std::vector<std::string> tokens = tokenize(line);
+    if (tokens.empty()) return typeFromExtension(fileName);
 
-    try {
-      reader = createReader(arg, Observation::BUILTINVTK);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
+    if (tokens.front() == "ply") return Observation::PLY;
+    if (tokens.front() == "OFF" && tokens.size() == 1) return Observation::OFF;
+    if (line.compare(0, 5, "# vtk") == 0) return Observation::BUILTINVTK;
+    if (tokens.size() >= 2 && tokens[1] == "rows") return Observation::OSUTXT;
+
+    // PCD headers start with comments and a VERSION or FIELDS line.
+    {
+      std::istringstream pcd(head.substr(start));
+      std::string l;
+      while (std::getline(pcd, l))
+      {
+        std::vector<std::string> t = tokenize(cleanLine(l));
+        if (t.empty() || t.front()[0] == '#') continue;
+        if (t.front() == "VERSION" || t.front() == "FIELDS")
+          return Observation::PCD;
+        break;
+      }
     }
 
-    try {
-      reader = createReader(arg, Observation::TXT);
-      return reader;
-    } catch (ObservationIOError &e) {
-      errorsCat += "\n" + std::string(e.what());
+    // RIF headers end with a line holding a single `|'.
+    {
+      std::istringstream rif(head.substr(start));
+      std::string l;
+      while (std::getline(rif, l))
+        if (cleanLine(l) == "|") return Observation::RIF;
     }
 
-    throw ObservationIOError
-      ("Error loading observations with automatic type detection. "
-       "Maybe the filename `" + arg + "' is incorrect. "
-       "Else please try again with a defined type.");
-    return reader;
+    // Point lists: CRD files start with a point count, optionally preceded
+    // by `syncpc', TXT files have 3, 6 or 7 numbers per line.
+    bool numeric = true;
+    for (std::vector<std::string>::const_iterator i = tokens.begin();
+         i != tokens.end(); ++i)
+      if (!isNumber(*i)) { numeric = false; break; }
+    if (tokens.size() == 1 && (tokens.front() == "syncpc" || numeric))
+      return Observation::CRD;
+    if (numeric && (tokens.size() == 3 || tokens.size() == 6 ||
+                    tokens.size() == 7))
+      return Observation::TXT;
+
+    return typeFromExtension(fileName);
     NUKLEI_TRACE_END();
   }
 
@@ -283,6 +471,16 @@ namespace nuklei {
         reader.reset(new IisReader(arg));
         break;
       }
+      case Observation::BINARY:
+      {
+        reader.reset(new BinaryReader(arg));
+        break;
+      }
+      case Observation::PACKED:
+      {
+        reader.reset(new PackedReader(arg));
+        break;
+      }
       default:
       {
         NUKLEI_THROW("Unknown format.");
@@ -383,6 +581,16 @@ namespace nuklei {
         writer.reset(new IisWriter(arg));
         break;
       }
+      case Observation::BINARY:
+      {
+        writer.reset(new BinaryWriter(arg));
+        break;
+      }
+      case Observation::PACKED:
+      {
+        writer.reset(new PackedWriter(arg));
+        break;
+      }
       default:
       {
         NUKLEI_THROW("Unknown format.");
@@ -423,6 +631,75 @@ namespace nuklei {
     readObservations(*reader, kc);
   }
 
+  void readObservations(std::vector<ObservationFile> &files)
+  {
+    NUKLEI_TRACE_BEGIN();
+    // Files are read concurrently, so that their I/O overlaps. Most readers
+    // also parse their file with several threads: when there are fewer
+    // files than threads, each file gets a share of the threads, which its
+    // reader uses in a nested parallel region.
+    const int nFiles = files.size();
+#ifdef _OPENMP
+    const int nThreads = omp_get_max_threads();
+    const bool nested = nFiles > 1 && nFiles < nThreads;
+    const int maxLevels = omp_get_max_active_levels();
+    if (nested && maxLevels < omp_get_active_level() + 2)
+      omp_set_max_active_levels(omp_get_active_level() + 2);
+#endif
+    std::string error;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) \
+  num_threads(nested ? nFiles : nThreads) if(nFiles > 1)
+#endif
+    for (int i = 0; i < nFiles; ++i)
+    {
+#ifdef _OPENMP
+      if (nFiles > 1)
+        omp_set_num_threads(nested ?
+                            nThreads / nFiles + (i < nThreads % nFiles) : 1);
+#endif
+      ObservationFile &f = files[i];
+      try {
+        std::auto_ptr<ObservationReader> reader;
+        if (f.type == Observation::UNKNOWN)
+          reader = ObservationReader::createReader(f.fileName);
+        else
+          reader = ObservationReader::createReader(f.fileName, f.type);
+        if (f.roi) reader->addRegionOfInterest(f.roi);
+        if (f.policy) reader->setSubsamplingPolicy(f.policy);
+        f.type = reader->type();
+        f.kernels.clear();
+        nullable<unsigned> n = reader->nObservations();
+        if (n.isDefined() && !f.policy) f.kernels.reserve(*n);
+        while (reader->readKernels(f.kernels, KERNEL_BATCH_SIZE) > 0) ;
+      } catch (std::exception &e) {
+#ifdef _OPENMP
+#pragma omp critical(nuklei_readObservations_error)
+#endif
+        if (error.empty())
+          error = "Error reading `" + f.fileName + "': " + e.what();
+      }
+    }
+#ifdef _OPENMP
+    omp_set_max_active_levels(maxLevels);
+#endif
+    if (!error.empty()) throw ObservationIOError(error);
+    NUKLEI_TRACE_END();
+  }
+
+  void readObservations(const std::vector<std::string> &fileNames,
+                        KernelCollection &kc)
+  {
+    NUKLEI_TRACE_BEGIN();
+    std::vector<ObservationFile> files(fileNames.begin(), fileNames.end());
+    readObservations(files);
+    kc.clear();
+    for (std::vector<ObservationFile>::iterator i = files.begin();
+         i != files.end(); ++i)
+      kc.transfer(i->kernels);
+    NUKLEI_TRACE_END();
+  }
+
 
   kernel::base::ptr readSingleObservation(const std::string &s)
   {
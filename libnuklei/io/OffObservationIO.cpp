@@ -18,7 +18,7 @@ namespace nuklei {
 
 
   OffReader::OffReader(const std::string &observationFileName) :
-    observationFileName(observationFileName), count_(0)
+    observationFileName(observationFileName), index_(-1)
   {
   }
 
@@ -30,21 +30,17 @@ namespace nuklei {
 
   void OffReader::init_()
   {
-    NUKLEI_ASSERT(!in_.is_open());
-    in_.open(observationFileName.c_str(), std::ios::in);
-    if (!in_.is_open())
-      throw ObservationIOError(std::string("Could not open file ") +
-                                   observationFileName + " for reading.");
+    NUKLEI_TRACE_BEGIN();
+    file_.open(observationFileName);
     
     int count = -1;
     {
       std::string firstline;
-      if (! std::getline(in_, firstline) )
+      if (! file_.getLine(firstline) )
         throw ObservationIOError("Input does not look like OFF (file read error).");
-      cleanLine(firstline);
       if (firstline != "OFF")
         throw ObservationIOError("Input does not look like OFF (marker error).");
-      if (! std::getline(in_, firstline) )
+      if (! file_.getLine(firstline) )
         throw ObservationIOError("Input does not look like OFF (file read error).");
       try {
         count = numify<int>(firstline, false);        
@@ -55,52 +51,71 @@ namespace nuklei {
       if (!(count >= 0))
         throw ObservationIOError("Input does not look like OFF (no point count).");
     }
-    count_ = count;
+
+    // Vertices are followed by faces, which are ignored.
+    const char* verticesEnd =
+      skipAsciiLines(file_.cursor(), file_.end(), count);
+    table_.parse(file_.cursor(), verticesEnd, 3, 3, true);
+    file_.close();
+    if (table_.rows() != size_t(count))
+      throw ObservationIOError("Unexpected end of file.");
+    index_ = 0;
+    NUKLEI_TRACE_END();
   }
 
 
   void OffReader::reset()
   {
-    in_.close();
     init();
   }
 
 
-  std::auto_ptr<Observation> OffReader::readObservation_()
+  std::auto_ptr<kernel::r3> OffReader::nextKernel()
   {
-    if (!in_.is_open()) NUKLEI_THROW("Reader does not seem inited.");
+    NUKLEI_TRACE_BEGIN();
+    if (index_ < 0) NUKLEI_THROW("Reader does not seem inited.");
+
+    // End of file reached.
+    if (size_t(index_) >= table_.rows()) return std::auto_ptr<kernel::r3>();
 
-    if (!in_.good()) return std::auto_ptr<Observation>();
+    const coord_t* v = table_.values() + 3*index_;
+    index_++;
+
+    std::auto_ptr<kernel::r3> k(new kernel::r3);
+    k->loc_ = Vector3(v[0], v[1], v[2]);
+    ColorDescriptor d;
+    d.setColor(RGBColor(.5,.5,.5));
+    k->setDescriptor(d);
     
-    std::string line;
-        
-    if (count_ > 0)
+    return k;
+    NUKLEI_TRACE_END();
+  }
+
+
+  std::auto_ptr<Observation> OffReader::readObservation_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    std::auto_ptr<kernel::r3> k = nextKernel();
+    if (k.get() == NULL) return std::auto_ptr<Observation>();
+    return std::auto_ptr<Observation>(new OffObservation(*k));
+    NUKLEI_TRACE_END();
+  }
+
+
+  size_t OffReader::readKernels_(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (index_ < 0) NUKLEI_THROW("Reader does not seem inited.");
+    size_t i = 0;
+    for (; i < n && size_t(index_) < table_.rows(); ++i)
     {
-      if (!std::getline(in_, line))
-      {
-        throw ObservationIOError("Unexpected end of file.");
-      }
-      cleanLine(line);
-
-      std::istringstream iss(line);
-      
-      std::auto_ptr<OffObservation> observation(new OffObservation);
-      
-      Vector3 loc;
-      if ( ! (iss >> loc[0] >> loc[1] >> loc[2]) )
-        throw ObservationIOError("Parsing error.");
-      observation->setLoc(loc);
-      
-      RGBColor c(.5,.5,.5);
-      observation->setColor(c);
-      
-      count_--;
-      
-      return std::auto_ptr<Observation>(observation);
+      const coord_t* v = table_.values() + 3*index_;
+      if (accepts(Vector3(v[0], v[1], v[2]), 1))
+        keep(std::auto_ptr<kernel::base>(nextKernel()), batch);
+      else index_++;
     }
-    
-    // End of file reached.
-    return std::auto_ptr<Observation>();
+    return i;
+    NUKLEI_TRACE_END();
   }
 
   
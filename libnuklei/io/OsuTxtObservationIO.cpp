@@ -49,52 +49,39 @@ namespace nuklei {
   {
     NUKLEI_TRACE_BEGIN();
     
-    NUKLEI_ASSERT(!in_.is_open());
-    in_.open(geometryFileName.c_str(), std::ios::in);
-    if (!in_.is_open())
-      throw ObservationIOError(std::string("Could not open file ") +
-                                   geometryFileName + " for reading.");
-    try {
-      if ( !(in_ >> rows_ >> Match("rows") >> columns_ >> Match("columns")) )
-        throw ObservationIOError("Non-OsuTxt format.");
-      if ( !(in_ >> Match("pixels") >> Match("(flag") >> Match("X") >>
-                  Match("Y") >> Match("Z):")) )
-        throw ObservationIOError("Non-OsuTxt format.");
-    } catch (Error &e) {
-        throw ObservationIOError("Non-OsuTxt format.");
-    }
-    flags_.clear();
-    x_.clear();
-    y_.clear();
-    z_.clear();
-    
-    for (unsigned i = 0; i < rows_*columns_; ++i)
-    {
-      // Why does this not work?:
-      // in_>>flags_[i];
-    
-      bool b;
-      NUKLEI_ASSERT(in_>>b);
-      flags_.push_back(b);
-    }
-    for (unsigned i = 0; i < rows_*columns_; ++i)
-    {
-      coord_t c;
-      NUKLEI_ASSERT(in_>>c);
-      x_.push_back(c);
-    }
-    for (unsigned i = 0; i < rows_*columns_; ++i)
-    {
-      coord_t c;
-      NUKLEI_ASSERT(in_>>c);
-      y_.push_back(c);
-    }
-    for (unsigned i = 0; i < rows_*columns_; ++i)
+    file_.open(geometryFileName);
     {
-      coord_t c;
-      NUKLEI_ASSERT(in_>>c);
-      z_.push_back(c);
+      // Header: "<rows> rows <columns> columns pixels (flag X Y Z):"
+      const char* expected[] = { NULL, "rows", NULL, "columns",
+        "pixels", "(flag", "X", "Y", "Z):" };
+      std::string token;
+      for (unsigned i = 0; i < sizeof(expected)/sizeof(expected[0]); ++i)
+      {
+        if (!file_.getToken(token))
+          throw ObservationIOError("Non-OsuTxt format.");
+        if (expected[i] != NULL)
+        {
+          if (token != expected[i])
+            throw ObservationIOError("Non-OsuTxt format.");
+        }
+        else
+        {
+          try {
+            (i == 0 ? rows_ : columns_) = numify<unsigned>(token);
+          } catch (BadStrNumConversion &e) {
+            throw ObservationIOError("Non-OsuTxt format.");
+          }
+        }
+      }
     }
+
+    // The header is followed by rows*columns flags, then as many X, Y and Z
+    // coordinates.
+    values_.clear();
+    parseAsciiNumbers(values_, file_.cursor(), file_.end());
+    file_.close();
+    if (values_.size() < 4*rows_*columns_)
+      throw ObservationIOError("Unexpected end of file.");
     
     rgb_.clear();
     if (!appFileName.empty())
@@ -126,8 +113,6 @@ namespace nuklei {
           rgb_.push_back(rgb);
         }
     }
-    NUKLEI_ASSERT(in_.peek() != EOF);
-    in_.close();
     currentIndex_ = 0;
     
     
@@ -143,32 +128,64 @@ namespace nuklei {
   }
 
 
-  std::auto_ptr<Observation> OsuTxtReader::readObservation_()
+  std::auto_ptr<kernel::r3> OsuTxtReader::nextKernel()
   {
     NUKLEI_TRACE_BEGIN();
     if (rows_ == 0 || columns_ == 0) NUKLEI_THROW("Reader does not seem inited.");
     
+    const unsigned n = rows_*columns_;
     for (;;)
     {
-      if (currentIndex_ >= rows_*columns_)
-        return std::auto_ptr<Observation>();
+      if (currentIndex_ >= n)
+        return std::auto_ptr<kernel::r3>();
       
       unsigned index = currentIndex_;
       currentIndex_++;
       
-      if (flags_[index] == false) continue;
+      if (values_[index] == 0) continue;
       
-      std::auto_ptr<OsuTxtObservation> observation(new OsuTxtObservation);
-
-      Vector3 loc(x_[index], y_[index], z_[index]);
-      observation->setLoc(loc);
-      RGBColor c(rgb_[index]);
-      observation->setColor(c);
+      std::auto_ptr<kernel::r3> k(new kernel::r3);
+      k->loc_ = Vector3(values_[n+index], values_[2*n+index], values_[3*n+index]);
+      ColorDescriptor d;
+      d.setColor(RGBColor(rgb_[index]));
+      k->setDescriptor(d);
             
-      return std::auto_ptr<Observation>(observation);
+      return k;
     }
+    NUKLEI_TRACE_END();
+  }
+
+
+  std::auto_ptr<Observation> OsuTxtReader::readObservation_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    std::auto_ptr<kernel::r3> k = nextKernel();
+    if (k.get() == NULL) return std::auto_ptr<Observation>();
+    return std::auto_ptr<Observation>(new OsuTxtObservation(*k));
+    NUKLEI_TRACE_END();
+  }
+
+
+  size_t OsuTxtReader::readKernels_(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (rows_ == 0 || columns_ == 0) NUKLEI_THROW("Reader does not seem inited.");
     
-    return std::auto_ptr<Observation>();
+    const unsigned nPoints = rows_*columns_;
+    size_t i = 0;
+    for (; i < n; ++i)
+    {
+      while (currentIndex_ < nPoints && values_[currentIndex_] == 0)
+        currentIndex_++;
+      if (currentIndex_ >= nPoints) break;
+      
+      const unsigned index = currentIndex_;
+      if (accepts(Vector3(values_[nPoints+index], values_[2*nPoints+index],
+                          values_[3*nPoints+index]), 1))
+        keep(std::auto_ptr<kernel::base>(nextKernel()), batch);
+      else currentIndex_++;
+    }
+    return i;
     NUKLEI_TRACE_END();
   }
 
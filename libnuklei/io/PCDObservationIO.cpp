@@ -8,26 +8,206 @@
 #include <cassert>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <limits>
+#include <boost/cstdint.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/math/special_functions/fpclassify.hpp>
 
 #include <nuklei/PCDObservationIO.h>
 #include <nuklei/PCDObservation.h>
+#include <nuklei/Lzf.h>
+#include <nuklei/ByteOrder.h>
 #include <nuklei/Common.h>
 #include <nuklei/Match.h>
 #include <nuklei/Indenter.h>
 
-#ifdef NUKLEI_USE_PCL
-#include <pcl/io/pcd_io.h>
-#include <pcl/point_types.h>
-#include <nuklei/PCLBridge.h>
-#endif
-
 namespace nuklei {
 
+  namespace {
+
+    coord_t readField(const char* p, const PCDFieldLayout::Field &f)
+    {
+      if (f.type == 'F')
+        return f.size == 4 ?
+          coord_t(readLittleEndian<float>(p)) : readLittleEndian<double>(p);
+      else if (f.type == 'I')
+        switch (f.size)
+        {
+          case 1: return *reinterpret_cast<const signed char*>(p);
+          case 2: return readLittleEndian<boost::int16_t>(p);
+          case 4: return readLittleEndian<boost::int32_t>(p);
+          default: return coord_t(readLittleEndian<boost::int64_t>(p));
+        }
+      else
+        switch (f.size)
+        {
+          case 1: return *reinterpret_cast<const unsigned char*>(p);
+          case 2: return readLittleEndian<boost::uint16_t>(p);
+          case 4: return readLittleEndian<boost::uint32_t>(p);
+          default: return coord_t(readLittleEndian<boost::uint64_t>(p));
+        }
+    }
+
+    // Integer colors are scaled to [0,1].
+    coord_t colorScale(const PCDFieldLayout::Field &f)
+    {
+      if (f.type == 'F') return 1;
+      const int bits = 8 * f.size - (f.type == 'I' ? 1 : 0);
+      return std::ldexp(coord_t(1), bits) - 1;
+    }
+
+    void unpackColor(const boost::uint32_t rgb, coord_t* values)
+    {
+      typedef PCDFieldLayout L;
+      values[L::RED] = coord_t((rgb >> 16) & 0xff) / 255;
+      values[L::GREEN] = coord_t((rgb >> 8) & 0xff) / 255;
+      values[L::BLUE] = coord_t(rgb & 0xff) / 255;
+    }
+
+    // Number of values per decoded point. Positions come first, followed by
+    // the normal and the color, if present.
+    unsigned packedWidth(const PCDFieldLayout &l)
+    {
+      return 3 + (l.hasNormals() ? 3 : 0) + (l.hasColors() ? 3 : 0);
+    }
+
+    void pack(const PCDFieldLayout &l, const coord_t* slots, coord_t* packed)
+    {
+      typedef PCDFieldLayout L;
+      std::copy(slots + L::X, slots + L::Z + 1, packed);
+      packed += 3;
+      if (l.hasNormals())
+      {
+        std::copy(slots + L::NX, slots + L::NZ + 1, packed);
+        packed += 3;
+      }
+      if (l.hasColors())
+        std::copy(slots + L::RED, slots + L::BLUE + 1, packed);
+    }
+
+    boost::uint32_t packColor(const Color &color)
+    {
+      const RGBColor c(color);
+      boost::uint32_t rgb = 0;
+      for (int d = 0; d < 3; ++d)
+      {
+        coord_t v = std::min(std::max(c.getRGB()[d], 0.), 1.);
+        rgb = (rgb << 8) | boost::uint32_t(v*255 + .5);
+      }
+      return rgb;
+    }
+
+  }
+
+
+  void PCDFieldLayout::addField(const std::string &name, const char type,
+                                const unsigned size, const unsigned count)
+  {
+    NUKLEI_TRACE_BEGIN();
+    Field f;
+    if (!((type == 'F' && (size == 4 || size == 8)) ||
+          ((type == 'I' || type == 'U') &&
+           (size == 1 || size == 2 || size == 4 || size == 8))))
+      throw ObservationIOError("Unsupported PCD field type `" +
+                               std::string(1, type) + stringify(size) + "'.");
+    f.type = type;
+    f.size = size;
+    f.offset = stride;
+    f.column = nColumns;
+    f.packed = false;
+    stride += size * count;
+    nColumns += count;
+
+    if (count != 1) return;
+    if (name == "x") f.slot = X;
+    else if (name == "y") f.slot = Y;
+    else if (name == "z") f.slot = Z;
+    else if (name == "normal_x") f.slot = NX;
+    else if (name == "normal_y") f.slot = NY;
+    else if (name == "normal_z") f.slot = NZ;
+    else if (name == "r") f.slot = RED;
+    else if (name == "g") f.slot = GREEN;
+    else if (name == "b") f.slot = BLUE;
+    else if ((name == "rgb" || name == "rgba") && size == 4)
+    {
+      f.slot = RED;
+      f.packed = true;
+    }
+    else return;
+    used.push_back(f);
+    NUKLEI_TRACE_END();
+  }
+
+  bool PCDFieldLayout::has(const Slot first, const Slot last) const
+  {
+    for (int s = first; s <= last; ++s)
+    {
+      bool found = false;
+      for (std::vector<Field>::const_iterator i = used.begin();
+           i != used.end(); ++i)
+        if (i->slot == s || (i->packed && s >= RED && s <= BLUE))
+          found = true;
+      if (!found) return false;
+    }
+    return true;
+  }
+
+  void PCDFieldLayout::decode(const char* data, const size_t i, const size_t n,
+                              coord_t* values) const
+  {
+    for (std::vector<Field>::const_iterator f = used.begin();
+         f != used.end(); ++f)
+    {
+      // Compressed blocks store each field for all points, one field
+      // after the other.
+      const char* p = format == BINARY_COMPRESSED ?
+        data + size_t(f->offset) * n + i * f->size :
+        data + i * stride + f->offset;
+      if (f->packed)
+        unpackColor(readLittleEndian<boost::uint32_t>(p), values);
+      else
+      {
+        coord_t v = readField(p, *f);
+        if (f->slot >= RED) v /= colorScale(*f);
+        values[f->slot] = v;
+      }
+    }
+  }
+
+  void PCDFieldLayout::decode(const coord_t* row, coord_t* values) const
+  {
+    for (std::vector<Field>::const_iterator f = used.begin();
+         f != used.end(); ++f)
+    {
+      coord_t v = row[f->column];
+      if (f->packed)
+      {
+        // PCL writes packed colors as integers, and older versions as the
+        // float that has the same bits.
+        boost::uint32_t rgb;
+        if (v >= 0 && v < 4294967296. && v == std::floor(v))
+          rgb = boost::uint32_t(v);
+        else
+        {
+          const float fv = float(v);
+          std::memcpy(&rgb, &fv, sizeof(rgb));
+        }
+        unpackColor(rgb, values);
+      }
+      else
+      {
+        if (f->slot >= RED) v /= colorScale(*f);
+        values[f->slot] = v;
+      }
+    }
+  }
+
 
 
   PCDReader::PCDReader(const std::string &observationFileName) :
-    KernelReader(observationFileName)
+    index_(-1), n_(-1), observationFileName_(observationFileName)
   {
   }
 
@@ -38,153 +218,394 @@ namespace nuklei {
   void PCDReader::init_()
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_USE_PCL
-    kc_.clear();
-    
-    {
-      std::ifstream ifs(observationFileName_.c_str());
-      if (!ifs.is_open())
-        throw ObservationIOError(std::string("Could not open file ") +
-                                 observationFileName_ + " for reading.");    
-      
+    typedef PCDFieldLayout L;
+    file_.open(observationFileName_);
+    n_ = -1;
+    index_ = -1;
+    layout_ = L();
+    points_.clear();
+
+    size_t n = 0;
+    try {
+      std::vector<std::string> fields, types, sizes, counts;
+      int width = -1, height = 1, nPoints = -1;
+      bool data = false, first = true;
+
       std::string line;
-      if (!std::getline(ifs, line) ||
-          line.size() < 1 ||
-          line.at(0) != '#' ||
-          line.find("PCD") == std::string::npos)
-        throw ObservationIOError("File " +
-                                 observationFileName_ +
-                                 " does not appear to be PCD.");
-      
-      if (!std::getline(ifs, line) || !std::getline(ifs, line) ||
-          line.size() < 1)
-        throw ObservationIOError("File " +
-                                 observationFileName_ +
-                                 " does not appear to be PCD.");
-      
-      if (line.find("normal_x") != std::string::npos)
-      {
-        if (line.find("rgb") != std::string::npos ||
-            line.find("r g b") != std::string::npos)
+      while (!data && file_.getLine(line))
+      {
+        std::vector<std::string> tokens;
+        boost::split(tokens, line, boost::is_any_of(" \t"), boost::token_compress_on);
+        if (!tokens.empty() && tokens.front() == "")
+          tokens.erase(tokens.begin());
+        if (!tokens.empty() && tokens.back() == "")
+          tokens.pop_back();
+
+        const bool comment = !tokens.empty() && tokens.front().at(0) == '#';
+        if (first && !comment &&
+            (tokens.empty() ||
+             (tokens.front() != "VERSION" && tokens.front() != "FIELDS")))
+          throw ObservationIOError("Non-PCD format (PCD must start with a "
+                                   "comment, a VERSION or a FIELDS line).");
+        first = false;
+        if (tokens.empty() || comment) continue;
+
+        const std::string key = tokens.front();
+        tokens.erase(tokens.begin());
+        if (key == "VERSION" || key == "VIEWPOINT") continue;
+        else if (key == "FIELDS" || key == "COLUMNS") fields = tokens;
+        else if (key == "SIZE") sizes = tokens;
+        else if (key == "TYPE") types = tokens;
+        else if (key == "COUNT") counts = tokens;
+        else if (key == "WIDTH" && tokens.size() == 1)
+          width = numify<int>(tokens.front());
+        else if (key == "HEIGHT" && tokens.size() == 1)
+          height = numify<int>(tokens.front());
+        else if (key == "POINTS" && tokens.size() == 1)
+          nPoints = numify<int>(tokens.front());
+        else if (key == "DATA" && tokens.size() == 1)
         {
-          // Normals & RGB
-          pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr cloud
-          (new pcl::PointCloud<pcl::PointXYZRGBNormal>);
-          
-          if (pcl::io::loadPCDFile<pcl::PointXYZRGBNormal>
-              (observationFileName_, *cloud) == -1)
-            throw ObservationIOError("PCL cannot read file `" + observationFileName_ + "'.");
+          if (tokens.front() == "ascii") layout_.format = L::ASCII;
+          else if (tokens.front() == "binary") layout_.format = L::BINARY;
+          else if (tokens.front() == "binary_compressed")
+            layout_.format = L::BINARY_COMPRESSED;
           else
-            kc_ = nukleiFromPcl(*cloud, true);
+            throw ObservationIOError("Unknown PCD data format `" +
+                                     tokens.front() + "'.");
+          data = true;
         }
         else
-        {
-          // Normals
-          pcl::PointCloud<pcl::PointNormal>::Ptr cloud
-          (new pcl::PointCloud<pcl::PointNormal>);
-          
-          if (pcl::io::loadPCDFile<pcl::PointNormal>
-              (observationFileName_, *cloud) == -1)
-            throw ObservationIOError("PCL cannot read file `" + observationFileName_ + "'.");
-          else
-            kc_ = nukleiFromPcl(*cloud, true);
-        }
+          throw ObservationIOError("Non-PCD format (unexpected line `" +
+                                   line + "').");
       }
-      else
+
+      if (!data || fields.empty())
+        throw ObservationIOError("Non-PCD format.");
+      if (counts.empty()) counts.resize(fields.size(), "1");
+      if (sizes.size() != fields.size() || types.size() != fields.size() ||
+          counts.size() != fields.size())
+        throw ObservationIOError("Inconsistent PCD header.");
+      for (unsigned i = 0; i < fields.size(); ++i)
       {
-        if (line.find("rgb") != std::string::npos ||
-            line.find("r g b") != std::string::npos)
-        {
-          // RGB
-          pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud
-          (new pcl::PointCloud<pcl::PointXYZRGB>);
-          
-          if (pcl::io::loadPCDFile<pcl::PointXYZRGB>
-              (observationFileName_, *cloud) == -1)
-            throw ObservationIOError("PCL cannot read file `" + observationFileName_ + "'.");
-          else
-            kc_ = nukleiFromPcl(*cloud, true);
-        }
-        else
-        {
-          // only xyz
-          pcl::PointCloud<pcl::PointXYZ>::Ptr cloud
-          (new pcl::PointCloud<pcl::PointXYZ>);
-          
-          if (pcl::io::loadPCDFile<pcl::PointXYZ>
-              (observationFileName_, *cloud) == -1)
-            throw ObservationIOError("PCL cannot read file `" + observationFileName_ + "'.");
-          else
-            kc_ = nukleiFromPcl(*cloud, true);
-        }
+        if (types.at(i).size() != 1)
+          throw ObservationIOError("Unknown PCD type `" + types.at(i) + "'.");
+        layout_.addField(fields.at(i), types.at(i).at(0),
+                         numify<unsigned>(sizes.at(i)),
+                         numify<unsigned>(counts.at(i)));
       }
+      if (nPoints < 0) nPoints = width * height;
+      if (nPoints < 0)
+        throw ObservationIOError("PCD header gives no number of points.");
+      n = nPoints;
+
+      if (!layout_.has(L::X, L::Z))
+        throw ObservationIOError("PCD points have no position.");
+
+    } catch (ObservationIOError &e) {
+      throw;
+    } catch (Error &e) {
+      throw ObservationIOError("Non-PCD format.");
     }
-    
-    idx_ = 0;
-#else
-    throw ObservationIOError("This method requires PCL.");
+
+    const unsigned width = packedWidth(layout_);
+    points_.resize(n * width);
+
+    if (layout_.format == L::ASCII)
+    {
+      if (layout_.nColumns > std::numeric_limits<unsigned char>::max())
+        throw ObservationIOError("Too many PCD fields.");
+      AsciiTable table;
+      table.parse(file_.cursor(), file_.end(),
+                  layout_.nColumns, layout_.nColumns, false);
+      if (table.rows() != n)
+        throw ObservationIOError("Unexpected number of PCD points.");
+      const coord_t* values = table.values();
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+      for (int i = 0; i < int(n); ++i)
+      {
+        coord_t slots[L::N_SLOTS];
+        layout_.decode(values + size_t(i) * layout_.nColumns, slots);
+        pack(layout_, slots, &points_[size_t(i) * width]);
+      }
+    }
+    else
+    {
+      const char* data = file_.cursor();
+      size_t available = file_.end() - data;
+      std::vector<char> buffer;
+      if (layout_.format == L::BINARY_COMPRESSED)
+      {
+        if (available < 8)
+          throw ObservationIOError("Unexpected end of file.");
+        const size_t compressed = readLittleEndian<boost::uint32_t>(data);
+        const size_t uncompressed = readLittleEndian<boost::uint32_t>(data + 4);
+        if (available - 8 < compressed)
+          throw ObservationIOError("Unexpected end of file.");
+        if (uncompressed != n * layout_.stride)
+          throw ObservationIOError("Unexpected PCD compressed data size.");
+        buffer.resize(uncompressed);
+        if (uncompressed > 0)
+          lzfDecompress(data + 8, compressed, &buffer.front(), uncompressed);
+        data = buffer.empty() ? NULL : &buffer.front();
+        available = buffer.size();
+      }
+      if (available < n * layout_.stride)
+        throw ObservationIOError("Unexpected end of file.");
+#ifdef _OPENMP
+#pragma omp parallel for
 #endif
+      for (int i = 0; i < int(n); ++i)
+      {
+        coord_t slots[L::N_SLOTS];
+        layout_.decode(data, i, n, slots);
+        pack(layout_, slots, &points_[size_t(i) * width]);
+      }
+    }
+    file_.close();
+
+    // Drop points with NaN positions or normals, as PCL does for
+    // non-dense clouds.
+    const unsigned nChecked = layout_.hasNormals() ? 6 : 3;
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      const coord_t* v = &points_[i * width];
+      coord_t sum = 0;
+      for (unsigned d = 0; d < nChecked; ++d) sum += v[d];
+      if ((boost::math::isnan)(sum)) continue;
+      if (kept != i) std::copy(v, v + width, &points_[kept * width]);
+      kept++;
+    }
+    points_.resize(kept * width);
+
+    n_ = kept;
+    index_ = 0;
+    NUKLEI_TRACE_END();
+  }
+
+  void PCDReader::reset()
+  {
+    NUKLEI_TRACE_BEGIN();
+    init();
+    NUKLEI_TRACE_END();
+  }
+
+  std::auto_ptr<kernel::base> PCDReader::nextKernel()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (index_ < 0) NUKLEI_THROW("Reader does not seem inited.");
+
+    if (index_ == n_)
+      return std::auto_ptr<kernel::base>();
+
+    const coord_t* v = &points_[size_t(index_) * packedWidth(layout_)];
+    index_++;
+
+    std::auto_ptr<kernel::base> k;
+    Vector3 loc(v[0], v[1], v[2]);
+    v += 3;
+
+    if (layout_.hasNormals())
+    {
+      // Warning: converts to axial orientation.
+      std::auto_ptr<kernel::r3xs2p> r(new kernel::r3xs2p);
+      r->loc_ = loc;
+      r->dir_ = la::normalized(Vector3(v[0], v[1], v[2]));
+      k = r;
+      v += 3;
+    }
+    else
+    {
+      std::auto_ptr<kernel::r3> r(new kernel::r3);
+      r->loc_ = loc;
+      k = r;
+    }
+
+    if (layout_.hasColors())
+    {
+      ColorDescriptor d;
+      d.setColor(RGBColor(std::min(std::max(v[0], 0.), 1.),
+                          std::min(std::max(v[1], 0.), 1.),
+                          std::min(std::max(v[2], 0.), 1.)));
+      k->setDescriptor(d);
+    }
+
+    return k;
     NUKLEI_TRACE_END();
   }
 
   std::auto_ptr<Observation> PCDReader::readObservation_()
   {
     NUKLEI_TRACE_BEGIN();
-    if (idx_ < 0) NUKLEI_THROW("Reader does not seem inited.");
-    if (idx_ >= int(kc_.size())) return std::auto_ptr<Observation>();
-    else return std::auto_ptr<Observation>(new PCDObservation(kc_.at(idx_++)));
+    std::auto_ptr<kernel::base> k = nextKernel();
+    if (k.get() == NULL) return std::auto_ptr<Observation>();
+    return std::auto_ptr<Observation>(new PCDObservation(*k));
     NUKLEI_TRACE_END();
   }
 
-  PCDWriter::PCDWriter(const std::string &observationFileName) :
-    KernelWriter(observationFileName)
+  size_t PCDReader::readKernels_(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (index_ < 0) NUKLEI_THROW("Reader does not seem inited.");
+    size_t i = 0;
+    for (; i < n && index_ < n_; ++i)
+    {
+      const coord_t* v = &points_[size_t(index_) * packedWidth(layout_)];
+      if (accepts(Vector3(v[0], v[1], v[2]), 1)) keep(nextKernel(), batch);
+      else index_++;
+    }
+    return i;
+    NUKLEI_TRACE_END();
+  }
+
+
+
+  PCDWriter::PCDWriter(const std::string &observationFileName,
+                       const Format format) :
+    KernelWriter(observationFileName), format_(format)
   {
     NUKLEI_TRACE_BEGIN();
     NUKLEI_TRACE_END();
   }
-  
+
   PCDWriter::~PCDWriter()
   {
   }
 
-  
+
   void PCDWriter::writeBuffer()
   {
     NUKLEI_TRACE_BEGIN();
-    
-#ifdef NUKLEI_USE_PCL
-    NUKLEI_ASSERT(kc_.size() > 0);
-    
-    if (kc_.kernelType() == kernel::base::R3)
+    typedef PCDFieldLayout L;
+
+    bool normals = !kc_.empty(), colors = !kc_.empty();
+    for (KernelCollection::const_iterator i = kc_.begin(); i != kc_.end(); ++i)
     {
-      if (kc_.front().hasDescriptor())
+      switch (i->polyType())
       {
-        pcl::PointCloud<pcl::PointXYZRGB> cloud = pclFromNuklei<pcl::PointXYZRGB>(kc_);
-        pcl::io::savePCDFileASCII(observationFileName_, cloud);
+        case kernel::base::R3:
+          normals = false;
+          break;
+        case kernel::base::R3XS2:
+        case kernel::base::R3XS2P:
+          break;
+        default:
+          NUKLEI_THROW("Kernel type unsupported by PCD.");
       }
-      else
+      if (!i->hasDescriptor() ||
+          dynamic_cast<const ColorDescriptor*>(&i->getDescriptor()) == NULL)
+        colors = false;
+    }
+
+    // Fields follow PCL's PointXYZRGBNormal, all of them are 4-byte floats.
+    // The packed color holds the bits of 0x00RRGGBB.
+    std::string names = "x y z";
+    if (colors) names += " rgb";
+    if (normals) names += " normal_x normal_y normal_z curvature";
+    const unsigned nFields = 3 + (colors ? 1 : 0) + (normals ? 4 : 0);
+    const size_t n = kc_.size();
+
+    std::vector<float> values(n * nFields);
+    for (size_t i = 0; i < n; ++i)
+    {
+      const kernel::base& k = kc_.at(i);
+      float* v = &values[i * nFields];
+      for (int d = 0; d < 3; ++d) *v++ = k.getLoc()[d];
+      if (colors)
       {
-        pcl::PointCloud<pcl::PointXYZ> cloud = pclFromNuklei<pcl::PointXYZ>(kc_);
-        pcl::io::savePCDFileASCII(observationFileName_, cloud);
+        const boost::uint32_t rgb = packColor
+          (dynamic_cast<const ColorDescriptor&>(k.getDescriptor()).getColor());
+        std::memcpy(v++, &rgb, sizeof(rgb));
+      }
+      if (normals)
+      {
+        const Vector3 dir = k.polyType() == kernel::base::R3XS2 ?
+          static_cast<const kernel::r3xs2&>(k).dir_ :
+          static_cast<const kernel::r3xs2p&>(k).dir_;
+        for (int d = 0; d < 3; ++d) *v++ = dir[d];
+        *v++ = 0;
       }
     }
-    else if (kc_.kernelType() == kernel::base::R3XS2P)
+
+    std::ofstream ofs(observationFileName_.c_str(),
+                      std::ios::out | std::ios::binary);
+    ofs << "# .PCD v0.7 - Point Cloud Data file format\n" <<
+      "VERSION 0.7\nFIELDS " << names << "\nSIZE";
+    for (unsigned f = 0; f < nFields; ++f) ofs << " 4";
+    ofs << "\nTYPE";
+    for (unsigned f = 0; f < nFields; ++f) ofs << " F";
+    ofs << "\nCOUNT";
+    for (unsigned f = 0; f < nFields; ++f) ofs << " 1";
+    ofs << "\nWIDTH " << n << "\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\n" <<
+      "POINTS " << n << "\nDATA ";
+
+    switch (format_)
     {
-      if (kc_.front().hasDescriptor())
+      case L::ASCII:
       {
-        pcl::PointCloud<pcl::PointXYZRGBNormal> cloud = pclFromNuklei<pcl::PointXYZRGBNormal>(kc_);
-        pcl::io::savePCDFileASCII(observationFileName_, cloud);
+        ofs << "ascii\n";
+        ofs.precision(std::numeric_limits<float>::digits10 + 3);
+        const unsigned rgbField = colors ? 3 : nFields;
+        for (size_t i = 0; i < n; ++i)
+        {
+          const float* v = &values[i * nFields];
+          for (unsigned f = 0; f < nFields; ++f)
+          {
+            if (f > 0) ofs << ' ';
+            if (f == rgbField)
+            {
+              boost::uint32_t rgb;
+              std::memcpy(&rgb, v + f, sizeof(rgb));
+              ofs << rgb;
+            }
+            else ofs << v[f];
+          }
+          ofs << '\n';
+        }
+        break;
       }
-      else
+      case L::BINARY:
+      {
+        ofs << "binary\n";
+        if (!hostIsLittleEndian())
+          for (size_t i = 0; i < values.size(); ++i)
+          {
+            char* p = reinterpret_cast<char*>(&values[i]);
+            std::reverse(p, p + sizeof(float));
+          }
+        if (!values.empty())
+          ofs.write(reinterpret_cast<const char*>(&values.front()),
+                    values.size() * sizeof(float));
+        break;
+      }
+      case L::BINARY_COMPRESSED:
       {
-        pcl::PointCloud<pcl::PointNormal> cloud = pclFromNuklei<pcl::PointNormal>(kc_);
-        pcl::io::savePCDFileASCII(observationFileName_, cloud);
+        ofs << "binary_compressed\n";
+        // Fields are stored one after the other, each for all points.
+        std::vector<char> block(values.size() * sizeof(float));
+        for (size_t i = 0; i < n; ++i)
+          for (unsigned f = 0; f < nFields; ++f)
+          {
+            char* p = &block[(f * n + i) * sizeof(float)];
+            std::memcpy(p, &values[i * nFields + f], sizeof(float));
+            if (!hostIsLittleEndian()) std::reverse(p, p + sizeof(float));
+          }
+        std::vector<char> compressed;
+        if (!block.empty())
+          lzfCompress(&block.front(), block.size(), compressed);
+        writeLittleEndian(ofs, boost::uint32_t(compressed.size()));
+        writeLittleEndian(ofs, boost::uint32_t(block.size()));
+        if (!compressed.empty())
+          ofs.write(&compressed.front(), compressed.size());
+        break;
       }
+      default:
+        NUKLEI_THROW("Unknown PCD format.");
     }
-    else NUKLEI_THROW("Kernel type unsupported by PCD.");
-#else
-    NUKLEI_THROW("This method requires PCL.");
-#endif
+    if (!ofs)
+      throw ObservationIOError("Error writing `" + observationFileName_ + "'.");
 
     NUKLEI_TRACE_END();
   }
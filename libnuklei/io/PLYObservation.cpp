@@ -14,40 +14,42 @@ namespace nuklei {
   PLYObservation::PLYObservation()
   {
     NUKLEI_TRACE_BEGIN();
+    kernel::r3 k;
     ColorDescriptor d;
-    k_.setDescriptor(d);
+    k.setDescriptor(d);
+    k_ = k;
     NUKLEI_TRACE_END();
   }
 
-  PLYObservation::PLYObservation(const kernel::r3& k) : k_(k)
+  PLYObservation::PLYObservation(const kernel::base& k) : k_(k)
   {}
     
   void PLYObservation::setLoc(Vector3 loc)
   {
     NUKLEI_TRACE_BEGIN();
-    k_.loc_ = loc;
+    k_->setLoc(loc);
     NUKLEI_TRACE_END();
   }
-  Vector3 PLYObservation::getLoc() const { return k_.loc_; }
+  Vector3 PLYObservation::getLoc() const { return k_->getLoc(); }
   
   void PLYObservation::setWeight(weight_t weight)
   {
     NUKLEI_TRACE_BEGIN();
-    k_.setWeight(weight);
+    k_->setWeight(weight);
     NUKLEI_TRACE_END();
   }
-  weight_t PLYObservation::getWeight() const { return k_.getWeight(); }
+  weight_t PLYObservation::getWeight() const { return k_->getWeight(); }
     
   const Color& PLYObservation::getColor() const
   {
     NUKLEI_TRACE_BEGIN();
-    return dynamic_cast<const ColorDescriptor&>(k_.getDescriptor()).getColor();
+    return dynamic_cast<const ColorDescriptor&>(k_->getDescriptor()).getColor();
     NUKLEI_TRACE_END();
   }
   void PLYObservation::setColor(const Color& color)
   {
     NUKLEI_TRACE_BEGIN();
-    dynamic_cast<ColorDescriptor&>(k_.getDescriptor()).setColor(color);
+    dynamic_cast<ColorDescriptor&>(k_->getDescriptor()).setColor(color);
     NUKLEI_TRACE_END();
   }
 
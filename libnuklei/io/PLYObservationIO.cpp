@@ -8,17 +8,145 @@
 #include <cassert>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <limits>
+#include <boost/cstdint.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <boost/algorithm/string.hpp>
 
 #include <nuklei/PLYObservationIO.h>
 #include <nuklei/PLYObservation.h>
+#include <nuklei/ByteOrder.h>
 #include <nuklei/Common.h>
 #include <nuklei/Match.h>
 #include <nuklei/Indenter.h>
 
 namespace nuklei {
 
+  namespace {
+
+    unsigned scalarSize(const PLYVertexLayout::ScalarType type)
+    {
+      switch (type)
+      {
+        case PLYVertexLayout::INT8: case PLYVertexLayout::UINT8: return 1;
+        case PLYVertexLayout::INT16: case PLYVertexLayout::UINT16: return 2;
+        case PLYVertexLayout::INT32: case PLYVertexLayout::UINT32:
+        case PLYVertexLayout::FLOAT32: return 4;
+        case PLYVertexLayout::FLOAT64: return 8;
+        default: NUKLEI_THROW("Unknown PLY type.");
+      }
+    }
+
+    // Integer colors are scaled to [0,1].
+    coord_t colorScale(const PLYVertexLayout::ScalarType type)
+    {
+      switch (type)
+      {
+        case PLYVertexLayout::INT8: return 127;
+        case PLYVertexLayout::UINT8: return 255;
+        case PLYVertexLayout::INT16: return 32767;
+        case PLYVertexLayout::UINT16: return 65535;
+        case PLYVertexLayout::INT32: return 2147483647.;
+        case PLYVertexLayout::UINT32: return 4294967295.;
+        default: return 1;
+      }
+    }
+
+    // Number of values per decoded vertex, and position of the normal and
+    // of the color in a decoded vertex.
+    unsigned packedWidth(const PLYVertexLayout &l)
+    {
+      return 3 + (l.hasNormals() ? 3 : 0) + (l.hasColors() ? 3 : 0);
+    }
+
+    void pack(const PLYVertexLayout &l, const coord_t* slots, coord_t* packed)
+    {
+      typedef PLYVertexLayout L;
+      std::copy(slots + L::X, slots + L::Z + 1, packed);
+      packed += 3;
+      if (l.hasNormals())
+      {
+        std::copy(slots + L::NX, slots + L::NZ + 1, packed);
+        packed += 3;
+      }
+      if (l.hasColors())
+        std::copy(slots + L::RED, slots + L::BLUE + 1, packed);
+    }
+
+  }
+
+
+  void PLYVertexLayout::addProperty(const std::string &type,
+                                    const std::string &name)
+  {
+    NUKLEI_TRACE_BEGIN();
+    Property p;
+    if (type == "char" || type == "int8") p.type = INT8;
+    else if (type == "uchar" || type == "uint8") p.type = UINT8;
+    else if (type == "short" || type == "int16") p.type = INT16;
+    else if (type == "ushort" || type == "uint16") p.type = UINT16;
+    else if (type == "int" || type == "int32") p.type = INT32;
+    else if (type == "uint" || type == "uint32") p.type = UINT32;
+    else if (type == "float" || type == "float32") p.type = FLOAT32;
+    else if (type == "double" || type == "float64") p.type = FLOAT64;
+    else throw ObservationIOError("Unknown PLY property type `" + type + "'.");
+    p.offset = stride;
+    p.column = nProperties;
+    stride += scalarSize(p.type);
+    nProperties++;
+
+    if (name == "x") p.slot = X;
+    else if (name == "y") p.slot = Y;
+    else if (name == "z") p.slot = Z;
+    else if (name == "nx") p.slot = NX;
+    else if (name == "ny") p.slot = NY;
+    else if (name == "nz") p.slot = NZ;
+    else if (name == "red" || name == "diffuse_red") p.slot = RED;
+    else if (name == "green" || name == "diffuse_green") p.slot = GREEN;
+    else if (name == "blue" || name == "diffuse_blue") p.slot = BLUE;
+    else return;
+    used.push_back(p);
+    NUKLEI_TRACE_END();
+  }
+
+  bool PLYVertexLayout::has(const Slot first, const Slot last) const
+  {
+    for (int s = first; s <= last; ++s)
+    {
+      bool found = false;
+      for (std::vector<Property>::const_iterator i = used.begin();
+           i != used.end(); ++i)
+        if (i->slot == s) found = true;
+      if (!found) return false;
+    }
+    return true;
+  }
+
+  void PLYVertexLayout::decode(const char* record, coord_t* values) const
+  {
+    const bool swap = (format == BINARY_BIG_ENDIAN) == hostIsLittleEndian();
+    for (std::vector<Property>::const_iterator i = used.begin();
+         i != used.end(); ++i)
+    {
+      const char* p = record + i->offset;
+      coord_t v = 0;
+      switch (i->type)
+      {
+        case INT8: v = *reinterpret_cast<const signed char*>(p); break;
+        case UINT8: v = *reinterpret_cast<const unsigned char*>(p); break;
+        case INT16: v = readScalar<boost::int16_t>(p, swap); break;
+        case UINT16: v = readScalar<boost::uint16_t>(p, swap); break;
+        case INT32: v = readScalar<boost::int32_t>(p, swap); break;
+        case UINT32: v = readScalar<boost::uint32_t>(p, swap); break;
+        case FLOAT32: v = readScalar<float>(p, swap); break;
+        case FLOAT64: v = readScalar<double>(p, swap); break;
+      }
+      if (i->slot >= RED) v /= colorScale(i->type);
+      values[i->slot] = v;
+    }
+  }
+
 
 
   PLYReader::PLYReader(const std::string &observationFileName) :
@@ -35,30 +163,27 @@ namespace nuklei {
   void PLYReader::init_()
   {
     NUKLEI_TRACE_BEGIN();
-    NUKLEI_ASSERT(!in_.is_open());
-    in_.open(observationFileName_.c_str(), std::ios::in);
-    std::string dump;
+    typedef PLYVertexLayout L;
+    file_.open(observationFileName_);
     n_ = -1;
-    if (!in_.is_open())
-      throw ObservationIOError(std::string("Could not open file ") +
-                                   observationFileName_ + " for reading.");
+    index_ = -1;
+    layout_ = L();
+    vertices_.clear();
     try {
       // Note: we only read PLY that *begin* with verticies.
 
-      
       std::string line;
-      if (!std::getline(in_, line) || cleanLine(line) != "ply")
+      if (!file_.getLine(line) || line != "ply")
         throw ObservationIOError("Non-PLY format (PLY must start with a line `ply'.");
       
-      bool format = false, px = false, py = false, pz = false, header = false;
-      while (std::getline(in_, line))
+      bool format = false, header = false, inVertex = false, element = false;
+      while (file_.getLine(line))
       {
-        cleanLine(line);
         std::vector<std::string> tokens;
-        boost::split(tokens, line, boost::is_any_of(" "), boost::token_compress_on);
+        boost::split(tokens, line, boost::is_any_of(" \t"), boost::token_compress_on);
         if (tokens.front() == "")
           tokens.erase(tokens.begin());
-        if (tokens.back() == "")
+        if (!tokens.empty() && tokens.back() == "")
           tokens.pop_back();
         
         if (tokens.size() == 1 && tokens.front() == "end_header")
@@ -69,32 +194,95 @@ namespace nuklei {
         
         if (tokens.size() == 0) continue;
         
-        if (tokens.front() == "comment") continue;
-        else if (line == "format ascii 1.0") format = true;
-        else if (tokens.front() == "element" && tokens.size() >= 3 &&
-            tokens.at(1) == "vertex")
+        if (tokens.front() == "comment" || tokens.front() == "obj_info")
+          continue;
+        else if (tokens.front() == "format" && tokens.size() >= 2)
+        {
+          if (tokens.at(1) == "ascii") layout_.format = L::ASCII;
+          else if (tokens.at(1) == "binary_little_endian")
+            layout_.format = L::BINARY_LITTLE_ENDIAN;
+          else if (tokens.at(1) == "binary_big_endian")
+            layout_.format = L::BINARY_BIG_ENDIAN;
+          else
+            throw ObservationIOError("Unknown PLY format `" + tokens.at(1) + "'.");
+          format = true;
+        }
+        else if (tokens.front() == "element" && tokens.size() >= 3)
+        {
+          inVertex = !element && tokens.at(1) == "vertex";
+          if (!element && !inVertex)
+            throw ObservationIOError("Unsupported PLY file (vertices must come first).");
+          if (inVertex) n_ = numify<int>(tokens.at(2));
+          element = true;
+        }
+        else if (tokens.front() == "property" && inVertex)
         {
-          n_ = numify<int>(tokens.at(2));
+          if (tokens.size() >= 2 && tokens.at(1) == "list")
+            throw ObservationIOError("Unsupported PLY file (list property in vertices).");
+          if (tokens.size() >= 3)
+            layout_.addProperty(tokens.at(1), tokens.at(2));
         }
-        else if (tokens.front() == "property" && tokens.size() >= 3 &&
-            tokens.at(2) == "x")
-          px = true;
-        else if (tokens.front() == "property" && tokens.size() >= 3 &&
-            tokens.at(2) == "y")
-          py = true;
-        else if (tokens.front() == "property" && tokens.size() >= 3 &&
-            tokens.at(2) == "z")
-          pz = true;
       }
       if ( n_ < 0 || !header )
         throw ObservationIOError("Non-PLY format.");
       
-      if (!format || !px || !py || !pz)
+      if (!format)
         NUKLEI_WARN("Unsupported PLY header. PLY parsing may not work as expected.");
+
+      if (!layout_.has(L::X, L::Z))
+        throw ObservationIOError("PLY vertices have no position.");
       
+    } catch (ObservationIOError &e) {
+      throw;
     } catch (Error &e) {
       throw ObservationIOError("Non-PLY format.");
     }
+
+    const unsigned width = packedWidth(layout_);
+    vertices_.resize(size_t(n_) * width);
+
+    // We don't check that we reached the EOF because
+    // there may be more data following (e.g. triangles).
+    if (layout_.format == L::ASCII)
+    {
+      if (layout_.nProperties > std::numeric_limits<unsigned char>::max())
+        throw ObservationIOError("Too many PLY vertex properties.");
+      const char* verticesEnd = skipAsciiLines(file_.cursor(), file_.end(), n_);
+      AsciiTable table;
+      table.parse(file_.cursor(), verticesEnd,
+                  layout_.nProperties, layout_.nProperties, true);
+      if (table.rows() != size_t(n_))
+        throw ObservationIOError("Unexpected end of file.");
+      const coord_t* values = table.values();
+      for (int i = 0; i < n_; ++i)
+      {
+        coord_t slots[L::N_SLOTS];
+        const coord_t* row = values + size_t(i) * layout_.nProperties;
+        for (std::vector<L::Property>::const_iterator p = layout_.used.begin();
+             p != layout_.used.end(); ++p)
+        {
+          slots[p->slot] = row[p->column];
+          if (p->slot >= L::RED) slots[p->slot] /= colorScale(p->type);
+        }
+        pack(layout_, slots, &vertices_[size_t(i) * width]);
+      }
+    }
+    else
+    {
+      const char* data = file_.cursor();
+      if (size_t(file_.end() - data) < size_t(n_) * layout_.stride)
+        throw ObservationIOError("Unexpected end of file.");
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+      for (int i = 0; i < n_; ++i)
+      {
+        coord_t slots[L::N_SLOTS];
+        layout_.decode(data + size_t(i) * layout_.stride, slots);
+        pack(layout_, slots, &vertices_[size_t(i) * width]);
+      }
+    }
+    file_.close();
     index_ = 0;
     NUKLEI_TRACE_END();
   }
@@ -108,42 +296,82 @@ namespace nuklei {
   }
 
 
-  std::auto_ptr<Observation> PLYReader::readObservation_()
+  std::auto_ptr<kernel::base> PLYReader::nextKernel()
   {
-    if (!in_.is_open()) NUKLEI_THROW("Reader does not seem inited.");
+    NUKLEI_TRACE_BEGIN();
+    if (index_ < 0) NUKLEI_THROW("Reader does not seem inited.");
 
     if (index_ == n_)
-    {
-      // We don't check that we reached the EOF because
-      // there may be more data following (e.g. triangles).
-      return std::auto_ptr<Observation>();
-    }
+      return std::auto_ptr<kernel::base>();
+
+    const coord_t* v = &vertices_[size_t(index_) * packedWidth(layout_)];
     index_++;
     
-    std::string line;
-    
-    NUKLEI_ASSERT(std::getline(in_, line));
-    cleanLine(line);
+    std::auto_ptr<kernel::base> k;
+    Vector3 loc(v[0], v[1], v[2]);
+    v += 3;
 
-    std::istringstream iss(line);
-    
-    std::auto_ptr<PLYObservation> observation(new PLYObservation);
-    
-    Vector3 loc;
-    NUKLEI_ASSERT(iss >> loc[0] >> loc[1] >> loc[2]);
-    observation->setLoc(loc);
-    
-    RGBColor c(.5,.5,.5);
-    observation->setColor(c);
+    if (layout_.hasNormals())
+    {
+      std::auto_ptr<kernel::r3xs2p> r(new kernel::r3xs2p);
+      r->loc_ = loc;
+      r->dir_ = la::normalized(Vector3(v[0], v[1], v[2]));
+      k = r;
+      v += 3;
+    }
+    else
+    {
+      std::auto_ptr<kernel::r3> r(new kernel::r3);
+      r->loc_ = loc;
+      k = r;
+    }
+
+    ColorDescriptor d;
+    if (layout_.hasColors())
+      d.setColor(RGBColor(std::min(std::max(v[0], 0.), 1.),
+                          std::min(std::max(v[1], 0.), 1.),
+                          std::min(std::max(v[2], 0.), 1.)));
+    else
+      d.setColor(RGBColor(.5,.5,.5));
+    k->setDescriptor(d);
     
-    return std::auto_ptr<Observation>(observation);
+    return k;
+    NUKLEI_TRACE_END();
+  }
+
+
+  std::auto_ptr<Observation> PLYReader::readObservation_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    std::auto_ptr<kernel::base> k = nextKernel();
+    if (k.get() == NULL) return std::auto_ptr<Observation>();
+    return std::auto_ptr<Observation>(new PLYObservation(*k));
+    NUKLEI_TRACE_END();
+  }
+
+
+  size_t PLYReader::readKernels_(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (index_ < 0) NUKLEI_THROW("Reader does not seem inited.");
+    size_t i = 0;
+    for (; i < n && index_ < n_; ++i)
+    {
+      const coord_t* v = &vertices_[size_t(index_) * packedWidth(layout_)];
+      if (accepts(Vector3(v[0], v[1], v[2]), 1)) keep(nextKernel(), batch);
+      else index_++;
+    }
+    return i;
+    NUKLEI_TRACE_END();
   }
 
   
   
   
-  PLYWriter::PLYWriter(const std::string &observationFileName) :
-  observationFileName_(observationFileName)
+  PLYWriter::PLYWriter(const std::string &observationFileName,
+                       const Format format) :
+  observationFileName_(observationFileName), format_(format),
+  hasNormals_(true), hasColors_(true)
   {
     NUKLEI_TRACE_BEGIN();
     NUKLEI_TRACE_END();
@@ -158,6 +386,10 @@ namespace nuklei {
     NUKLEI_TRACE_BEGIN();
     try {
       points_.clear();
+      normals_.clear();
+      colors_.clear();
+      hasNormals_ = true;
+      hasColors_ = true;
     } catch (std::exception& e) {
       throw ObservationIOError(e.what());
     }
@@ -175,13 +407,69 @@ namespace nuklei {
   void PLYWriter::writeBuffer()
   {
     NUKLEI_TRACE_BEGIN();
-    
-    std::ofstream ofs(observationFileName_.c_str());
-    ofs << "ply\nformat ascii 1.0\nelement vertex " << points_.size() <<
-      "\nproperty float x\nproperty float y\nproperty float z\nend_header\n";
-    for (std::vector<Vector3>::const_iterator i = points_.begin();
-         i != points_.end(); ++i)
-      ofs << stringify(*i, PRECISION) << std::endl;
+    typedef PLYVertexLayout L;
+
+    const bool normals = hasNormals_ && !points_.empty();
+    const bool colors = hasColors_ && !points_.empty();
+    const bool binary = format_ != L::ASCII;
+
+    std::ofstream ofs(observationFileName_.c_str(),
+                      std::ios::out | std::ios::binary);
+    ofs << "ply\nformat ";
+    switch (format_)
+    {
+      case L::ASCII: ofs << "ascii"; break;
+      case L::BINARY_LITTLE_ENDIAN: ofs << "binary_little_endian"; break;
+      case L::BINARY_BIG_ENDIAN: ofs << "binary_big_endian"; break;
+      default: NUKLEI_THROW("Unknown PLY format.");
+    }
+    // Binary positions are written as doubles, to preserve precision.
+    const char* locType = binary ? "double" : "float";
+    ofs << " 1.0\nelement vertex " << points_.size() << "\n" <<
+      "property " << locType << " x\nproperty " << locType << " y\n" <<
+      "property " << locType << " z\n";
+    if (normals)
+      ofs << "property float nx\nproperty float ny\nproperty float nz\n";
+    if (colors)
+      ofs << "property uchar red\nproperty uchar green\nproperty uchar blue\n";
+    ofs << "end_header\n";
+
+    if (binary)
+    {
+      const bool swap = (format_ == L::BINARY_BIG_ENDIAN) == hostIsLittleEndian();
+      std::vector<char> buffer;
+      buffer.reserve(points_.size() *
+                     (3*sizeof(double) + (normals ? 3*sizeof(float) : 0) +
+                      (colors ? 3 : 0)));
+      for (std::size_t i = 0; i < points_.size(); ++i)
+      {
+        for (int d = 0; d < 3; ++d)
+          appendScalar<double>(buffer, points_[i][d], swap);
+        if (normals)
+          for (int d = 0; d < 3; ++d)
+            appendScalar<float>(buffer, normals_[i][d], swap);
+        if (colors)
+          for (int d = 0; d < 3; ++d)
+            buffer.push_back(char(unsigned(colors_[i][d]*255 + .5)));
+      }
+      if (!buffer.empty())
+        ofs.write(&buffer.front(), buffer.size());
+    }
+    else
+    {
+      for (std::size_t i = 0; i < points_.size(); ++i)
+      {
+        ofs << stringify(points_[i], PRECISION);
+        if (normals)
+          ofs << " " << stringify(normals_[i], PRECISION);
+        if (colors)
+          for (int d = 0; d < 3; ++d)
+            ofs << " " << unsigned(colors_[i][d]*255 + .5);
+        ofs << "\n";
+      }
+    }
+    if (!ofs)
+      throw ObservationIOError("Error writing `" + observationFileName_ + "'.");
     
     NUKLEI_TRACE_END();
   }
@@ -194,6 +482,32 @@ namespace nuklei {
     
     points_.push_back(k->getLoc());
 
+    if (hasNormals_)
+    {
+      if (k->polyType() == kernel::base::R3XS2)
+        normals_.push_back(static_cast<const kernel::r3xs2&>(*k).dir_);
+      else if (k->polyType() == kernel::base::R3XS2P)
+        normals_.push_back(static_cast<const kernel::r3xs2p&>(*k).dir_);
+      else
+      {
+        hasNormals_ = false;
+        std::vector<Vector3>().swap(normals_);
+      }
+    }
+
+    if (hasColors_)
+    {
+      const ColorDescriptor* d = k->hasDescriptor() ?
+        dynamic_cast<const ColorDescriptor*>(&k->getDescriptor()) : NULL;
+      if (d != NULL)
+        colors_.push_back(RGBColor(d->getColor()).getRGB());
+      else
+      {
+        hasColors_ = false;
+        std::vector<Vector3>().swap(colors_);
+      }
+    }
+
     NUKLEI_TRACE_END();
   }
   
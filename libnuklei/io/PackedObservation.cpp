@@ -0,0 +1,21 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <nuklei/PackedObservation.h>
+
+
+namespace nuklei {
+  
+  PackedObservation::PackedObservation()
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_TRACE_END();
+  }
+
+  PackedObservation::PackedObservation(const kernel::base& k) : k_(k)
+  {}
+
+}
@@ -0,0 +1,546 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+
+#include <nuklei/PackedObservationIO.h>
+#include <nuklei/PackedObservation.h>
+
+namespace nuklei {
+
+  namespace {
+
+    typedef BinaryFileHeader F;
+    typedef PackedFileHeader H;
+
+    // Number of kernels per block.
+    const boost::uint32_t BLOCK_SIZE = 65536;
+
+    // Resolution of the octahedral and smallest-three encodings.
+    const coord_t U16_MAX = 65535;
+
+    const coord_t SQRT1_2 = 0.70710678118654752440;
+
+    void putUInt(std::vector<char> &out, boost::uint64_t v, const unsigned bytes)
+    {
+      for (unsigned b = 0; b < bytes; ++b, v >>= 8)
+        out.push_back(char(v & 0xff));
+    }
+
+    void putDouble(std::vector<char> &out, const double d)
+    {
+      boost::uint64_t v;
+      std::memcpy(&v, &d, sizeof(v));
+      putUInt(out, v, 8);
+    }
+
+    void putVarint(std::vector<char> &out, boost::uint64_t v)
+    {
+      while (v >= 0x80)
+      {
+        out.push_back(char((v & 0x7f) | 0x80));
+        v >>= 7;
+      }
+      out.push_back(char(v));
+    }
+
+    // Bounds-checked decoding of the numbers written by the functions above.
+    class ByteReader
+    {
+    public:
+      ByteReader(const char* begin, const char* end) :
+        p_(reinterpret_cast<const unsigned char*>(begin)),
+        end_(reinterpret_cast<const unsigned char*>(end)) {}
+
+      boost::uint64_t getUInt(const unsigned bytes)
+      {
+        if (size_t(end_ - p_) < bytes) corrupt();
+        boost::uint64_t v = 0;
+        for (unsigned b = 0; b < bytes; ++b)
+          v |= boost::uint64_t(*p_++) << (8*b);
+        return v;
+      }
+
+      double getDouble()
+      {
+        boost::uint64_t v = getUInt(8);
+        double d;
+        std::memcpy(&d, &v, sizeof(d));
+        return d;
+      }
+
+      boost::uint64_t getVarint()
+      {
+        boost::uint64_t v = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+          if (p_ == end_) corrupt();
+          const unsigned char c = *p_++;
+          v |= boost::uint64_t(c & 0x7f) << shift;
+          if (!(c & 0x80)) return v;
+        }
+        corrupt();
+        return 0;
+      }
+
+      bool atEnd() const { return p_ == end_; }
+
+    private:
+      static void corrupt()
+      {
+        throw ObservationIOError("Corrupted Nuklei packed file.");
+      }
+
+      const unsigned char* p_;
+      const unsigned char* end_;
+    };
+
+    inline boost::uint64_t zigzag(const boost::int64_t v)
+    {
+      return (boost::uint64_t(v) << 1) ^ boost::uint64_t(v >> 63);
+    }
+
+    inline boost::int64_t unzigzag(const boost::uint64_t v)
+    {
+      return boost::int64_t(v >> 1) ^ -boost::int64_t(v & 1);
+    }
+
+    inline unsigned quantizeUnit(const coord_t v)
+    {
+      return unsigned(std::floor((std::max(coord_t(-1), std::min(coord_t(1), v))
+                                  * .5 + .5) * U16_MAX + .5));
+    }
+
+    inline coord_t dequantizeUnit(const unsigned u)
+    {
+      return u / U16_MAX * 2 - 1;
+    }
+
+    inline coord_t signNotZero(const coord_t v)
+    {
+      return v < 0 ? -1 : 1;
+    }
+
+    // Octahedral encoding: the direction is projected on the octahedron
+    // |x|+|y|+|z| = 1, whose lower half is folded onto the upper half.
+    void putDirection(std::vector<char> &out, const coord_t* d)
+    {
+      coord_t l1 = std::fabs(d[0]) + std::fabs(d[1]) + std::fabs(d[2]);
+      coord_t x = 0, y = 0;
+      if (l1 > 0)
+      {
+        x = d[0] / l1;
+        y = d[1] / l1;
+        if (d[2] < 0)
+        {
+          coord_t fx = (1 - std::fabs(y)) * signNotZero(x);
+          coord_t fy = (1 - std::fabs(x)) * signNotZero(y);
+          x = fx;
+          y = fy;
+        }
+      }
+      putUInt(out, quantizeUnit(x), 2);
+      putUInt(out, quantizeUnit(y), 2);
+    }
+
+    void getDirection(ByteReader &in, coord_t* d)
+    {
+      coord_t x = dequantizeUnit(unsigned(in.getUInt(2)));
+      coord_t y = dequantizeUnit(unsigned(in.getUInt(2)));
+      coord_t z = 1 - std::fabs(x) - std::fabs(y);
+      if (z < 0)
+      {
+        coord_t fx = (1 - std::fabs(y)) * signNotZero(x);
+        coord_t fy = (1 - std::fabs(x)) * signNotZero(y);
+        x = fx;
+        y = fy;
+      }
+      coord_t n = std::sqrt(x*x + y*y + z*z);
+      d[0] = x / n;
+      d[1] = y / n;
+      d[2] = z / n;
+    }
+
+    // Smallest-three encoding: the largest component is dropped, and
+    // recovered from the unit norm. q and -q are the same rotation, which
+    // makes the dropped component positive.
+    void putQuaternion(std::vector<char> &out, const coord_t* q)
+    {
+      unsigned largest = 0;
+      for (unsigned c = 1; c < 4; ++c)
+        if (std::fabs(q[c]) > std::fabs(q[largest])) largest = c;
+      coord_t sign = q[largest] < 0 ? -1 : 1;
+      putUInt(out, largest, 1);
+      for (unsigned c = 0; c < 4; ++c)
+        if (c != largest)
+          putUInt(out, quantizeUnit(sign * q[c] / SQRT1_2), 2);
+    }
+
+    void getQuaternion(ByteReader &in, coord_t* q)
+    {
+      unsigned largest = unsigned(in.getUInt(1));
+      if (largest > 3) throw ObservationIOError("Corrupted Nuklei packed file.");
+      coord_t sum = 0;
+      for (unsigned c = 0; c < 4; ++c)
+        if (c != largest)
+        {
+          q[c] = dequantizeUnit(unsigned(in.getUInt(2))) * SQRT1_2;
+          sum += q[c]*q[c];
+        }
+      q[largest] = std::sqrt(std::max(coord_t(0), 1 - sum));
+      coord_t n = std::sqrt(sum + q[largest]*q[largest]);
+      for (unsigned c = 0; c < 4; ++c)
+        q[c] /= n;
+    }
+
+    void putRuns(std::vector<char> &out, const coord_t* v, const size_t n)
+    {
+      std::vector< std::pair<boost::uint64_t, coord_t> > runs;
+      for (size_t i = 0; i < n; ++i)
+      {
+        if (runs.empty() || !(v[i] == runs.back().second))
+          runs.push_back(std::make_pair(boost::uint64_t(0), v[i]));
+        runs.back().first++;
+      }
+      putVarint(out, runs.size());
+      for (size_t r = 0; r < runs.size(); ++r)
+      {
+        putVarint(out, runs[r].first);
+        putDouble(out, runs[r].second);
+      }
+    }
+
+    void getRuns(ByteReader &in, coord_t* v, const size_t n)
+    {
+      boost::uint64_t nRuns = in.getVarint();
+      size_t i = 0;
+      for (boost::uint64_t r = 0; r < nRuns; ++r)
+      {
+        boost::uint64_t length = in.getVarint();
+        coord_t value = in.getDouble();
+        if (length > n - i) throw ObservationIOError("Corrupted Nuklei packed file.");
+        std::fill(v + i, v + i + length, value);
+        i += length;
+      }
+      if (i != n) throw ObservationIOError("Corrupted Nuklei packed file.");
+    }
+
+    std::vector<char> compress(const std::vector<char> &raw)
+    {
+      namespace io = boost::iostreams;
+      std::vector<char> out;
+      io::filtering_ostream os;
+      os.push(io::zlib_compressor(io::zlib_params(io::zlib::best_compression)));
+      os.push(io::back_inserter(out));
+      if (!raw.empty()) os.write(&raw.front(), raw.size());
+      os.reset();
+      return out;
+    }
+
+    void decompress(const char* data, const size_t size,
+                    std::vector<char> &raw)
+    {
+      namespace io = boost::iostreams;
+      try {
+        io::filtering_istream is;
+        is.push(io::zlib_decompressor());
+        is.push(io::array_source(data, size));
+        if (!raw.empty()) is.read(&raw.front(), raw.size());
+        if (size_t(is.gcount()) != raw.size() || is.get() != EOF)
+          throw ObservationIOError("Corrupted Nuklei packed file.");
+      } catch (io::zlib_error &e) {
+        throw ObservationIOError("Corrupted Nuklei packed file.");
+      }
+    }
+
+  }
+
+
+  PackedReader::PackedReader(const std::string &observationFileName) :
+    BinaryReader(observationFileName)
+  {
+  }
+
+  PackedReader::~PackedReader()
+  {
+  }
+
+  void PackedReader::init_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    inited_ = false;
+    if (file_.is_open()) file_.close();
+    try {
+      file_.open(observationFileName_);
+    } catch (std::exception &e) {
+      throw ObservationIOError(std::string("Could not open file ") +
+                               observationFileName_ + " for reading.");
+    }
+
+    if (file_.size() < H::SIZE)
+      throw ObservationIOError("Input does not look like Nuklei packed (too short).");
+    if (!std::equal(file_.data(), file_.data() + H::MAGIC_SIZE, H::magic()))
+      throw ObservationIOError("Input does not look like Nuklei packed (no magic).");
+
+    ByteReader in(file_.data() + H::MAGIC_SIZE, file_.data() + file_.size());
+    PackedFileHeader h;
+    h.version = boost::uint32_t(in.getUInt(4));
+    h.kernelType = boost::uint32_t(in.getUInt(4));
+    h.count = in.getUInt(8);
+    h.blockSize = boost::uint32_t(in.getUInt(4));
+    h.flags = boost::uint32_t(in.getUInt(4));
+    h.step = in.getDouble();
+    for (int d = 0; d < 3; ++d) h.bboxMin[d] = in.getDouble();
+    for (int d = 0; d < 3; ++d) h.bboxMax[d] = in.getDouble();
+    h.nBlocks = in.getUInt(8);
+
+    if (h.version != H::VERSION)
+      throw ObservationIOError("Unsupported Nuklei packed version " +
+                               stringify(h.version) + ".");
+    if (h.kernelType > kernel::base::SE3)
+      throw ObservationIOError("Unknown kernel type in Nuklei packed file.");
+    if (h.count > std::numeric_limits<unsigned>::max())
+      throw ObservationIOError("Too many points in Nuklei packed file.");
+    if (h.blockSize == 0 ||
+        h.nBlocks != (h.count + h.blockSize - 1) / h.blockSize ||
+        h.nBlocks > (file_.size() - H::SIZE) / H::BLOCK_ENTRY_SIZE)
+      throw ObservationIOError("Corrupted Nuklei packed file.");
+
+    std::vector<boost::uint64_t> table(3*h.nBlocks);
+    for (size_t i = 0; i < table.size(); ++i)
+      table[i] = in.getUInt(8);
+    for (boost::uint64_t b = 0; b < h.nBlocks; ++b)
+    {
+      if (table[3*b] > file_.size() || table[3*b+1] > file_.size() - table[3*b])
+        throw ObservationIOError("Corrupted Nuklei packed file.");
+      // Bound the point count by the size of the file before allocating
+      // the fields: a kernel takes at least 3 bytes (its position) and less
+      // than 128 bytes in a decompressed block, and zlib does not compress
+      // by more than 1032:1.
+      const boost::uint64_t n =
+        std::min(boost::uint64_t(h.blockSize), h.count - b*h.blockSize);
+      if (table[3*b+2] < 3 * n || table[3*b+2] > 128 * (n + 1) ||
+          table[3*b+2] > 1032 * (table[3*b+1] + 1))
+        throw ObservationIOError("Corrupted Nuklei packed file.");
+    }
+
+    kernel::base::Type type = kernel::base::Type(h.kernelType);
+    const bool hasColor = h.flags & H::HAS_COLOR;
+    for (int f = 0; f < F::N_FIELDS; ++f)
+    {
+      unsigned width = F::width(F::Field(f), type);
+      if (f == F::COLOR && !hasColor) width = 0;
+      data_[f].assign(h.count * width, 0);
+    }
+
+    std::string error;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int b = 0; b < int(h.nBlocks); ++b)
+    {
+      try {
+        const size_t first = size_t(b) * h.blockSize;
+        const size_t n = std::min(size_t(h.blockSize), size_t(h.count - first));
+        std::vector<char> raw(table[3*b+2]);
+        decompress(file_.data() + table[3*b], table[3*b+1], raw);
+        const char* rawBegin = raw.empty() ? NULL : &raw.front();
+        ByteReader block(rawBegin, rawBegin + raw.size());
+
+        boost::uint64_t q[3] = { 0, 0, 0 };
+        coord_t* loc = &data_[F::LOC][3*first];
+        for (size_t i = 0; i < n; ++i)
+          for (int d = 0; d < 3; ++d)
+          {
+            q[d] += boost::uint64_t(unzigzag(block.getVarint()));
+            loc[3*i+d] = h.bboxMin[d] + coord_t(q[d]) * h.step;
+          }
+
+        if (type == kernel::base::SE3)
+          for (size_t i = 0; i < n; ++i)
+            getQuaternion(block, &data_[F::ORI][4*(first+i)]);
+        else if (type != kernel::base::R3)
+          for (size_t i = 0; i < n; ++i)
+            getDirection(block, &data_[F::ORI][3*(first+i)]);
+
+        getRuns(block, &data_[F::LOC_H][first], n);
+        if (type != kernel::base::R3)
+          getRuns(block, &data_[F::ORI_H][first], n);
+        getRuns(block, &data_[F::WEIGHT][first], n);
+
+        if (hasColor)
+          for (size_t i = 0; i < 3*n; ++i)
+            data_[F::COLOR][3*first+i] = coord_t(block.getUInt(1)) / 255;
+
+        if (!block.atEnd())
+          throw ObservationIOError("Corrupted Nuklei packed file.");
+      } catch (std::exception &e) {
+#ifdef _OPENMP
+#pragma omp critical(nuklei_packedReader_error)
+#endif
+        error = e.what();
+      }
+    }
+    if (!error.empty()) throw ObservationIOError(error);
+
+    std::memset(&header_, 0, sizeof(header_));
+    header_.kernelType = h.kernelType;
+    header_.count = h.count;
+    for (int d = 0; d < 3; ++d)
+    {
+      header_.bboxMin[d] = h.bboxMin[d];
+      header_.bboxMax[d] = h.bboxMax[d];
+    }
+    for (int f = 0; f < F::N_FIELDS; ++f)
+      fields_[f] = data_[f].empty() ? NULL : &data_[f].front();
+    file_.close();
+
+    idx_ = 0;
+    inited_ = true;
+    NUKLEI_TRACE_END();
+  }
+
+  std::auto_ptr<Observation> PackedReader::readObservation_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!inited_) NUKLEI_THROW("Reader does not seem inited.");
+    if (idx_ >= header_.count)
+      return std::auto_ptr<Observation>();
+    std::auto_ptr<kernel::base> k = kernelAt(idx_++);
+    return std::auto_ptr<Observation>(new PackedObservation(*k));
+    NUKLEI_TRACE_END();
+  }
+
+
+  PackedWriter::PackedWriter(const std::string &observationFileName,
+                             const coord_t tolerance) :
+    BinaryWriter(observationFileName), tolerance_(tolerance)
+  {
+    NUKLEI_ASSERT(tolerance > 0);
+  }
+
+  PackedWriter::~PackedWriter()
+  {
+  }
+
+  void PackedWriter::writeBuffer()
+  {
+    NUKLEI_TRACE_BEGIN();
+    PackedFileHeader h;
+    h.version = H::VERSION;
+    h.kernelType = kernelType_ < 0 ? kernel::base::R3 : kernelType_;
+    h.count = count_;
+    h.blockSize = BLOCK_SIZE;
+    h.flags = hasColor_ && count_ > 0 ? H::HAS_COLOR : 0;
+    h.nBlocks = (count_ + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    std::vector<coord_t> fields[F::N_FIELDS];
+    for (int f = 0; f < F::N_FIELDS; ++f)
+      if (f != F::COLOR || (h.flags & H::HAS_COLOR))
+        readField(F::Field(f), fields[f]);
+
+    const std::vector<coord_t>& loc = fields[F::LOC];
+    for (boost::uint64_t i = 0; i < 3*count_; ++i)
+      if (!(std::fabs(loc[i]) <= std::numeric_limits<coord_t>::max()))
+        throw ObservationIOError("Nuklei packed files cannot hold "
+                                 "non-finite positions.");
+    std::copy(bboxMin_, bboxMin_ + 3, h.bboxMin);
+    std::copy(bboxMax_, bboxMax_ + 3, h.bboxMax);
+    coord_t extent = 0;
+    for (int d = 0; d < 3; ++d)
+      extent = std::max(extent, h.bboxMax[d] - h.bboxMin[d]);
+    // Rounding to the nearest step keeps the error below half a step.
+    h.step = extent > 0 ? 2 * tolerance_ * extent : 1;
+
+    const kernel::base::Type type = kernel::base::Type(h.kernelType);
+    std::vector< std::vector<char> > blocks(h.nBlocks);
+    std::vector<boost::uint64_t> rawSizes(h.nBlocks);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int b = 0; b < int(h.nBlocks); ++b)
+    {
+      const size_t first = size_t(b) * BLOCK_SIZE;
+      const size_t n = std::min(size_t(BLOCK_SIZE), size_t(count_ - first));
+      std::vector<char> raw;
+
+      boost::uint64_t previous[3] = { 0, 0, 0 };
+      for (size_t i = first; i < first + n; ++i)
+        for (int d = 0; d < 3; ++d)
+        {
+          boost::uint64_t q = boost::uint64_t
+            (std::floor((loc[3*i+d] - h.bboxMin[d]) / h.step + .5));
+          putVarint(raw, zigzag(boost::int64_t(q - previous[d])));
+          previous[d] = q;
+        }
+
+      if (type == kernel::base::SE3)
+        for (size_t i = first; i < first + n; ++i)
+          putQuaternion(raw, &fields[F::ORI][4*i]);
+      else if (type != kernel::base::R3)
+        for (size_t i = first; i < first + n; ++i)
+          putDirection(raw, &fields[F::ORI][3*i]);
+
+      putRuns(raw, &fields[F::LOC_H][first], n);
+      if (type != kernel::base::R3)
+        putRuns(raw, &fields[F::ORI_H][first], n);
+      putRuns(raw, &fields[F::WEIGHT][first], n);
+
+      if (h.flags & H::HAS_COLOR)
+        for (size_t i = 3*first; i < 3*(first + n); ++i)
+        {
+          coord_t c = std::max(coord_t(0), std::min(coord_t(1), fields[F::COLOR][i]));
+          putUInt(raw, unsigned(std::floor(c * 255 + .5)), 1);
+        }
+
+      rawSizes[b] = raw.size();
+      blocks[b] = compress(raw);
+    }
+
+    std::vector<char> head;
+    head.insert(head.end(), H::magic(), H::magic() + H::MAGIC_SIZE);
+    putUInt(head, h.version, 4);
+    putUInt(head, h.kernelType, 4);
+    putUInt(head, h.count, 8);
+    putUInt(head, h.blockSize, 4);
+    putUInt(head, h.flags, 4);
+    putDouble(head, h.step);
+    for (int d = 0; d < 3; ++d) putDouble(head, h.bboxMin[d]);
+    for (int d = 0; d < 3; ++d) putDouble(head, h.bboxMax[d]);
+    putUInt(head, h.nBlocks, 8);
+    NUKLEI_ASSERT(head.size() == H::SIZE);
+
+    boost::uint64_t offset = H::SIZE + H::BLOCK_ENTRY_SIZE * h.nBlocks;
+    for (boost::uint64_t b = 0; b < h.nBlocks; ++b)
+    {
+      putUInt(head, offset, 8);
+      putUInt(head, blocks[b].size(), 8);
+      putUInt(head, rawSizes[b], 8);
+      offset += blocks[b].size();
+    }
+
+    std::ofstream ofs(observationFileName_.c_str(), std::ios::binary);
+    if (!ofs.is_open())
+      throw ObservationIOError(std::string("Could not open file ") +
+                               observationFileName_ + " for writing.");
+    ofs.write(&head.front(), head.size());
+    for (boost::uint64_t b = 0; b < h.nBlocks; ++b)
+      if (!blocks[b].empty())
+        ofs.write(&blocks[b].front(), blocks[b].size());
+    if (!ofs)
+      throw ObservationIOError("Error writing `" + observationFileName_ + "'.");
+    NUKLEI_TRACE_END();
+  }
+
+}
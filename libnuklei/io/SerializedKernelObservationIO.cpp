@@ -33,12 +33,16 @@ namespace nuklei {
   void KernelReader::init_()
   {
     NUKLEI_TRACE_BEGIN();
-    kc_.clear();
+    kernels_.clear();
+    KernelCollection kc;
     try {
-      Serial::readObject(kc_, observationFileName_);
+      Serial::readObject(kc, observationFileName_);
     } catch (SerialError& e) {
       throw ObservationIOError(e.what());
     }
+    kc.release(kernels_);
+    // Reverses the pointers, not the kernels.
+    std::reverse(kernels_.begin().base(), kernels_.end().base());
     idx_ = 0;
     NUKLEI_TRACE_END();
   }
@@ -54,8 +58,24 @@ namespace nuklei {
   {
     NUKLEI_TRACE_BEGIN();
     if (idx_ < 0) NUKLEI_THROW("Reader does not seem inited.");
-    if (idx_ >= int(kc_.size())) return std::auto_ptr<Observation>();
-    else return std::auto_ptr<Observation>(new SerializedKernelObservation(kc_.at(idx_++)));
+    if (kernels_.empty()) return std::auto_ptr<Observation>();
+    idx_++;
+    return std::auto_ptr<Observation>
+      (new SerializedKernelObservation(*kernels_.pop_back()));
+    NUKLEI_TRACE_END();
+  }
+
+  size_t KernelReader::readKernels_(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (idx_ < 0) NUKLEI_THROW("Reader does not seem inited.");
+    size_t i = 0;
+    for (; i < n && !kernels_.empty(); ++i, ++idx_)
+    {
+      std::auto_ptr<kernel::base> k(kernels_.pop_back().release());
+      if (accepts(k->getLoc(), k->getWeight())) keep(k, batch);
+    }
+    return i;
     NUKLEI_TRACE_END();
   }
 
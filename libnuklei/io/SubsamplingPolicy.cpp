@@ -0,0 +1,109 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <algorithm>
+#include <cmath>
+
+#include <nuklei/SubsamplingPolicy.h>
+#include <nuklei/Random.h>
+
+namespace nuklei {
+
+  namespace {
+
+    struct ByIndex
+    {
+      template<class E>
+      bool operator()(const E &a, const E &b) const
+      { return a.index < b.index; }
+    };
+
+  }
+
+  WeightedReservoirSampling::WeightedReservoirSampling(const unsigned n) :
+    n_(n), index_(0), key_(0)
+  {
+  }
+
+  WeightedReservoirSampling::~WeightedReservoirSampling()
+  {
+    reset();
+  }
+
+  bool WeightedReservoirSampling::offer(const Vector3 &loc, const weight_t w)
+  {
+    NUKLEI_TRACE_BEGIN();
+    index_++;
+    if (n_ == 0 || !(w > 0)) return false;
+    // log(u^(1/w)), which orders the points the same way.
+    key_ = std::log(1 - Random::uniform()) / w;
+    return reservoir_.size() < n_ || key_ > reservoir_.front().key;
+    NUKLEI_TRACE_END();
+  }
+
+  void WeightedReservoirSampling::keep(std::auto_ptr<kernel::base> k,
+                                       KernelBatch &batch)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (reservoir_.size() == n_)
+    {
+      std::pop_heap(reservoir_.begin(), reservoir_.end());
+      delete reservoir_.back().kernel;
+      reservoir_.pop_back();
+    }
+    Entry e;
+    e.key = key_;
+    e.index = index_;
+    e.kernel = k.release();
+    reservoir_.push_back(e);
+    std::push_heap(reservoir_.begin(), reservoir_.end());
+    NUKLEI_TRACE_END();
+  }
+
+  void WeightedReservoirSampling::flush(KernelBatch &batch)
+  {
+    NUKLEI_TRACE_BEGIN();
+    std::sort(reservoir_.begin(), reservoir_.end(), ByIndex());
+    batch.reserve(batch.size() + reservoir_.size());
+    for (std::vector<Entry>::iterator i = reservoir_.begin();
+         i != reservoir_.end(); ++i)
+    {
+      batch.push_back(i->kernel);
+      i->kernel = NULL;
+    }
+    reservoir_.clear();
+    NUKLEI_TRACE_END();
+  }
+
+  void WeightedReservoirSampling::reset()
+  {
+    NUKLEI_TRACE_BEGIN();
+    for (std::vector<Entry>::iterator i = reservoir_.begin();
+         i != reservoir_.end(); ++i)
+      delete i->kernel;
+    reservoir_.clear();
+    index_ = 0;
+    NUKLEI_TRACE_END();
+  }
+
+
+  VoxelSubsampling::VoxelSubsampling(const coord_t stride) :
+    stride_(stride)
+  {
+    NUKLEI_ASSERT(stride > 0);
+  }
+
+  bool VoxelSubsampling::offer(const Vector3 &loc, const weight_t w)
+  {
+    NUKLEI_TRACE_BEGIN();
+    Voxel v(long(std::floor(loc.X()/stride_)),
+            long(std::floor(loc.Y()/stride_)),
+            long(std::floor(loc.Z()/stride_)));
+    return voxels_.insert(v).second;
+    NUKLEI_TRACE_END();
+  }
+
+}
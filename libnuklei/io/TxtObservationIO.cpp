@@ -9,7 +9,6 @@
 #include <algorithm>
 #include <cmath>
 #include <boost/tuple/tuple.hpp>
-#include <boost/algorithm/string.hpp>
 
 #include <nuklei/TxtObservationIO.h>
 #include <nuklei/TxtObservation.h>
@@ -19,7 +18,7 @@ namespace nuklei {
 
 
   TxtReader::TxtReader(const std::string &observationFileName) :
-    observationFileName(observationFileName)
+    observationFileName(observationFileName), row_(-1), value_(0)
   {
   }
 
@@ -31,124 +30,109 @@ namespace nuklei {
 
   void TxtReader::init_()
   {
-    NUKLEI_ASSERT(!in_.is_open());
-    in_.open(observationFileName.c_str(), std::ios::in);
-    if (!in_.is_open())
-      throw ObservationIOError(std::string("Could not open file ") +
-                                   observationFileName + " for reading.");    
+    NUKLEI_TRACE_BEGIN();
+    file_.open(observationFileName);
+
+    // Lines hold a position (3 numbers), a position and a direction (6), or
+    // a position and a quaternion (7). Parsing and validation are done in a
+    // single pass over the mapped file.
+    table_.parse(file_.begin(), file_.end(), 3, 7, false);
+    file_.close();
 
-    std::string line;
     int ntok = -1;
-    while (std::getline(in_, line))
+    for (size_t i = 0; i < table_.rows(); ++i)
     {
-      cleanLine(line);
-      std::vector<std::string> tokens;
-      boost::split(tokens, line, boost::is_any_of(" "), boost::token_compress_on);
-      if (tokens.front() == "")
-        tokens.erase(tokens.begin());
-      if (tokens.back() == "")
-        tokens.pop_back();
-      if (tokens.size() == 0)
-      {
-        if (in_.good())
-          throw ObservationIOError("Unexpected empty line.");
-      }
-      if (tokens.size() == 3)
-      {
-        if (ntok == -1) ntok = 3;
-        else if (ntok != 3) throw ObservationIOError("Wrong number of tokens.");
-      }
-      else if (tokens.size() == 6)
-      {
-        if (ntok == -1) ntok = 7;
-        else if (ntok != 7) throw ObservationIOError("Wrong number of tokens.");
-      }
-      else if (tokens.size() == 7)
-      {
-        if (ntok == -1) ntok = 7;
-        else if (ntok != 7) throw ObservationIOError("Wrong number of tokens.");
-      }
-      else {
-        throw ObservationIOError("Wrong number of tokens on line (" + stringify(tokens.size()) + ")");
-      }
+      unsigned w = table_.width(i);
+      if (w != 3 && w != 6 && w != 7)
+        throw ObservationIOError("Wrong number of tokens on line (" +
+                                 stringify(w) + ")");
+      int t = (w == 3) ? 3 : 7;
+      if (ntok == -1) ntok = t;
+      else if (ntok != t) throw ObservationIOError("Wrong number of tokens.");
     }
-    
-    in_.close();
-    in_.open(observationFileName.c_str(), std::ios::in);
-    if (!in_.is_open())
-      throw ObservationIOError(std::string("Could not open file ") +
-                               observationFileName + " for reading.");
+
+    row_ = 0;
+    value_ = 0;
+    NUKLEI_TRACE_END();
   }
 
 
   void TxtReader::reset()
   {
-    in_.close();
     init();
   }
 
 
+  std::auto_ptr<kernel::base> TxtReader::nextKernel()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (row_ < 0) NUKLEI_THROW("Reader does not seem inited.");
+
+    // End of file reached.
+    if (size_t(row_) >= table_.rows()) return std::auto_ptr<kernel::base>();
+
+    const coord_t* v = table_.values() + value_;
+    unsigned w = table_.width(row_);
+    row_++;
+    value_ += w;
+
+    if (w == 3)
+    {
+      std::auto_ptr<kernel::r3> k(new kernel::r3);
+      k->loc_ = Vector3(v[0], v[1], v[2]);
+      return std::auto_ptr<kernel::base>(k);
+    }
+    else if (w == 6)
+    {
+      std::auto_ptr<kernel::r3xs2p> k(new kernel::r3xs2p);
+      k->loc_ = Vector3(v[0], v[1], v[2]);
+      k->dir_ = la::normalized(Vector3(v[3], v[4], v[5]));
+      return std::auto_ptr<kernel::base>(k);
+    }
+    else if (w == 7)
+    {
+      std::auto_ptr<kernel::se3> k(new kernel::se3);
+      k->loc_ = Vector3(v[0], v[1], v[2]);
+      k->ori_ = la::normalized(Quaternion(v[3], v[4], v[5], v[6]));
+      return std::auto_ptr<kernel::base>(k);
+    }
+    else {
+      NUKLEI_THROW("Wrong number of tokens on line (" << w << ")");
+    }
+    NUKLEI_TRACE_END();
+  }
+
+
   std::auto_ptr<Observation> TxtReader::readObservation_()
   {
-    if (!in_.is_open()) NUKLEI_THROW("Reader does not seem inited.");
+    NUKLEI_TRACE_BEGIN();
+    std::auto_ptr<kernel::base> k = nextKernel();
+    if (k.get() == NULL) return std::auto_ptr<Observation>();
+    return std::auto_ptr<Observation>(new TxtObservation(*k));
+    NUKLEI_TRACE_END();
+  }
 
-    if (!in_.good()) return std::auto_ptr<Observation>();
-    
-    std::string line;
-    
-    while (std::getline(in_, line))
+
+  size_t TxtReader::readKernels_(KernelBatch &batch, const size_t n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (row_ < 0) NUKLEI_THROW("Reader does not seem inited.");
+    size_t i = 0;
+    for (; i < n && size_t(row_) < table_.rows(); ++i)
     {
-      cleanLine(line);      
-      std::auto_ptr<TxtObservation> observation(new TxtObservation);
-
-      std::vector<std::string> tokens;
-      boost::split(tokens, line, boost::is_any_of(" "), boost::token_compress_on);
-      if (tokens.front() == "")
-        tokens.erase(tokens.begin());
-      if (tokens.back() == "")
-        tokens.pop_back();
-      if (tokens.size() == 0)
-      {
-        // end of file
-      }
-      if (tokens.size() == 3)
-      {
-        kernel::r3 k;
-        k.loc_ = Vector3(numify<double>(tokens.at(0)), numify<double>(tokens.at(1)), numify<double>(tokens.at(2)));
-        observation->setKernel(k);
-      }
-      else if (tokens.size() == 6)
+      const coord_t* v = table_.values() + value_;
+      unsigned w = table_.width(row_);
+      // Malformed lines are left to nextKernel(), which reports them.
+      if ((w == 3 || w == 6 || w == 7) &&
+          !accepts(Vector3(v[0], v[1], v[2]), 1))
       {
-        kernel::r3xs2p k;
-        k.loc_ = Vector3(numify<double>(tokens.at(0)), numify<double>(tokens.at(1)), numify<double>(tokens.at(2)));
-        k.dir_ = la::normalized(Vector3(numify<double>(tokens.at(3)),
-                                        numify<double>(tokens.at(4)),
-                                        numify<double>(tokens.at(5))
-                                        )
-                                );
-        observation->setKernel(k);
+        row_++;
+        value_ += w;
       }
-      else if (tokens.size() == 7)
-      {
-        kernel::se3 k;
-        k.loc_ = Vector3(numify<double>(tokens.at(0)), numify<double>(tokens.at(1)), numify<double>(tokens.at(2)));
-        k.ori_ = la::normalized(Quaternion(numify<double>(tokens.at(3)),
-                                           numify<double>(tokens.at(4)),
-                                           numify<double>(tokens.at(5)),
-                                           numify<double>(tokens.at(6))
-                                           )
-                                );
-        observation->setKernel(k);
-      }
-      else {
-        NUKLEI_THROW("Wrong number of tokens on line (" << tokens.size() << ")");
-      }
-      
-      return std::auto_ptr<Observation>(observation);
+      else keep(nextKernel(), batch);
     }
-    
-    // End of file reached.
-    return std::auto_ptr<Observation>();
+    return i;
+    NUKLEI_TRACE_END();
   }
 
   
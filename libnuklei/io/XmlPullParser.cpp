@@ -0,0 +1,497 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include <nuklei/XmlPullParser.h>
+#include <nuklei/AsciiParser.h>
+#include <nuklei/ObservationIO.h>
+
+namespace nuklei {
+
+  namespace {
+
+    // Initial size of the read window. The window only grows to hold
+    // tags or text nodes that are larger than this.
+    const size_t WINDOW_SIZE = 1 << 16;
+
+    inline bool isXmlSpace(const char c)
+    {
+      return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    inline const char* skipXmlSpaces(const char* p, const char* end)
+    {
+      while (p != end && isXmlSpace(*p)) ++p;
+      return p;
+    }
+
+    inline bool isNameEnd(const char c)
+    {
+      return isXmlSpace(c) || c == '/' || c == '=';
+    }
+
+    void appendUtf8(std::string &out, const unsigned long c)
+    {
+      if (c < 0x80)
+        out += char(c);
+      else if (c < 0x800)
+      {
+        out += char(0xc0 | (c >> 6));
+        out += char(0x80 | (c & 0x3f));
+      }
+      else if (c < 0x10000)
+      {
+        out += char(0xe0 | (c >> 12));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+      }
+      else
+      {
+        out += char(0xf0 | (c >> 18));
+        out += char(0x80 | ((c >> 12) & 0x3f));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+      }
+    }
+
+    // Parses [b, e) as a sequence of exactly n numbers.
+    bool parseNumbers(const char* b, const char* e,
+                      coord_t* values, const unsigned n)
+    {
+      const char* p = b;
+      for (unsigned i = 0; i < n; ++i)
+      {
+        p = skipXmlSpaces(p, e);
+        if (!parseAsciiNumber(p, e, values[i])) return false;
+      }
+      return skipXmlSpaces(p, e) == e;
+    }
+
+  }
+
+
+  XmlPullParser::XmlPullParser() :
+  begin_(0), end_(0), consumed_(0), eof_(true),
+  depth_(0), current_(0), pendingEnd_(false), rootSeen_(false),
+  nAttributes_(0)
+  {
+  }
+
+  void XmlPullParser::open(const std::string &fileName)
+  {
+    NUKLEI_TRACE_BEGIN();
+    close();
+    fileName_ = fileName;
+    in_.open(fileName.c_str(), std::ios::in | std::ios::binary);
+    if (!in_.is_open())
+      throw ObservationIOError(std::string("Could not open file ") +
+                               fileName + " for reading.");
+    buffer_.resize(WINDOW_SIZE);
+    eof_ = false;
+
+    // Skip the UTF-8 byte order mark.
+    while (end_ < 3 && fill()) ;
+    if (end_ >= 3 && std::memcmp(&buffer_[0], "\xef\xbb\xbf", 3) == 0)
+      begin_ = 3;
+    NUKLEI_TRACE_END();
+  }
+
+  void XmlPullParser::close()
+  {
+    if (in_.is_open()) in_.close();
+    in_.clear();
+    // Release a window that grew to hold a large node.
+    std::vector<char>().swap(buffer_);
+    begin_ = end_ = consumed_ = 0;
+    eof_ = true;
+    depth_ = current_ = 0;
+    pendingEnd_ = rootSeen_ = false;
+    nAttributes_ = 0;
+  }
+
+  bool XmlPullParser::fill()
+  {
+    if (eof_) return false;
+    if (begin_ > 0)
+    {
+      std::memmove(&buffer_[0], &buffer_[0] + begin_, end_ - begin_);
+      consumed_ += begin_;
+      end_ -= begin_;
+      begin_ = 0;
+    }
+    if (end_ == buffer_.size())
+      buffer_.resize(2 * buffer_.size());
+    in_.read(&buffer_[0] + end_, buffer_.size() - end_);
+    std::streamsize n = in_.gcount();
+    if (n <= 0)
+    {
+      eof_ = true;
+      return false;
+    }
+    end_ += n;
+    return true;
+  }
+
+  // Returns the offset, relative to begin_, of the first occurrence of
+  // [s, s+length) at or after begin_+from, or npos if the file ends before.
+  // Offsets relative to begin_ remain valid through fill().
+  size_t XmlPullParser::find(const char* s, const size_t length, size_t from)
+  {
+    for (;;)
+    {
+      const char* b = &buffer_[0] + begin_;
+      const size_t n = end_ - begin_;
+      while (from + length <= n)
+      {
+        const char* p =
+          static_cast<const char*>(std::memchr(b + from, s[0], n - from));
+        if (p == NULL)
+        {
+          from = n;
+          break;
+        }
+        const size_t o = p - b;
+        if (o + length > n)
+        {
+          from = o;
+          break;
+        }
+        if (std::memcmp(p, s, length) == 0) return o;
+        from = o + 1;
+      }
+      if (!fill()) return npos;
+    }
+  }
+
+  // Returns the offset, relative to begin_, of the '>' that closes the tag
+  // that starts at begin_. Quoted attribute values may contain '>'.
+  size_t XmlPullParser::findTagEnd()
+  {
+    char quote = 0;
+    size_t i = 1;
+    for (;;)
+    {
+      for (; begin_ + i < end_; ++i)
+      {
+        const char c = buffer_[begin_ + i];
+        if (quote != 0)
+        {
+          if (c == quote) quote = 0;
+        }
+        else if (c == '"' || c == '\'') quote = c;
+        else if (c == '>') return i;
+        else if (c == '<') error("Unexpected `<' in tag");
+      }
+      if (!fill()) error("Unexpected end of file in tag");
+    }
+  }
+
+  void XmlPullParser::skipUntil(const char* s, const size_t length,
+                                const size_t from)
+  {
+    size_t o = find(s, length, from);
+    if (o == npos) error("Unexpected end of file");
+    begin_ += o + length;
+  }
+
+  // Skips <!...> declarations other than comments and CDATA sections,
+  // including DOCTYPEs with an internal subset.
+  void XmlPullParser::skipDeclaration()
+  {
+    int nesting = 0;
+    char quote = 0;
+    size_t i = 2;
+    for (;;)
+    {
+      for (; begin_ + i < end_; ++i)
+      {
+        const char c = buffer_[begin_ + i];
+        if (quote != 0)
+        {
+          if (c == quote) quote = 0;
+        }
+        else if (c == '"' || c == '\'') quote = c;
+        else if (c == '[') ++nesting;
+        else if (c == ']') --nesting;
+        else if (c == '>' && nesting <= 0)
+        {
+          begin_ += i + 1;
+          return;
+        }
+      }
+      if (!fill()) error("Unexpected end of file in declaration");
+    }
+  }
+
+  XmlPullParser::Event XmlPullParser::next()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!in_.is_open()) NUKLEI_THROW("Parser does not seem opened.");
+
+    if (pendingEnd_)
+    {
+      pendingEnd_ = false;
+      current_ = --depth_;
+      return END_ELEMENT;
+    }
+
+    for (;;)
+    {
+      // Skip text up to the next markup. Outside the root element, only
+      // whitespace is allowed.
+      for (;;)
+      {
+        for (; begin_ < end_ && buffer_[begin_] != '<'; ++begin_)
+          if (depth_ == 0 && !isXmlSpace(buffer_[begin_]))
+            error("Text outside of the root element");
+        if (begin_ < end_ || !fill()) break;
+      }
+
+      if (begin_ == end_)
+      {
+        if (depth_ > 0)
+          error("Unexpected end of file in element `" +
+                names_.at(depth_-1) + "'");
+        if (!rootSeen_) error("Missing root element");
+        return END_DOCUMENT;
+      }
+
+      if (end_ - begin_ < 9) fill();
+      const size_t n = end_ - begin_;
+      const char* b = &buffer_[0] + begin_;
+
+      if (n >= 2 && b[1] == '/')
+      {
+        size_t e = findTagEnd();
+        b = &buffer_[0] + begin_;
+        parseEndTag(b + 2, b + e);
+        begin_ += e + 1;
+        current_ = --depth_;
+        return END_ELEMENT;
+      }
+      else if (n >= 2 && b[1] == '?')
+        skipUntil("?>", 2, 2);
+      else if (n >= 4 && std::memcmp(b, "<!--", 4) == 0)
+        skipUntil("-->", 3, 4);
+      else if (n >= 9 && std::memcmp(b, "<![CDATA[", 9) == 0)
+      {
+        if (depth_ == 0) error("CDATA section outside of the root element");
+        skipUntil("]]>", 3, 9);
+      }
+      else if (n >= 2 && b[1] == '!')
+        skipDeclaration();
+      else
+      {
+        if (depth_ == 0 && rootSeen_) error("Multiple root elements");
+        size_t e = findTagEnd();
+        b = &buffer_[0] + begin_;
+        const bool selfClosing = (b[e-1] == '/');
+        parseStartTag(b + 1, selfClosing ? b + e - 1 : b + e);
+        begin_ += e + 1;
+        current_ = depth_++;
+        rootSeen_ = true;
+        pendingEnd_ = selfClosing;
+        return START_ELEMENT;
+      }
+    }
+    NUKLEI_TRACE_END();
+  }
+
+  void XmlPullParser::parseStartTag(const char* b, const char* e)
+  {
+    const char* p = b;
+    while (p != e && !isNameEnd(*p)) ++p;
+    if (p == b) error("Missing element name");
+    if (names_.size() <= depth_) names_.resize(depth_ + 1);
+    names_[depth_].assign(b, p);
+
+    nAttributes_ = 0;
+    for (;;)
+    {
+      p = skipXmlSpaces(p, e);
+      if (p == e) break;
+      const char* nameBegin = p;
+      while (p != e && !isNameEnd(*p)) ++p;
+      const char* nameEnd = p;
+      if (nameBegin == nameEnd) error("Missing attribute name");
+      p = skipXmlSpaces(p, e);
+      if (p == e || *p != '=') error("Missing `=' after attribute name");
+      p = skipXmlSpaces(p + 1, e);
+      if (p == e || (*p != '"' && *p != '\'')) error("Unquoted attribute");
+      const char quote = *p++;
+      const char* valueBegin = p;
+      p = std::find(p, e, quote);
+      if (p == e) error("Unterminated attribute value");
+
+      if (attributes_.size() <= nAttributes_)
+        attributes_.resize(nAttributes_ + 1);
+      Attribute& a = attributes_[nAttributes_++];
+      a.first.assign(nameBegin, nameEnd);
+      a.second.clear();
+      appendDecoded(a.second, valueBegin, p);
+      ++p;
+    }
+  }
+
+  void XmlPullParser::parseEndTag(const char* b, const char* e)
+  {
+    const char* nameEnd = std::find_if(b, e, isXmlSpace);
+    if (skipXmlSpaces(nameEnd, e) != e) error("Malformed end tag");
+    if (depth_ == 0) error("Unexpected end tag");
+    const std::string& open = names_[depth_-1];
+    if (open.size() != size_t(nameEnd - b) ||
+        std::memcmp(open.data(), b, nameEnd - b) != 0)
+      error("End tag `" + std::string(b, nameEnd) + "' does not match `" +
+            open + "'");
+  }
+
+  void XmlPullParser::appendDecoded(std::string &out,
+                                    const char* b, const char* e) const
+  {
+    for (;;)
+    {
+      const char* amp = std::find(b, e, '&');
+      out.append(b, amp);
+      if (amp == e) return;
+      const char* semi = std::find(amp, e, ';');
+      if (semi == e) error("Unterminated entity reference");
+      std::string entity(amp + 1, semi);
+      if (entity == "lt") out += '<';
+      else if (entity == "gt") out += '>';
+      else if (entity == "amp") out += '&';
+      else if (entity == "quot") out += '"';
+      else if (entity == "apos") out += '\'';
+      else if (entity.size() > 1 && entity[0] == '#')
+      {
+        const bool hex = (entity[1] == 'x');
+        const char* digits = entity.c_str() + (hex ? 2 : 1);
+        char* end = NULL;
+        unsigned long c = std::strtoul(digits, &end, hex ? 16 : 10);
+        if (*digits == 0 || *end != 0 || c > 0x10ffff)
+          error("Invalid character reference `&" + entity + ";'");
+        appendUtf8(out, c);
+      }
+      else error("Unknown entity `&" + entity + ";'");
+      b = semi + 1;
+    }
+  }
+
+  const std::string& XmlPullParser::parentName() const
+  {
+    static const std::string none;
+    return current_ == 0 ? none : names_.at(current_-1);
+  }
+
+  bool XmlPullParser::attribute(const std::string &name,
+                                std::string &value) const
+  {
+    for (unsigned i = 0; i < nAttributes_; ++i)
+      if (attributes_[i].first == name)
+      {
+        value = attributes_[i].second;
+        return true;
+      }
+    return false;
+  }
+
+  coord_t XmlPullParser::numericAttribute(const std::string &name) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    for (unsigned i = 0; i < nAttributes_; ++i)
+      if (attributes_[i].first == name)
+      {
+        const std::string& s = attributes_[i].second;
+        coord_t value;
+        if (!parseNumbers(s.data(), s.data() + s.size(), &value, 1))
+          error("Attribute `" + name + "' of `" + names_.at(current_) +
+                "' is not a number");
+        return value;
+      }
+    error("Element `" + names_.at(current_) + "' has no attribute `" +
+          name + "'");
+    return 0;
+    NUKLEI_TRACE_END();
+  }
+
+  void XmlPullParser::readText(std::string &text)
+  {
+    NUKLEI_TRACE_BEGIN();
+    text.clear();
+    if (pendingEnd_)
+    {
+      next();
+      return;
+    }
+    if (depth_ == 0 || current_ != depth_-1)
+      NUKLEI_THROW("readText() must follow a start event.");
+
+    for (;;)
+    {
+      size_t o = find("<", 1, 0);
+      if (o == npos)
+        error("Unexpected end of file in element `" +
+              names_[depth_-1] + "'");
+      const char* b = &buffer_[0] + begin_;
+      appendDecoded(text, b, b + o);
+      begin_ += o;
+
+      if (end_ - begin_ < 9) fill();
+      const size_t n = end_ - begin_;
+      b = &buffer_[0] + begin_;
+
+      if (n >= 2 && b[1] == '/')
+      {
+        next();
+        return;
+      }
+      else if (n >= 2 && b[1] == '?')
+        skipUntil("?>", 2, 2);
+      else if (n >= 4 && std::memcmp(b, "<!--", 4) == 0)
+        skipUntil("-->", 3, 4);
+      else if (n >= 9 && std::memcmp(b, "<![CDATA[", 9) == 0)
+      {
+        size_t e = find("]]>", 3, 9);
+        if (e == npos) error("Unterminated CDATA section");
+        b = &buffer_[0] + begin_;
+        text.append(b + 9, b + e);
+        begin_ += e + 3;
+      }
+      else
+        error("Unexpected child element in `" + names_[depth_-1] + "'");
+    }
+    NUKLEI_TRACE_END();
+  }
+
+  void XmlPullParser::readNumbers(coord_t* values, const unsigned n)
+  {
+    NUKLEI_TRACE_BEGIN();
+    readText(text_);
+    if (!parseNumbers(text_.data(), text_.data() + text_.size(), values, n))
+      error("Element `" + name() + "' does not hold " + stringify(n) +
+            " number(s)");
+    NUKLEI_TRACE_END();
+  }
+
+  void XmlPullParser::skipElement()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (depth_ == 0 || current_ != depth_-1)
+      NUKLEI_THROW("skipElement() must follow a start event.");
+    const unsigned depth = depth_;
+    while (depth_ >= depth) next();
+    NUKLEI_TRACE_END();
+  }
+
+  void XmlPullParser::error(const std::string &msg) const
+  {
+    throw ObservationIOError("XML error in `" + fileName_ + "' at byte " +
+                             stringify(offset()) + ": " + msg + ".");
+  }
+
+}
@@ -0,0 +1,153 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_ASCIIPARSER_H
+#define NUKLEI_ASCIIPARSER_H
+
+
+#include <vector>
+#include <string>
+#include <boost/utility.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <nuklei/Definitions.h>
+
+namespace nuklei {
+
+  /**
+   * @brief Memory-mapped text file.
+   *
+   * Headers are read line by line with getLine(). Bulk numeric data is then
+   * parsed with AsciiTable::parse() or parseAsciiNumbers(), directly from the
+   * mapped memory.
+   */
+  class AsciiFile : boost::noncopyable
+  {
+  public:
+    AsciiFile() : isEmpty_(false), begin_(NULL), end_(NULL), cursor_(NULL) {}
+
+    /**
+     * @brief Maps @p fileName and places the cursor at its beginning.
+     *
+     * Throws ObservationIOError if the file cannot be opened.
+     */
+    void open(const std::string &fileName);
+    void close();
+    bool isOpen() const { return file_.is_open() || isEmpty_; }
+
+    const char* begin() const { return begin_; }
+    const char* end() const { return end_; }
+
+    /**
+     * @brief Copies the line at the cursor into @p line, without its
+     * end-of-line characters, and moves the cursor to the next line.
+     *
+     * Returns false if the cursor is at the end of the file.
+     */
+    bool getLine(std::string &line);
+
+    /**
+     * @brief Copies the next whitespace-delimited token into @p token, and
+     * moves the cursor past it.
+     *
+     * Returns false if there are no more tokens.
+     */
+    bool getToken(std::string &token);
+
+    const char* cursor() const { return cursor_; }
+    void seek(const char* p) { cursor_ = p; }
+
+  private:
+    boost::iostreams::mapped_file_source file_;
+    bool isEmpty_;
+    const char* begin_;
+    const char* end_;
+    const char* cursor_;
+  };
+
+
+  /**
+   * @brief Parses a number at @p p, and moves @p p past it.
+   *
+   * The number must be followed by a space, a tab, an end-of-line or @p end.
+   * Returns false (leaving @p p untouched) if no number can be read.
+   *
+   * Numbers with at most 19 significant digits and a decimal exponent within
+   * [-22,22] are converted directly, other numbers are converted with
+   * @c strtod. In both cases, the result is correctly rounded.
+   */
+  bool parseAsciiNumber(const char* &p, const char* end, coord_t &value);
+
+  /**
+   * @brief Parses all the numbers in [@p begin, @p end), ignoring line
+   * structure, and appends them to @p values.
+   *
+   * Large inputs are split at line boundaries and parsed in parallel.
+   * Throws ObservationIOError if a token is not a number.
+   */
+  void parseAsciiNumbers(std::vector<coord_t> &values,
+                         const char* begin, const char* end);
+
+
+  /**
+   * @brief Numbers read from consecutive lines of text.
+   *
+   * Numbers are stored contiguously, row after row. The number of values
+   * of each row is available through width(). Readers typically walk the
+   * table sequentially, keeping track of the row and of the offset of its
+   * first value.
+   */
+  class AsciiTable
+  {
+  public:
+    AsciiTable() {}
+
+    /**
+     * @brief Replaces the table with the lines of [@p begin, @p end).
+     *
+     * At most @p maxColumns numbers are read from a line. If
+     * @p ignoreExtraColumns is true, the rest of the line is skipped
+     * without being validated. Else, a line with more than @p maxColumns
+     * tokens is an error. A line with fewer than @p minColumns numbers is an
+     * error.
+     *
+     * Blank lines are only allowed at the end of the range.
+     *
+     * Large inputs are split at line boundaries and parsed in parallel.
+     * Parsing errors throw ObservationIOError.
+     */
+    void parse(const char* begin, const char* end,
+               const unsigned minColumns, const unsigned maxColumns,
+               const bool ignoreExtraColumns);
+
+    void clear() { values_.clear(); widths_.clear(); }
+
+    size_t rows() const { return widths_.size(); }
+    unsigned width(const size_t row) const { return widths_[row]; }
+    const coord_t* values() const
+    { return values_.empty() ? NULL : &values_.front(); }
+    size_t nValues() const { return values_.size(); }
+
+    /** @brief Returns true if all rows have the same width. */
+    bool isUniform() const;
+
+  private:
+    std::vector<coord_t> values_;
+    std::vector<unsigned char> widths_;
+  };
+
+  /**
+   * @brief Returns the beginning of the line that follows the @p n first
+   * lines of [@p begin, @p end).
+   *
+   * Throws ObservationIOError if the range has fewer than @p n lines.
+   */
+  const char* skipAsciiLines(const char* begin, const char* end,
+                             const size_t n);
+
+}
+
+#endif
@@ -0,0 +1,48 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_BINARYOBSERVATION_H
+#define NUKLEI_BINARYOBSERVATION_H
+
+
+#include <nuklei/Definitions.h>
+#include <nuklei/Color.h>
+#include <nuklei/LinearAlgebra.h>
+#include <nuklei/Observation.h>
+#include <nuklei/member_clone_ptr.h>
+
+
+namespace nuklei {
+
+  class BinaryObservation : public Observation
+    {
+    public:
+
+      Type type() const { return BINARY; }
+
+      std::auto_ptr<kernel::base> getKernel() const
+      {
+        return k_->clone();
+      }
+ 
+      void setKernel(const kernel::base& k)
+      {
+        NUKLEI_TRACE_BEGIN();
+        k_ = k;
+        NUKLEI_TRACE_END();
+      }
+
+      BinaryObservation();
+      BinaryObservation(const kernel::base& k);
+      ~BinaryObservation() {};
+          
+    private:
+      member_clone_ptr<kernel::base> k_;
+    };
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_BINARYOBSERVATIONIO_H
+#define NUKLEI_BINARYOBSERVATIONIO_H
+
+
+#include <vector>
+#include <fstream>
+#include <boost/cstdint.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <nuklei/Definitions.h>
+#include <nuklei/ObservationIO.h>
+#include <nuklei/BinaryObservation.h>
+
+namespace nuklei {
+
+  /**
+   * @brief Header of Nuklei's native binary point-cloud format.
+   *
+   * A file starts with this header, followed by one array per field. Each
+   * array holds @c count consecutive records of @c coord_t, and starts at an
+   * offset (from the beginning of the file) that is a multiple of
+   * #ALIGNMENT. Absent fields have a zero offset. The fields, and the number
+   * of values per record, are:
+   * - @c LOC (3): position,
+   * - @c ORI: orientation, as a quaternion @c w, @c x, @c y, @c z (4) for
+   *   @c se3 kernels, or as a direction (3) for @c r3xs2 and @c r3xs2p
+   *   kernels,
+   * - @c LOC_H (1), @c ORI_H (1): bandwidths,
+   * - @c WEIGHT (1),
+   * - @c COLOR (3): RGB color in [0,1], present if all kernels have a
+   *   ColorDescriptor.
+   *
+   * Numbers are stored in the byte order of the machine that wrote the
+   * file. The reader rejects files written with a different byte order.
+   */
+  struct BinaryFileHeader
+  {
+    typedef enum { LOC = 0, ORI, LOC_H, ORI_H, WEIGHT, COLOR, N_FIELDS } Field;
+    static const unsigned ALIGNMENT = 64;
+    static const boost::uint32_t VERSION = 1;
+    static const boost::uint32_t BYTE_ORDER_MARK = 0x01020304;
+    static const char* magic() { return "NUKLEIPC"; }
+    static const unsigned MAGIC_SIZE = 8;
+
+    char magic_[MAGIC_SIZE];
+    boost::uint32_t version;
+    boost::uint32_t byteOrder;
+    boost::uint32_t kernelType;
+    boost::uint32_t reserved;
+    boost::uint64_t count;
+    coord_t bboxMin[3];
+    coord_t bboxMax[3];
+    boost::uint64_t offsets[N_FIELDS];
+
+    /** @brief Number of values per record of @p field, for @p type. */
+    static unsigned width(const Field field, const kernel::base::Type type);
+  };
+
+  /**
+   * @brief Reads Nuklei's native binary point-cloud format.
+   *
+   * The file is memory-mapped: kernels are built directly from the mapped
+   * field arrays, without parsing or deserialization.
+   */
+  class BinaryReader : public ObservationReader
+    {
+    public:
+      BinaryReader(const std::string &observationFileName);
+      ~BinaryReader();
+
+      Observation::Type type() const { return Observation::BINARY; }
+
+      nullable<unsigned> nObservations() const
+      { NUKLEI_ASSERT(inited_); return unsigned(header_.count); }
+
+      /** @brief Bounding box of the kernel positions, as written in the header. */
+      Vector3 boundingBoxMin() const;
+      /** @brief Bounding box of the kernel positions, as written in the header. */
+      Vector3 boundingBoxMax() const;
+
+      void reset();
+
+    protected:
+      void init_();
+      std::auto_ptr<Observation> readObservation_();
+      size_t readKernels_(KernelBatch &batch, const size_t n);
+
+      std::auto_ptr<kernel::base> kernelAt(const boost::uint64_t i) const;
+
+      std::string observationFileName_;
+      boost::iostreams::mapped_file_source file_;
+      BinaryFileHeader header_;
+      const coord_t* fields_[BinaryFileHeader::N_FIELDS];
+      boost::uint64_t idx_;
+      bool inited_;
+    };
+
+  /**
+   * @brief Writes Nuklei's native binary point-cloud format.
+   *
+   * Each field is streamed to its own temporary file, next to the output
+   * file, as kernels arrive. writeBuffer() writes the header, then copies
+   * the field files into place. Temporary files are removed by init() and
+   * by the destructor.
+   */
+  class BinaryWriter : public ObservationWriter
+    {
+    public:
+      BinaryWriter(const std::string &observationFileName);
+      ~BinaryWriter();
+
+      Observation::Type type() const { return Observation::BINARY; }
+
+      void init();
+      void reset();
+
+      std::auto_ptr<Observation> templateObservation() const
+      { return std::auto_ptr<Observation>(new BinaryObservation); }
+
+      void writeObservation(const Observation &o);
+      void writeBuffer();
+
+    protected:
+      /** @brief Reads back the values written so far to @p field. */
+      void readField(const BinaryFileHeader::Field field,
+                     std::vector<coord_t> &values);
+
+      std::string observationFileName_;
+      int kernelType_;
+      boost::uint64_t count_;
+      bool hasColor_;
+      coord_t bboxMin_[3];
+      coord_t bboxMax_[3];
+
+    private:
+      void append(const BinaryFileHeader::Field field, const coord_t value);
+      void removeFieldFiles();
+
+      std::string fieldFileNames_[BinaryFileHeader::N_FIELDS];
+      std::ofstream fieldFiles_[BinaryFileHeader::N_FIELDS];
+    };
+
+}
+
+#endif
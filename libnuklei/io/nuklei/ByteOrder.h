@@ -0,0 +1,77 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_BYTEORDER_H
+#define NUKLEI_BYTEORDER_H
+
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <boost/cstdint.hpp>
+
+namespace nuklei {
+
+  /** @brief Returns true if the host stores numbers little-endian first. */
+  inline bool hostIsLittleEndian()
+  {
+    const boost::uint16_t one = 1;
+    return *reinterpret_cast<const unsigned char*>(&one) == 1;
+  }
+
+  /**
+   * @brief Reads the @p T stored at @p p, which need not be aligned,
+   * reversing its bytes if @p swap is true.
+   */
+  template<typename T>
+  inline T readScalar(const char* p, const bool swap)
+  {
+    T v;
+    if (swap)
+    {
+      char b[sizeof(T)];
+      std::reverse_copy(p, p + sizeof(T), b);
+      std::memcpy(&v, b, sizeof(T));
+    }
+    else std::memcpy(&v, p, sizeof(T));
+    return v;
+  }
+
+  /** @brief Reads the little-endian @p T stored at @p p. */
+  template<typename T>
+  inline T readLittleEndian(const char* p)
+  {
+    return readScalar<T>(p, !hostIsLittleEndian());
+  }
+
+  /**
+   * @brief Appends the bytes of @p value to @p buffer, in reverse order if
+   * @p swap is true.
+   */
+  template<typename T>
+  inline void appendScalar(std::vector<char> &buffer, const T value,
+                           const bool swap)
+  {
+    char b[sizeof(T)];
+    std::memcpy(b, &value, sizeof(T));
+    if (swap) std::reverse(b, b + sizeof(T));
+    buffer.insert(buffer.end(), b, b + sizeof(T));
+  }
+
+  /** @brief Writes @p value to @p os in little-endian byte order. */
+  template<typename T>
+  inline void writeLittleEndian(std::ostream &os, const T value)
+  {
+    char b[sizeof(T)];
+    std::memcpy(b, &value, sizeof(T));
+    if (!hostIsLittleEndian()) std::reverse(b, b + sizeof(T));
+    os.write(b, sizeof(T));
+  }
+
+}
+
+#endif
@@ -11,6 +11,7 @@
 #include <nuklei/Definitions.h>
 #include <nuklei/ObservationIO.h>
 #include <nuklei/CoViS3DObservation.h>
+#include <nuklei/XmlPullParser.h>
 
 #ifdef NUKLEI_USE_TICPP
 namespace ticpp {
@@ -41,6 +42,12 @@ namespace nuklei {
       boost::shared_ptr<CoViS3DReader> reader_;
     };
 
+  /**
+   * @brief Reads CoViS3D XML scenes.
+   *
+   * The document is streamed with XmlPullParser: primitives are converted
+   * as their element closes.
+   */
   class CoViS3DXMLReader : public CoViS3DReader
     {
     public:
@@ -53,11 +60,9 @@ namespace nuklei {
       void init_();
       std::auto_ptr<Observation> readObservation_();
     private:
-#ifdef NUKLEI_USE_TICPP
-      boost::shared_ptr<ticpp::Document> in_;
-      typedef ticpp::Iterator< ticpp::Element > ElementIterator;
-      boost::shared_ptr<ElementIterator> e_;
-#endif
+      std::auto_ptr<Observation> parsePrimitive();
+
+      XmlPullParser parser_;
     };
 
 
@@ -12,6 +12,7 @@
 #include <nuklei/Definitions.h>
 #include <nuklei/ObservationIO.h>
 #include <nuklei/IisObservation.h>
+#include <nuklei/XmlPullParser.h>
 
 #ifdef NUKLEI_USE_TICPP
 namespace ticpp {
@@ -24,6 +25,12 @@ namespace ticpp {
 
 namespace nuklei {
 
+  /**
+   * @brief Reads IIS grasp files.
+   *
+   * The document is streamed with XmlPullParser: grasps are converted as
+   * their element closes.
+   */
   class IisReader : public ObservationReader
     {
     public:
@@ -39,11 +46,9 @@ namespace nuklei {
       std::auto_ptr<Observation> readObservation_();
       std::string observationFileName_;
     private:
-#ifdef NUKLEI_USE_TICPP
-      boost::shared_ptr<ticpp::Document> in_;
-      typedef ticpp::Iterator< ticpp::Element > ElementIterator;
-      boost::shared_ptr<ElementIterator> e_;
-#endif
+      std::auto_ptr<Observation> parseGrasp();
+
+      XmlPullParser parser_;
     };
 
   class IisWriter : public ObservationWriter
@@ -0,0 +1,36 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_LZF_H
+#define NUKLEI_LZF_H
+
+
+#include <vector>
+
+#include <nuklei/Definitions.h>
+
+namespace nuklei {
+
+  /**
+   * @brief Compresses [@p in, @p in + @p n) into @p out, in the LZF format
+   * (as used by PCD's @c binary_compressed data).
+   *
+   * Returns the compressed size.
+   */
+  size_t lzfCompress(const char* in, const size_t n, std::vector<char> &out);
+
+  /**
+   * @brief Decompresses the LZF stream [@p in, @p in + @p n) into @p out,
+   * which must hold exactly @p outSize bytes once decompressed.
+   *
+   * Throws ObservationIOError if the stream is corrupt.
+   */
+  void lzfDecompress(const char* in, const size_t n,
+                     char* out, const size_t outSize);
+
+}
+
+#endif
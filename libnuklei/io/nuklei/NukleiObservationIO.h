@@ -12,6 +12,7 @@
 #include <nuklei/Definitions.h>
 #include <nuklei/ObservationIO.h>
 #include <nuklei/NukleiObservation.h>
+#include <nuklei/XmlPullParser.h>
 
 #ifdef NUKLEI_USE_TICPP
 namespace ticpp {
@@ -29,6 +30,13 @@ namespace tinyxml2 {
 
 namespace nuklei {
 
+  /**
+   * @brief Reads Nuklei's XML format.
+   *
+   * The document is streamed with XmlPullParser: kernels are converted as
+   * their element closes, and memory use does not depend on the size of
+   * the file.
+   */
   class NukleiReader : public ObservationReader
     {
     public:
@@ -42,16 +50,15 @@ namespace nuklei {
     protected:
       void init_();
       std::auto_ptr<Observation> readObservation_();
+      size_t readKernels_(KernelBatch &batch, const size_t n);
       std::string observationFileName_;
     private:
-#ifdef NUKLEI_USE_TICPP
-      boost::shared_ptr<ticpp::Document> in_;
-      typedef ticpp::Iterator< ticpp::Element > ElementIterator;
-      boost::shared_ptr<ElementIterator> e_;
-#else
-      boost::shared_ptr<tinyxml2::XMLDocument> in_;
-      tinyxml2::XMLElement* e_;
-#endif
+      /** @brief Moves to the next kernel element, or returns false. */
+      bool nextKernelElement();
+      std::auto_ptr<kernel::base> nextKernel();
+      std::auto_ptr<kernel::base> parseKernel(const bool filter);
+
+      XmlPullParser parser_;
     };
 
   class NukleiWriter : public ObservationWriter
@@ -9,6 +9,7 @@
 
 #include <typeinfo>
 #include <boost/utility.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 
 #include <nuklei/Definitions.h>
 #include <nuklei/Observation.h>
@@ -18,6 +19,7 @@
 namespace nuklei {
   
   class KernelCollection;
+  class SubsamplingPolicy;
   
   class ObservationIOError : public Error
     {
@@ -34,11 +36,33 @@ namespace nuklei {
   class ObservationReader : boost::noncopyable
     {
     public:
+      ObservationReader() : nInROI_(0) {}
       virtual ~ObservationReader();
       
+      /** @brief Batch of kernels, see readKernels(). */
+      typedef boost::ptr_vector<kernel::base> KernelBatch;
+
       std::auto_ptr<Observation> readObservation();
       std::auto_ptr<KernelCollection> readObservations();
+      /**
+       * @brief Reads all the remaining observations into @p kc.
+       *
+       * Kernels are read in batches with readKernels() and moved into @p
+       * kc, which is sized up front when nObservations() is known.
+       */
       void readObservations(KernelCollection &kc);
+
+      /**
+       * @brief Appends to @p batch the kernels of the next @p n
+       * observations, without creating Observation objects.
+       *
+       * Observations outside the region of interest, or dropped by the
+       * subsampling policy, are skipped. Returns the number of observations
+       * read from the input, which is zero once the input is exhausted.
+       * Kernels that the policy holds back until the end of the input are
+       * appended by the call that returns zero.
+       */
+      size_t readKernels(KernelBatch &batch, const size_t n);
   
       virtual Observation::Type type() const = 0;
 
@@ -56,9 +80,19 @@ namespace nuklei {
       { return undefined(); }
 
       virtual void addRegionOfInterest(boost::shared_ptr<RegionOfInterest> roi);
+
+      /**
+       * @brief Subsamples the input while it is read.
+       *
+       * The policy applies to readKernels() and readObservations(), after the
+       * region of interest. Most readers consult it before building a
+       * kernel, so that dropped observations are never materialized.
+       * readObservation() ignores it.
+       */
+      void setSubsamplingPolicy(boost::shared_ptr<SubsamplingPolicy> policy);
   
 
-      virtual void init() { registerType(*this); init_(); }
+      virtual void init();
       virtual void reset() = 0;
   
       class Counter
@@ -68,7 +102,7 @@ namespace nuklei {
         public:
           Counter() {}
         
-          void incLabel(const std::string &label);
+          void incLabel(const std::string &label, const unsigned n = 1);
           bool empty() const;
         
           //private:
@@ -78,16 +112,55 @@ namespace nuklei {
           list_t labels_;
         };
 
+      /**
+       * @brief Creates a reader for @p arg, detecting its format.
+       *
+       * The format returned by detectType() is tried first. If it is
+       * unknown or if its reader fails, all the formats are tried in turn.
+       */
       static std::auto_ptr<ObservationReader>
       createReader(const std::string& arg);
       static std::auto_ptr<ObservationReader>
       createReader(const std::string& arg, const Observation::Type t);
+      /**
+       * @brief Guesses the format of @p fileName from its first few
+       * kilobytes, and from its extension when the contents are ambiguous.
+       *
+       * Returns Observation::UNKNOWN if no format stands out. The guess is
+       * only a hint: the reader of that format may still reject the file.
+       */
+      static Observation::Type detectType(const std::string& fileName);
     protected:
       virtual std::auto_ptr<Observation> readObservation_() = 0;
       virtual void init_() = 0;
+      /**
+       * @brief Appends the kernels of up to @p n observations to @p batch,
+       * and returns their number.
+       *
+       * The default implementation goes through readObservation_(), and
+       * builds a kernel for every observation, including those that
+       * accepts() rejects. Readers that can build kernels directly
+       * override it, and only build the kernels of accepted observations.
+       */
+      virtual size_t readKernels_(KernelBatch &batch, const size_t n);
+      /**
+       * @brief Returns false if the observation at @p loc, of weight @p w,
+       * is outside the region of interest or dropped by the subsampling
+       * policy.
+       *
+       * Readers that override readKernels_() call it before building each
+       * kernel, in input order, and pass the kernels of accepted
+       * observations to keep().
+       */
+      bool accepts(const Vector3 &loc, const weight_t w);
+      void keep(std::auto_ptr<kernel::base> k, KernelBatch &batch);
       Counter oc;
     private:
       boost::shared_ptr<RegionOfInterest> roi_;
+      boost::shared_ptr<SubsamplingPolicy> policy_;
+      // Observations accepted by the region of interest during a call to
+      // readKernels().
+      size_t nInROI_;
     };
 
   std::ostream& operator<<(std::ostream &out, const ObservationReader::Counter &c);
@@ -120,6 +193,50 @@ namespace nuklei {
                                           KernelCollection &kc,
                                           const Observation::Type& t);
 
+  /** @brief A file read by readObservations(std::vector<ObservationFile>&). */
+  struct ObservationFile
+  {
+    ObservationFile(const std::string &fileName = "",
+                    const Observation::Type type = Observation::UNKNOWN) :
+      fileName(fileName), type(type) {}
+
+    std::string fileName;
+    /**
+     * @brief Format of the file, or Observation::UNKNOWN for automatic
+     * type detection. Set to the format that was read.
+     */
+    Observation::Type type;
+    boost::shared_ptr<RegionOfInterest> roi;
+    boost::shared_ptr<SubsamplingPolicy> policy;
+    /** @brief Kernels read from the file. */
+    ObservationReader::KernelBatch kernels;
+  };
+
+  /**
+   * @brief Reads @p files, each with its own reader.
+   *
+   * Files are read concurrently. If there are fewer files than OpenMP
+   * threads, each file is read by its own thread, and the remaining
+   * threads are split among the readers, which parse their file in a
+   * nested parallel region. The kernels of each file
+   * are stored in its @c kernels batch, from which
+   * KernelCollection::transfer() moves them without copying. If a file
+   * cannot be read, an ObservationIOError is thrown once all files have
+   * been processed.
+   *
+   * Policies are called from the thread that reads their file: a policy
+   * must not be shared by several files.
+   */
+  void readObservations(std::vector<ObservationFile> &files);
+  /**
+   * @brief Reads the files @p fileNames (with automatic type detection),
+   * and stores their data into @p kc, in the order of @p fileNames.
+   *
+   * See readObservations(std::vector<ObservationFile>&).
+   */
+  void readObservations(const std::vector<std::string> &fileNames,
+                        KernelCollection &kc);
+
   /**
    * @brief Reads a single observation from file @p s (with automatic type
    * detection), and returns it.
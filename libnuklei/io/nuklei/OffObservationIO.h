@@ -10,6 +10,7 @@
 
 #include <nuklei/Definitions.h>
 #include <nuklei/ObservationIO.h>
+#include <nuklei/AsciiParser.h>
 #include <nuklei/OffObservation.h>
 
 namespace nuklei {
@@ -23,15 +24,22 @@ namespace nuklei {
   
       Observation::Type type() const { return Observation::OFF; }
 
+      nullable<unsigned> nObservations() const
+      { NUKLEI_ASSERT(index_ >= 0); return unsigned(table_.rows()); }
+
       void reset();
   
     protected:
       void init_();
       std::auto_ptr<Observation> readObservation_();
+      size_t readKernels_(KernelBatch &batch, const size_t n);
     private:
-      std::ifstream in_;
+      std::auto_ptr<kernel::r3> nextKernel();
+
       std::string observationFileName;
-      int count_;
+      AsciiFile file_;
+      AsciiTable table_;
+      int index_;
     };
 
   
@@ -10,6 +10,7 @@
 
 #include <nuklei/Definitions.h>
 #include <nuklei/ObservationIO.h>
+#include <nuklei/AsciiParser.h>
 #include <nuklei/OsuTxtObservation.h>
 
 
@@ -29,8 +30,11 @@ namespace nuklei {
     protected:
       void init_();
       std::auto_ptr<Observation> readObservation_();
+      size_t readKernels_(KernelBatch &batch, const size_t n);
     private:
-      std::ifstream in_;
+      std::auto_ptr<kernel::r3> nextKernel();
+
+      AsciiFile file_;
       std::string geometryFileName;
       std::string appFileName;
       
@@ -38,10 +42,8 @@ namespace nuklei {
       unsigned columns_;
       unsigned currentIndex_;
       
-      std::vector<bool> flags_;
-      std::vector<coord_t> x_;
-      std::vector<coord_t> y_;
-      std::vector<coord_t> z_;
+      // Flags, then X, Y and Z coordinates, rows_*columns_ values each.
+      std::vector<coord_t> values_;
       std::vector<Vector3> rgb_;
     };
 
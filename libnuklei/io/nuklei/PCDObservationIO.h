@@ -8,43 +8,150 @@
 #define NUKLEI_PCDOBSERVATIONSERIAL_H
 
 
+#include <vector>
+
 #include <nuklei/Definitions.h>
 #include <nuklei/ObservationIO.h>
 #include <nuklei/PCDObservation.h>
 #include <nuklei/SerializedKernelObservationIO.h>
+#include <nuklei/AsciiParser.h>
 
 
 namespace nuklei {
 
 
-  class PCDReader : public KernelReader
+  /**
+   * @brief Layout of the points of a PCD file.
+   *
+   * Built from the header, it decodes the fields that Nuklei uses
+   * (position, normal, color) from a binary point record, in any order and
+   * with any scalar type. Colors are read from a packed @c rgb or @c rgba
+   * field, or from separate @c r, @c g, @c b fields. Other fields, and
+   * fields with a count other than 1, are skipped.
+   */
+  struct PCDFieldLayout
+  {
+    typedef enum { ASCII = 0, BINARY, BINARY_COMPRESSED } Format;
+    typedef enum { X = 0, Y, Z, NX, NY, NZ, RED, GREEN, BLUE, N_SLOTS } Slot;
+
+    PCDFieldLayout() : format(ASCII), nColumns(0), stride(0) {}
+
+    /**
+     * @brief Registers the next field.
+     *
+     * Throws ObservationIOError for unknown types.
+     */
+    void addField(const std::string &name, const char type,
+                  const unsigned size, const unsigned count);
+
+    bool has(const Slot first, const Slot last) const;
+    bool hasNormals() const { return has(NX, NZ); }
+    bool hasColors() const { return has(RED, BLUE); }
+
+    /**
+     * @brief Decodes point @p i of the binary data block @p data, which
+     * holds @p n points, into @p values, indexed by Slot.
+     *
+     * Colors are scaled to [0,1].
+     */
+    void decode(const char* data, const size_t i, const size_t n,
+                coord_t* values) const;
+
+    /**
+     * @brief Decodes the values of an ASCII line into @p values, indexed
+     * by Slot.
+     */
+    void decode(const coord_t* row, coord_t* values) const;
+
+    struct Field
+    {
+      char type;
+      unsigned size;
+      // Offset in a binary record, or number of preceding values per point
+      // in a compressed block.
+      unsigned offset;
+      // Index of the field in an ASCII line.
+      unsigned column;
+      Slot slot;
+      // The field holds the three colors, packed as 0x00RRGGBB.
+      bool packed;
+    };
+
+    Format format;
+    unsigned nColumns;
+    unsigned stride;
+    // Fields with a slot, in the order in which they appear.
+    std::vector<Field> used;
+  };
+
+
+  /**
+   * @brief Reads ASCII, binary and compressed PCD files.
+   *
+   * Points with normals (@c normal_x, @c normal_y, @c normal_z) are read as
+   * kernel::r3xs2p, other points as kernel::r3. Colors are stored in a
+   * ColorDescriptor. Points with a NaN coordinate are skipped. The file is
+   * memory-mapped, and the points are decoded in bulk during init().
+   *
+   * Binary data is expected in little-endian byte order.
+   */
+  class PCDReader : public ObservationReader
     {
     public:
       PCDReader(const std::string &observationFileName);
       ~PCDReader();
-  
+
       Observation::Type type() const { return Observation::PCD; }
+
+      nullable<unsigned> nObservations() const
+      { NUKLEI_ASSERT(index_ >= 0); return unsigned(n_); }
+
+      void reset();
+
     protected:
       void init_();
       std::auto_ptr<Observation> readObservation_();
+      size_t readKernels_(KernelBatch &batch, const size_t n);
+    private:
+      std::auto_ptr<kernel::base> nextKernel();
+
+      AsciiFile file_;
+      PCDFieldLayout layout_;
+      // Decoded points, PCDFieldLayout::N_SLOTS values per point.
+      std::vector<coord_t> points_;
+      int index_;
+      int n_;
+      std::string observationFileName_;
     };
 
+  /**
+   * @brief Writes PCD files.
+   *
+   * The fields follow the layout of PCL's point types: @c PointXYZ,
+   * @c PointXYZRGB, @c PointNormal or @c PointXYZRGBNormal. Normals are
+   * written if all kernels have a direction (r3xs2 and r3xs2p kernels), and
+   * colors if all kernels have a ColorDescriptor.
+   */
   class PCDWriter : public KernelWriter
   {
   public:
-    PCDWriter(const std::string &observationFileName);
+    typedef PCDFieldLayout::Format Format;
+
+    PCDWriter(const std::string &observationFileName,
+              const Format format = PCDFieldLayout::ASCII);
     ~PCDWriter();
-    
+
     Observation::Type type() const { return Observation::PCD; }
-    
+
     std::auto_ptr<Observation> templateObservation() const
     { return std::auto_ptr<Observation>(new PCDObservation); }
 
     void writeBuffer();
 
+  private:
+    Format format_;
   };
-  
+
 }
 
 #endif
-
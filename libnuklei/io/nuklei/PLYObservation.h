@@ -19,6 +19,7 @@
 #include <nuklei/Color.h>
 #include <nuklei/LinearAlgebra.h>
 #include <nuklei/Observation.h>
+#include <nuklei/member_clone_ptr.h>
 
 // See http://sampl.ece.ohio-state.edu/data/3DDB/RID/minolta/
 
@@ -34,18 +35,18 @@ namespace nuklei {
  
       std::auto_ptr<kernel::base> getKernel() const
       {
-        return k_.clone();
+        return k_->clone();
       }
  
       void setKernel(const kernel::base& k)
       {
         NUKLEI_TRACE_BEGIN();
-        k_ = dynamic_cast<const kernel::r3&>(k);
+        k_ = k;
         NUKLEI_TRACE_END();
       }
 
       PLYObservation();
-      PLYObservation(const kernel::r3& k);
+      PLYObservation(const kernel::base& k);
       ~PLYObservation() {};
     
       void setLoc(Vector3 loc);
@@ -58,7 +59,7 @@ namespace nuklei {
       const Color& getColor() const;
     
     private:
-      kernel::r3 k_;
+      member_clone_ptr<kernel::base> k_;
     };
 
 }
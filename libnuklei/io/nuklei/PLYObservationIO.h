@@ -10,12 +10,73 @@
 
 #include <nuklei/Definitions.h>
 #include <nuklei/ObservationIO.h>
+#include <nuklei/AsciiParser.h>
 #include <nuklei/PLYObservation.h>
 
 
 namespace nuklei {
 
 
+  /**
+   * @brief Layout of the vertex element of a PLY file.
+   *
+   * Built from the header, it decodes the properties that Nuklei uses
+   * (position, normal, color) from a binary vertex record, in any order and
+   * with any scalar type. Other properties are skipped.
+   */
+  struct PLYVertexLayout
+  {
+    typedef enum { ASCII = 0, BINARY_LITTLE_ENDIAN, BINARY_BIG_ENDIAN } Format;
+    typedef enum { INT8 = 0, UINT8, INT16, UINT16, INT32, UINT32,
+      FLOAT32, FLOAT64 } ScalarType;
+    typedef enum { X = 0, Y, Z, NX, NY, NZ, RED, GREEN, BLUE, N_SLOTS } Slot;
+
+    PLYVertexLayout() : format(ASCII), nProperties(0), stride(0) {}
+
+    /**
+     * @brief Registers the next vertex property.
+     *
+     * Throws ObservationIOError for unknown types.
+     */
+    void addProperty(const std::string &type, const std::string &name);
+
+    bool has(const Slot first, const Slot last) const;
+    bool hasNormals() const { return has(NX, NZ); }
+    bool hasColors() const { return has(RED, BLUE); }
+
+    /**
+     * @brief Decodes the vertex record at @p record into @p values, indexed
+     * by Slot.
+     *
+     * Colors stored as integers are scaled to [0,1].
+     */
+    void decode(const char* record, coord_t* values) const;
+
+    struct Property
+    {
+      ScalarType type;
+      unsigned offset;
+      // Index of the property in an ASCII line.
+      unsigned column;
+      Slot slot;
+    };
+
+    Format format;
+    unsigned nProperties;
+    unsigned stride;
+    // Properties with a slot, in the order in which they appear.
+    std::vector<Property> used;
+  };
+
+
+  /**
+   * @brief Reads the vertices of ASCII and binary PLY files.
+   *
+   * Vertices with normals (@c nx, @c ny, @c nz) are read as
+   * kernel::r3xs2p, other vertices as kernel::r3. Colors (@c red,
+   * @c green, @c blue) are stored in a ColorDescriptor. The vertex block is
+   * decoded in bulk during init().
+   */
   class PLYReader : public ObservationReader
     {
     public:
@@ -24,22 +85,42 @@ namespace nuklei {
   
       Observation::Type type() const { return Observation::PLY; }
 
+      nullable<unsigned> nObservations() const
+      { NUKLEI_ASSERT(index_ >= 0); return unsigned(n_); }
+
       void reset();
   
     protected:
       void init_();
       std::auto_ptr<Observation> readObservation_();
+      size_t readKernels_(KernelBatch &batch, const size_t n);
     private:
-      std::ifstream in_;
+      std::auto_ptr<kernel::base> nextKernel();
+
+      AsciiFile file_;
+      PLYVertexLayout layout_;
+      // Decoded vertices: x, y, z, followed by nx, ny, nz if the layout has
+      // normals, and by red, green, blue if it has colors.
+      std::vector<coord_t> vertices_;
       int index_;
       int n_;
       std::string observationFileName_;
     };
 
+  /**
+   * @brief Writes PLY files.
+   *
+   * Positions are always written. Normals are written if all kernels have
+   * a direction (r3xs2 and r3xs2p kernels), and colors if all kernels have a
+   * ColorDescriptor.
+   */
   class PLYWriter : public ObservationWriter
   {
   public:
-    PLYWriter(const std::string &observationFileName);
+    typedef PLYVertexLayout::Format Format;
+
+    PLYWriter(const std::string &observationFileName,
+              const Format format = PLYVertexLayout::ASCII);
     ~PLYWriter();
     
     Observation::Type type() const { return Observation::PLY; }
@@ -55,7 +136,12 @@ namespace nuklei {
     
   private:
     std::string observationFileName_;
+    Format format_;
     std::vector<Vector3> points_;
+    std::vector<Vector3> normals_;
+    std::vector<Vector3> colors_;
+    bool hasNormals_;
+    bool hasColors_;
   };
   
 }
@@ -0,0 +1,48 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_PACKEDOBSERVATION_H
+#define NUKLEI_PACKEDOBSERVATION_H
+
+
+#include <nuklei/Definitions.h>
+#include <nuklei/Color.h>
+#include <nuklei/LinearAlgebra.h>
+#include <nuklei/Observation.h>
+#include <nuklei/member_clone_ptr.h>
+
+
+namespace nuklei {
+
+  class PackedObservation : public Observation
+    {
+    public:
+
+      Type type() const { return PACKED; }
+
+      std::auto_ptr<kernel::base> getKernel() const
+      {
+        return k_->clone();
+      }
+ 
+      void setKernel(const kernel::base& k)
+      {
+        NUKLEI_TRACE_BEGIN();
+        k_ = k;
+        NUKLEI_TRACE_END();
+      }
+
+      PackedObservation();
+      PackedObservation(const kernel::base& k);
+      ~PackedObservation() {};
+          
+    private:
+      member_clone_ptr<kernel::base> k_;
+    };
+
+}
+
+#endif
@@ -0,0 +1,120 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_PACKEDOBSERVATIONIO_H
+#define NUKLEI_PACKEDOBSERVATIONIO_H
+
+
+#include <vector>
+#include <boost/cstdint.hpp>
+
+#include <nuklei/Definitions.h>
+#include <nuklei/BinaryObservationIO.h>
+#include <nuklei/PackedObservation.h>
+
+namespace nuklei {
+
+  /**
+   * @brief Layout of Nuklei's compact archival point-cloud format.
+   *
+   * Numbers are written in little-endian byte order. A file holds a header:
+   * - magic @c "NUKLEIPK" (8 bytes), #VERSION (u32), kernel type (u32),
+   *   kernel count (u64), block size (u32), flags (u32),
+   * - position quantization step, bounding box min and max (7 f64),
+   * - number of blocks (u64),
+   *
+   * followed by a table of blocks, each entry holding the offset, the
+   * compressed size and the decompressed size of a block (3 u64), and by
+   * the blocks. A block holds up to block size kernels, and is a zlib stream
+   * that can be decoded independently of the others. Decompressed, it
+   * holds:
+   * - positions: for each kernel and each axis, the difference between the
+   *   quantized position (an integer number of steps from the bounding box
+   *   min) and that of the previous kernel, zigzag- and varint-encoded,
+   * - orientations: directions of @c r3xs2 and @c r3xs2p kernels in
+   *   octahedral encoding (2 u16), quaternions of @c se3 kernels in
+   *   smallest-three encoding (index of the dropped component as a u8, and
+   *   3 u16),
+   * - location bandwidths, orientation bandwidths (except for @c r3 kernels)
+   *   and weights, each as run-length encoded f64 (varint number of runs,
+   *   then varint length and f64 value of each run),
+   * - colors, if #HAS_COLOR is set: 3 u8 per kernel.
+   */
+  struct PackedFileHeader
+  {
+    static const boost::uint32_t VERSION = 1;
+    static const char* magic() { return "NUKLEIPK"; }
+    static const unsigned MAGIC_SIZE = 8;
+    /** @brief Size of the header, in bytes. */
+    static const unsigned SIZE = 96;
+    /** @brief Size of an entry of the block table, in bytes. */
+    static const unsigned BLOCK_ENTRY_SIZE = 24;
+    static const boost::uint32_t HAS_COLOR = 1;
+
+    boost::uint32_t version;
+    boost::uint32_t kernelType;
+    boost::uint64_t count;
+    boost::uint32_t blockSize;
+    boost::uint32_t flags;
+    coord_t step;
+    coord_t bboxMin[3];
+    coord_t bboxMax[3];
+    boost::uint64_t nBlocks;
+  };
+
+  /**
+   * @brief Reads Nuklei's compact archival format.
+   *
+   * Blocks are decompressed and decoded in parallel during init(), into
+   * the field arrays that BinaryReader builds kernels from.
+   */
+  class PackedReader : public BinaryReader
+    {
+    public:
+      PackedReader(const std::string &observationFileName);
+      ~PackedReader();
+
+      Observation::Type type() const { return Observation::PACKED; }
+
+    protected:
+      void init_();
+      std::auto_ptr<Observation> readObservation_();
+
+    private:
+      std::vector<coord_t> data_[BinaryFileHeader::N_FIELDS];
+    };
+
+  /**
+   * @brief Writes Nuklei's compact archival format.
+   *
+   * Positions are quantized so that the error on each coordinate does not
+   * exceed @p tolerance times the largest side of the bounding box.
+   * Directions and quaternions are stored with a precision of about
+   * @f$ 10^{-4} @f$ radians, and colors with 8 bits per channel. Bandwidths
+   * and weights are stored exactly. Blocks are encoded and compressed in
+   * parallel.
+   */
+  class PackedWriter : public BinaryWriter
+    {
+    public:
+      PackedWriter(const std::string &observationFileName,
+                   const coord_t tolerance = PACKED_POSITION_TOLERANCE);
+      ~PackedWriter();
+
+      Observation::Type type() const { return Observation::PACKED; }
+
+      std::auto_ptr<Observation> templateObservation() const
+      { return std::auto_ptr<Observation>(new PackedObservation); }
+
+      void writeBuffer();
+
+    private:
+      coord_t tolerance_;
+    };
+
+}
+
+#endif
@@ -25,16 +25,19 @@ namespace nuklei {
       Observation::Type type() const { return Observation::SERIAL; }
 
       nullable<unsigned> nObservations() const
-      { NUKLEI_ASSERT(idx_ >= 0); return kc_.size(); }
+      { NUKLEI_ASSERT(idx_ >= 0); return idx_ + kernels_.size(); }
 
       void reset();
   
     protected:
       void init_();
       std::auto_ptr<Observation> readObservation_();
+      size_t readKernels_(KernelBatch &batch, const size_t n);
       std::string observationFileName_;
       int idx_;
-      KernelCollection kc_;
+      // Kernels not read yet, in reverse order, so that the next one can
+      // be popped from the back without copying it.
+      KernelBatch kernels_;
     };
 
   class KernelWriter : public ObservationWriter
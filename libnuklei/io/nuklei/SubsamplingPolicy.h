@@ -0,0 +1,113 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_SUBSAMPLINGPOLICY_H
+#define NUKLEI_SUBSAMPLINGPOLICY_H
+
+
+#include <set>
+#include <vector>
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
+#include <nuklei/Definitions.h>
+#include <nuklei/ObservationIO.h>
+
+namespace nuklei {
+
+  /**
+   * @brief Selects the points a reader keeps, while the input is parsed.
+   *
+   * Readers call offer() with the location and weight of each point, in
+   * input order, before building its kernel. Kernels are only built for
+   * points that offer() accepts, and are handed to keep(). See
+   * ObservationReader::setSubsamplingPolicy().
+   */
+  class SubsamplingPolicy : boost::noncopyable
+  {
+  public:
+    typedef ObservationReader::KernelBatch KernelBatch;
+
+    virtual ~SubsamplingPolicy() {}
+
+    /** @brief Returns false if the point is dropped. */
+    virtual bool offer(const Vector3 &loc, const weight_t w) = 0;
+
+    /**
+     * @brief Takes the kernel of the point last accepted by offer().
+     *
+     * The default implementation appends it to @p batch. Policies that
+     * can only decide once the input is exhausted hold it until flush().
+     */
+    virtual void keep(std::auto_ptr<kernel::base> k, KernelBatch &batch)
+    { batch.push_back(k.release()); }
+
+    /** @brief Appends the kernels held back by keep() to @p batch. */
+    virtual void flush(KernelBatch &batch) {}
+
+    /** @brief Forgets the points seen so far. */
+    virtual void reset() {}
+  };
+
+  /**
+   * @brief Keeps @p n points, drawn without replacement with a probability
+   * proportional to their weight.
+   *
+   * Uses the weighted reservoir sampling of Efraimidis and Spirakis: each
+   * point gets the key @f$ u^{1/w} @f$, with @f$ u @f$ uniform in
+   * @f$ (0,1] @f$, and the @p n points with the largest keys are kept.
+   * Kernels are built only for the points that enter the reservoir, and
+   * are returned in input order by flush(). Points of null weight are
+   * dropped.
+   */
+  class WeightedReservoirSampling : public SubsamplingPolicy
+  {
+  public:
+    WeightedReservoirSampling(const unsigned n);
+    ~WeightedReservoirSampling();
+
+    bool offer(const Vector3 &loc, const weight_t w);
+    void keep(std::auto_ptr<kernel::base> k, KernelBatch &batch);
+    void flush(KernelBatch &batch);
+    void reset();
+
+  private:
+    struct Entry
+    {
+      coord_t key;
+      unsigned long index;
+      kernel::base* kernel;
+      bool operator<(const Entry &e) const { return key > e.key; }
+    };
+
+    const unsigned n_;
+    unsigned long index_;
+    coord_t key_;
+    // Min-heap on the keys (see Entry::operator<).
+    std::vector<Entry> reservoir_;
+  };
+
+  /**
+   * @brief Keeps the first point of each cubic voxel of side @p stride.
+   */
+  class VoxelSubsampling : public SubsamplingPolicy
+  {
+  public:
+    VoxelSubsampling(const coord_t stride);
+
+    bool offer(const Vector3 &loc, const weight_t w);
+    void reset() { voxels_.clear(); }
+
+  private:
+    typedef boost::tuple<long, long, long> Voxel;
+
+    const coord_t stride_;
+    std::set<Voxel> voxels_;
+  };
+
+}
+
+#endif
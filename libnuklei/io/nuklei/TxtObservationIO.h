@@ -10,6 +10,7 @@
 
 #include <nuklei/Definitions.h>
 #include <nuklei/ObservationIO.h>
+#include <nuklei/AsciiParser.h>
 #include <nuklei/TxtObservation.h>
 #include <nuklei/KernelCollection.h>
 
@@ -24,14 +25,23 @@ namespace nuklei {
   
       Observation::Type type() const { return Observation::TXT; }
 
+      nullable<unsigned> nObservations() const
+      { NUKLEI_ASSERT(row_ >= 0); return unsigned(table_.rows()); }
+
       void reset();
   
     protected:
       void init_();
       std::auto_ptr<Observation> readObservation_();
+      size_t readKernels_(KernelBatch &batch, const size_t n);
     private:
-      std::ifstream in_;
+      std::auto_ptr<kernel::base> nextKernel();
+
       std::string observationFileName;
+      AsciiFile file_;
+      AsciiTable table_;
+      int row_;
+      size_t value_;
     };
 
   
@@ -0,0 +1,135 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_XMLPULLPARSER_H
+#define NUKLEI_XMLPULLPARSER_H
+
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <boost/utility.hpp>
+
+#include <nuklei/Definitions.h>
+
+namespace nuklei {
+
+  /**
+   * @brief Streaming XML parser.
+   *
+   * The file is read through a fixed-size window, which only grows if a
+   * single tag or text node does not fit in it. Memory use is thus
+   * independent of the size of the document.
+   *
+   * The parser is driven by next(), which returns the next start or end
+   * tag. Self-closing elements produce a start and an end event. The text
+   * of an element is read with readText() or readNumbers(), right after its
+   * start event. Text that is not read this way, comments, processing
+   * instructions and DTDs are skipped.
+   *
+   * Malformed documents throw ObservationIOError, which lets readers
+   * reject files of other formats.
+   */
+  class XmlPullParser : boost::noncopyable
+  {
+  public:
+    typedef enum { START_ELEMENT, END_ELEMENT, END_DOCUMENT } Event;
+
+    XmlPullParser();
+
+    /**
+     * @brief Opens @p fileName and places the parser before its root
+     * element.
+     */
+    void open(const std::string &fileName);
+    void close();
+    bool isOpen() const { return in_.is_open(); }
+
+    /** @brief Moves to the next start or end tag. */
+    Event next();
+
+    /** @brief Name of the element of the last start or end event. */
+    const std::string& name() const { return names_.at(current_); }
+    /**
+     * @brief Name of the element that contains the element of the last
+     * start event, or an empty string for the root element.
+     */
+    const std::string& parentName() const;
+    /** @brief Number of open elements. */
+    unsigned depth() const { return depth_; }
+
+    /**
+     * @brief Looks up an attribute of the element of the last start
+     * event. Returns false if the element does not have it.
+     */
+    bool attribute(const std::string &name, std::string &value) const;
+    /**
+     * @brief Returns a numeric attribute of the element of the last
+     * start event. Throws ObservationIOError if it is missing or not a
+     * number.
+     */
+    coord_t numericAttribute(const std::string &name) const;
+
+    /**
+     * @brief Reads the text of the element of the last start event, up to
+     * and including its end tag.
+     *
+     * Throws ObservationIOError if the element has child elements.
+     */
+    void readText(std::string &text);
+
+    /**
+     * @brief Reads exactly @p n whitespace-separated numbers from the text
+     * of the element of the last start event, up to and including its end
+     * tag.
+     */
+    void readNumbers(coord_t* values, const unsigned n);
+    coord_t readNumber()
+    { coord_t v; readNumbers(&v, 1); return v; }
+
+    /**
+     * @brief Skips the content of the element of the last start event, up
+     * to and including its end tag.
+     */
+    void skipElement();
+
+  private:
+    typedef std::pair<std::string, std::string> Attribute;
+
+    static const size_t npos = size_t(-1);
+
+    bool fill();
+    size_t find(const char* s, const size_t length, size_t from);
+    size_t findTagEnd();
+    void skipUntil(const char* s, const size_t length, const size_t from);
+    void skipDeclaration();
+    void parseStartTag(const char* b, const char* e);
+    void parseEndTag(const char* b, const char* e);
+    void appendDecoded(std::string &out, const char* b, const char* e) const;
+    size_t offset() const { return consumed_ + begin_; }
+    void error(const std::string &msg) const;
+
+    std::string fileName_;
+    std::ifstream in_;
+    std::vector<char> buffer_;
+    size_t begin_;
+    size_t end_;
+    size_t consumed_;
+    bool eof_;
+
+    std::vector<std::string> names_;
+    unsigned depth_;
+    unsigned current_;
+    bool pendingEnd_;
+    bool rootSeen_;
+    std::vector<Attribute> attributes_;
+    unsigned nAttributes_;
+    std::string text_;
+  };
+
+}
+
+#endif
@@ -24,7 +24,7 @@ namespace nuklei {
   const int KernelCollection::KDTREE_KEY        = 1;
   const int KernelCollection::NSTREE_KEY        = 2;
   const int KernelCollection::MESH_KEY          = 3;
-  const int KernelCollection::AABBTREE_KEY      = 4;
+  const int KernelCollection::BVH_KEY           = 4;
   const int KernelCollection::VIEWCACHE_KEY     = 5;
   
   std::istream& operator>>(std::istream &in, KernelCollection &v)
@@ -81,6 +81,27 @@ namespace nuklei {
     NUKLEI_TRACE_END();
   }
   
+  void KernelCollection::transfer(Container &batch)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (batch.empty()) return;
+    invalidateHelperStructures();
+    if (size() == 0)
+      kernelType_ = batch.front().polyType();
+    for (const_iterator i = batch.begin(); i != batch.end(); ++i)
+      NUKLEI_ASSERT(*kernelType_ == i->polyType());
+    kernels_.transfer(kernels_.end(), batch);
+    NUKLEI_TRACE_END();
+  }
+
+  void KernelCollection::release(Container &batch)
+  {
+    NUKLEI_TRACE_BEGIN();
+    batch.transfer(batch.end(), kernels_);
+    clear();
+    NUKLEI_TRACE_END();
+  }
+
   void KernelCollection::replace(const size_t idx, const kernel::base &k)
   {
     NUKLEI_TRACE_BEGIN();
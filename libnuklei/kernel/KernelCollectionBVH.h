@@ -0,0 +1,337 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_KERNEL_COLLECTION_BVH_H
+#define NUKLEI_KERNEL_COLLECTION_BVH_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <iostream>
+#include <boost/utility.hpp>
+#include <boost/cstdint.hpp>
+
+#include <nuklei/Common.h>
+#include <nuklei/LinearAlgebra.h>
+
+#include "KernelCollectionDepthBuffer.h"
+
+namespace nuklei
+{
+
+  /**
+   * Bounding volume hierarchy over the triangles of a mesh.
+   *
+   * Nodes are stored in a flat array in depth-first order: the left child of
+   * an inner node immediately follows its parent, and the node records the
+   * index of its right child. Leaf triangles are stored contiguously in the
+   * order in which leaves are visited, in a form ready for ray-triangle
+   * intersection.
+   *
+   * The only query is an any-hit segment test, which stops at the first
+   * triangle found.
+   */
+  class MeshBVH : boost::noncopyable
+  {
+  public:
+    typedef DepthBuffer::Triangle Triangle;
+
+    MeshBVH() {}
+
+    explicit MeshBVH(const std::vector<Triangle>& triangles) :
+      triangles_(triangles)
+    {
+      std::vector<int> order(triangles_.size());
+      for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
+      std::vector<Vector3> centroids;
+      centroids.reserve(triangles_.size());
+      for (std::vector<Triangle>::const_iterator t = triangles_.begin();
+           t != triangles_.end(); ++t)
+        centroids.push_back((t->v[0] + t->v[1] + t->v[2]) / 3);
+      if (!order.empty())
+        build(order, centroids, 0, order.size());
+    }
+
+    /** @brief Mesh triangles, in the order given to the constructor. */
+    const std::vector<Triangle>& triangles() const { return triangles_; }
+
+    /**
+     * @brief Returns true if the segment that goes from @p from to
+     * @f$ from + tmax (to - from) @f$ intersects a triangle.
+     */
+    bool intersects(const Vector3& from, const Vector3& to,
+                    const coord_t tmax) const
+    {
+      if (nodes_.empty() || tmax < 0) return false;
+
+      coord_t o[3] = { from.X(), from.Y(), from.Z() };
+      coord_t d[3] = { to.X()-from.X(), to.Y()-from.Y(), to.Z()-from.Z() };
+      coord_t inv[3];
+      for (int k = 0; k < 3; ++k)
+        inv[k] = (d[k] == 0) ? std::numeric_limits<coord_t>::max() : 1 / d[k];
+
+      int stack[MAX_DEPTH];
+      int top = 0;
+      stack[top++] = 0;
+      while (top > 0)
+      {
+        const Node& node = nodes_[stack[--top]];
+        if (!hitsBox(node, o, inv, tmax)) continue;
+        if (node.count > 0)
+        {
+          for (int i = node.offset; i < node.offset + node.count; ++i)
+            if (hitsTriangle(leafTriangles_[i], o, d, tmax))
+              return true;
+        }
+        else
+        {
+          int self = &node - &nodes_.front();
+          stack[top++] = node.offset;
+          stack[top++] = self + 1;
+        }
+      }
+      return false;
+    }
+
+    /** @brief Writes the triangles and the hierarchy in binary form. */
+    void write(std::ostream& out) const
+    {
+      writeVector(out, triangles_);
+      writeVector(out, nodes_);
+      writeVector(out, leafTriangles_);
+      if (!out)
+        NUKLEI_THROW("Error writing BVH.");
+    }
+
+    /**
+     * @brief Replaces this hierarchy with one written by write(), without
+     * rebuilding it.
+     *
+     * Throws if the stream is truncated, or if the hierarchy it contains
+     * is not one that intersects() can traverse safely.
+     */
+    void read(std::istream& in)
+    {
+      readVector(in, triangles_);
+      readVector(in, nodes_);
+      readVector(in, leafTriangles_);
+      try {
+        check();
+      } catch (...) {
+        triangles_.clear();
+        nodes_.clear();
+        leafTriangles_.clear();
+        throw;
+      }
+    }
+
+  private:
+    static const int LEAF_SIZE = 4;
+    static const int MAX_DEPTH = 128;
+
+    // The element types below are plain arrays of coord_t and ints, and are
+    // written as raw bytes.
+    template<typename T>
+    static void writeVector(std::ostream& out, const std::vector<T>& v)
+    {
+      boost::uint64_t n = v.size();
+      out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+      if (n > 0)
+        out.write(reinterpret_cast<const char*>(&v.front()), n*sizeof(T));
+    }
+
+    template<typename T>
+    static void readVector(std::istream& in, std::vector<T>& v)
+    {
+      boost::uint64_t n = 0;
+      in.read(reinterpret_cast<char*>(&n), sizeof(n));
+      if (!in) NUKLEI_THROW("Truncated BVH.");
+      // Bound n by what is left in the stream before allocating.
+      std::streampos here = in.tellg();
+      in.seekg(0, std::ios::end);
+      std::streampos end = in.tellg();
+      in.seekg(here);
+      if (!in || here < 0 || end < here)
+        NUKLEI_THROW("Cannot determine the size of the BVH.");
+      if (n > boost::uint64_t(end - here) / sizeof(T))
+        NUKLEI_THROW("Truncated BVH.");
+      v.resize(n);
+      if (n > 0)
+        in.read(reinterpret_cast<char*>(&v.front()), n*sizeof(T));
+      if (!in) NUKLEI_THROW("Truncated BVH.");
+    }
+
+    // Checks that every child index and leaf range is within bounds, that
+    // children follow their parent (which excludes cycles), and that the
+    // tree is shallow enough for the traversal stack of intersects().
+    void check() const
+    {
+      if (nodes_.size() > std::size_t(std::numeric_limits<int>::max()) ||
+          leafTriangles_.size() > std::size_t(std::numeric_limits<int>::max()))
+        NUKLEI_THROW("BVH too large.");
+      const int nNodes = nodes_.size();
+      const int nLeafTriangles = leafTriangles_.size();
+      std::vector<int> depth(nNodes, 0);
+      for (int i = 0; i < nNodes; ++i)
+      {
+        const Node& node = nodes_[i];
+        if (node.count > 0)
+        {
+          if (node.offset < 0 || node.offset > nLeafTriangles - node.count)
+            NUKLEI_THROW("Invalid leaf range in BVH.");
+        }
+        else
+        {
+          if (node.count < 0 || node.offset <= i + 1 ||
+              node.offset >= nNodes)
+            NUKLEI_THROW("Invalid child index in BVH.");
+          if (depth[i] + 1 >= MAX_DEPTH - 1)
+            NUKLEI_THROW("BVH too deep.");
+          depth[i+1] = std::max(depth[i+1], depth[i] + 1);
+          depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+        }
+      }
+    }
+
+    struct Node
+    {
+      coord_t lo[3], hi[3];
+      // Leaf: index of the first triangle in leafTriangles_.
+      // Inner node: index of the right child.
+      int offset;
+      // Number of triangles for a leaf, 0 for an inner node.
+      int count;
+    };
+
+    struct LeafTriangle
+    {
+      coord_t v0[3], e1[3], e2[3];
+    };
+
+    // Slab test, branch-free over the three axes.
+    static bool hitsBox(const Node& n, const coord_t o[3],
+                        const coord_t inv[3], const coord_t tmax)
+    {
+      coord_t tnear = 0, tfar = tmax;
+      for (int k = 0; k < 3; ++k)
+      {
+        coord_t t0 = (n.lo[k] - o[k]) * inv[k];
+        coord_t t1 = (n.hi[k] - o[k]) * inv[k];
+        tnear = std::max(tnear, std::min(t0, t1));
+        tfar = std::min(tfar, std::max(t0, t1));
+      }
+      return tnear <= tfar;
+    }
+
+    // Moller-Trumbore.
+    static bool hitsTriangle(const LeafTriangle& t, const coord_t o[3],
+                             const coord_t d[3], const coord_t tmax)
+    {
+      coord_t p[3] = { d[1]*t.e2[2] - d[2]*t.e2[1],
+                       d[2]*t.e2[0] - d[0]*t.e2[2],
+                       d[0]*t.e2[1] - d[1]*t.e2[0] };
+      coord_t det = t.e1[0]*p[0] + t.e1[1]*p[1] + t.e1[2]*p[2];
+      if (std::fabs(det) < FLOATTOL) return false;
+      coord_t invDet = 1 / det;
+      coord_t s[3] = { o[0]-t.v0[0], o[1]-t.v0[1], o[2]-t.v0[2] };
+      coord_t u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) * invDet;
+      if (u < 0 || u > 1) return false;
+      coord_t q[3] = { s[1]*t.e1[2] - s[2]*t.e1[1],
+                       s[2]*t.e1[0] - s[0]*t.e1[2],
+                       s[0]*t.e1[1] - s[1]*t.e1[0] };
+      coord_t v = (d[0]*q[0] + d[1]*q[1] + d[2]*q[2]) * invDet;
+      if (v < 0 || u + v > 1) return false;
+      coord_t tt = (t.e2[0]*q[0] + t.e2[1]*q[1] + t.e2[2]*q[2]) * invDet;
+      return tt >= 0 && tt <= tmax;
+    }
+
+    // Builds the subtree of triangles order[begin..end), and returns the
+    // index of its root.
+    int build(std::vector<int>& order, const std::vector<Vector3>& centroids,
+              const int begin, const int end, const int depth = 0)
+    {
+      int index = nodes_.size();
+      nodes_.push_back(Node());
+      {
+        Node& node = nodes_.back();
+        for (int k = 0; k < 3; ++k)
+        {
+          node.lo[k] = std::numeric_limits<coord_t>::max();
+          node.hi[k] = -std::numeric_limits<coord_t>::max();
+        }
+        for (int i = begin; i < end; ++i)
+          for (int j = 0; j < 3; ++j)
+            for (int k = 0; k < 3; ++k)
+            {
+              node.lo[k] = std::min(node.lo[k], triangles_[order[i]].v[j][k]);
+              node.hi[k] = std::max(node.hi[k], triangles_[order[i]].v[j][k]);
+            }
+      }
+
+      // Split on the longest axis of the centroid bounds.
+      Vector3 clo = centroids[order[begin]], chi = clo;
+      for (int i = begin; i < end; ++i)
+        for (int k = 0; k < 3; ++k)
+        {
+          clo[k] = std::min(clo[k], centroids[order[i]][k]);
+          chi[k] = std::max(chi[k], centroids[order[i]][k]);
+        }
+      int axis = 0;
+      for (int k = 1; k < 3; ++k)
+        if (chi[k] - clo[k] > chi[axis] - clo[axis]) axis = k;
+
+      if (end - begin <= LEAF_SIZE || chi[axis] - clo[axis] <= 0 ||
+          depth >= MAX_DEPTH - 2)
+      {
+        nodes_[index].offset = leafTriangles_.size();
+        nodes_[index].count = end - begin;
+        for (int i = begin; i < end; ++i)
+          leafTriangles_.push_back(leafTriangle(triangles_[order[i]]));
+        return index;
+      }
+
+      int mid = (begin + end) / 2;
+      std::nth_element(order.begin() + begin, order.begin() + mid,
+                       order.begin() + end, CentroidLess(centroids, axis));
+
+      build(order, centroids, begin, mid, depth + 1);
+      int right = build(order, centroids, mid, end, depth + 1);
+      nodes_[index].offset = right;
+      nodes_[index].count = 0;
+      return index;
+    }
+
+    struct CentroidLess
+    {
+      CentroidLess(const std::vector<Vector3>& c, const int axis) :
+        c_(c), axis_(axis) {}
+      bool operator()(const int a, const int b) const
+      { return c_[a][axis_] < c_[b][axis_]; }
+    private:
+      const std::vector<Vector3>& c_;
+      int axis_;
+    };
+
+    static LeafTriangle leafTriangle(const Triangle& t)
+    {
+      LeafTriangle l;
+      for (int k = 0; k < 3; ++k)
+      {
+        l.v0[k] = t.v[0][k];
+        l.e1[k] = t.v[1][k] - t.v[0][k];
+        l.e2[k] = t.v[2][k] - t.v[0][k];
+      }
+      return l;
+    }
+
+    std::vector<Triangle> triangles_;
+    std::vector<Node> nodes_;
+    std::vector<LeafTriangle> leafTriangles_;
+  };
+
+}
+
+#endif
@@ -0,0 +1,220 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_KERNEL_COLLECTION_DEPTH_BUFFER_H
+#define NUKLEI_KERNEL_COLLECTION_DEPTH_BUFFER_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <boost/utility.hpp>
+
+#include <nuklei/Common.h>
+#include <nuklei/LinearAlgebra.h>
+
+namespace nuklei
+{
+
+  /**
+   * Software depth buffer of a triangle mesh, seen by a pinhole camera.
+   *
+   * The buffer stores, for each pixel, the depth (distance along the
+   * optical axis) of the closest triangle. Rendering is split into bands of
+   * rows, which are rasterized in parallel. Triangles that cross the plane
+   * of the camera are ignored, so the camera should lie outside the mesh.
+   */
+  class DepthBuffer : boost::noncopyable
+  {
+  public:
+    struct Triangle
+    {
+      Vector3 v[3];
+    };
+
+    /**
+     * @param viewpoint Camera position.
+     * @param forward Optical axis.
+     * @param tanHalfFov Tangent of half the (square) field of view.
+     * @param resolution Width and height of the buffer, in pixels.
+     */
+    DepthBuffer(const Vector3& viewpoint,
+                const Vector3& forward,
+                const coord_t tanHalfFov,
+                const unsigned resolution) :
+      viewpoint_(viewpoint), tanHalfFov_(tanHalfFov),
+      resolution_(resolution),
+      depth_(resolution*resolution, std::numeric_limits<coord_t>::infinity())
+    {
+      NUKLEI_ASSERT(resolution_ > 0 && tanHalfFov_ > 0);
+      forward_ = la::normalized(forward);
+      Vector3 up = Vector3::UNIT_Z;
+      if (std::fabs(forward_.Dot(up)) > .9) up = Vector3::UNIT_X;
+      right_ = la::normalized(forward_.Cross(up));
+      up_ = right_.Cross(forward_);
+    }
+
+    void render(const std::vector<Triangle>& triangles)
+    {
+      std::fill(depth_.begin(), depth_.end(),
+                std::numeric_limits<coord_t>::infinity());
+
+      const int n = triangles.size();
+      std::vector<Projected> projected(n);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+      for (int t = 0; t < n; ++t)
+        projected[t] = project(triangles[t]);
+
+      const int bandHeight = 16;
+      const int nBands = (resolution_ + bandHeight - 1) / bandHeight;
+      std::vector< std::vector<int> > bands(nBands);
+      for (int t = 0; t < n; ++t)
+      {
+        const Projected& p = projected[t];
+        if (!p.valid) continue;
+        for (int b = p.ymin / bandHeight; b <= p.ymax / bandHeight; ++b)
+          bands[b].push_back(t);
+      }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+      for (int b = 0; b < nBands; ++b)
+      {
+        int y0 = b * bandHeight;
+        int y1 = std::min(y0 + bandHeight, int(resolution_)) - 1;
+        for (std::vector<int>::const_iterator t = bands[b].begin();
+             t != bands[b].end(); ++t)
+          rasterize(projected[*t], y0, y1);
+      }
+    }
+
+    /**
+     * @brief Returns true if @p p is within @p tolerance of the closest
+     * surface along the ray that links the camera to @p p, or if @p p is
+     * not in the field of view.
+     *
+     * As in KernelCollection::isVisibleFrom(), @p tolerance is measured
+     * along the ray.
+     */
+    bool isVisible(const Vector3& p, const coord_t tolerance) const
+    {
+      coord_t x, y, z;
+      if (!toPixel(p, x, y, z)) return true;
+      int px = int(x), py = int(y);
+      if (px < 0 || py < 0 || px >= int(resolution_) || py >= int(resolution_))
+        return true;
+      coord_t d = depth_[py*resolution_ + px];
+      if (d == std::numeric_limits<coord_t>::infinity()) return true;
+      // Convert the depth difference to a distance along the ray.
+      return (z - d) * (p - viewpoint_).Length() / z < tolerance;
+    }
+
+    /**
+     * @brief Returns the tangent of the smallest half field of view, seen
+     * from @p viewpoint along @p forward, that contains @p points, or a
+     * negative number if one of the points is behind the camera.
+     */
+    static coord_t tanHalfFovOf(const std::vector<Vector3>& points,
+                                const Vector3& viewpoint,
+                                const Vector3& forward)
+    {
+      DepthBuffer frame(viewpoint, forward, 1, 1);
+      coord_t t = 0;
+      for (std::vector<Vector3>::const_iterator i = points.begin();
+           i != points.end(); ++i)
+      {
+        Vector3 c = frame.toCamera(*i);
+        if (c.Z() <= 0) return -1;
+        t = std::max(t, std::max(std::fabs(c.X()), std::fabs(c.Y())) / c.Z());
+      }
+      return t;
+    }
+
+  private:
+    struct Projected
+    {
+      Projected() : valid(false) {}
+      coord_t x[3], y[3], invZ[3];
+      int xmin, xmax, ymin, ymax;
+      bool valid;
+    };
+
+    Vector3 toCamera(const Vector3& p) const
+    {
+      Vector3 d = p - viewpoint_;
+      return Vector3(d.Dot(right_), d.Dot(up_), d.Dot(forward_));
+    }
+
+    bool toPixel(const Vector3& p, coord_t& x, coord_t& y, coord_t& z) const
+    {
+      Vector3 c = toCamera(p);
+      z = c.Z();
+      if (z <= 0) return false;
+      x = (c.X() / z / tanHalfFov_ + 1) * resolution_ / 2;
+      y = (c.Y() / z / tanHalfFov_ + 1) * resolution_ / 2;
+      return true;
+    }
+
+    Projected project(const Triangle& t) const
+    {
+      Projected p;
+      for (int i = 0; i < 3; ++i)
+      {
+        coord_t z;
+        if (!toPixel(t.v[i], p.x[i], p.y[i], z)) return p;
+        p.invZ[i] = 1 / z;
+      }
+      int last = resolution_ - 1;
+      p.xmin = std::max(0, int(std::floor(*std::min_element(p.x, p.x+3))));
+      p.xmax = std::min(last, int(std::ceil(*std::max_element(p.x, p.x+3))));
+      p.ymin = std::max(0, int(std::floor(*std::min_element(p.y, p.y+3))));
+      p.ymax = std::min(last, int(std::ceil(*std::max_element(p.y, p.y+3))));
+      p.valid = p.xmin <= p.xmax && p.ymin <= p.ymax;
+      return p;
+    }
+
+    static coord_t edge(const coord_t ax, const coord_t ay,
+                        const coord_t bx, const coord_t by,
+                        const coord_t px, const coord_t py)
+    {
+      return (bx - ax) * (py - ay) - (by - ay) * (px - ax);
+    }
+
+    // Rasterizes rows y0 to y1 (inclusive) of triangle t.
+    void rasterize(const Projected& t, const int y0, const int y1)
+    {
+      coord_t area = edge(t.x[0], t.y[0], t.x[1], t.y[1], t.x[2], t.y[2]);
+      if (std::fabs(area) < FLOATTOL) return;
+      for (int py = std::max(y0, t.ymin); py <= std::min(y1, t.ymax); ++py)
+      {
+        coord_t cy = py + .5;
+        for (int px = t.xmin; px <= t.xmax; ++px)
+        {
+          coord_t cx = px + .5;
+          coord_t w0 = edge(t.x[1], t.y[1], t.x[2], t.y[2], cx, cy) / area;
+          coord_t w1 = edge(t.x[2], t.y[2], t.x[0], t.y[0], cx, cy) / area;
+          coord_t w2 = 1 - w0 - w1;
+          if (w0 < 0 || w1 < 0 || w2 < 0) continue;
+          // Perspective-correct depth: 1/z is affine in screen space.
+          coord_t z = 1 / (w0*t.invZ[0] + w1*t.invZ[1] + w2*t.invZ[2]);
+          coord_t& d = depth_[py*resolution_ + px];
+          if (z < d) d = z;
+        }
+      }
+    }
+
+    Vector3 viewpoint_;
+    Vector3 forward_, right_, up_;
+    coord_t tanHalfFov_;
+    unsigned resolution_;
+    std::vector<coord_t> depth_;
+  };
+
+}
+
+#endif
@@ -0,0 +1,60 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_KERNEL_COLLECTION_HASH_H
+#define NUKLEI_KERNEL_COLLECTION_HASH_H
+
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <boost/cstdint.hpp>
+
+#include <nuklei/LinearAlgebra.h>
+
+namespace nuklei
+{
+
+  // 64-bit FNV-1a, used to key on-disk caches on the data they derive from.
+  namespace hash_types
+  {
+    
+    const boost::uint64_t FNV_OFFSET = 14695981039346656037ULL;
+    const boost::uint64_t FNV_PRIME = 1099511628211ULL;
+    
+    inline void hashBytes(boost::uint64_t& h, const void* data, const size_t n)
+    {
+      const unsigned char* p = static_cast<const unsigned char*>(data);
+      for (size_t i = 0; i < n; ++i)
+      {
+        h ^= p[i];
+        h *= FNV_PRIME;
+      }
+    }
+    
+    template<typename T>
+    inline void hashValue(boost::uint64_t& h, const T& v)
+    {
+      hashBytes(h, &v, sizeof(T));
+    }
+    
+    inline void hashVector(boost::uint64_t& h, const Vector3& v)
+    {
+      for (int i = 0; i < 3; ++i)
+        hashValue(h, double(v[i]));
+    }
+    
+    inline std::string toHex(const boost::uint64_t h)
+    {
+      std::ostringstream oss;
+      oss << std::hex << std::setw(16) << std::setfill('0') << h;
+      return oss.str();
+    }
+    
+  }
+
+}
+
+#endif
@@ -8,63 +8,8 @@
 
 #include <nuklei/KernelCollection.h>
 
-#include "nanoflann.hpp"
-
 namespace nuklei {
   
-  namespace nanoflann_types
-  {
-    
-    struct PointCloud
-    {
-      typedef double T;
-      struct Point
-      {
-        Point(T x, T y, T z) : x(x), y(y), z(z) {}
-        T  x,y,z;
-      };
-      
-      std::vector<Point>  pts;
-      
-      // Must return the number of data points
-      inline size_t kdtree_get_point_count() const { return pts.size(); }
-      
-      // Returns the distance between the vector "p1[0:size-1]" and the data point with index "idx_p2" stored in the class:
-      inline T kdtree_distance(const T *p1, const size_t idx_p2,size_t size) const
-      {
-        const T d0=p1[0]-pts[idx_p2].x;
-        const T d1=p1[1]-pts[idx_p2].y;
-        const T d2=p1[2]-pts[idx_p2].z;
-        return d0*d0+d1*d1+d2*d2;
-      }
-      
-      // Returns the dim'th component of the idx'th point in the class:
-      // Since this is inlined and the "dim" argument is typically an immediate value, the
-      //  "if/else's" are actually solved at compile time.
-      inline T kdtree_get_pt(const size_t idx, int dim) const
-      {
-        if (dim==0) return pts[idx].x;
-        else if (dim==1) return pts[idx].y;
-        else return pts[idx].z;
-      }
-      
-      // Optional bounding-box computation: return false to default to a standard bbox computation loop.
-      //   Return true if the BBOX was already computed by the class and returned in "bb" so it can be avoided to redo it again.
-      //   Look at bb.size() to find out the expected dimensionality (e.g. 2 or 3 for point clouds)
-      template <class BBOX>
-      bool kdtree_get_bbox(BBOX &bb) const { return false; }
-      
-    };
-    
-    using namespace nuklei_nanoflann;
-    typedef KDTreeSingleIndexAdaptor<
-		L2_Simple_Adaptor<double, PointCloud > ,
-		PointCloud,
-		3 /* dim */
-		> KDTreeIndex;
-    typedef std::pair<boost::shared_ptr<KDTreeIndex>, PointCloud> Tree;
-  }
-  
   void KernelCollection::buildNeighborSearchTree()
   {
     NUKLEI_TRACE_BEGIN();
@@ -124,6 +69,83 @@ namespace nuklei {
     }
   }
   
+  std::pair<int, coord_t>
+  KernelCollection::nearestNeighbor(const Vector3& loc) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!deco_.has_key(KDTREE_KEY))
+      NUKLEI_THROW("Undefined kd-tree. Call buildKdTree() first.");
+
+    if (KDTREE_NANOFLANN)
+    {
+      using namespace nanoflann_types;
+
+      const Tree& tree = *deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY);
+
+      size_t index = 0;
+      coord_t sqDist = 0;
+      KNNResultSet<coord_t,size_t> resultSet(1);
+      resultSet.init(&index, &sqDist);
+      tree.first->findNeighbors(resultSet, loc, nuklei_nanoflann::SearchParams());
+      return std::make_pair(int(index), std::sqrt(sqDist));
+    }
+    else
+    {
+      using namespace libkdtree_types;
+
+      const Tree& tree = *deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY);
+
+      std::pair<Tree::const_iterator, Tree::distance_type> found =
+      tree.find_nearest(FlexiblePoint(loc.X(), loc.Y(), loc.Z(), -1));
+      NUKLEI_ASSERT(found.first != tree.end());
+      return std::make_pair(found.first->idx(), coord_t(found.second));
+    }
+    NUKLEI_TRACE_END();
+  }
+
+  std::vector<int>
+  KernelCollection::neighborsWithin(const Vector3& loc,
+                                    const coord_t radius) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!deco_.has_key(KDTREE_KEY))
+      NUKLEI_THROW("Undefined kd-tree. Call buildKdTree() first.");
+    
+    std::vector<int> indices;
+    if (KDTREE_NANOFLANN)
+    {
+      using namespace nanoflann_types;
+      
+      const Tree& tree = *deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY);
+      
+      // nanoflann takes squared distances.
+      std::vector<std::pair<size_t,coord_t> > indices_dists;
+      RadiusResultSet<coord_t,size_t> resultSet(radius*radius, indices_dists);
+      tree.first->findNeighbors(resultSet, loc, nuklei_nanoflann::SearchParams());
+      indices.reserve(indices_dists.size());
+      for (std::vector<std::pair<size_t,coord_t> >::const_iterator i = indices_dists.begin();
+           i != indices_dists.end(); ++i)
+        indices.push_back(i->first);
+    }
+    else
+    {
+      using namespace libkdtree_types;
+      
+      const Tree& tree = *deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY);
+      
+      std::vector<FlexiblePoint> in_range;
+      tree.find_within_range(FlexiblePoint(loc.X(), loc.Y(), loc.Z(), -1),
+                             radius, std::back_inserter(in_range));
+      // libkdtree searches a box, keep the ball.
+      for (std::vector<FlexiblePoint>::const_iterator i = in_range.begin();
+           i != in_range.end(); ++i)
+        if ((at(i->idx()).getLoc() - loc).SquaredLength() <= radius*radius)
+          indices.push_back(i->idx());
+    }
+    return indices;
+    NUKLEI_TRACE_END();
+  }
+  
   template<class KernelType>
   weight_t KernelCollection::staticEvaluationAt(const kernel::base &k,
                                                 const EvaluationStrategy strategy) const
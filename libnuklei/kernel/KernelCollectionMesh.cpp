@@ -21,6 +21,7 @@
 #include <CGAL/trace.h>
 #include <CGAL/Exact_predicates_inexact_constructions_kernel.h>
 #include <CGAL/Polyhedron_3.h>
+#include <CGAL/Polyhedron_incremental_builder_3.h>
 #include <CGAL/IO/Polyhedron_iostream.h>
 #include <CGAL/Surface_mesh_default_triangulation_3.h>
 #include <CGAL/make_surface_mesh.h>
@@ -32,20 +33,8 @@
 #include <CGAL/IO/read_xyz_points.h>
 #include <CGAL/compute_average_spacing.h>
 
-
 #include <CGAL/Simple_cartesian.h>
-#include <CGAL/AABB_tree.h>
-#include <CGAL/AABB_traits.h>
-#include <CGAL/Polyhedron_3.h>
-#include <CGAL/AABB_polyhedron_triangle_primitive.h>
-#include <CGAL/property_map.h>
-#include <CGAL/IO/read_off_points.h>
-#include <CGAL/IO/read_xyz_points.h>
-#include <CGAL/IO/write_xyz_points.h>
-#include <CGAL/IO/Polyhedron_iostream.h>
-
-#include <CGAL/squared_distance_3.h>
-#include <CGAL/Point_with_normal_3.h>
+#include <CGAL/Inverse_index.h>
 
 #endif
 
@@ -53,11 +42,15 @@
 #include <fstream>
 #include <utility> // defines std::pair
 #include <list>
+#include <sstream>
 #include <boost/filesystem.hpp>
+#include <boost/cstdint.hpp>
 #include <trimesh/TriMesh.h>
 
 #include <nuklei/KernelCollection.h>
 #include <nuklei/ObservationIO.h>
+#include "KernelCollectionBVH.h"
+#include "KernelCollectionHash.h"
 
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
 
@@ -87,43 +80,223 @@ namespace meshing_types {
 
 typedef CGAL::Polyhedron_3< CGAL::Simple_cartesian<double> > SimplePolyhedron;
 
-namespace view_types {
-  typedef CGAL::Simple_cartesian<double> K;
-  typedef K::Point_3 Point;
-  typedef K::Plane_3 Plane;
-  typedef K::Vector_3 Vector;
-  typedef K::Segment_3 Segment;
-  typedef K::Line_3 Line;
-  typedef SimplePolyhedron Polyhedron;
-  typedef CGAL::AABB_polyhedron_triangle_primitive<K,Polyhedron> Primitive;
-  typedef CGAL::AABB_traits<K, Primitive> Traits;
-  typedef CGAL::AABB_tree<Traits> Tree;
-  typedef Tree::Object_and_primitive_id Object_and_primitive_id;
-  typedef Tree::Primitive_id Primitive_id;
-  
-  
-  typedef CGAL::Point_with_normal_3<K> Point_with_normal;
-  typedef std::vector<Point_with_normal> PointList;
-}
-
 #endif
 
 namespace nuklei {
   
+  static void buildBVH(decoration<int>& deco, const int bvhKey,
+                       const std::vector<MeshBVH::Triangle>& triangles)
+  {
+    boost::shared_ptr<MeshBVH> bvh(new MeshBVH(triangles));
+    if (deco.has_key(bvhKey)) deco.erase(bvhKey);
+    deco.insert(bvhKey, bvh);
+  }
+  
+#ifdef NUKLEI_HAS_PARTIAL_VIEW
+  static void buildBVH(decoration<int>& deco, const int bvhKey,
+                       const SimplePolyhedron& poly)
+  {
+    std::vector<MeshBVH::Triangle> triangles;
+    triangles.reserve(poly.size_of_facets());
+    for (SimplePolyhedron::Facet_const_iterator f = poly.facets_begin();
+         f != poly.facets_end(); ++f)
+    {
+      // Fan triangulation of the facet.
+      std::vector<Vector3> v;
+      SimplePolyhedron::Halfedge_around_facet_const_circulator c = f->facet_begin();
+      do {
+        const SimplePolyhedron::Point_3& p = c->vertex()->point();
+        v.push_back(Vector3(p.x(), p.y(), p.z()));
+      } while (++c != f->facet_begin());
+      for (unsigned i = 2; i < v.size(); ++i)
+      {
+        MeshBVH::Triangle t;
+        t.v[0] = v.front();
+        t.v[1] = v.at(i-1);
+        t.v[2] = v.at(i);
+        triangles.push_back(t);
+      }
+    }
+    buildBVH(deco, bvhKey, triangles);
+  }
+#else
+  static void buildBVH(decoration<int>& deco, const int bvhKey,
+                       trimesh::TriMesh& mesh)
+  {
+    mesh.need_faces();
+    std::vector<MeshBVH::Triangle> triangles;
+    triangles.reserve(mesh.faces.size());
+    for (std::vector<trimesh::TriMesh::Face>::const_iterator f = mesh.faces.begin();
+         f != mesh.faces.end(); ++f)
+    {
+      MeshBVH::Triangle t;
+      for (int i = 0; i < 3; ++i)
+      {
+        const trimesh::point& p = mesh.vertices.at((*f)[i]);
+        t.v[i] = Vector3(p[0], p[1], p[2]);
+      }
+      triangles.push_back(t);
+    }
+    buildBVH(deco, bvhKey, triangles);
+  }
+#endif
+  
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
-  static void buildAABBTree(decoration<int>& deco, const int aabbKey,
-                            SimplePolyhedron& poly)
+  // Meshing parameters. They are part of the mesh cache key.
+  static const int MESH_NB_NEIGHBORS = 16;
+  static const double MESH_SM_ANGLE = 20.0;
+  static const double MESH_SM_RADIUS = 30;
+  static const double MESH_SM_DISTANCE = 0.05;
+  
+  static boost::uint64_t meshCacheKey(const KernelCollection& kc)
+  {
+    using namespace hash_types;
+    boost::uint64_t h = FNV_OFFSET;
+    hashValue(h, MESH_NB_NEIGHBORS);
+    hashValue(h, MESH_SM_ANGLE);
+    hashValue(h, MESH_SM_RADIUS);
+    hashValue(h, MESH_SM_DISTANCE);
+    hashValue(h, boost::uint64_t(kc.size()));
+    for (KernelCollection::const_iterator i = kc.begin(); i != kc.end(); ++i)
+      hashVector(h, i->getLoc());
+    return h;
+  }
+  
+  // The format version is part of the magic string.
+  static const char MESH_CACHE_MAGIC[] = "NKLMESH1";
+  
+  template<typename T>
+  static void writeValue(std::ostream& out, const T& v)
+  {
+    out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+  }
+  
+  template<typename T>
+  static T readValue(std::istream& in)
+  {
+    T v;
+    in.read(reinterpret_cast<char*>(&v), sizeof(T));
+    if (!in) NUKLEI_THROW("Truncated mesh cache.");
+    return v;
+  }
+  
+  // Mesh cache files contain the vertices and facets of the mesh, followed
+  // by its BVH. They are written to a temporary file first, so that
+  // concurrent processes never read a partial cache.
+  static void writeMeshCache(const std::string& filename,
+                             const SimplePolyhedron& poly,
+                             const MeshBVH& bvh)
+  {
+    typedef SimplePolyhedron::Vertex_const_iterator Vertex_const_iterator;
+    
+    boost::filesystem::path file(filename);
+    if (file.has_parent_path())
+      boost::filesystem::create_directories(file.parent_path());
+    boost::filesystem::path tmp(filename +
+      boost::filesystem::unique_path(".%%%%-%%%%.tmp").string());
+    
+    {
+      std::ofstream out(tmp.string().c_str(), std::ios::out | std::ios::binary);
+      out.write(MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)-1);
+      writeValue(out, boost::uint64_t(poly.size_of_vertices()));
+      for (Vertex_const_iterator v = poly.vertices_begin(); v != poly.vertices_end(); ++v)
+      {
+        writeValue(out, double(v->point().x()));
+        writeValue(out, double(v->point().y()));
+        writeValue(out, double(v->point().z()));
+      }
+      CGAL::Inverse_index<Vertex_const_iterator> index(poly.vertices_begin(),
+                                                       poly.vertices_end());
+      writeValue(out, boost::uint64_t(poly.size_of_facets()));
+      for (SimplePolyhedron::Facet_const_iterator f = poly.facets_begin();
+           f != poly.facets_end(); ++f)
+      {
+        SimplePolyhedron::Halfedge_around_facet_const_circulator c = f->facet_begin();
+        writeValue(out, boost::uint32_t(CGAL::circulator_size(c)));
+        do {
+          writeValue(out, boost::uint32_t(index[Vertex_const_iterator(c->vertex())]));
+        } while (++c != f->facet_begin());
+      }
+      bvh.write(out);
+      if (!out)
+        NUKLEI_THROW("Error writing mesh cache `" << tmp.string() << "'.");
+    }
+    boost::filesystem::rename(tmp, file);
+  }
+  
+  // Rebuilds a polyhedron from the vertices and facets of a mesh cache,
+  // without going through text.
+  template<class HDS>
+  class MeshCacheBuilder : public CGAL::Modifier_base<HDS>
+  {
+  public:
+    MeshCacheBuilder(const std::vector<double>& coords,
+                     const std::vector< std::vector<boost::uint32_t> >& facets) :
+      coords_(coords), facets_(facets), error_(false) {}
+    
+    void operator()(HDS& hds)
+    {
+      typedef typename HDS::Vertex::Point Point;
+      CGAL::Polyhedron_incremental_builder_3<HDS> b(hds);
+      b.begin_surface(coords_.size()/3, facets_.size());
+      for (std::size_t v = 0; v < coords_.size(); v += 3)
+        b.add_vertex(Point(coords_[v], coords_[v+1], coords_[v+2]));
+      for (std::size_t f = 0; f < facets_.size() && !b.error(); ++f)
+        b.add_facet(facets_[f].begin(), facets_[f].end());
+      if (b.error())
+      {
+        b.rollback();
+        error_ = true;
+        return;
+      }
+      b.end_surface();
+    }
+    
+    bool error() const { return error_; }
+    
+  private:
+    const std::vector<double>& coords_;
+    const std::vector< std::vector<boost::uint32_t> >& facets_;
+    bool error_;
+  };
+  
+  static void readMeshCache(const std::string& filename,
+                            SimplePolyhedron& poly,
+                            MeshBVH& bvh)
   {
-    using namespace view_types;
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    char magic[sizeof(MESH_CACHE_MAGIC)-1];
+    in.read(magic, sizeof(magic));
+    if (!in || !std::equal(magic, magic+sizeof(magic), MESH_CACHE_MAGIC))
+      NUKLEI_THROW("Not a mesh cache file, or obsolete mesh cache format.");
     
-    boost::shared_ptr<Tree> tree(new Tree);
+    // Vertices are read back as the doubles that were written, so that the
+    // polyhedron matches the BVH stored after it.
+    std::vector<double> coords;
+    boost::uint64_t nVertices = readValue<boost::uint64_t>(in);
+    for (boost::uint64_t c = 0; c < 3*nVertices; ++c)
+      coords.push_back(readValue<double>(in));
+    boost::uint64_t nFacets = readValue<boost::uint64_t>(in);
+    std::vector< std::vector<boost::uint32_t> > facets;
+    for (boost::uint64_t f = 0; f < nFacets; ++f)
+    {
+      boost::uint32_t degree = readValue<boost::uint32_t>(in);
+      facets.push_back(std::vector<boost::uint32_t>());
+      for (boost::uint32_t i = 0; i < degree; ++i)
+      {
+        boost::uint32_t v = readValue<boost::uint32_t>(in);
+        if (v >= nVertices)
+          NUKLEI_THROW("Invalid vertex index in mesh cache.");
+        facets.back().push_back(v);
+      }
+    }
     
-    // constructs AABB tree
-    tree.reset(new Tree(poly.facets_begin(),poly.facets_end()));
-    tree->accelerate_distance_queries();
+    MeshCacheBuilder<SimplePolyhedron::HalfedgeDS> builder(coords, facets);
+    poly.delegate(builder);
+    if (builder.error() || !poly.is_valid() || poly.empty())
+      NUKLEI_THROW("Cannot rebuild mesh from cache.");
     
-    if (deco.has_key(aabbKey)) deco.erase(aabbKey);
-    deco.insert(aabbKey, tree);
+    bvh.read(in);
   }
 #endif
   
@@ -132,6 +305,28 @@ namespace nuklei {
     NUKLEI_TRACE_BEGIN();
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
     
+    std::string cachefile;
+    if (!MESH_CACHE_DIR.empty())
+    {
+      cachefile = (boost::filesystem::path(MESH_CACHE_DIR) /
+                   (hash_types::toHex(meshCacheKey(*this)) + ".mesh")).string();
+      if (boost::filesystem::exists(cachefile))
+      {
+        boost::shared_ptr<SimplePolyhedron> poly(new SimplePolyhedron);
+        boost::shared_ptr<MeshBVH> bvh(new MeshBVH);
+        try {
+          readMeshCache(cachefile, *poly, *bvh);
+          if (deco_.has_key(MESH_KEY)) deco_.erase(MESH_KEY);
+          deco_.insert(MESH_KEY, poly);
+          if (deco_.has_key(BVH_KEY)) deco_.erase(BVH_KEY);
+          deco_.insert(BVH_KEY, bvh);
+          return;
+        } catch (std::exception& e) {
+          NUKLEI_WARN("Ignoring mesh cache `" << cachefile << "': " << e.what());
+        }
+      }
+    }
+    
     boost::shared_ptr<SimplePolyhedron> poly(new SimplePolyhedron);
     
     {
@@ -148,7 +343,7 @@ namespace nuklei {
         }
       }
       
-      const int nb_neighbors = 16;
+      const int nb_neighbors = MESH_NB_NEIGHBORS;
       CGAL::jet_estimate_normals(points.begin(), points.end(),
                                  CGAL::First_of_pair_property_map<PointVectorPair>(),
                                  CGAL::Second_of_pair_property_map<PointVectorPair>(),
@@ -179,9 +374,9 @@ namespace nuklei {
       }
       
       // Poisson options
-      FT sm_angle = 20.0; // Min triangle angle in degrees.
-      FT sm_radius = 30; // Max triangle size w.r.t. point set average spacing.
-      FT sm_distance = 0.05; // Surface Approximation error w.r.t. point set average spacing.
+      FT sm_angle = MESH_SM_ANGLE; // Min triangle angle in degrees.
+      FT sm_radius = MESH_SM_RADIUS; // Max triangle size w.r.t. point set average spacing.
+      FT sm_distance = MESH_SM_DISTANCE; // Surface Approximation error w.r.t. point set average spacing.
       
       // Reads the point set file in points[].
       // Note: read_xyz_points_and_normals() requires an iterator over points
@@ -260,7 +455,17 @@ namespace nuklei {
     if (deco_.has_key(MESH_KEY)) deco_.erase(MESH_KEY);
     deco_.insert(MESH_KEY, poly);
     
-    buildAABBTree(deco_, AABBTREE_KEY, *poly);
+    buildBVH(deco_, BVH_KEY, *poly);
+    
+    if (!cachefile.empty())
+    {
+      try {
+        writeMeshCache(cachefile, *poly,
+                       *deco_.get< boost::shared_ptr<MeshBVH> >(BVH_KEY));
+      } catch (std::exception& e) {
+        NUKLEI_WARN("Cannot write mesh cache `" << cachefile << "': " << e.what());
+      }
+    }
 #else
     NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://nuklei.sourceforge.net/doxygen/group__install.html");
 #endif
@@ -312,9 +517,14 @@ namespace nuklei {
     }
     if (deco_.has_key(MESH_KEY)) deco_.erase(MESH_KEY);
     deco_.insert(MESH_KEY, poly);
-    buildAABBTree(deco_, AABBTREE_KEY, *poly);
+    buildBVH(deco_, BVH_KEY, *poly);
 #else
-    NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://nuklei.sourceforge.net/doxygen/group__install.html");
+    // Without CGAL, the mesh is only used for visibility queries, and is
+    // kept as a BVH.
+    boost::shared_ptr<trimesh::TriMesh> mesh(trimesh::TriMesh::read(filename));
+    if (!mesh || mesh->vertices.empty())
+      NUKLEI_THROW("Cannot read mesh.");
+    buildBVH(deco_, BVH_KEY, *mesh);
 #endif
     NUKLEI_TRACE_END();
   }
@@ -322,7 +532,6 @@ namespace nuklei {
   void KernelCollection::readMeshFromPlyFile(const std::string& filename)
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
     boost::filesystem::path offfile =
     boost::filesystem::unique_path("/tmp/nuklei-%%%%-%%%%-%%%%-%%%%.off");
     boost::filesystem::path plyfile =
@@ -331,9 +540,6 @@ namespace nuklei {
     boost::shared_ptr<trimesh::TriMesh> mesh(trimesh::TriMesh::read(plyfile.native()));
     mesh->write(offfile.native());
     readMeshFromOffFile(offfile.native());
-#else
-    NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://nuklei.sourceforge.net/doxygen/group__install.html");
-#endif
     NUKLEI_TRACE_END();
   }
 
@@ -4,66 +4,24 @@
 
 /** @file */
 
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
-
-#define CGAL_EIGEN3_ENABLED
-
-#include <CGAL/Simple_cartesian.h>
-#include <CGAL/AABB_tree.h>
-#include <CGAL/AABB_traits.h>
-#include <CGAL/Polyhedron_3.h>
-#include <CGAL/AABB_polyhedron_triangle_primitive.h>
-#include <CGAL/property_map.h>
-#include <CGAL/IO/read_off_points.h>
-#include <CGAL/IO/read_xyz_points.h>
-#include <CGAL/IO/write_xyz_points.h>
-#include <CGAL/IO/Polyhedron_iostream.h>
-
-#include <CGAL/squared_distance_3.h>
-#include <CGAL/Point_with_normal_3.h>
-
-#endif
-
-#include <nuklei/KernelCollection.h>
-#include <nuklei/ObservationIO.h>
-
+#include <fstream>
 #include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
 
 #include <nuklei/KernelCollection.h>
-
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
-
-typedef CGAL::Simple_cartesian<double> K;
-typedef K::Point_3 Point;
-typedef K::Plane_3 Plane;
-typedef K::Vector_3 Vector;
-typedef K::Segment_3 Segment;
-typedef K::Line_3 Line;
-typedef CGAL::Polyhedron_3<K> Polyhedron;
-typedef CGAL::AABB_polyhedron_triangle_primitive<K,Polyhedron> Primitive;
-typedef CGAL::AABB_traits<K, Primitive> Traits;
-typedef CGAL::AABB_tree<Traits> Tree;
-typedef Tree::Object_and_primitive_id Object_and_primitive_id;
-typedef Tree::Primitive_id Primitive_id;
-
-typedef CGAL::Point_with_normal_3<K> Point_with_normal;
-typedef std::vector<Point_with_normal> PointList;
-
-#endif
+#include <nuklei/ObservationIO.h>
+#include "KernelCollectionViewCache.h"
+#include "KernelCollectionDepthBuffer.h"
+#include "KernelCollectionBVH.h"
+#include "KernelCollectionHash.h"
 
 namespace nuklei {
 
-  typedef std::vector< std::pair< Vector3, std::vector<int> > > viewcache_t;
-
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
-  
-  
-  inline bool isVisible(const Vector3& wtarget,
+  // Points seen at a grazing angle are considered occluded. Normals of
+  // length zero disable the test.
+  inline bool isGrazing(const Vector3& wtarget,
                         const Vector3& wnormal,
-                        const Vector3& wcamera,
-                        const Polyhedron& poly,
-                        const Tree& tree,
-                        const coord_t& tolerance)
+                        const Vector3& wcamera)
   {
     if (std::fabs(wnormal.SquaredLength()-1) < FLOATTOL)
     {
@@ -71,92 +29,94 @@ namespace nuklei {
       double dot = wnormal.Dot(ctot);
       if (std::acos(std::fabs(dot)) > (80./180*M_PI))
       {
-        return false;
-      }
-    }
-    
-    Point camera(wcamera.X(), wcamera.Y(), wcamera.Z());
-    Point target(wtarget.X(), wtarget.Y(), wtarget.Z());
-    
-    //double d = dot();
-    Segment segment_query(camera,target);
-    bool visible = true;
-    
-    std::list<Object_and_primitive_id> intersections;
-    tree.all_intersections(segment_query, std::back_inserter(intersections));
-    
-    int self_intersect = 0;
-    for (std::list<Object_and_primitive_id>::const_iterator intersection = intersections.begin();
-         intersection != intersections.end(); ++intersection)
-    {
-      Object_and_primitive_id op = *intersection;
-      CGAL::Object object = op.first;
-      Point intersectionPoint;
-      if(CGAL::assign(intersectionPoint,object))
-      {
-        double sq2 = squared_distance(intersectionPoint, target);
-        if (sq2 < tolerance*tolerance) self_intersect++;
-      }
-      else
-      {
-        // This is very unlikely (p<<0.001)
-        //NUKLEI_THROW("intersection is not a point!");
+        return true;
       }
     }
+    return false;
+  }
+  
+  // The target is visible if the segment from the camera to the target does
+  // not meet the mesh farther than tolerance from the target.
+  inline bool isVisible(const Vector3& wtarget,
+                        const Vector3& wnormal,
+                        const Vector3& wcamera,
+                        const MeshBVH& bvh,
+                        const coord_t& tolerance)
+  {
+    if (isGrazing(wtarget, wnormal, wcamera))
+      return false;
     
-    int num_inter = intersections.size();
-    if (self_intersect > 1)
-      NUKLEI_LOG("Number of self-intersections (" << self_intersect << ") greater than 1");
-    
-    if (num_inter == 0)
-      visible = true;
-    else
-    {
-      if (num_inter - self_intersect > 0)
-        visible = false;
-      else
-        visible = true;
-    }
-    if (num_inter > 1 && visible)
-      NUKLEI_INFO("Strange visibility at" << target);
-    
-    return visible;
-    
+    coord_t length = (wtarget - wcamera).Length();
+    if (length <= tolerance)
+      return true;
+    return !bvh.intersects(wcamera, wtarget, 1 - tolerance/length);
   }
   
   inline bool isVisible(const Vector3& wtarget,
                         const Vector3& wcamera,
-                        const Polyhedron& poly,
-                        const Tree& tree,
+                        const MeshBVH& bvh,
                         const coord_t& tolerance)
   {
     return isVisible(wtarget,
                      Vector3::ZERO,
                      wcamera,
-                     poly,
-                     tree,
+                     bvh,
                      tolerance);
   }
-
-#endif
+  
+  // Classifies all points with one rendering of the mesh. Returns false if
+  // the points do not all lie in front of the viewpoint, in which case the
+  // caller should fall back to ray casting.
+  template<typename C>
+  static bool depthBufferPartialView(const KernelCollection& kc,
+                                     const MeshBVH& bvh,
+                                     const Vector3& viewpoint,
+                                     const coord_t& tolerance,
+                                     const bool useRayToSurfacenormalAngle,
+                                     C& index_collection)
+  {
+    std::vector<Vector3> points;
+    points.reserve(kc.size());
+    Vector3 center = Vector3::ZERO;
+    for (KernelCollection::const_iterator v = kc.begin(); v != kc.end(); ++v)
+    {
+      points.push_back(v->getLoc());
+      center += points.back();
+    }
+    if (points.empty()) return true;
+    center /= points.size();
+    
+    Vector3 forward = center - viewpoint;
+    if (forward.Length() < FLOATTOL) return false;
+    coord_t tanHalfFov = DepthBuffer::tanHalfFovOf(points, viewpoint, forward);
+    if (tanHalfFov <= 0) return false;
+    
+    DepthBuffer buffer(viewpoint, forward, tanHalfFov * 1.01,
+                       DEPTH_BUFFER_RESOLUTION);
+    buffer.render(bvh.triangles());
+    
+    for (KernelCollection::const_iterator v = kc.begin(); v != kc.end(); ++v)
+    {
+      int i = std::distance(kc.begin(), v);
+      if (useRayToSurfacenormalAngle &&
+          isGrazing(points[i], kernel::r3xs2p(*v).dir_, viewpoint))
+        continue;
+      if (buffer.isVisible(points[i], tolerance))
+        index_collection.push_back(i);
+    }
+    return true;
+  }
   
   bool KernelCollection::isVisibleFrom(const Vector3& p, const Vector3& viewpoint,
                                        const coord_t& tolerance) const
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
-    if (!deco_.has_key(MESH_KEY))
-      NUKLEI_THROW("Undefined mesh. Call buildMesh() first.");
-    if (!deco_.has_key(AABBTREE_KEY))
-      NUKLEI_THROW("Undefined AABB tree. Call buildMesh() first.");
+    if (!deco_.has_key(BVH_KEY))
+      NUKLEI_THROW("Undefined mesh. Call buildMesh() or readMeshFromOffFile() first.");
     
     return isVisible(p, viewpoint,
-                     *deco_.get< boost::shared_ptr<Polyhedron> >(MESH_KEY),
-                     *deco_.get< boost::shared_ptr<Tree> >(AABBTREE_KEY),
+                     *deco_.get< boost::shared_ptr<MeshBVH> >(BVH_KEY),
                      tolerance);
-#else
-    NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://nuklei.sourceforge.net/doxygen/group__install.html");
-#endif
     NUKLEI_TRACE_END();
   }
   
@@ -164,19 +124,12 @@ namespace nuklei {
                                        const coord_t& tolerance) const
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
-    if (!deco_.has_key(MESH_KEY))
-      NUKLEI_THROW("Undefined mesh. Call buildMesh() first.");
-    if (!deco_.has_key(AABBTREE_KEY))
-      NUKLEI_THROW("Undefined AABB tree. Call buildMesh() first.");
+    if (!deco_.has_key(BVH_KEY))
+      NUKLEI_THROW("Undefined mesh. Call buildMesh() or readMeshFromOffFile() first.");
 
     return isVisible(p.loc_, p.dir_, viewpoint,
-                     *deco_.get< boost::shared_ptr<Polyhedron> >(MESH_KEY),
-                     *deco_.get< boost::shared_ptr<Tree> >(AABBTREE_KEY),
+                     *deco_.get< boost::shared_ptr<MeshBVH> >(BVH_KEY),
                      tolerance);
-#else
-    NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://nuklei.sourceforge.net/doxygen/group__install.html");
-#endif
     NUKLEI_TRACE_END();
   }
 
@@ -192,14 +145,15 @@ namespace nuklei {
 
     if (!useViewcache)
     {
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
-      if (!deco_.has_key(MESH_KEY))
-        NUKLEI_THROW("Undefined mesh. Call buildMesh() first.");
-      if (!deco_.has_key(AABBTREE_KEY))
-        NUKLEI_THROW("Undefined AABB tree. Call buildMesh() first.");
+      if (!deco_.has_key(BVH_KEY))
+        NUKLEI_THROW("Undefined mesh. Call buildMesh() or readMeshFromOffFile() first.");
       
-      const Polyhedron& poly = *deco_.get< boost::shared_ptr<Polyhedron> >(MESH_KEY);
-      const Tree& tree = *deco_.get< boost::shared_ptr<Tree> >(AABBTREE_KEY);
+      const MeshBVH& bvh = *deco_.get< boost::shared_ptr<MeshBVH> >(BVH_KEY);
+      
+      if (PARTIAL_VIEW_DEPTH_BUFFER &&
+          depthBufferPartialView(*this, bvh, viewpoint, tolerance,
+                                 useRayToSurfacenormalAngle, index_collection))
+        return index_collection;
       
       for (const_iterator v = begin(); v != end(); ++v)
       {
@@ -207,33 +161,21 @@ namespace nuklei {
         Vector3 normal = Vector3::ZERO;
         if (useRayToSurfacenormalAngle)
           normal = kernel::r3xs2p(*v).dir_;
-        if (isVisible(p, normal, viewpoint, poly, tree, tolerance))
+        if (isVisible(p, normal, viewpoint, bvh, tolerance))
           index_collection.push_back(std::distance(begin(), v));
       }
-#else
-      NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://nuklei.sourceforge.net/doxygen/group__install.html");
-#endif
     }
     else
     {
       if (!deco_.has_key(VIEWCACHE_KEY))
         NUKLEI_THROW("Undefined view cache. Call buildPartialViewCache() first.");
 
-      const viewcache_t &viewIndex = *deco_.get< boost::shared_ptr<viewcache_t> >(VIEWCACHE_KEY);
-      
-      double minDist = 1e6;
-      viewcache_t::const_iterator closest = as_const(viewIndex).begin();
-      for (viewcache_t::const_iterator oo = as_const(viewIndex).begin(); oo != viewIndex.end(); ++oo)
-      {
-        double tmp = (viewpoint-oo->first).SquaredLength();
-        if (tmp < minDist*minDist)
-        {
-          minDist = tmp;
-          closest = oo;
-        }
-      }
-      for (std::vector<int>::const_iterator i = closest->second.begin(); i != closest->second.end(); ++i)
-        index_collection.push_back(*i);
+      const ViewCache &viewIndex = *deco_.get< boost::shared_ptr<ViewCache> >(VIEWCACHE_KEY);
+      if (viewIndex.empty())
+        NUKLEI_THROW("Empty view cache.");
+
+      // With the view cache, viewpoint is a viewing direction.
+      viewIndex.view(viewIndex.nearest(viewpoint)).appendTo(index_collection);
     }
     return index_collection;
     NUKLEI_TRACE_END();
@@ -246,11 +188,7 @@ namespace nuklei {
                                                  const bool useRayToSurfacenormalAngle) const
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
     return partialView< std::vector<int> >(viewpoint, tolerance, useViewcache, useRayToSurfacenormalAngle);
-#else
-    NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://nuklei.sourceforge.net/doxygen/group__install.html");
-#endif
     NUKLEI_TRACE_END();
   }
   
@@ -261,8 +199,6 @@ namespace nuklei {
                                                                                   const bool useRayToSurfacenormalAngle) const
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
-    
     typedef const_partialview_iterator::index_container
     index_container;
     typedef const_partialview_iterator::index_container_ptr
@@ -274,62 +210,86 @@ namespace nuklei {
     *index_collection = partialView< index_container >(viewpoint, tolerance, useViewcache, useRayToSurfacenormalAngle);
     
     return const_partialview_iterator(begin(), index_collection);
-#else
-    NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://nuklei.sourceforge.net/doxygen/group__install.html");
-#endif
     NUKLEI_TRACE_END();
   }
   
+  // Number of views in the partial view cache. The views are spread on a
+  // Fibonacci lattice, whose neighboring directions are about 0.18 apart.
+  static const int PARTIAL_VIEW_CACHE_SIZE = 400;
+  
+  // Identifies the model points, the mesh, and the visibility parameters a
+  // view cache is computed from.
+  static boost::uint64_t viewCacheKey(const KernelCollection& kc,
+                                      const MeshBVH& bvh,
+                                      const double meshTol,
+                                      const bool useRayToSurfacenormalAngle)
+  {
+    using namespace hash_types;
+    boost::uint64_t h = FNV_OFFSET;
+    hashValue(h, meshTol);
+    hashValue(h, char(useRayToSurfacenormalAngle));
+    
+    hashValue(h, boost::uint64_t(kc.size()));
+    for (KernelCollection::const_iterator i = kc.begin(); i != kc.end(); ++i)
+    {
+      hashVector(h, i->getLoc());
+      if (useRayToSurfacenormalAngle)
+        hashVector(h, kernel::r3xs2p(*i).dir_);
+    }
+    
+    const std::vector<MeshBVH::Triangle>& triangles = bvh.triangles();
+    hashValue(h, boost::uint64_t(triangles.size()));
+    for (std::vector<MeshBVH::Triangle>::const_iterator t = triangles.begin();
+         t != triangles.end(); ++t)
+      for (int i = 0; i < 3; ++i)
+        hashVector(h, t->v[i]);
+    return h;
+  }
+  
   void KernelCollection::buildPartialViewCache(const double meshTol, const bool useRayToSurfacenormalAngle)
   {
     NUKLEI_TRACE_BEGIN();
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
+    if (!deco_.has_key(BVH_KEY))
+      NUKLEI_THROW("Undefined mesh. Call buildMesh() or readMeshFromOffFile() first.");
+    
     Vector3 mean = as_const(*this).moments()->getLoc();
     double stdev = as_const(*this).moments()->getLocH();
     
+    const int n = PARTIAL_VIEW_CACHE_SIZE;
     std::vector< Vector3 > keys;
-    for (int o = 0; o < 10000; ++o)
     {
-      Vector3 key = Random::uniformDirection3d();
-      keys.push_back(key);
+      const double goldenAngle = M_PI * (3 - std::sqrt(5.));
+      for (int o = 0; o < n; ++o)
+      {
+        double z = 1 - (2*o + 1) / double(n);
+        double r = std::sqrt(std::max(0., 1 - z*z));
+        double phi = goldenAngle * o;
+        keys.push_back(Vector3(r * std::cos(phi), r * std::sin(phi), z));
+      }
     }
     
+    std::vector< std::vector<int> > views(keys.size());
+    
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int o = 0; o < int(keys.size()); ++o)
     {
-      double minDist2 = .15;
-      std::vector< Vector3 > tmp = keys;
-      keys.clear();
-      for (std::vector<Vector3>::const_iterator
-           i = tmp.begin();
-           i != tmp.end(); ++i)
-      {
-        bool cnt = false;
-        Vector3 iLoc = (*i);
-        for (std::vector<Vector3>::const_iterator
-             j = keys.begin();
-             j != keys.end(); ++j)
-        {
-          if ( (iLoc - *j).SquaredLength() < minDist2*minDist2 )
-          {
-            cnt = true;
-            break;
-          }
-        }
-        if (!cnt)
-        {
-          keys.push_back(iLoc);
-        }
-      }
+      Vector3 vp = mean + keys.at(o)*stdev*20;
+      views.at(o) = as_const(*this).partialView(vp, meshTol, false, useRayToSurfacenormalAngle);
     }
     
-    boost::shared_ptr<viewcache_t> viewIndex(new viewcache_t());
+    boost::shared_ptr<ViewCache> viewIndex
+    (new ViewCache(size(), viewCacheKey(*this,
+                                      *deco_.get< boost::shared_ptr<MeshBVH> >(BVH_KEY),
+                                      meshTol, useRayToSurfacenormalAngle)));
     
     for (unsigned int o = 0; o < keys.size(); ++o)
     {
-      Vector3 key = keys.at(o);
-      Vector3 vp = mean + key*stdev*20;
-      std::vector<int> vi = as_const(*this).partialView(vp, meshTol, false, useRayToSurfacenormalAngle);
 #if 0
       // debug - delete when code is considered stable
+      Vector3 vp = mean + keys.at(o)*stdev*20;
+      std::vector<int>& vi = views.at(o);
       KernelCollection v;
       for (std::vector<int>::iterator i = vi.begin(); i != vi.end(); ++i)
         v.add(as_const(*this).at(*i));
@@ -339,8 +299,9 @@ namespace nuklei {
       v.add(*k);
       v.computeKernelStatistics();
 #endif
-      viewIndex->push_back(std::make_pair(key, vi));
+      viewIndex->add(keys.at(o), views.at(o));
     }
+    viewIndex->buildIndex();
     
     if (deco_.has_key(VIEWCACHE_KEY)) deco_.erase(VIEWCACHE_KEY);
     deco_.insert(VIEWCACHE_KEY, viewIndex);
@@ -348,24 +309,23 @@ namespace nuklei {
 #if 0
     // debug - delete when code is considered stable
     
-      for (viewcache_t::iterator o = viewIndex->begin(); o != viewIndex->end(); ++o)
+      for (size_t o = 0; o < viewIndex->size(); ++o)
       {
-        double d = 1e6;
         KernelCollection near;
         
-        for (viewcache_t::iterator oo = viewIndex->begin(); oo != viewIndex->end(); ++oo)
+        std::vector<size_t> nn = viewIndex->nearest(viewIndex->direction(o), 2);
+        if (nn.size() == 2)
         {
-          if (oo == o) continue;
-          double dd = (o->first-oo->first).Length();
-          if (dd < d) {
-            d = dd;
-            near.clear();
-            for (std::vector<int>::iterator j = oo->second.begin(); j != oo->second.end(); ++j)
-              near.add(as_const(*this).at(*j));
-            near.computeKernelStatistics();
-            if (near.size() == 0) continue;
+          size_t oo = nn.back();
+          std::vector<int> ooi;
+          viewIndex->view(oo).appendTo(ooi);
+          for (std::vector<int>::const_iterator j = ooi.begin(); j != ooi.end(); ++j)
+            near.add(as_const(*this).at(*j));
+          near.computeKernelStatistics();
+          if (near.size() > 0)
+          {
             kernel::base::ptr k = near.randomKernel().create();
-            k->setLoc(mean + oo->first*stdev*20);
+            k->setLoc(mean + viewIndex->direction(oo)*stdev*20);
             near.add(*k);
             near.computeKernelStatistics();
           }
@@ -376,7 +336,9 @@ namespace nuklei {
           cd.setColor(RGBColor(1, 0, 0));
           i->setDescriptor(cd);
         }
-        for (std::vector<int>::iterator j = o->second.begin(); j != o->second.end(); ++j)
+        std::vector<int> oi;
+        viewIndex->view(o).appendTo(oi);
+        for (std::vector<int>::const_iterator j = oi.begin(); j != oi.end(); ++j)
         {
           near.add(as_const(*this).at(*j));
           near.back().setLoc(near.back().getLoc()+Vector3(0.001, 0, 0));
@@ -384,19 +346,62 @@ namespace nuklei {
         near.computeKernelStatistics();
         if (near.size() == 0) continue;
         kernel::base::ptr k = near.randomKernel().create();
-        k->setLoc(mean + o->first*stdev*20);
+        k->setLoc(mean + viewIndex->direction(o)*stdev*20);
         near.add(*k);
         near.computeKernelStatistics();
-        writeObservations("/tmp/v/" + stringify(std::distance(viewIndex->begin(), o)), near, Observation::SERIAL);
+        writeObservations("/tmp/v/" + stringify(o), near, Observation::SERIAL);
       }
 #endif
     
-#else
-    NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://nuklei.sourceforge.net/doxygen/group__install.html");
-#endif
     NUKLEI_TRACE_END();
 
   }
 
-}
+  void KernelCollection::writePartialViewCache(const std::string& filename) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!deco_.has_key(VIEWCACHE_KEY))
+      NUKLEI_THROW("Undefined view cache. Call buildPartialViewCache() first.");
+    std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!out)
+      NUKLEI_THROW("Cannot open `" << filename << "' for writing.");
+    deco_.get< boost::shared_ptr<ViewCache> >(VIEWCACHE_KEY)->write(out);
+    NUKLEI_TRACE_END();
+  }
+  
+  bool KernelCollection::readPartialViewCache(const std::string& filename,
+                                              const double meshTol,
+                                              const bool useRayToSurfacenormalAngle)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!deco_.has_key(BVH_KEY))
+      NUKLEI_THROW("Undefined mesh. Call buildMesh() or readMeshFromOffFile() first.");
+    
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    if (!in)
+      return false;
+    
+    boost::shared_ptr<ViewCache> viewIndex(new ViewCache);
+    try {
+      if (!viewIndex->read(in,
+                           viewCacheKey(*this,
+                                        *deco_.get< boost::shared_ptr<MeshBVH> >(BVH_KEY),
+                                        meshTol, useRayToSurfacenormalAngle),
+                           size()))
+      {
+        NUKLEI_LOG("View cache `" << filename << "' was computed for a different "
+                   "model, mesh, or visibility tolerance, or is corrupt.");
+        return false;
+      }
+    } catch (std::exception& e) {
+      NUKLEI_WARN("Ignoring view cache `" << filename << "': " << e.what());
+      return false;
+    }
+    
+    if (deco_.has_key(VIEWCACHE_KEY)) deco_.erase(VIEWCACHE_KEY);
+    deco_.insert(VIEWCACHE_KEY, viewIndex);
+    return true;
+    NUKLEI_TRACE_END();
+  }
 
+}
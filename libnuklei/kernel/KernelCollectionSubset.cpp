@@ -0,0 +1,172 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <set>
+#include <map>
+#include <algorithm>
+
+#include <nuklei/KernelCollection.h>
+
+namespace nuklei
+{
+  
+  namespace subset_types
+  {
+    typedef std::pair<int, std::pair<int, int> > Voxel;
+    
+    struct VoxelInfo
+    {
+      VoxelInfo() : dispersion(0), bin(0) {}
+      std::vector<int> members;
+      coord_t dispersion;
+      int bin;
+    };
+    
+    struct HigherDispersion
+    {
+      bool operator()(const VoxelInfo* a, const VoxelInfo* b) const
+      {
+        return a->dispersion > b->dispersion;
+      }
+    };
+    
+    struct CloserTo
+    {
+      CloserTo(const KernelCollection& kc, const Vector3& c) : kc_(kc), c_(c) {}
+      bool operator()(const int a, const int b) const
+      {
+        return ((kc_.at(a).getLoc() - c_).SquaredLength() <
+                (kc_.at(b).getLoc() - c_).SquaredLength());
+      }
+    private:
+      const KernelCollection& kc_;
+      Vector3 c_;
+    };
+  }
+  
+  static inline subset_types::Voxel voxelOf(const Vector3& loc,
+                                            const Vector3& origin,
+                                            const coord_t size)
+  {
+    return std::make_pair(int(std::floor((loc.X()-origin.X())/size)),
+                          std::make_pair(int(std::floor((loc.Y()-origin.Y())/size)),
+                                         int(std::floor((loc.Z()-origin.Z())/size))));
+  }
+  
+  static inline bool directionOf(const kernel::base& k, Vector3& dir)
+  {
+    switch (k.polyType())
+    {
+      case kernel::base::R3XS2:
+        dir = static_cast<const kernel::r3xs2&>(k).dir_;
+        return true;
+      case kernel::base::R3XS2P:
+        dir = static_cast<const kernel::r3xs2p&>(k).dir_;
+        return true;
+      default:
+        return false;
+    }
+  }
+  
+  std::vector<int> KernelCollection::informativeSubset(const size_t n) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    using namespace subset_types;
+    
+    std::vector<int> subset;
+    if (empty() || n == 0)
+      return subset;
+    
+    const size_t target = std::min(n, size());
+    
+    Vector3 lower = front().getLoc(), upper = lower, mean = Vector3::ZERO;
+    for (const_iterator i = begin(); i != end(); ++i)
+    {
+      lower = la::min(lower, i->getLoc());
+      upper = la::max(upper, i->getLoc());
+      mean += i->getLoc();
+    }
+    mean /= size();
+    const coord_t extent = std::max((upper-lower).Length(), FLOATTOL);
+    
+    // Largest voxel size for which at least target voxels are occupied.
+    coord_t lo = extent / size(), hi = extent;
+    for (int it = 0; it < 20; ++it)
+    {
+      coord_t mid = std::sqrt(lo*hi);
+      std::set<Voxel> occupied;
+      for (const_iterator i = begin(); i != end(); ++i)
+        occupied.insert(voxelOf(i->getLoc(), lower, mid));
+      if (occupied.size() >= target) lo = mid;
+      else hi = mid;
+    }
+    
+    std::map<Voxel, VoxelInfo> voxels;
+    for (const_iterator i = begin(); i != end(); ++i)
+      voxels[voxelOf(i->getLoc(), lower, lo)].members.push_back(std::distance(begin(), i));
+    
+    std::vector<VoxelInfo*> ranked;
+    for (std::map<Voxel, VoxelInfo>::iterator v = voxels.begin();
+         v != voxels.end(); ++v)
+    {
+      VoxelInfo& info = v->second;
+      
+      Vector3 centroid = Vector3::ZERO, dirSum = Vector3::ZERO, first, dir;
+      bool hasDirection = directionOf(at(info.members.front()), first);
+      for (std::vector<int>::const_iterator m = info.members.begin();
+           m != info.members.end(); ++m)
+      {
+        centroid += at(*m).getLoc();
+        if (hasDirection && directionOf(at(*m), dir))
+          // Directions of r3xs2p kernels are defined up to their sign.
+          dirSum += (dir.Dot(first) < 0 ? -dir : dir);
+      }
+      centroid /= info.members.size();
+      
+      if (hasDirection)
+      {
+        // One minus the mean resultant length: 0 for a flat patch, close to 1
+        // where normals spread out.
+        info.dispersion = 1 - dirSum.Length() / info.members.size();
+        Vector3 d = la::normalized(dirSum.Length() > 0 ? dirSum : first);
+        info.bin = 0;
+        for (int a = 1; a < 3; ++a)
+          if (std::fabs(d[a]) > std::fabs(d[info.bin])) info.bin = a;
+      }
+      else
+      {
+        Vector3 d = centroid - mean;
+        info.bin = (d.X() > 0) + 2*(d.Y() > 0) + 4*(d.Z() > 0);
+      }
+      
+      // The kernel closest to the voxel centroid represents the voxel.
+      std::sort(info.members.begin(), info.members.end(), CloserTo(*this, centroid));
+      ranked.push_back(&info);
+    }
+    std::stable_sort(ranked.begin(), ranked.end(), HigherDispersion());
+    
+    // Interleave bins, so that consecutive voxels face different directions.
+    std::vector< std::vector<VoxelInfo*> > bins(8);
+    for (std::vector<VoxelInfo*>::const_iterator v = ranked.begin();
+         v != ranked.end(); ++v)
+      bins.at((*v)->bin).push_back(*v);
+    std::vector<VoxelInfo*> order;
+    for (size_t r = 0; order.size() < ranked.size(); ++r)
+      for (std::vector< std::vector<VoxelInfo*> >::const_iterator b = bins.begin();
+           b != bins.end(); ++b)
+        if (r < b->size()) order.push_back(b->at(r));
+    
+    // One kernel per voxel, then a second one per voxel, etc.
+    for (size_t r = 0; subset.size() < target; ++r)
+      for (std::vector<VoxelInfo*>::const_iterator v = order.begin();
+           v != order.end() && subset.size() < target; ++v)
+        if (r < (*v)->members.size()) subset.push_back((*v)->members.at(r));
+    
+    return subset;
+    NUKLEI_TRACE_END();
+  }
+  
+}
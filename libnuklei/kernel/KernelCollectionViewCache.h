@@ -0,0 +1,341 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_KERNEL_COLLECTION_VIEW_CACHE_H
+#define NUKLEI_KERNEL_COLLECTION_VIEW_CACHE_H
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+#include <boost/cstdint.hpp>
+
+#include <nuklei/Common.h>
+#include <nuklei/LinearAlgebra.h>
+
+#include "KernelCollectionTypes.h"
+
+namespace nuklei
+{
+
+  /**
+   * Set of point indices, stored as a bitset over the points of a model.
+   *
+   * A set costs one bit per model point, whatever the number of points it
+   * contains.
+   */
+  class VisibilitySet
+  {
+  public:
+    typedef boost::uint64_t word_t;
+
+    explicit VisibilitySet(const size_t nPoints = 0) :
+      nPoints_(nPoints), words_((nPoints + WORD_BITS - 1) / WORD_BITS, 0) {}
+
+    size_t capacity() const { return nPoints_; }
+
+    void insert(const int i)
+    {
+      NUKLEI_ASSERT(i >= 0 && size_t(i) < nPoints_);
+      words_[i / WORD_BITS] |= word_t(1) << (i % WORD_BITS);
+    }
+
+    bool contains(const int i) const
+    {
+      NUKLEI_ASSERT(i >= 0 && size_t(i) < nPoints_);
+      return (words_[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+    }
+
+    /** @brief Number of indices in the set. */
+    size_t count() const
+    {
+      size_t c = 0;
+      for (std::vector<word_t>::const_iterator w = words_.begin();
+           w != words_.end(); ++w)
+        c += popcount(*w);
+      return c;
+    }
+
+    VisibilitySet& operator|=(const VisibilitySet& s)
+    {
+      NUKLEI_ASSERT(nPoints_ == s.nPoints_);
+      for (size_t i = 0; i < words_.size(); ++i) words_[i] |= s.words_[i];
+      return *this;
+    }
+
+    VisibilitySet& operator&=(const VisibilitySet& s)
+    {
+      NUKLEI_ASSERT(nPoints_ == s.nPoints_);
+      for (size_t i = 0; i < words_.size(); ++i) words_[i] &= s.words_[i];
+      return *this;
+    }
+
+    /**
+     * @brief Appends the indices of the set to @p c, in increasing order.
+     */
+    template<typename C>
+    void appendTo(C& c) const
+    {
+      for (size_t i = 0; i < words_.size(); ++i)
+      {
+        word_t w = words_[i];
+        while (w != 0)
+        {
+          c.push_back(int(i * WORD_BITS + lowestBit(w)));
+          w &= w - 1;
+        }
+      }
+    }
+
+    std::vector<word_t>& words() { return words_; }
+    const std::vector<word_t>& words() const { return words_; }
+
+    /**
+     * @brief Returns false if bits past capacity() are set, which words()
+     * allows.
+     */
+    bool isValid() const
+    {
+      const size_t tail = nPoints_ % WORD_BITS;
+      return tail == 0 || (words_.back() >> tail) == 0;
+    }
+
+  private:
+    static const size_t WORD_BITS = 64;
+
+    static int popcount(const word_t w)
+    {
+#ifdef __GNUC__
+      return __builtin_popcountll(w);
+#else
+      int c = 0;
+      for (word_t v = w; v != 0; v &= v - 1) ++c;
+      return c;
+#endif
+    }
+
+    static int lowestBit(const word_t w)
+    {
+#ifdef __GNUC__
+      return __builtin_ctzll(w);
+#else
+      int b = 0;
+      while (((w >> b) & 1) == 0) ++b;
+      return b;
+#endif
+    }
+
+    size_t nPoints_;
+    std::vector<word_t> words_;
+  };
+
+  /**
+   * Partial views of an object, indexed by viewing direction.
+   *
+   * Directions are unit vectors pointing from the object center to the
+   * camera. A kd-tree over the directions makes nearest-view lookups
+   * logarithmic in the number of views. Views are stored as bitsets over the
+   * model points.
+   *
+   * The cache carries a key identifying the model, mesh and visibility
+   * parameters it was computed for, so that a serialized cache can be
+   * checked against the collection it is reloaded into.
+   */
+  class ViewCache : boost::noncopyable
+  {
+  public:
+    typedef VisibilitySet view_t;
+
+    ViewCache(const size_t nPoints = 0, const boost::uint64_t key = 0) :
+      nPoints_(nPoints), key_(key) {}
+
+    boost::uint64_t key() const { return key_; }
+    /** @brief Number of points of the model the views refer to. */
+    size_t nPoints() const { return nPoints_; }
+
+    /** @brief Adds the view made of points @p indices. */
+    void add(const Vector3& direction, const std::vector<int>& indices)
+    {
+      view_t view(nPoints_);
+      for (std::vector<int>::const_iterator i = indices.begin();
+           i != indices.end(); ++i)
+        view.insert(*i);
+      directions_.push_back(la::normalized(direction));
+      views_.push_back(view);
+      index_.reset();
+    }
+
+    /** @brief Builds the direction index. Call after the last add(). */
+    void buildIndex()
+    {
+      using namespace nanoflann_types;
+      cloud_.pts.clear();
+      for (std::vector<Vector3>::const_iterator i = directions_.begin();
+           i != directions_.end(); ++i)
+        cloud_.pts.push_back(PointCloud::Point(i->X(), i->Y(), i->Z()));
+      index_.reset(new KDTreeIndex(3 /*dim*/, cloud_,
+                                   KDTreeSingleIndexAdaptorParams(10 /* max leaf */)));
+      index_->buildIndex();
+    }
+
+    size_t size() const { return views_.size(); }
+    bool empty() const { return views_.empty(); }
+    const Vector3& direction(const size_t i) const { return directions_.at(i); }
+    const view_t& view(const size_t i) const { return views_.at(i); }
+
+    /** @brief Returns the index of the view closest to @p direction. */
+    size_t nearest(const Vector3& direction) const
+    {
+      std::vector<size_t> n = nearest(direction, 1);
+      NUKLEI_ASSERT(!n.empty());
+      return n.front();
+    }
+
+    /**
+     * @brief Returns the indices of the @p k views closest to @p direction,
+     * closest first.
+     */
+    std::vector<size_t> nearest(const Vector3& direction, const size_t k) const
+    {
+      if (!index_)
+        NUKLEI_THROW("Undefined view index. Call buildIndex() first.");
+      size_t m = std::min(k, size());
+      std::vector<size_t> indices(m);
+      std::vector<coord_t> sqDists(m);
+      if (m == 0) return indices;
+      Vector3 d = la::normalized(direction);
+      index_->knnSearch(&d[0], m, &indices.front(), &sqDists.front());
+      return indices;
+    }
+
+    /**
+     * @brief Returns the points visible in any of the @p k views closest to
+     * @p direction.
+     */
+    view_t unionOfNearest(const Vector3& direction, const size_t k) const
+    {
+      view_t u(nPoints_);
+      std::vector<size_t> n = nearest(direction, k);
+      for (std::vector<size_t>::const_iterator i = n.begin(); i != n.end(); ++i)
+        u |= view(*i);
+      return u;
+    }
+
+    /**
+     * @brief Returns the points visible in all of the @p k views closest to
+     * @p direction.
+     */
+    view_t intersectionOfNearest(const Vector3& direction, const size_t k) const
+    {
+      std::vector<size_t> n = nearest(direction, k);
+      if (n.empty()) return view_t(nPoints_);
+      view_t u = view(n.front());
+      for (std::vector<size_t>::const_iterator i = n.begin()+1; i != n.end(); ++i)
+        u &= view(*i);
+      return u;
+    }
+
+    void write(std::ostream& out) const
+    {
+      out.write(magic(), MAGIC_SIZE);
+      writeValue(out, key_);
+      writeValue(out, boost::uint64_t(nPoints_));
+      writeValue(out, boost::uint32_t(size()));
+      for (size_t i = 0; i < size(); ++i)
+      {
+        writeVector(out, directions_.at(i));
+        const std::vector<view_t::word_t>& words = views_.at(i).words();
+        if (!words.empty())
+          out.write(reinterpret_cast<const char*>(&words.front()),
+                    words.size()*sizeof(view_t::word_t));
+      }
+      if (!out)
+        NUKLEI_THROW("Error writing view cache.");
+    }
+
+    /**
+     * @brief Replaces the contents of this cache with a cache serialized
+     * by write(), and builds the direction index.
+     *
+     * The key and the number of points stored in the stream are compared
+     * to @p key and @p nPoints before any view is allocated. If they
+     * differ, or if a view holds indices past @p nPoints, the cache is left
+     * empty and false is returned.
+     */
+    bool read(std::istream& in, const boost::uint64_t key,
+              const size_t nPoints)
+    {
+      char m[MAGIC_SIZE];
+      in.read(m, MAGIC_SIZE);
+      if (!in || !std::equal(m, m+MAGIC_SIZE, magic()))
+        NUKLEI_THROW("Not a view cache file, or obsolete view cache format.");
+      directions_.clear();
+      views_.clear();
+      index_.reset();
+      boost::uint64_t storedKey = 0, storedNPoints = 0;
+      readValue(in, storedKey);
+      readValue(in, storedNPoints);
+      if (storedKey != key || storedNPoints != nPoints)
+        return false;
+      key_ = key;
+      nPoints_ = nPoints;
+      boost::uint32_t n = 0;
+      readValue(in, n);
+      for (boost::uint32_t i = 0; i < n; ++i)
+      {
+        Vector3 direction;
+        readVector(in, direction);
+        view_t view(nPoints_);
+        std::vector<view_t::word_t>& words = view.words();
+        if (!words.empty())
+          in.read(reinterpret_cast<char*>(&words.front()),
+                  words.size()*sizeof(view_t::word_t));
+        if (!in)
+          NUKLEI_THROW("Truncated view cache.");
+        if (!view.isValid())
+        {
+          directions_.clear();
+          views_.clear();
+          return false;
+        }
+        directions_.push_back(direction);
+        views_.push_back(view);
+      }
+      buildIndex();
+      return true;
+    }
+
+  private:
+    // The format version is part of the magic string.
+    static const size_t MAGIC_SIZE = 8;
+    static const char* magic() { return "NKLVIEW2"; }
+
+    template<typename T>
+    static void writeValue(std::ostream& out, const T& v)
+    { out.write(reinterpret_cast<const char*>(&v), sizeof(T)); }
+    template<typename T>
+    static void readValue(std::istream& in, T& v)
+    {
+      in.read(reinterpret_cast<char*>(&v), sizeof(T));
+      if (!in) NUKLEI_THROW("Truncated view cache.");
+    }
+    static void writeVector(std::ostream& out, const Vector3& v)
+    { writeValue(out, v.X()); writeValue(out, v.Y()); writeValue(out, v.Z()); }
+    static void readVector(std::istream& in, Vector3& v)
+    { readValue(in, v.X()); readValue(in, v.Y()); readValue(in, v.Z()); }
+
+    size_t nPoints_;
+    boost::uint64_t key_;
+    std::vector<Vector3> directions_;
+    std::vector<view_t> views_;
+    nanoflann_types::PointCloud cloud_;
+    boost::shared_ptr<nanoflann_types::KDTreeIndex> index_;
+  };
+
+}
+
+#endif
@@ -6,12 +6,30 @@
 
 #include <nuklei/KernelLogisticRegressor.h>
 #include <nuklei/ObservationIO.h>
+#include <nuklei/Random.h>
 #include <klr_train.h>
+#include <numeric>
+#include <algorithm>
 
 namespace nuklei
 {
   
   
+  void KernelLogisticRegressor::assertConsistency() const
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_ASSERT(trainSet_.size() == labels_.size());
+    trainSet_.assertConsistency();
+    if (landmarks_) landmarks_->assertConsistency();
+    if (vklr_)
+    {
+      NUKLEI_ASSERT(vklr_->GetRows() == 2);
+      NUKLEI_ASSERT(vklr_->GetColumns() == int(basis().size()));
+      NUKLEI_ASSERT(testWeights_.size() == 2*basis().size());
+    }
+    NUKLEI_TRACE_END();
+  }
+  
   KernelLogisticRegressor::KernelLogisticRegressor
   (const KernelCollection &data,
    const std::vector<int>& labels) :
@@ -19,7 +37,6 @@ namespace nuklei
   {
     NUKLEI_TRACE_BEGIN();
     NUKLEI_ASSERT(trainSet_.size() == labels_.size());
-    computeGramMatrix();
     NUKLEI_TRACE_END();
   }
   
@@ -29,9 +46,11 @@ namespace nuklei
    const std::vector<int>& labels) :
   trainSet_(data), gramMatrix_(gramMatrix), labels_(labels)
   {
+    NUKLEI_TRACE_BEGIN();
     NUKLEI_ASSERT(trainSet_.size() == labels_.size());
     NUKLEI_ASSERT(gramMatrix_.GetRows() == trainSet_.size());
     NUKLEI_ASSERT(gramMatrix_.GetColumns() == trainSet_.size());
+    NUKLEI_TRACE_END();
   }
   
   
@@ -40,22 +59,196 @@ namespace nuklei
   {
     trainSet_ = data;
     labels_ = labels;
-    computeGramMatrix();
+    gramMatrix_ = GMatrix();
+    sparseGramMatrix_ = SparseGramMatrix();
     vklr_ = boost::optional<GMatrix>();
+    landmarks_ = boost::optional<KernelCollection>();
+  }
+  
+  template<class KernelType>
+  void KernelLogisticRegressor::staticComputeGramMatrix()
+  {
+    NUKLEI_TRACE_BEGIN();
+    const KernelCollection& trainSet = trainSet_;
+    const int n = trainSet.size();
+    
+    // K(i,j) = K(j,i) only if the two kernels have the same bandwidths.
+    bool symmetric = true;
+    for (int i = 1; i < n && symmetric; ++i)
+      symmetric = (trainSet.at(i).getLocH() == trainSet.at(0).getLocH() &&
+                   trainSet.at(i).getOriH() == trainSet.at(0).getOriH());
+    
+    const coord_t range = trainSet.maxLocCutPoint();
+    
+    // Each row is written by one thread. In the symmetric case, the entry
+    // mirrored below the diagonal, (j,i), belongs to row j, but each (i,j)
+    // pair is computed by exactly one thread, so the writes do not overlap.
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < n; ++i)
+    {
+      const KernelType& ki = static_cast<const KernelType&>(trainSet.at(i));
+      std::vector<int> neighbors = trainSet.neighborsWithin(ki.loc_, range);
+      for (std::vector<int>::const_iterator j = neighbors.begin();
+           j != neighbors.end(); ++j)
+      {
+        if (symmetric && *j < i) continue;
+        const KernelType& kj = static_cast<const KernelType&>(trainSet.at(*j));
+        gramMatrix_(i, *j) = ki.eval(kj);
+        if (symmetric) gramMatrix_(*j, i) = gramMatrix_(i, *j);
+      }
+    }
+    NUKLEI_TRACE_END();
   }
   
   void KernelLogisticRegressor::computeGramMatrix()
   {
     NUKLEI_TRACE_BEGIN();
+    // GMatrix zero-initializes its entries. Pairs of kernels farther apart
+    // than the cut point are not evaluated and stay at zero.
     gramMatrix_ = GMatrix(trainSet_.size(), trainSet_.size());
-
-    for (unsigned i = 0; i < trainSet_.size(); ++i)
+    
+    if (!trainSet_.empty())
     {
-      for (unsigned j = 0; j < trainSet_.size(); ++j)
+      trainSet_.computeKernelStatistics();
+      trainSet_.buildKdTree();
+      
+      switch (trainSet_.kernelType())
       {
-        gramMatrix_(i, j) = trainSet_.at(i).polyEval(trainSet_.at(j));
+        case kernel::base::R3:
+          staticComputeGramMatrix<kernel::r3>();
+          break;
+        case kernel::base::R3XS2:
+          staticComputeGramMatrix<kernel::r3xs2>();
+          break;
+        case kernel::base::R3XS2P:
+          staticComputeGramMatrix<kernel::r3xs2p>();
+          break;
+        case kernel::base::SE3:
+          staticComputeGramMatrix<kernel::se3>();
+          break;
+        default:
+          NUKLEI_THROW("Unknow kernel type.");
+          break;
       }
     }
+    
+    sparseGramMatrix_ = SparseGramMatrix();
+    NUKLEI_TRACE_END();
+  }
+  
+  template<class KernelType>
+  void KernelLogisticRegressor::staticComputeSparseGramMatrix()
+  {
+    NUKLEI_TRACE_BEGIN();
+    const KernelCollection& trainSet = trainSet_;
+    const int n = trainSet.size();
+    const coord_t range = trainSet.maxLocCutPoint();
+    
+    // Rows are computed independently, then concatenated.
+    std::vector< std::vector<unsigned> > columns(n);
+    std::vector< std::vector<double> > values(n);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < n; ++i)
+    {
+      const KernelType& ki = static_cast<const KernelType&>(trainSet.at(i));
+      std::vector<int> neighbors = trainSet.neighborsWithin(ki.loc_, range);
+      std::sort(neighbors.begin(), neighbors.end());
+      for (std::vector<int>::const_iterator j = neighbors.begin();
+           j != neighbors.end(); ++j)
+      {
+        const KernelType& kj = static_cast<const KernelType&>(trainSet.at(*j));
+        double value = ki.eval(kj);
+        if (value == 0) continue;
+        columns[i].push_back(*j);
+        values[i].push_back(value);
+      }
+    }
+    
+    SparseGramMatrix sparse;
+    sparse.rowBegin.reserve(n+1);
+    sparse.rowBegin.push_back(0);
+    for (int i = 0; i < n; ++i)
+      sparse.rowBegin.push_back(sparse.rowBegin.back() + values[i].size());
+    sparse.columns.reserve(sparse.rowBegin.back());
+    sparse.values.reserve(sparse.rowBegin.back());
+    for (int i = 0; i < n; ++i)
+    {
+      sparse.columns.insert(sparse.columns.end(),
+                            columns[i].begin(), columns[i].end());
+      sparse.values.insert(sparse.values.end(),
+                           values[i].begin(), values[i].end());
+      std::vector<unsigned>().swap(columns[i]);
+      std::vector<double>().swap(values[i]);
+    }
+    std::swap(sparseGramMatrix_, sparse);
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelLogisticRegressor::computeSparseGramMatrix()
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (gramMatrix_.GetRows() != 0)
+    {
+      // The dense matrix may have been provided by the user: the sparse
+      // form must hold the same values.
+      const int n = gramMatrix_.GetRows();
+      std::vector< std::vector<unsigned> > columns(n);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+      for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+          if (gramMatrix_(i, j) != 0) columns[i].push_back(j);
+      
+      SparseGramMatrix sparse;
+      sparse.rowBegin.reserve(n+1);
+      sparse.rowBegin.push_back(0);
+      for (int i = 0; i < n; ++i)
+      {
+        for (std::vector<unsigned>::const_iterator j = columns[i].begin();
+             j != columns[i].end(); ++j)
+        {
+          sparse.columns.push_back(*j);
+          sparse.values.push_back(gramMatrix_(i, *j));
+        }
+        sparse.rowBegin.push_back(sparse.values.size());
+      }
+      std::swap(sparseGramMatrix_, sparse);
+      return;
+    }
+    
+    sparseGramMatrix_ = SparseGramMatrix();
+    if (trainSet_.empty())
+    {
+      sparseGramMatrix_.rowBegin.push_back(0);
+      return;
+    }
+    
+    trainSet_.computeKernelStatistics();
+    trainSet_.buildKdTree();
+    
+    switch (trainSet_.kernelType())
+    {
+      case kernel::base::R3:
+        staticComputeSparseGramMatrix<kernel::r3>();
+        break;
+      case kernel::base::R3XS2:
+        staticComputeSparseGramMatrix<kernel::r3xs2>();
+        break;
+      case kernel::base::R3XS2P:
+        staticComputeSparseGramMatrix<kernel::r3xs2p>();
+        break;
+      case kernel::base::SE3:
+        staticComputeSparseGramMatrix<kernel::se3>();
+        break;
+      default:
+        NUKLEI_THROW("Unknow kernel type.");
+        break;
+    }
     NUKLEI_TRACE_END();
   }
   
@@ -67,6 +260,8 @@ namespace nuklei
     NUKLEI_ASSERT(trainSet_.size() == labels_.size());
     NUKLEI_ASSERT(trainSet_.size() != 0);
     
+    if (!hasGramMatrix()) computeGramMatrix();
+    
     GMatrix vklr(trainSet_.size(), 2);
     
     klr_train(gramMatrix_, gramMatrix_.GetRows(), gramMatrix_.GetColumns(),
@@ -75,46 +270,461 @@ namespace nuklei
               delta, itrNewton);
     
     vklr_ = vklr.Transpose();
+    landmarks_ = boost::optional<KernelCollection>();
+    prepareTest();
+    
+    // Recomputed on demand by gramMatrix().
+    gramMatrix_ = GMatrix();
+    sparseGramMatrix_ = SparseGramMatrix();
     NUKLEI_TRACE_END();
   }
   
+  // Returns an index drawn with probability proportional to weights[i].
+  static unsigned sampleProportional(const std::vector<double>& weights)
+  {
+    double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+    if (!(total > 0))
+      return Random::uniformInt(weights.size());
+    double r = Random::uniform(0, total);
+    for (unsigned i = 0; i < weights.size(); ++i)
+    {
+      if (r < weights[i]) return i;
+      r -= weights[i];
+    }
+    // Rounding errors: return the last index of non-zero weight.
+    unsigned i = weights.size()-1;
+    while (i > 0 && weights[i] == 0) --i;
+    return i;
+  }
+  
+  // Returns n distinct indices drawn uniformly from [0, size).
+  static std::vector<unsigned> sampleUniform(const unsigned size,
+                                             const unsigned n)
+  {
+    std::vector<unsigned> permutation(size);
+    for (unsigned i = 0; i < size; ++i) permutation[i] = i;
+    for (unsigned i = 0; i < n; ++i)
+      std::swap(permutation[i], permutation[i + Random::uniformInt(size-i)]);
+    permutation.resize(n);
+    return permutation;
+  }
+  
+  template<class KernelType>
+  void KernelLogisticRegressor::staticTrainLowRank(const unsigned nLandmarks,
+                                                   const LandmarkSelection selection,
+                                                   const double delta,
+                                                   const unsigned itrNewton)
+  {
+    NUKLEI_TRACE_BEGIN();
+    const KernelCollection& trainSet = trainSet_;
+    const int n = trainSet.size();
+    const int m = nLandmarks;
     
-  Vector2 KernelLogisticRegressor::test(const kernel::base &t) const
+    std::vector<double> selfValues(n);
+    for (int i = 0; i < n; ++i)
+    {
+      const KernelType& ki = static_cast<const KernelType&>(trainSet.at(i));
+      selfValues[i] = ki.eval(ki);
+    }
+    
+    // -------------------- //
+    // Landmark selection:  //
+    // -------------------- //
+    
+    std::vector<unsigned> landmarks;
+    switch (selection)
+    {
+      case UNIFORM_LANDMARKS:
+      {
+        landmarks = sampleUniform(n, m);
+        break;
+      }
+      case KMEANSPP_LANDMARKS:
+      {
+        // Squared distance, in the feature space of the kernel, to the
+        // closest landmark: k(x,x) + k(l,l) - 2 k(l,x).
+        std::vector<double> sqDist(n, std::numeric_limits<double>::max());
+        landmarks.push_back(Random::uniformInt(n));
+        while (landmarks.size() < unsigned(m))
+        {
+          const int last = landmarks.back();
+          const KernelType& kl = static_cast<const KernelType&>(trainSet.at(last));
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+          for (int i = 0; i < n; ++i)
+          {
+            const KernelType& ki = static_cast<const KernelType&>(trainSet.at(i));
+            double d = selfValues[i] + selfValues[last] - 2*kl.eval(ki);
+            sqDist[i] = std::min(sqDist[i], std::max(d, 0.));
+          }
+          for (std::vector<unsigned>::const_iterator l = landmarks.begin();
+               l != landmarks.end(); ++l)
+            sqDist[*l] = 0;
+          landmarks.push_back(sampleProportional(sqDist));
+          if (sqDist[landmarks.back()] == 0)
+          {
+            // All remaining points coincide with a landmark. Fill in with
+            // points that are not landmarks yet.
+            landmarks.pop_back();
+            for (int i = 0; i < n && landmarks.size() < unsigned(m); ++i)
+              if (std::find(landmarks.begin(), landmarks.end(), unsigned(i)) ==
+                  landmarks.end())
+                landmarks.push_back(i);
+          }
+        }
+        break;
+      }
+      case LEVERAGE_LANDMARKS:
+      {
+        // Ridge leverage scores
+        //   tau_i = (k_ii - k_iS^T (K_SS + lambda I)^-1 k_iS) / lambda,
+        // approximated from a uniform pilot sample S. The regularizer
+        // lambda matches that of the objective below, which is normalized
+        // by n.
+        const double lambda = std::max(delta * n, FLOATTOL);
+        const int s = std::min(n, 2*m);
+        std::vector<unsigned> pilot = sampleUniform(n, s);
+        GMatrix Kss(s, s);
+        for (int a = 0; a < s; ++a)
+          for (int b = 0; b < s; ++b)
+          {
+            const KernelType& ka = static_cast<const KernelType&>(trainSet.at(pilot[a]));
+            const KernelType& kb = static_cast<const KernelType&>(trainSet.at(pilot[b]));
+            Kss(a, b) = ka.eval(kb);
+          }
+        for (int a = 0; a < s; ++a) Kss(a, a) += lambda;
+        const GMatrix KssInv = la::inverse(Kss);
+        
+        std::vector<double> tau(n);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < n; ++i)
+        {
+          const KernelType& ki = static_cast<const KernelType&>(trainSet.at(i));
+          std::vector<double> kiS(s);
+          for (int a = 0; a < s; ++a)
+            kiS[a] = static_cast<const KernelType&>(trainSet.at(pilot[a])).eval(ki);
+          double q = 0;
+          for (int a = 0; a < s; ++a)
+            for (int b = 0; b < s; ++b)
+              q += kiS[a] * KssInv(a, b) * kiS[b];
+          tau[i] = std::max(selfValues[i] - q, 0.) / lambda;
+        }
+        
+        // Draw without replacement.
+        while (landmarks.size() < unsigned(m))
+        {
+          unsigned l = sampleProportional(tau);
+          if (tau[l] == 0)
+          {
+            // Remaining scores are zero: fall back to uniform draws.
+            std::fill(tau.begin(), tau.end(), 1);
+            for (std::vector<unsigned>::const_iterator i = landmarks.begin();
+                 i != landmarks.end(); ++i)
+              tau[*i] = 0;
+            continue;
+          }
+          landmarks.push_back(l);
+          tau[l] = 0;
+        }
+        break;
+      }
+      default:
+        NUKLEI_THROW("Unknown landmark selection method.");
+    }
+    
+    KernelCollection basis;
+    for (std::vector<unsigned>::const_iterator l = landmarks.begin();
+         l != landmarks.end(); ++l)
+      basis.add(trainSet.at(*l));
+    basis.computeKernelStatistics();
+    basis.buildKdTree();
+    const KernelCollection& cbasis = basis;
+    
+    // ---------------------- //
+    // Kernel feature map:    //
+    // ---------------------- //
+    
+    // Knm(i,l) = k_l(x_i), with the same convention as test().
+    GMatrix Knm(n, m);
+    std::vector< std::vector<int> > nonZeros(n);
+    const coord_t range = cbasis.maxLocCutPoint();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < n; ++i)
+    {
+      const KernelType& ki = static_cast<const KernelType&>(trainSet.at(i));
+      nonZeros[i] = cbasis.neighborsWithin(ki.loc_, range);
+      for (std::vector<int>::const_iterator l = nonZeros[i].begin();
+           l != nonZeros[i].end(); ++l)
+        Knm(i, *l) = static_cast<const KernelType&>(cbasis.at(*l)).eval(ki);
+    }
+    
+    GMatrix Kmm(m, m);
+    for (int a = 0; a < m; ++a)
+      for (int b = 0; b < m; ++b)
+      {
+        const KernelType& ka = static_cast<const KernelType&>(cbasis.at(a));
+        const KernelType& kb = static_cast<const KernelType&>(cbasis.at(b));
+        Kmm(a, b) = ka.eval(kb);
+      }
+    // Bandwidths may differ among kernels: symmetrize the penalty.
+    Kmm = (Kmm + Kmm.Transpose()) * .5;
+    
+    // ---------------- //
+    // Newton's method: //
+    // ---------------- //
+    
+    // Minimizes
+    //   1/n sum_i logloss(y_i, f_i) + delta/2 alpha^T Kmm alpha,
+    // with f = Knm alpha, and y_i = 1 for class 2.
+    GVector alpha(m);
+    for (unsigned itr = 0; itr < itrNewton; ++itr)
+    {
+      std::vector<double> residual(n), curvature(n);
+      for (int i = 0; i < n; ++i)
+      {
+        double f = 0;
+        for (std::vector<int>::const_iterator l = nonZeros[i].begin();
+             l != nonZeros[i].end(); ++l)
+          f += Knm(i, *l) * alpha[*l];
+        double p = 1 / (1 + std::exp(-f));
+        residual[i] = (p - (labels_.at(i) == 2 ? 1 : 0)) / n;
+        curvature[i] = p * (1 - p) / n;
+      }
+      
+      GMatrix H = Kmm * delta;
+      GVector g = (Kmm * alpha) * delta;
+      for (int a = 0; a < m; ++a) H(a, a) += FLOATTOL;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+      {
+        GMatrix localH(m, m);
+        GVector localG(m);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+        for (int i = 0; i < n; ++i)
+        {
+          const std::vector<int>& nz = nonZeros[i];
+          for (std::vector<int>::const_iterator a = nz.begin(); a != nz.end(); ++a)
+          {
+            localG[*a] += Knm(i, *a) * residual[i];
+            for (std::vector<int>::const_iterator b = nz.begin(); b != nz.end(); ++b)
+              localH(*a, *b) += Knm(i, *a) * curvature[i] * Knm(i, *b);
+          }
+        }
+#ifdef _OPENMP
+#pragma omp critical(nuklei_klr_low_rank)
+#endif
+        {
+          H += localH;
+          g += localG;
+        }
+      }
+      
+      alpha -= la::inverse(H) * g;
+    }
+    
+    // With the weights (0, alpha), the two-class softmax of test() is the
+    // logistic function of f.
+    GMatrix vklr(2, m);
+    for (int l = 0; l < m; ++l)
+      vklr(1, l) = alpha[l];
+    vklr_ = vklr;
+    landmarks_ = basis;
+    prepareTest();
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelLogisticRegressor::trainLowRank(const unsigned nLandmarks,
+                                             const LandmarkSelection selection,
+                                             const double delta,
+                                             const unsigned itrNewton)
+  {
+    NUKLEI_TRACE_BEGIN();
+    
+    NUKLEI_ASSERT(trainSet_.size() == labels_.size());
+    NUKLEI_ASSERT(trainSet_.size() != 0);
+    NUKLEI_ASSERT(0 < nLandmarks && nLandmarks <= trainSet_.size());
+    for (std::vector<int>::const_iterator l = labels_.begin();
+         l != labels_.end(); ++l)
+      if (*l != 1 && *l != 2)
+        NUKLEI_THROW("Labels should be 1 or 2.");
+    
+    switch (trainSet_.kernelType())
+    {
+      case kernel::base::R3:
+        staticTrainLowRank<kernel::r3>(nLandmarks, selection, delta, itrNewton);
+        break;
+      case kernel::base::R3XS2:
+        staticTrainLowRank<kernel::r3xs2>(nLandmarks, selection, delta, itrNewton);
+        break;
+      case kernel::base::R3XS2P:
+        staticTrainLowRank<kernel::r3xs2p>(nLandmarks, selection, delta, itrNewton);
+        break;
+      case kernel::base::SE3:
+        staticTrainLowRank<kernel::se3>(nLandmarks, selection, delta, itrNewton);
+        break;
+      default:
+        NUKLEI_THROW("Unknow kernel type.");
+        break;
+    }
+    NUKLEI_TRACE_END();
+  }
+  
+    
+  void KernelLogisticRegressor::prepareTest()
   {
     NUKLEI_TRACE_BEGIN();
     NUKLEI_ASSERT(vklr_);
-    Vector2 pr;
+    KernelCollection& b = landmarks_ ? *landmarks_ : trainSet_;
+    NUKLEI_ASSERT(vklr_->GetRows() == 2);
+    NUKLEI_ASSERT(vklr_->GetColumns() == int(b.size()));
+    b.computeKernelStatistics();
+    b.buildKdTree();
     
-    GMatrix Ktest(trainSet_.size(), 1);
-    for (unsigned i = 0; i < trainSet_.size(); ++i)
+    testWeights_.resize(2*b.size());
+    for (unsigned i = 0; i < b.size(); ++i)
     {
-      Ktest(i, 0) = trainSet_.at(i).polyEval(t);
+      testWeights_[2*i] = (*vklr_)(0, i);
+      testWeights_[2*i+1] = (*vklr_)(1, i);
     }
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelLogisticRegressor::compactModel(KernelCollection &support,
+                                             std::vector<double> &weights) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!vklr_)
+      NUKLEI_THROW("Untrained classifier.");
+    const KernelCollection& b = basis();
+    
+    // The class probabilities only depend on the difference between the
+    // two class weights.
+    double largest = 0;
+    for (unsigned i = 0; i < b.size(); ++i)
+      largest = std::max(largest,
+                         std::fabs(testWeights_[2*i+1] - testWeights_[2*i]));
+    
+    support.clear();
+    weights.clear();
+    for (unsigned i = 0; i < b.size(); ++i)
+    {
+      double difference = std::fabs(testWeights_[2*i+1] - testWeights_[2*i]);
+      if (difference < KLR_PRUNING_TOLERANCE * largest) continue;
+      if (largest == 0 && !support.empty()) continue;
+      support.add(b.at(i));
+      weights.push_back(testWeights_[2*i]);
+      weights.push_back(testWeights_[2*i+1]);
+    }
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelLogisticRegressor::setModel(const KernelCollection &support,
+                                         const std::vector<double> &weights)
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_ASSERT(!support.empty());
+    NUKLEI_ASSERT(weights.size() == 2*support.size());
+    
+    GMatrix vklr(2, support.size());
+    for (unsigned i = 0; i < support.size(); ++i)
+    {
+      vklr(0, i) = weights[2*i];
+      vklr(1, i) = weights[2*i+1];
+    }
+    
+    trainSet_.clear();
+    labels_.clear();
+    gramMatrix_ = GMatrix();
+    sparseGramMatrix_ = SparseGramMatrix();
+    vklr_ = vklr;
+    landmarks_ = support;
+    prepareTest();
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelLogisticRegressor::compact()
+  {
+    NUKLEI_TRACE_BEGIN();
+    KernelCollection support;
+    std::vector<double> weights;
+    compactModel(support, weights);
+    setModel(support, weights);
+    NUKLEI_TRACE_END();
+  }
+  
+  template<class KernelType>
+  Vector2 KernelLogisticRegressor::staticTest(const kernel::base &t) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    const KernelCollection& b = basis();
+    const KernelType& k = static_cast<const KernelType&>(t);
     
-    GMatrix f = *vklr_ * Ktest;
-    double m = std::max(f(0,0), f(1,0));
+    // f = vklr * Ktest, where Ktest is zero beyond the cut point.
+    double f0 = 0, f1 = 0;
+    std::vector<int> neighbors = b.neighborsWithin(k.loc_, b.maxLocCutPoint());
+    for (std::vector<int>::const_iterator i = neighbors.begin();
+         i != neighbors.end(); ++i)
+    {
+      double value = static_cast<const KernelType&>(b.at(*i)).eval(k);
+      f0 += testWeights_[2*(*i)] * value;
+      f1 += testWeights_[2*(*i)+1] * value;
+    }
     
-    double e1 = std::exp(f(0,0)-m), e2 = std::exp(f(1,0)-m);
+    Vector2 pr;
+    double m = std::max(f0, f1);
+    double e1 = std::exp(f0-m), e2 = std::exp(f1-m);
     pr.X() = e1/(e1+e2);
     pr.Y() = e2/(e1+e2);
-    
     return pr;
     NUKLEI_TRACE_END();
   }
   
+  Vector2 KernelLogisticRegressor::test(const kernel::base &t) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_ASSERT(vklr_);
+    NUKLEI_ASSERT(basis().kernelType() == t.polyType());
+    
+    switch (t.polyType())
+    {
+      case kernel::base::R3:
+        return staticTest<kernel::r3>(t);
+      case kernel::base::R3XS2:
+        return staticTest<kernel::r3xs2>(t);
+      case kernel::base::R3XS2P:
+        return staticTest<kernel::r3xs2p>(t);
+      case kernel::base::SE3:
+        return staticTest<kernel::se3>(t);
+      default:
+        NUKLEI_THROW("Unknow kernel type.");
+    }
+    NUKLEI_TRACE_END();
+  }
+  
   
   GMatrix KernelLogisticRegressor::test(const KernelCollection &testSet) const
   {
     NUKLEI_TRACE_BEGIN();
     
-    GMatrix pr(2, testSet.size());
+    const int n = testSet.size();
+    GMatrix pr(2, n);
     
-    for (KernelCollection::const_iterator ti = testSet.begin();
-         ti != testSet.end(); ++ti)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+    for (int i = 0; i < n; ++i)
     {
-      Vector2 p = test(*ti);
-      pr(0,std::distance(testSet.begin(), ti)) = p.X();
-      pr(1,std::distance(testSet.begin(), ti)) = p.Y();
+      Vector2 p = test(testSet.at(i));
+      pr(0,i) = p.X();
+      pr(1,i) = p.Y();
     }
     return pr;
     NUKLEI_TRACE_END();
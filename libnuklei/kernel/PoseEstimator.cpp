@@ -6,7 +6,10 @@
 
 #include <nuklei/PoseEstimator.h>
 #include <boost/bind.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/filesystem.hpp>
 #include <nuklei/parallelizer.h>
+#include <nuklei/SubsamplingPolicy.h>
 
 namespace nuklei
 {
@@ -22,7 +25,9 @@ namespace nuklei
   loc_h_(locH), ori_h_(oriH),
   nChains_(nChains), n_(n),
   cif_(cif), partialview_(partialview),
-  progress_(progress), meshTol_(4)
+  progress_(progress), meshTol_(4), writeMesh_(false),
+  icpType_(ICP_NONE), icpIterations_(10), nSteps_(-1),
+  informativeSubset_(false)
   {
     if (nChains_ <= 0) nChains_ = 8;
     parallel_ = typeFromName<parallelizer>(PARALLELIZATION);
@@ -33,32 +38,25 @@ namespace nuklei
   PoseEstimator::modelToSceneTransformation(const boost::optional<kernel::se3>& gtTransfo) const
   {
     NUKLEI_TRACE_BEGIN();
-    int n = -1;
+    int n = numberOfModelPoints();
     
-    if (n_ <= 0)
+    if (n_ <= 0 && n < objectModel_.size())
     {
-      n = objectModel_.size();
-      if (n > 1000)
-      {
-        NUKLEI_WARN("Warning: Object model has more than 1000 points. "
-                    "To keep computational cost low, only 1000 points will be "
-                    "used at each inference loop. "
-                    "Use -n to force a large number of model points.");
-        n = 1000;
-      }
+      NUKLEI_WARN("Warning: Object model has more than 1000 points. "
+                  "To keep computational cost low, only 1000 points will be "
+                  "used at each inference loop. "
+                  "Use -n to force a large number of model points.");
     }
-    else
-      n = n_;
     
     KernelCollection poses;
-    if (!hasOpenMP())
+    if (parallel_ == parallelizer::OPENMP && !hasOpenMP())
     {
       NUKLEI_WARN("Nuklei has not been compiled with OpenMP support. "
                   "Pose estimation will use a single core.");
     }
     
     if (progress_)
-      pi_->initialize(0, 10*n*(partialview_?4:1)*nChains_ / 10, "Estimating pose", 0);
+      pi_->initialize(0, numberOfSteps(n)*nChains_ / 10, "Estimating pose", 0);
     
     parallelizer p(nChains_, parallel_);
     std::vector<kernel::se3> retv =
@@ -95,6 +93,16 @@ namespace nuklei
     kernel::se3 pose(*poses.sortBegin(1));
     pose.setWeight(findMatchingScore(pose));
     
+    if (icpType_ != ICP_NONE)
+    {
+      kernel::se3 refined = icpRefinement(pose);
+      refined.setWeight(findMatchingScore(refined));
+      // ICP minimizes a geometric error, not the matching score. Keep the
+      // MCMC pose if refinement made things worse.
+      if (refined.getWeight() >= pose.getWeight())
+        pose = refined;
+    }
+    
     return pose;
     NUKLEI_TRACE_END();
   }
@@ -154,6 +162,152 @@ namespace nuklei
     NUKLEI_TRACE_END();
   }
   
+  // Adds the contribution of a pair (p, q) to the normal equations of the
+  // linearized registration problem, where p is a transformed model point, q
+  // is its scene match, and n is the direction along which p - q is measured.
+  // The unknowns are a rotation vector w and a translation t, with
+  // p + w x p + t approximating the updated p.
+  static inline void accumulateIcpTerm(coord_t A[6][6], coord_t b[6],
+                                       const Vector3& p, const Vector3& q,
+                                       const Vector3& n)
+  {
+    Vector3 c = p.Cross(n);
+    coord_t J[6] = { c.X(), c.Y(), c.Z(), n.X(), n.Y(), n.Z() };
+    coord_t r = (p - q).Dot(n);
+    for (int i = 0; i < 6; ++i)
+    {
+      for (int j = 0; j < 6; ++j)
+        A[i][j] += J[i] * J[j];
+      b[i] -= J[i] * r;
+    }
+  }
+  
+  kernel::se3
+  PoseEstimator::icpRefinement(const kernel::se3& pose) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (icpType_ == ICP_NONE || icpIterations_ <= 0)
+      return pose;
+    
+    const bool pointToPlane = (icpType_ == ICP_POINT_TO_PLANE);
+    if (pointToPlane && sceneModel_.kernelType() != kernel::base::R3XS2P)
+      NUKLEI_THROW("Point-to-plane ICP requires scene normals.");
+    
+    kernel::se3 current = pose;
+    
+    // In partial-view mode, only the visible side of the model is registered.
+    std::vector<int> indices;
+    if (partialview_)
+    {
+      Vector3 mean = objectModel_.mean()->getLoc();
+      Vector3 v = la::normalized(viewpointInFrame(current) - mean);
+      indices = objectModel_.partialView(v, meshTol_, true, true);
+    }
+    else
+    {
+      for (int i = 0; i < int(objectModel_.size()); ++i)
+        indices.push_back(i);
+    }
+    
+    // Pairs farther apart than the kernel bandwidth are considered outliers.
+    const coord_t maxDist = loc_h_;
+    const int nIndices = indices.size();
+    
+    for (int it = 0; it < icpIterations_; ++it)
+    {
+      coord_t A[6][6] = { { 0 } };
+      coord_t b[6] = { 0 };
+      int nPairs = 0;
+      
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+      {
+        coord_t localA[6][6] = { { 0 } };
+        coord_t localB[6] = { 0 };
+        int localPairs = 0;
+        
+#ifdef _OPENMP
+#pragma omp for
+#endif
+        for (int i = 0; i < nIndices; ++i)
+        {
+          Vector3 p = la::transform(current.loc_, current.ori_,
+                                    objectModel_.at(indices[i]).getLoc());
+          std::pair<int, coord_t> nn = sceneModel_.nearestNeighbor(p);
+          if (nn.second > maxDist) continue;
+          
+          const kernel::base& match = sceneModel_.at(nn.first);
+          if (pointToPlane)
+          {
+            const Vector3& n = static_cast<const kernel::r3xs2p&>(match).dir_;
+            accumulateIcpTerm(localA, localB, p, match.getLoc(), n);
+          }
+          else
+          {
+            accumulateIcpTerm(localA, localB, p, match.getLoc(), Vector3::UNIT_X);
+            accumulateIcpTerm(localA, localB, p, match.getLoc(), Vector3::UNIT_Y);
+            accumulateIcpTerm(localA, localB, p, match.getLoc(), Vector3::UNIT_Z);
+          }
+          localPairs++;
+        }
+        
+#ifdef _OPENMP
+#pragma omp critical(nuklei_icpRefinement_merge)
+#endif
+        {
+          for (int r = 0; r < 6; ++r)
+          {
+            for (int c = 0; c < 6; ++c)
+              A[r][c] += localA[r][c];
+            b[r] += localB[r];
+          }
+          nPairs += localPairs;
+        }
+      }
+      
+      if (nPairs < 6)
+      {
+        NUKLEI_WARN("ICP: not enough correspondences (" << nPairs << ").");
+        break;
+      }
+      
+      GMatrix M(6, 6), Minv(6, 6);
+      for (int r = 0; r < 6; ++r)
+        for (int c = 0; c < 6; ++c)
+          M(r, c) = A[r][c];
+      if (!M.GetInverse(Minv))
+      {
+        NUKLEI_WARN("ICP: degenerate correspondences.");
+        break;
+      }
+      
+      coord_t x[6] = { 0 };
+      for (int r = 0; r < 6; ++r)
+        for (int c = 0; c < 6; ++c)
+          x[r] += Minv(r, c) * b[c];
+      
+      Vector3 w(x[0], x[1], x[2]);
+      kernel::se3 delta;
+      delta.loc_ = Vector3(x[3], x[4], x[5]);
+      coord_t angle = w.Length();
+      if (angle > 0)
+        delta.ori_.FromAxisAngle(w / angle, angle);
+      
+      current = current.transformedWith(delta);
+      current.ori_ = la::normalized(current.ori_);
+      
+      if (angle < 1e-6 && delta.loc_.Length() < 1e-6 * objectSize_)
+        break;
+    }
+    
+    current.loc_h_ = pose.loc_h_;
+    current.ori_h_ = pose.ori_h_;
+    current.setWeight(pose.getWeight());
+    return current;
+    NUKLEI_TRACE_END();
+  }
+  
   void PoseEstimator::load(const std::string& objectFilename,
                            const std::string& sceneFilename,
                            const std::string& meshfile,
@@ -162,17 +316,28 @@ namespace nuklei
                            const bool computeNormals)
   {
     NUKLEI_TRACE_BEGIN();
-    KernelCollection objectModel, sceneModel;
-    readObservations(objectFilename, objectModel);
-    readObservations(sceneFilename, sceneModel);
-    Vector3 viewpoint(0, 0, 0);
+    std::vector<ObservationFile> files;
+    files.push_back(ObservationFile(objectFilename));
+    files.push_back(ObservationFile(sceneFilename));
+    // Normals of an R3 scene are computed from the whole cloud before it is
+    // subsampled (see load_()). The type of the scene is only known once
+    // it is read, so the scene is sampled while it is read only if normals
+    // are not computed.
+    if (light && !computeNormals)
+      files.back().policy.reset(new WeightedReservoirSampling(LIGHT_SCENE_SIZE));
+    readObservations(files);
+    objectModel_.clear();
+    objectModel_.transfer(files.front().kernels);
+    sceneModel_.clear();
+    sceneModel_.transfer(files.back().kernels);
+    
+    viewpoint_ = Vector3(0, 0, 0);
     if (partialview_)
     {
       NUKLEI_ASSERT(!viewpointfile.empty());
-      viewpoint = kernel::se3(*readSingleObservation(viewpointfile)).getLoc();
+      viewpoint_ = kernel::se3(*readSingleObservation(viewpointfile)).getLoc();
     }
-    load(objectModel, sceneModel, meshfile, viewpoint,
-         light, computeNormals);
+    load_(meshfile, light, computeNormals);
     NUKLEI_TRACE_END();
   }
   
@@ -188,37 +353,116 @@ namespace nuklei
     objectModel_ = objectModel;
     sceneModel_ = sceneModel;
     viewpoint_ = viewpoint;
+    load_(meshfile, light, computeNormals);
+    NUKLEI_TRACE_END();
+  }
+  
+  
+  namespace {
     
-    if (objectModel_.size() == 0 || sceneModel_.size() == 0)
-      NUKLEI_THROW("Empty input cloud.");
-    
-    if (objectModel_.front().polyType() == kernel::base::R3)
+    void computeNormalsOfR3(KernelCollection& kc)
     {
-      if (computeNormals)
+      if (kc.front().polyType() == kernel::base::R3)
       {
-        objectModel_.buildNeighborSearchTree();
-        objectModel_.computeSurfaceNormals();
+        kc.buildNeighborSearchTree();
+        kc.computeSurfaceNormals();
       }
     }
     
-    if (sceneModel_.front().polyType() == kernel::base::R3)
+    // First exception thrown by one of several threads.
+    class FirstError
     {
-      if (computeNormals)
+    public:
+      // Call from a catch block.
+      void capture(const std::string& what)
+      {
+        boost::exception_ptr e = boost::current_exception();
+#ifdef _OPENMP
+#pragma omp critical(nuklei_FirstError_capture)
+#endif
+        if (!error_)
+        {
+          error_ = e;
+          what_ = what;
+        }
+      }
+      
+      // Rethrows the exception with its original type. Without
+      // std::exception_ptr, Boost cannot copy exceptions of types it does
+      // not know; their message is then rethrown as an Error.
+      void rethrow() const
       {
-        sceneModel_.buildNeighborSearchTree();
-        sceneModel_.computeSurfaceNormals();
+        if (!error_) return;
+        try {
+          boost::rethrow_exception(error_);
+        } catch (boost::unknown_exception&) {
+          if (what_.empty()) throw;
+          NUKLEI_THROW(what_);
+        }
       }
+      
+    private:
+      boost::exception_ptr error_;
+      std::string what_;
+    };
+    
+    // Runs a and b on two OpenMP threads, and rethrows the first exception
+    // they throw once both are done.
+    template<typename A, typename B>
+    void runConcurrently(A a, B b)
+    {
+      FirstError error;
+#ifdef _OPENMP
+#pragma omp parallel sections
+#endif
+      {
+#ifdef _OPENMP
+#pragma omp section
+#endif
+        try {
+          a();
+        } catch (std::exception& e) {
+          error.capture(e.what());
+        } catch (...) {
+          error.capture("");
+        }
+#ifdef _OPENMP
+#pragma omp section
+#endif
+        try {
+          b();
+        } catch (std::exception& e) {
+          error.capture(e.what());
+        } catch (...) {
+          error.capture("");
+        }
+      }
+      error.rethrow();
     }
     
+  }
+  
+  void PoseEstimator::load_(const std::string& meshfile,
+                            const bool light,
+                            const bool computeNormals)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (objectModel_.size() == 0 || sceneModel_.size() == 0)
+      NUKLEI_THROW("Empty input cloud.");
+    
+    if (computeNormals)
+      runConcurrently(boost::bind(computeNormalsOfR3, boost::ref(objectModel_)),
+                      boost::bind(computeNormalsOfR3, boost::ref(sceneModel_)));
+    
     if (objectModel_.front().polyType() != sceneModel_.front().polyType())
       NUKLEI_THROW("Input point clouds must be defined on the same domain.");
     
-    if (light && sceneModel_.size() > 10000)
+    if (light && sceneModel_.size() > LIGHT_SCENE_SIZE)
     {
       sceneModel_.computeKernelStatistics();
       KernelCollection tmp;
       KernelCollection::sample_iterator i =
-      sceneModel_.sampleBegin(10000);
+      sceneModel_.sampleBegin(LIGHT_SCENE_SIZE);
       for (; i != i.end(); i++)
       {
         tmp.add(*i);
@@ -231,22 +475,48 @@ namespace nuklei
     if (loc_h_ <= 0)
       loc_h_ = objectSize_ / 10;
     
-    sceneModel_.setKernelLocH(loc_h_);
-    sceneModel_.setKernelOriH(ori_h_);
-    objectModel_.setKernelLocH(loc_h_);
-    objectModel_.setKernelOriH(ori_h_);
-    
-    objectModel_.computeKernelStatistics();
-    sceneModel_.computeKernelStatistics();
-    sceneModel_.buildKdTree();
+    runConcurrently(boost::bind(&PoseEstimator::prepareObjectModel_, this),
+                    boost::bind(&PoseEstimator::prepareSceneModel_, this));
     
     if (partialview_)
     {
-      if (!meshfile.empty())
+      if (meshfile.empty())
+        objectModel_.buildMesh();
+      else if (boost::filesystem::exists(meshfile))
         objectModel_.readMeshFromOffFile(meshfile);
-      else
+      else if (writeMesh_)
+      {
         objectModel_.buildMesh();
-      objectModel_.buildPartialViewCache(meshTol_, as_const(objectModel_).front().polyType() == kernel::base::R3XS2P);
+        objectModel_.writeMeshToOffFile(meshfile);
+        // Reload the mesh, for the view cache to be keyed on the mesh as
+        // it is stored on disk.
+        objectModel_.readMeshFromOffFile(meshfile);
+      }
+      else
+        NUKLEI_THROW("Mesh file `" << meshfile << "' does not exist.");
+      
+      bool useRayToSurfacenormalAngle =
+        as_const(objectModel_).front().polyType() == kernel::base::R3XS2P;
+      std::string viewcachefile;
+      if (!meshfile.empty())
+        viewcachefile = meshfile + ".views";
+      if (viewcachefile.empty() ||
+          !objectModel_.readPartialViewCache(viewcachefile, meshTol_,
+                                             useRayToSurfacenormalAngle))
+      {
+        objectModel_.buildPartialViewCache(meshTol_, useRayToSurfacenormalAngle);
+        // The cache only saves time on the next load. Failing to write it
+        // should not fail this one.
+        if (!viewcachefile.empty())
+        {
+          try {
+            objectModel_.writePartialViewCache(viewcachefile);
+          } catch (std::exception& e) {
+            NUKLEI_WARN("Cannot write view cache `" << viewcachefile <<
+                        "': " << e.what());
+          }
+        }
+      }
     }
     
     // Create dummy ProgressIndicator
@@ -255,6 +525,35 @@ namespace nuklei
     NUKLEI_TRACE_END();
   }
   
+  void PoseEstimator::prepareObjectModel_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    objectModel_.setKernelLocH(loc_h_);
+    objectModel_.setKernelOriH(ori_h_);
+    objectModel_.computeKernelStatistics();
+    
+    modelSubset_.clear();
+    modelSubsetRank_.clear();
+    if (informativeSubset_)
+    {
+      modelSubset_ = objectModel_.informativeSubset(numberOfModelPoints());
+      modelSubsetRank_.assign(objectModel_.size(), objectModel_.size());
+      for (unsigned i = 0; i < modelSubset_.size(); ++i)
+        modelSubsetRank_.at(modelSubset_.at(i)) = i;
+    }
+    NUKLEI_TRACE_END();
+  }
+  
+  void PoseEstimator::prepareSceneModel_()
+  {
+    NUKLEI_TRACE_BEGIN();
+    sceneModel_.setKernelLocH(loc_h_);
+    sceneModel_.setKernelOriH(ori_h_);
+    sceneModel_.computeKernelStatistics();
+    sceneModel_.buildKdTree();
+    NUKLEI_TRACE_END();
+  }
+  
   
   // Temperature function (cooling factor)
   double PoseEstimator::Ti(const unsigned i, const unsigned F)
@@ -267,6 +566,17 @@ namespace nuklei
     }
   }
   
+  struct SubsetRankLess
+  {
+    SubsetRankLess(const std::vector<int>& rank) : rank_(rank) {}
+    bool operator()(const int a, const int b) const
+    {
+      return rank_[a] < rank_[b];
+    }
+  private:
+    const std::vector<int>& rank_;
+  };
+  
   bool PoseEstimator::recomputeIndices(std::vector<int>& indices,
                                        const kernel::se3& nextPose,
                                        const int n) const
@@ -276,11 +586,17 @@ namespace nuklei
     std::vector<int> pindices = objectModel_.partialView(v, meshTol_, true, true);
     
     if (pindices.size() < 20) return false;
-    indices = pindices;
+    indices.swap(pindices);
     
     //      indices = objectModel_.partialView(viewpointInFrame(nextPose),
     //                                         meshTol_);
     std::random_shuffle(indices.begin(), indices.end(), Random::uniformInt);
+    if (!modelSubset_.empty())
+    {
+      // Visible points of the informative subset first, in subset order.
+      std::stable_sort(indices.begin(), indices.end(),
+                       SubsetRankLess(modelSubsetRank_));
+    }
     if (indices.size() > n)
       indices.resize(n);
     return true;
@@ -302,16 +618,24 @@ namespace nuklei
   {
     NUKLEI_TRACE_BEGIN();
     
-    // Randomly select particles from the object model
     std::vector<int> indices;
-    for (KernelCollection::const_sample_iterator
-         i = objectModel_.sampleBegin(n);
-         i != i.end();
-         i++)
+    if (!modelSubset_.empty())
     {
-      indices.push_back(i.index());
+      // Precomputed subset, most informative points first
+      indices = modelSubset_;
+    }
+    else
+    {
+      // Randomly select particles from the object model
+      for (KernelCollection::const_sample_iterator
+           i = objectModel_.sampleBegin(n);
+           i != i.end();
+           i++)
+      {
+        indices.push_back(i.index());
+      }
+      std::random_shuffle(indices.begin(), indices.end(), Random::uniformInt);
     }
-    std::random_shuffle(indices.begin(), indices.end(), Random::uniformInt);
     
     // Next chain state
     kernel::se3 nextPose;
@@ -455,11 +779,7 @@ namespace nuklei
     bestPose.setWeight(currentWeight);
     metropolisHastings(currentPose, currentWeight, 1, true, n);
     
-    //fixme: See if nSteps should be computed as a function of n.
-    int nSteps = 1000;
-    if (partialview_) nSteps = 1000;
-    //fixme:
-    nSteps = 10*n*(partialview_?4:1);
+    int nSteps = numberOfSteps(n);
     
     for (int i = 0; i < nSteps; i++)
     {
@@ -497,6 +817,20 @@ namespace nuklei
     NUKLEI_TRACE_END();
   }
   
+  int PoseEstimator::numberOfModelPoints() const
+  {
+    if (n_ > 0) return n_;
+    return std::min(int(objectModel_.size()), 1000);
+  }
+  
+  int PoseEstimator::numberOfSteps(const int n) const
+  {
+    // The bandwidth schedule of mcmc() needs at least two steps.
+    if (nSteps_ > 0) return std::max(nSteps_, 2);
+    //fixme: See if nSteps should be computed as a function of n.
+    return 10*n*(partialview_?4:1);
+  }
+  
   Vector3 PoseEstimator::viewpointInFrame(const kernel::se3& frame) const
   {
     kernel::se3 origin;
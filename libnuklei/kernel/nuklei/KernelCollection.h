@@ -231,6 +231,23 @@ namespace nuklei {
       void add(const kernel::base &f);
       /** @brief Adds a copy of the kernels contained in @p kv. */
       void add(const KernelCollection &kv);
+      /**
+       * @brief Moves the kernels of @p batch to the end of the collection,
+       * leaving @p batch empty.
+       *
+       * Kernels are not copied, and intermediary results are invalidated
+       * once for the whole batch.
+       */
+      void transfer(Container &batch);
+      /**
+       * @brief Moves all the kernels to the end of @p batch, leaving the
+       * collection empty.
+       *
+       * This is the converse of #transfer(). Kernels are not copied.
+       */
+      void release(Container &batch);
+      /** @brief Reserves memory for @p n kernels. */
+      void reserve(const Container::size_type n) { kernels_.reserve(n); }
       /** @brief Replaces the @p idx'th kernel with a copy of @p k. */
       void replace(const size_t idx, const kernel::base &k);
       kernel::base::Type kernelType() const;
@@ -419,6 +436,21 @@ namespace nuklei {
        * internally. See @ref intermediary.
        */
       void buildKdTree();
+      /**
+       * @brief Returns the index of the kernel whose location is closest to
+       * @p loc, and the distance between @p loc and that kernel.
+       *
+       * Precede by a call to #buildKdTree(). See @ref intermediary.
+       */
+      std::pair<int, coord_t> nearestNeighbor(const Vector3& loc) const;
+      /**
+       * @brief Returns the indices of the kernels whose location is within
+       * @p radius of @p loc, in no particular order.
+       *
+       * Precede by a call to #buildKdTree(). See @ref intermediary.
+       */
+      std::vector<int> neighborsWithin(const Vector3& loc,
+                                       const coord_t radius) const;
       /**
        * @brief Builds a neighbor search tree of the kernel positions and stores
        * the tree internally. See @ref intermediary.
@@ -438,6 +470,12 @@ namespace nuklei {
       bool isWithinConvexHull(const kernel::base& k) const;
       /**
        * @brief Builds a mesh from kernel positions. See @ref intermediary.
+       *
+       * If the environment variable @c NUKLEI_MESH_CACHE_DIR names a
+       * directory, the mesh and its bounding volume hierarchy are stored
+       * there, in a file named after a hash of the kernel positions and of
+       * the meshing parameters. Later calls on the same positions read the
+       * mesh from that file instead of reconstructing it.
        */
       void buildMesh();
       void writeMeshToOffFile(const std::string& filename) const;
@@ -446,18 +484,46 @@ namespace nuklei {
       void readMeshFromPlyFile(const std::string& filename);
       /**
        * @brief Builds set of partial views of the object. See @ref intermediary.
+       *
+       * Views are computed in parallel from a fixed set of directions evenly
+       * spread around the object, so that two calls on the same model and
+       * mesh produce the same cache.
        */
       void buildPartialViewCache(const double meshTol, const bool useRayToSurfacenormalAngle = false);
+      /**
+       * @brief Writes the partial view cache to @p filename.
+       *
+       * The file records a hash of the model points, the mesh, and the
+       * parameters given to buildPartialViewCache(). See
+       * readPartialViewCache().
+       */
+      void writePartialViewCache(const std::string& filename) const;
+      /**
+       * @brief Reads a partial view cache written by writePartialViewCache().
+       *
+       * Returns false and leaves the collection untouched if @p filename
+       * does not exist, if it is truncated or is not a cache in the current
+       * format, or if the cache it contains was computed for different
+       * model points, a different mesh, or different parameters.
+       * Precede by a call to buildMesh() or readMeshFromOffFile().
+       */
+      bool readPartialViewCache(const std::string& filename,
+                                const double meshTol,
+                                const bool useRayToSurfacenormalAngle = false);
       /**
        * @brief Assuming that the points in this collection form the surface of
        * an object, this function computes whether a point @p p is visible from
        * @p viewpoint, or if it is occluded by the object.
        *
        * This function requires prior computation of a surface mesh from the
-       * points of the collection. See buildMesh().
+       * points of the collection, see buildMesh(), or a mesh read with
+       * readMeshFromOffFile(). Reading a mesh does not require the partial
+       * view (CGAL) build of Nuklei.
        *
        * This function computes whether a segment linking @p viewpoint to @p p
-       * intersects with the mesh.
+       * intersects with the mesh. Intersections are searched in a bounding
+       * volume hierarchy of the mesh triangles, and the search stops at the
+       * first occluding triangle.
        *
        * If @p tolerance is greater than 0, the function computes whether a
        * segment linking @p viewpoint to \f[ viewpoint + (p - viewpoint)
@@ -478,6 +544,17 @@ namespace nuklei {
        * @p viewpoint.
        *
        * See isVisibleFrom() for more details.
+       *
+       * If @p useViewcache is true, @p viewpoint is interpreted as a viewing
+       * direction (from the center of the object towards the camera), and
+       * the view of the closest cached direction is returned. See
+       * buildPartialViewCache().
+       *
+       * If the environment variable @c NUKLEI_PARTIAL_VIEW_DEPTH_BUFFER is
+       * set to 1, the mesh is rendered once into a depth buffer of
+       * @c NUKLEI_DEPTH_BUFFER_RESOLUTION pixels squared, and points are
+       * classified by comparing their depth to the buffer, instead of
+       * casting one ray per point.
        */
       std::vector<int> partialView(const Vector3& viewpoint,
                                    const coord_t& tolerance = FLOATTOL,
@@ -505,6 +582,24 @@ namespace nuklei {
                        const bool useViewcache = false,
                        const bool useRayToSurfacenormalAngle = false) const;
       
+      /**
+       * @brief Returns the indices of @p n kernels that cover the collection
+       * evenly, ordered so that the most informative kernels come first.
+       *
+       * Kernel positions are binned into voxels sized so that about @p n
+       * voxels are occupied, and one kernel is taken per voxel before a
+       * voxel contributes a second one. Voxels in which the directions of
+       * r3xs2 and r3xs2p kernels vary most (edges, corners) come first, and
+       * consecutive indices alternate between surface orientations, so that
+       * short prefixes of the returned list already span several faces of
+       * the object. For kernels without a direction, the ordering alternates
+       * between octants around the mean position.
+       *
+       * This method runs in @f$ O(N \log N) @f$ time, where @f$ N @f$ is
+       * the number of kernels in the collection.
+       */
+      std::vector<int> informativeSubset(const size_t n) const;
+      
       // Density-related methods
             
       /**
@@ -574,7 +669,7 @@ namespace nuklei {
       const static int KDTREE_KEY;
       const static int NSTREE_KEY;
       const static int MESH_KEY;
-      const static int AABBTREE_KEY;
+      const static int BVH_KEY;
       const static int VIEWCACHE_KEY;
 
       void invalidateHelperStructures();
@@ -9,6 +9,7 @@
 #define NUKLEI_KERNEL_LOGISTIC_REGRESSOR_H
 
 
+#include <boost/serialization/split_member.hpp>
 #include <nuklei/KernelCollection.h>
 
 namespace nuklei
@@ -23,9 +24,39 @@ namespace nuklei
    *
    * This class is based on @c libklr, which is provided with Makoto Yamada's <a
    * href="http://sugiyama-www.cs.titech.ac.jp/~yamada/iwklr.html">IWKLR</a>.
+   *
+   * A trained classifier can be saved and loaded with Serial:
+   * @code
+   * Serial::writeObject(klr, "model.xml.gz");
+   * KernelLogisticRegressor deployed;
+   * Serial::readObject(deployed, "model.xml.gz");
+   * deployed.test(testSet);
+   * @endcode
+   * Only the model is saved (see compact()). A loaded classifier can be
+   * tested, but not retrained.
    */
   struct KernelLogisticRegressor
   {
+    /**
+     * @brief Gram matrix in compressed sparse row form.
+     *
+     * The non-zero entries of row @f$ i @f$ are stored at positions
+     * @c rowBegin[i] to @c rowBegin[i+1]-1 of @c columns and @c values,
+     * with increasing column indices.
+     */
+    struct SparseGramMatrix
+    {
+      std::vector<unsigned> rowBegin;
+      std::vector<unsigned> columns;
+      std::vector<double> values;
+      
+      unsigned size() const { return rowBegin.empty() ? 0 : rowBegin.size()-1; }
+      /** @brief Number of non-zero entries. */
+      unsigned nonZeros() const { return values.size(); }
+    };
+    
+    void assertConsistency() const;
+    
     /** @brief */
     KernelLogisticRegressor() {}
     /**
@@ -36,6 +67,14 @@ namespace nuklei
      * of elements. The @f$ i^{\mathrm{th}} @f$ element of @p labels indicates
      * the class of the @f$ i^{\mathrm{th}} @f$ element of @p data. The two
      * allowed values in @p labels are @c 1 and @c 2.
+     *
+     * The Gram matrix is computed when it is first needed, by train() or
+     * gramMatrix(). Rows of the Gram matrix are computed in parallel. Only
+     * the pairs of kernels whose distance is below the kernel cut point are
+     * evaluated, and when all kernels share the same bandwidths, only the
+     * upper triangle of the matrix is evaluated.
+     *
+     * trainLowRank() does not compute the Gram matrix.
      */
     KernelLogisticRegressor(const KernelCollection &data,
                              const std::vector<int>& labels);    
@@ -64,6 +103,8 @@ namespace nuklei
      * allowed values in @p labels are @c 1 and @c 2.
      *
      * This method also resets all the other member variables of the class.
+     * As with the constructor, the Gram matrix is computed when it is first
+     * needed.
      */
     void setData(const KernelCollection &data,
                  const std::vector<int>& labels);
@@ -77,6 +118,35 @@ namespace nuklei
      */
     void train(const double delta = 0.0001, const unsigned itrNewton = 5);
     
+    typedef enum { UNIFORM_LANDMARKS, KMEANSPP_LANDMARKS, LEVERAGE_LANDMARKS } LandmarkSelection;
+    
+    /**
+     * @brief Computes approximate KLR weights from @p nLandmarks training
+     * kernels.
+     *
+     * The classifier is restricted to a combination of @p nLandmarks
+     * kernels (inducing points) chosen among the training data. It is fit
+     * by Newton's method on the @f$ n \times m @f$ matrix of kernel values
+     * between the @f$ n @f$ training points and the @f$ m @f$ landmarks,
+     * with a penalty @p delta on the RKHS norm of the classifier. The
+     * @f$ n \times n @f$ Gram matrix is never computed, and test() only
+     * evaluates the @f$ m @f$ landmark kernels.
+     *
+     * Landmarks are chosen with @p selection:
+     * - @c UNIFORM_LANDMARKS: uniformly at random,
+     * - @c KMEANSPP_LANDMARKS: with k-means++ seeding, in the feature space
+     *   of the kernel,
+     * - @c LEVERAGE_LANDMARKS: with probabilities proportional to ridge
+     *   leverage scores, approximated from a uniform pilot sample of
+     *   @f$ 2m @f$ points.
+     *
+     * This method accepts only the labels @c 1 and @c 2.
+     */
+    void trainLowRank(const unsigned nLandmarks,
+                      const LandmarkSelection selection = KMEANSPP_LANDMARKS,
+                      const double delta = 0.0001,
+                      const unsigned itrNewton = 5);
+    
     /**
      * @brief Returns @c true if the classifier has been trained.
      */
@@ -88,6 +158,9 @@ namespace nuklei
     /**
      * @brief Returns a pair of values which indicate the probability of classes
      * @c 1 and @c 2.
+     *
+     * Only the kernels of basis() that lie within the kernel cut point of
+     * @p t are evaluated.
      */
     Vector2 test(const kernel::base &t) const;
     /**
@@ -95,14 +168,72 @@ namespace nuklei
      * points in @p testSet.
      *
      * This method returns a @f$ 2 \times n @f$ matrix, where @f$ n @f$ is the
-     * number of elements in @p testSet.
+     * number of elements in @p testSet. Test points are processed in
+     * parallel.
      */
     GMatrix test(const KernelCollection &testSet) const;
         
+    /**
+     * @brief Drops the training data, and the kernels of basis() whose
+     * weights are negligible.
+     *
+     * A kernel is dropped if the difference between its two class weights
+     * is smaller than @c KLR_PRUNING_TOLERANCE times the largest such
+     * difference. This is the form in which Serial saves the classifier.
+     * After this call, the classifier can be tested, but not retrained.
+     */
+    void compact();
+    
+    /**
+     * @brief Returns the Gram matrix of the training data, and computes it
+     * if needed.
+     *
+     * train() releases the Gram matrix once weights are computed.
+     */
+    const GMatrix& gramMatrix()
+    {
+      NUKLEI_TRACE_BEGIN();
+      if (!hasGramMatrix()) computeGramMatrix();
+      return gramMatrix_;
+      NUKLEI_TRACE_END();
+    }
+    
+    /**
+     * @brief Returns the non-zero entries of the Gram matrix, and computes
+     * them if needed.
+     *
+     * Kernels are truncated at their cut point (see @ref kernels), so the
+     * Gram matrix of a spatially spread training set is mostly zero. The
+     * sparse form is only built by this method, and is released with the
+     * Gram matrix. Unless the dense Gram matrix is already available, the
+     * sparse form is computed directly from the kernels, one row per
+     * thread, without allocating the dense matrix.
+     */
+    const SparseGramMatrix& sparseGramMatrix()
+    {
+      NUKLEI_TRACE_BEGIN();
+      if (sparseGramMatrix_.rowBegin.empty()) computeSparseGramMatrix();
+      return sparseGramMatrix_;
+      NUKLEI_TRACE_END();
+    }
+    
+    /**
+     * @brief Returns the kernels that the weights returned by vklr() apply
+     * to.
+     *
+     * These are the training data after train(), and the landmarks after
+     * trainLowRank().
+     */
+    const KernelCollection& basis() const
+    {
+      return landmarks_ ? *landmarks_ : trainSet_;
+    }
+    
     /**
      * @brief Returns KLR weights.
      *
-     * The parameter @p delta is the regularization constant.
+     * This is a @f$ 2 \times m @f$ matrix, where @f$ m @f$ is the size of
+     * basis().
      */
     const GMatrix& vklr() const
     {
@@ -112,12 +243,59 @@ namespace nuklei
       NUKLEI_TRACE_END();
     }
   private:
+    friend class boost::serialization::access;
+    template<class Archive>
+    void save(Archive &ar, const unsigned int version) const
+    {
+      KernelCollection support;
+      std::vector<double> weights;
+      compactModel(support, weights);
+      ar & boost::serialization::make_nvp("basis", support);
+      ar & boost::serialization::make_nvp("weights", weights);
+    }
+    template<class Archive>
+    void load(Archive &ar, const unsigned int version)
+    {
+      KernelCollection support;
+      std::vector<double> weights;
+      ar & boost::serialization::make_nvp("basis", support);
+      ar & boost::serialization::make_nvp("weights", weights);
+      setModel(support, weights);
+    }
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+    
+    void compactModel(KernelCollection &support,
+                      std::vector<double> &weights) const;
+    void setModel(const KernelCollection &support,
+                  const std::vector<double> &weights);
     void computeGramMatrix();
+    template<class KernelType>
+    void staticComputeGramMatrix();
+    void computeSparseGramMatrix();
+    template<class KernelType>
+    void staticComputeSparseGramMatrix();
+    bool hasGramMatrix() const
+    {
+      return trainSet_.empty() || gramMatrix_.GetRows() != 0;
+    }
+    void prepareTest();
+    template<class KernelType>
+    Vector2 staticTest(const kernel::base &t) const;
+    template<class KernelType>
+    void staticTrainLowRank(const unsigned nLandmarks,
+                            const LandmarkSelection selection,
+                            const double delta,
+                            const unsigned itrNewton);
     
     KernelCollection trainSet_;
     GMatrix gramMatrix_;
+    SparseGramMatrix sparseGramMatrix_;
     std::vector<int> labels_;
     boost::optional<GMatrix> vklr_;
+    boost::optional<KernelCollection> landmarks_;
+    // vklr_, transposed: the two class weights of basis kernel i are at
+    // 2i and 2i+1.
+    std::vector<double> testWeights_;
   };
 }
 
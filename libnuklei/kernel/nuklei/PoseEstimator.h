@@ -37,6 +37,14 @@ namespace nuklei {
   
   struct PoseEstimator
   {
+    /**
+     * @brief Local refinement applied to the pose returned by the MCMC chains.
+     */
+    typedef enum { ICP_NONE = 0, ICP_POINT_TO_POINT, ICP_POINT_TO_PLANE } IcpType;
+    
+    /** @brief Number of scene points kept in light mode, see load(). */
+    static const unsigned LIGHT_SCENE_SIZE = 10000;
+    
     PoseEstimator(const double locH = 0,
                   const double oriH = .2,
                   const int nChains = -1,
@@ -45,6 +53,23 @@ namespace nuklei {
                   const bool partialview = false,
                   const bool progress = true);
     
+    /**
+     * @brief Reads the model and scene point clouds.
+     *
+     * If @p light is true, the scene is subsampled to #LIGHT_SCENE_SIZE
+     * points. If normals are computed, they are computed from the whole
+     * scene, which is subsampled afterwards. Otherwise, the scene is
+     * subsampled while it is read, with weighted reservoir sampling.
+     *
+     * In partial-view mode, the mesh of the model is read from @p meshfile.
+     * If @p meshfile is empty, the mesh is computed. If @p meshfile does not
+     * exist, load() throws, unless writeComputedMesh() was enabled, in which
+     * case the mesh is computed and written to @p meshfile. The partial view
+     * cache is stored
+     * next to the mesh (@p meshfile followed by <tt>.views</tt>), and it is
+     * recomputed only when the model, the mesh, or the visibility tolerance
+     * changes.
+     */
     void load(const std::string& objectFilename,
               const std::string& sceneFilename,
               const std::string& meshfile = "",
@@ -67,9 +92,50 @@ namespace nuklei {
     
     void setMeshToVisibilityTol(const double meshTol) { meshTol_ = meshTol; }
     
+    /**
+     * @brief Lets load() compute the mesh and write it to its @p meshfile
+     * argument when that file does not exist.
+     */
+    void writeComputedMesh(const bool b) { writeMesh_ = b; }
+    
     void setParallelization(const parallelizer::Type t) { parallel_ = t; }
     parallelizer::Type getParallelization() const { return parallel_; }
     
+    /**
+     * @brief Refines the best MCMC pose with at most @p nIterations
+     * iterations of ICP.
+     *
+     * Point-to-plane ICP uses the normals of the scene model, which must
+     * then be made of kernel::r3xs2p kernels.
+     */
+    void setIcpRefinement(const IcpType t, const int nIterations = 10)
+    {
+      icpType_ = t;
+      icpIterations_ = nIterations;
+    }
+    IcpType getIcpRefinement() const { return icpType_; }
+    
+    /**
+     * @brief Sets the number of steps of each MCMC chain.
+     *
+     * If @p nSteps is smaller than or equal to 0, chains run for @f$ 10n @f$
+     * steps (@f$ 40n @f$ in partial-view mode), where @f$ n @f$ is the number
+     * of model points used at each step. With ICP refinement, much shorter
+     * chains usually reach the same accuracy.
+     */
+    void setNumberOfSteps(const int nSteps) { nSteps_ = nSteps; }
+    
+    /**
+     * @brief Scores poses with a fixed, spatially stratified subset of the
+     * model instead of a random subset drawn at each step.
+     *
+     * The subset is computed by KernelCollection::informativeSubset() when
+     * the model is loaded, and is visited in order of decreasing
+     * informativeness, which lets the early-abort test of
+     * metropolisHastings() reject bad proposals sooner. Call before load().
+     */
+    void useInformativeSubset(const bool b) { informativeSubset_ = b; }
+    
     void setCustomIntegrandFactor(boost::shared_ptr<CustomIntegrandFactor> cif);
     boost::shared_ptr<CustomIntegrandFactor> getCustomIntegrandFactor() const;
 
@@ -80,11 +146,28 @@ namespace nuklei {
     
     double findMatchingScore(const kernel::se3& pose) const;
     
+    /**
+     * @brief Runs ICP from @p pose, pairing model points with their nearest
+     * neighbor in the scene.
+     *
+     * See setIcpRefinement().
+     */
+    kernel::se3 icpRefinement(const kernel::se3& pose) const;
+    
     void writeAlignedModel(const std::string& filename,
                            const kernel::se3& t) const;
     
   private:
     
+    // Prepares objectModel_ and sceneModel_ once they are set. Normals,
+    // then kernel statistics and search trees, are computed for the model
+    // and the scene concurrently.
+    void load_(const std::string& meshfile,
+               const bool light,
+               const bool computeNormals);
+    void prepareObjectModel_();
+    void prepareSceneModel_();
+    
     Vector3 viewpointInFrame(const kernel::se3& frame) const;
     
     // Temperature function (cooling factor)
@@ -106,6 +189,8 @@ namespace nuklei {
     
     kernel::se3
     mcmc(const int n) const;
+    int numberOfSteps(const int n) const;
+    int numberOfModelPoints() const;
     bool recomputeIndices(std::vector<int>& indices,
                           const kernel::se3& nextPose,
                           const int n) const;
@@ -125,6 +210,15 @@ namespace nuklei {
     bool progress_;
     parallelizer::Type parallel_;
     double meshTol_;
+    bool writeMesh_;
+    IcpType icpType_;
+    int icpIterations_;
+    int nSteps_;
+    bool informativeSubset_;
+    // Model indices in scoring order, and the position of each model point
+    // in that order (or the model size if the point is not in the subset).
+    std::vector<int> modelSubset_;
+    std::vector<int> modelSubsetRank_;
   };
   
 }
@@ -28,3 +28,33 @@ target_name = 'kde'
 target  = os.path.join(env['BinDir'], 'tests', target_name)
 product = env.Program(source = sources, target = target)
 env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## parallelizer ############
+env = origEnv.Clone()
+
+sources = [ 'parallelizer.cpp' ]
+
+target_name = 'parallelizer'
+target  = os.path.join(env['BinDir'], 'tests', target_name)
+product = env.Program(source = sources, target = target)
+env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## packed ##################
+env = origEnv.Clone()
+
+sources = [ 'packed.cpp' ]
+
+target_name = 'packed'
+target  = os.path.join(env['BinDir'], 'tests', target_name)
+product = env.Program(source = sources, target = target)
+env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## pcd #####################
+env = origEnv.Clone()
+
+sources = [ 'pcd.cpp' ]
+
+target_name = 'pcd'
+target  = os.path.join(env['BinDir'], 'tests', target_name)
+product = env.Program(source = sources, target = target)
+env.Alias('check', [ 'install', target ], product[0].abspath)
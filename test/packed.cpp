@@ -0,0 +1,290 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test writes r3, r3xs2p and se3 point clouds with colors to Nuklei's
+// packed format, reads them back, and checks that positions, orientations
+// and colors are within the precision of the format, and that bandwidths
+// and weights are exact. The clouds span several blocks. It also checks
+// that truncated or corrupted files are rejected.
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <boost/filesystem.hpp>
+#include <nuklei/KernelCollection.h>
+#include <nuklei/ObservationIO.h>
+#include <nuklei/PackedObservationIO.h>
+#include <nuklei/Random.h>
+
+namespace {
+
+  using namespace nuklei;
+
+  // More than one block of 65536 kernels.
+  const unsigned N_POINTS = 150000;
+  const double ORI_TOLERANCE = 1e-4;
+
+  KernelCollection randomCloud(const kernel::base::Type type)
+  {
+    KernelCollection kc;
+    for (unsigned i = 0; i < N_POINTS; ++i)
+    {
+      Vector3 loc(Random::uniform(-200, 300), Random::uniform(0, 50),
+                  Random::uniform(-1, 1));
+      // Few distinct bandwidths, so that runs are exercised.
+      coord_t locH = 1 + i / 1000;
+      coord_t oriH = Random::uniform(.1, .5);
+      std::auto_ptr<kernel::base> k;
+      switch (type)
+      {
+        case kernel::base::R3:
+        {
+          kernel::r3 r;
+          r.loc_ = loc;
+          r.loc_h_ = locH;
+          k = r.clone();
+          break;
+        }
+        case kernel::base::R3XS2P:
+        {
+          kernel::r3xs2p r;
+          r.loc_ = loc;
+          r.dir_ = Random::uniformDirection3d();
+          r.loc_h_ = locH;
+          r.dir_h_ = oriH;
+          k = r.clone();
+          break;
+        }
+        case kernel::base::SE3:
+        {
+          kernel::se3 r;
+          r.loc_ = loc;
+          r.ori_ = Random::uniformQuaternion();
+          r.loc_h_ = locH;
+          r.ori_h_ = oriH;
+          k = r.clone();
+          break;
+        }
+        default:
+          NUKLEI_THROW("Unexpected kernel type.");
+      }
+      k->setWeight(i % 3 == 0 ? 1 : Random::uniform());
+      ColorDescriptor d;
+      d.setColor(RGBColor(Random::uniform(), Random::uniform(),
+                          Random::uniform()));
+      k->setDescriptor(d);
+      kc.add(*k);
+    }
+    return kc;
+  }
+
+  const RGBColor& colorOf(const kernel::base& k)
+  {
+    return dynamic_cast<const RGBColor&>
+      (dynamic_cast<const ColorDescriptor&>(k.getDescriptor()).getColor());
+  }
+
+  // Returns the number of failed checks.
+  int compare(const KernelCollection& in, const KernelCollection& out,
+              const std::string& name)
+  {
+    if (in.size() != out.size() || in.kernelType() != out.kernelType())
+    {
+      std::cout << name << ": read " << out.size() << " kernels, expected "
+                << in.size() << "." << std::endl;
+      return 1;
+    }
+
+    Vector3 min = in.at(0).getLoc(), max = min;
+    for (unsigned i = 0; i < in.size(); ++i)
+      for (int d = 0; d < 3; ++d)
+      {
+        min[d] = std::min(min[d], in.at(i).getLoc()[d]);
+        max[d] = std::max(max[d], in.at(i).getLoc()[d]);
+      }
+    coord_t extent = 0;
+    for (int d = 0; d < 3; ++d) extent = std::max(extent, max[d] - min[d]);
+    const coord_t locTolerance = PACKED_POSITION_TOLERANCE * extent * (1 + 1e-9);
+
+    double locError = 0, oriError = 0, colorError = 0;
+    int mismatches = 0;
+    for (unsigned i = 0; i < in.size(); ++i)
+    {
+      const kernel::base& a = in.at(i);
+      const kernel::base& b = out.at(i);
+      for (int d = 0; d < 3; ++d)
+        locError = std::max(locError,
+                            double(std::fabs(a.getLoc()[d] - b.getLoc()[d])));
+      if (a.getLocH() != b.getLocH() || a.getWeight() != b.getWeight())
+        ++mismatches;
+
+      if (a.polyType() == kernel::base::R3XS2P)
+      {
+        if (a.getOriH() != b.getOriH()) ++mismatches;
+        // Axial directions: d and -d are the same.
+        const Vector3& da = static_cast<const kernel::r3xs2p&>(a).dir_;
+        const Vector3& db = static_cast<const kernel::r3xs2p&>(b).dir_;
+        double dot = std::min(1., std::fabs(da.Dot(db)));
+        oriError = std::max(oriError, std::acos(dot));
+      }
+      else if (a.polyType() == kernel::base::SE3)
+      {
+        if (a.getOriH() != b.getOriH()) ++mismatches;
+        // q and -q are the same rotation.
+        const Quaternion& qa = static_cast<const kernel::se3&>(a).ori_;
+        const Quaternion& qb = static_cast<const kernel::se3&>(b).ori_;
+        double dot = std::min(1., std::fabs(qa.Dot(qb)));
+        oriError = std::max(oriError, 2 * std::acos(dot));
+      }
+
+      const RGBColor& ca = colorOf(a);
+      const RGBColor& cb = colorOf(b);
+      colorError = std::max(colorError, double(std::fabs(ca.R() - cb.R())));
+      colorError = std::max(colorError, double(std::fabs(ca.G() - cb.G())));
+      colorError = std::max(colorError, double(std::fabs(ca.B() - cb.B())));
+    }
+
+    int failures = 0;
+    if (locError > locTolerance)
+    {
+      std::cout << name << ": position error " << locError << " > "
+                << locTolerance << "." << std::endl;
+      ++failures;
+    }
+    if (oriError > ORI_TOLERANCE)
+    {
+      std::cout << name << ": orientation error " << oriError << " > "
+                << ORI_TOLERANCE << "." << std::endl;
+      ++failures;
+    }
+    if (colorError > .5 / 255 + 1e-9)
+    {
+      std::cout << name << ": color error " << colorError << "." << std::endl;
+      ++failures;
+    }
+    if (mismatches > 0)
+    {
+      std::cout << name << ": " << mismatches
+                << " kernels with different bandwidths or weights." << std::endl;
+      ++failures;
+    }
+    return failures;
+  }
+
+  std::vector<char> readFile(const std::string& name)
+  {
+    std::ifstream ifs(name.c_str(), std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(ifs),
+                             std::istreambuf_iterator<char>());
+  }
+
+  void writeFile(const std::string& name, const std::vector<char>& bytes)
+  {
+    std::ofstream ofs(name.c_str(), std::ios::binary);
+    ofs.write(&bytes.front(), bytes.size());
+  }
+
+  // Returns 1 if @p bytes are accepted by the packed reader.
+  int expectRejected(const std::string& file, const std::vector<char>& bytes,
+                     const std::string& what)
+  {
+    writeFile(file, bytes);
+    try {
+      KernelCollection kc;
+      readObservationsWithSpecificFormat(file, kc, Observation::PACKED);
+    } catch (std::exception& e) {
+      return 0;
+    }
+    std::cout << "Accepted a " << what << " file." << std::endl;
+    return 1;
+  }
+
+}
+
+int main(int argc, char ** argv)
+{
+  using namespace nuklei;
+  int failures = 0;
+
+  const std::string file =
+    (boost::filesystem::temp_directory_path() /
+     boost::filesystem::unique_path("nuklei-%%%%-%%%%.pk")).string();
+
+  // ----------- //
+  // Round trip: //
+  // ----------- //
+
+  const kernel::base::Type types[] =
+    { kernel::base::R3, kernel::base::R3XS2P, kernel::base::SE3 };
+  const char* names[] = { "r3", "r3xs2p", "se3" };
+  for (int t = 0; t < 3; ++t)
+  {
+    KernelCollection in = randomCloud(types[t]), out;
+    writeObservations(file, in, Observation::PACKED);
+    readObservationsWithSpecificFormat(file, out, Observation::PACKED);
+    failures += compare(in, out, names[t]);
+  }
+
+  // Empty clouds are valid.
+  {
+    KernelCollection in, out;
+    writeObservations(file, in, Observation::PACKED);
+    readObservationsWithSpecificFormat(file, out, Observation::PACKED);
+    if (!out.empty())
+    {
+      std::cout << "Read " << out.size() << " kernels from an empty file."
+                << std::endl;
+      ++failures;
+    }
+  }
+
+  // ------------------------------- //
+  // Truncated and corrupted input: //
+  // ------------------------------- //
+
+  writeObservations(file, randomCloud(kernel::base::SE3), Observation::PACKED);
+  const std::vector<char> bytes = readFile(file);
+  const size_t headerSize = PackedFileHeader::SIZE;
+  // Offset of the first block, from the block table.
+  size_t firstBlock = 0;
+  for (int i = 7; i >= 0; --i)
+    firstBlock = (firstBlock << 8) | (unsigned char)(bytes[headerSize + i]);
+
+  {
+    std::vector<char> b(bytes.begin(), bytes.end() - bytes.size() / 3);
+    failures += expectRejected(file, b, "truncated");
+  }
+  {
+    std::vector<char> b(bytes.begin(), bytes.begin() + headerSize - 1);
+    failures += expectRejected(file, b, "truncated header");
+  }
+  {
+    std::vector<char> b(bytes);
+    b[0] = 'X';
+    failures += expectRejected(file, b, "bad magic");
+  }
+  {
+    // Point count inconsistent with the number of blocks.
+    std::vector<char> b(bytes);
+    b[16] ^= 0x7f;
+    b[17] ^= 0x7f;
+    failures += expectRejected(file, b, "bad count");
+  }
+  {
+    // Compressed size of the first block past the end of the file.
+    std::vector<char> b(bytes);
+    b[headerSize + 15] = 0x7f;
+    failures += expectRejected(file, b, "bad block table");
+  }
+  {
+    std::vector<char> b(bytes);
+    for (size_t i = firstBlock + 100; i < firstBlock + 108; ++i) b[i] ^= 0x5a;
+    failures += expectRejected(file, b, "corrupted block");
+  }
+
+  boost::filesystem::remove(file);
+
+  if (failures == 0) std::cout << "All tests passed." << std::endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test exercises the thread pool behind parallel_for, parallel_reduce
+// and parallelizer::POOL: nested loops, exception propagation, determinism
+// of reductions, and pools other than the global one.
+//
+// The size of the global pool can be set with
+// NUKLEI_PARALLELIZATION_POOL_THREADS.
+
+#include <cmath>
+#include <iostream>
+#include <nuklei/parallelizer.h>
+#include <nuklei/Random.h>
+
+namespace {
+
+  struct Squares
+  {
+    Squares(std::vector<double>& v) : v_(v) {}
+    void operator()(const int begin, const int end)
+    {
+      for (int i = begin; i < end; ++i) v_.at(i) = double(i)*i;
+    }
+  private:
+    std::vector<double>& v_;
+  };
+
+  struct Sum
+  {
+    Sum(const std::vector<double>& v) : v_(v) {}
+    double operator()(const int begin, const int end, double init)
+    {
+      for (int i = begin; i < end; ++i) init += v_.at(i);
+      return init;
+    }
+  private:
+    const std::vector<double>& v_;
+  };
+
+  struct Plus
+  {
+    double operator()(const double a, const double b) const { return a+b; }
+  };
+
+  // Each iteration runs a parallel_for and a parallel_reduce of its own,
+  // from within a pool task.
+  struct Nested
+  {
+    Nested(std::vector<double>& sums) : sums_(sums) {}
+    void operator()(const int begin, const int end)
+    {
+      for (int i = begin; i < end; ++i)
+      {
+        std::vector<double> v(1000);
+        Squares squares(v);
+        nuklei::parallel_for(0, v.size(), squares, 10);
+        Sum sum(v);
+        sums_.at(i) = nuklei::parallel_reduce(0, v.size(), 0., sum,
+                                              Plus(), 7);
+      }
+    }
+  private:
+    std::vector<double>& sums_;
+  };
+
+  struct Thrower
+  {
+    void operator()(const int begin, const int end)
+    {
+      if (begin <= 500 && 500 < end) NUKLEI_THROW("Expected error.");
+    }
+  };
+
+  struct RandomSum
+  {
+    double operator()()
+    {
+      double s = 0;
+      for (int i = 0; i < 1000; ++i) s += nuklei::Random::uniform();
+      return s;
+    }
+  };
+
+}
+
+int main(int argc, char ** argv)
+{
+  using namespace nuklei;
+  int failures = 0;
+
+  // --------------------------------- //
+  // parallel_for and parallel_reduce: //
+  // --------------------------------- //
+
+  std::vector<double> v(1000000);
+  Squares squares(v);
+  parallel_for(0, v.size(), squares);
+
+  double serial = 0;
+  for (unsigned i = 0; i < v.size(); ++i)
+  {
+    if (v.at(i) != double(i)*i) { ++failures; break; }
+    serial += v.at(i);
+  }
+
+  // Partial sums are joined in order, so the result does not depend on
+  // which thread computed them.
+  Sum sum(v);
+  double r1 = parallel_reduce(0, v.size(), 0., sum, Plus());
+  double r2 = parallel_reduce(0, v.size(), 0., sum, Plus());
+  if (r1 != r2)
+  {
+    std::cout << "parallel_reduce is not deterministic." << std::endl;
+    ++failures;
+  }
+  if (std::fabs(r1-serial) > 1e-9*serial)
+  {
+    std::cout << "parallel_reduce: " << r1 << " != " << serial << std::endl;
+    ++failures;
+  }
+
+  // ------------- //
+  // Nested loops: //
+  // ------------- //
+
+  std::vector<double> sums(64, 0.);
+  Nested nested(sums);
+  parallel_for(0, sums.size(), nested, 1);
+  for (unsigned i = 0; i < sums.size(); ++i)
+    if (sums.at(i) != 332833500)
+    {
+      std::cout << "Nested loop " << i << ": " << sums.at(i) << std::endl;
+      ++failures;
+      break;
+    }
+
+  // ---------------------- //
+  // Exception propagation: //
+  // ---------------------- //
+
+  try {
+    Thrower thrower;
+    parallel_for(0, 1000, thrower, 10);
+    std::cout << "parallel_for did not rethrow." << std::endl;
+    ++failures;
+  } catch (Error& e) {}
+
+  // -------------------------------- //
+  // parallelizer::POOL, other pools: //
+  // -------------------------------- //
+
+  parallelizer p(16, parallelizer::POOL);
+  std::vector<double> randomSums = p.run<double>(RandomSum());
+  if (randomSums.size() != 16)
+  {
+    std::cout << "parallelizer returned " << randomSums.size()
+              << " values." << std::endl;
+    ++failures;
+  }
+
+  thread_pool pool(3);
+  std::fill(v.begin(), v.end(), 0.);
+  parallel_for(0, v.size(), squares, 0, pool);
+  double r3 = parallel_reduce(0, v.size(), 0., sum, Plus(), 0, pool);
+  if (std::fabs(r3-serial) > 1e-9*serial)
+  {
+    std::cout << "Private pool gave a different result." << std::endl;
+    ++failures;
+  }
+
+  if (failures == 0) std::cout << "All tests passed." << std::endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test checks that LZF compression, used by PCD's binary_compressed
+// data, round-trips random and repetitive buffers and rejects corrupt
+// streams, and that point clouds written to PCD in the ascii, binary and
+// binary_compressed formats are read back unchanged, up to the precision
+// of 4-byte floats and 8-bit colors.
+
+#include <cmath>
+#include <iostream>
+#include <boost/filesystem.hpp>
+#include <nuklei/KernelCollection.h>
+#include <nuklei/ObservationIO.h>
+#include <nuklei/PCDObservationIO.h>
+#include <nuklei/Lzf.h>
+#include <nuklei/Random.h>
+
+namespace {
+
+  using namespace nuklei;
+
+  // Returns the number of failed checks.
+  int lzfRoundTrip(const std::vector<char>& in, const std::string& name,
+                   const bool compressible)
+  {
+    std::vector<char> compressed;
+    lzfCompress(in.empty() ? NULL : &in.front(), in.size(), compressed);
+    if (compressible && compressed.size() >= in.size())
+    {
+      std::cout << name << ": compressed " << in.size() << " bytes to "
+                << compressed.size() << "." << std::endl;
+      return 1;
+    }
+    if (in.empty()) return compressed.empty() ? 0 : 1;
+
+    std::vector<char> out(in.size());
+    try {
+      lzfDecompress(&compressed.front(), compressed.size(),
+                    &out.front(), out.size());
+    } catch (std::exception& e) {
+      std::cout << name << ": " << e.what() << std::endl;
+      return 1;
+    }
+    if (out != in)
+    {
+      std::cout << name << ": decompressed data differs." << std::endl;
+      return 1;
+    }
+
+    // A stream that does not decompress to the expected size is corrupt.
+    int failures = 0;
+    std::vector<char> larger(in.size() + 1);
+    try {
+      lzfDecompress(&compressed.front(), compressed.size(),
+                    &larger.front(), larger.size());
+      std::cout << name << ": accepted a wrong size." << std::endl;
+      ++failures;
+    } catch (std::exception& e) {}
+    if (compressed.size() > 1)
+      try {
+        lzfDecompress(&compressed.front(), compressed.size() - 1,
+                      &out.front(), out.size());
+        std::cout << name << ": accepted a truncated stream." << std::endl;
+        ++failures;
+      } catch (std::exception& e) {}
+    return failures;
+  }
+
+  int testLzf()
+  {
+    int failures = 0;
+    const size_t sizes[] = { 0, 1, 2, 3, 31, 32, 33, 100000 };
+    for (unsigned s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s)
+    {
+      std::vector<char> random(sizes[s]);
+      for (size_t i = 0; i < random.size(); ++i)
+        random[i] = char(Random::uniformInt(256));
+      failures += lzfRoundTrip(random, "random " + stringify(sizes[s]), false);
+    }
+
+    // Long runs, short periods (references that overlap their output),
+    // periods longer than the maximum match length, and repetitive data
+    // interleaved with noise.
+    std::vector<char> zeros(100000, 0);
+    failures += lzfRoundTrip(zeros, "zeros", true);
+    std::vector<char> periodic(100000);
+    for (size_t i = 0; i < periodic.size(); ++i) periodic[i] = char(i % 3);
+    failures += lzfRoundTrip(periodic, "period 3", true);
+    for (size_t i = 0; i < periodic.size(); ++i) periodic[i] = char(i % 1000);
+    failures += lzfRoundTrip(periodic, "period 1000", true);
+    std::vector<char> mixed(100000);
+    for (size_t i = 0; i < mixed.size(); ++i)
+      mixed[i] = (i / 500) % 2 == 0 ? char(i % 7) :
+        char(Random::uniformInt(256));
+    failures += lzfRoundTrip(mixed, "mixed", true);
+    return failures;
+  }
+
+  KernelCollection randomCloud(const bool oriented, const bool colored)
+  {
+    KernelCollection kc;
+    for (unsigned i = 0; i < 10000; ++i)
+    {
+      Vector3 loc(Random::uniform(-100, 100), Random::uniform(-100, 100),
+                  Random::uniform(0, 10));
+      std::auto_ptr<kernel::base> k;
+      if (oriented)
+      {
+        kernel::r3xs2p r;
+        r.loc_ = loc;
+        r.dir_ = Random::uniformDirection3d();
+        k = r.clone();
+      }
+      else
+      {
+        kernel::r3 r;
+        r.loc_ = loc;
+        k = r.clone();
+      }
+      if (colored)
+      {
+        ColorDescriptor d;
+        d.setColor(RGBColor(Random::uniformInt(256) / 255.,
+                            Random::uniformInt(256) / 255.,
+                            Random::uniformInt(256) / 255.));
+        k->setDescriptor(d);
+      }
+      kc.add(*k);
+    }
+    return kc;
+  }
+
+  // Returns the number of failed checks.
+  int comparePcd(const KernelCollection& in, const KernelCollection& out,
+                 const bool colored, const std::string& name)
+  {
+    if (in.size() != out.size() || in.kernelType() != out.kernelType())
+    {
+      std::cout << name << ": read " << out.size() << " kernels, expected "
+                << in.size() << "." << std::endl;
+      return 1;
+    }
+    int mismatches = 0;
+    for (unsigned i = 0; i < in.size(); ++i)
+    {
+      const kernel::base& a = in.at(i);
+      const kernel::base& b = out.at(i);
+      for (int d = 0; d < 3; ++d)
+        if (std::fabs(a.getLoc()[d] - b.getLoc()[d]) >
+            1e-6 * (1 + std::fabs(a.getLoc()[d])))
+          ++mismatches;
+      if (a.polyType() == kernel::base::R3XS2P)
+      {
+        const Vector3& da = static_cast<const kernel::r3xs2p&>(a).dir_;
+        const Vector3& db = static_cast<const kernel::r3xs2p&>(b).dir_;
+        if ((da - db).Length() > 1e-6) ++mismatches;
+      }
+      if (colored != b.hasDescriptor())
+        ++mismatches;
+      else if (colored)
+      {
+        const RGBColor ca(dynamic_cast<const ColorDescriptor&>
+                          (a.getDescriptor()).getColor());
+        const RGBColor cb(dynamic_cast<const ColorDescriptor&>
+                          (b.getDescriptor()).getColor());
+        if ((ca.getRGB() - cb.getRGB()).Length() > 1e-6) ++mismatches;
+      }
+    }
+    if (mismatches > 0)
+    {
+      std::cout << name << ": " << mismatches << " mismatches." << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  int testPcd(const std::string& file)
+  {
+    int failures = 0;
+    const PCDFieldLayout::Format formats[] =
+      { PCDFieldLayout::ASCII, PCDFieldLayout::BINARY,
+        PCDFieldLayout::BINARY_COMPRESSED };
+    const char* formatNames[] = { "ascii", "binary", "binary_compressed" };
+    for (int f = 0; f < 3; ++f)
+      for (int c = 0; c < 4; ++c)
+      {
+        const bool oriented = c & 1, colored = c & 2;
+        KernelCollection in = randomCloud(oriented, colored), out;
+        PCDWriter writer(file, formats[f]);
+        writer.init();
+        writeObservations(writer, in);
+        writer.writeBuffer();
+        readObservationsWithSpecificFormat(file, out, Observation::PCD);
+        failures += comparePcd(in, out, colored,
+                               std::string(formatNames[f]) +
+                               (oriented ? " r3xs2p" : " r3") +
+                               (colored ? " colored" : ""));
+      }
+    return failures;
+  }
+
+}
+
+int main(int argc, char ** argv)
+{
+  using namespace nuklei;
+  int failures = 0;
+
+  failures += testLzf();
+
+  const std::string file =
+    (boost::filesystem::temp_directory_path() /
+     boost::filesystem::unique_path("nuklei-%%%%-%%%%.pcd")).string();
+  failures += testPcd(file);
+  boost::filesystem::remove(file);
+
+  if (failures == 0) std::cout << "All tests passed." << std::endl;
+  return failures == 0 ? 0 : 1;
+}
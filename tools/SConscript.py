@@ -40,3 +40,9 @@ else:
 env.Install(dir = '$BinInstallDir', source = product)
 env.Alias(target_name, [ target ])
 
+
+# Subsampling combined with voxel-grid sampling while reading.
+env.Alias('check', [ 'install', target ],
+          product[0].abspath + ' conv -n 10 --voxel_stride 20'
+          + ' examples/data/points1.txt /tmp/nuklei_conv_voxel.txt'
+          + ' && test `wc -l < /tmp/nuklei_conv_voxel.txt` -eq 10')
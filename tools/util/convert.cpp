@@ -5,9 +5,14 @@
 /** @file */
 
 #include <string>
+#include <cmath>
+#include <algorithm>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
 
 #include <tclap/CmdLine.h>
 #include "tclap-wrappers.h"
@@ -17,472 +22,821 @@
 #include <nuklei/nullable.h>
 #include <nuklei/ProgressIndicator.h>
 #include <nuklei/ObservationIO.h>
+#include <nuklei/SubsamplingPolicy.h>
+#include <nuklei/PLYObservationIO.h>
+#include <nuklei/PCDObservationIO.h>
+#include <nuklei/PackedObservationIO.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace nuklei;
 
-void convert(const std::vector<std::string>& files,
-             const kernel::se3* transfo = NULL,
-             const double scale = 0,
-             const bool normalizePose = false,
-             const std::string& normalizingTransfoFile = "",
-             const bool normalizeScale = false,
-             const std::string& normalizingScaleFile = "",
-             const bool uniformizeWeights = false,
-             const Observation::Type inType = Observation::UNKNOWN,
-             const Observation::Type outType = Observation::UNKNOWN,
-             boost::shared_ptr<RegionOfInterest> roi = boost::shared_ptr<RegionOfInterest>(),
-             const int nObs = -1,
-             const double minDist = 0,
-             const bool removePlane = false,
-             const int ransacIter = 100,
-             const double inlierThreshold = 8,
-             const std::string& fittedPlaneFile = "",
-             bool makeR3xS2P = false,
-             bool removeNormals = false,
-             const std::string &filterRGB = "",
-             const std::string &setRGB = "",
-             const Color::Type colorToLoc = Color::UNKNOWN)
-{
-  bool storeInKc = removePlane || !fittedPlaneFile.empty() ||
-    nObs >= 0 || minDist > 0 || minDist == -1 ||
-    normalizePose || !normalizingTransfoFile.empty() ||
-    normalizeScale || !normalizingScaleFile.empty() ||
-    makeR3xS2P || removeNormals ||
-    !filterRGB.empty() || !setRGB.empty() || colorToLoc != Color::UNKNOWN;
+// The conversion is a pipeline of stages through which kernels flow in
+// chunks. Stages that look at one kernel at a time process each chunk in
+// parallel and pass it on. Stages that need the whole point set (plane
+// fitting, normals, normalization, subsampling) buffer their input and
+// release it once all files have been read.
 
-  std::auto_ptr<ObservationWriter> writer;
-  Observation::Type writerType = outType;
-  Observation::Type readerType = Observation::UNKNOWN;
-  std::vector< boost::shared_ptr<Observation> > observations;
+namespace {
 
-  for (std::vector<std::string>::const_iterator i = files.begin();
-       i != --files.end(); ++i)
+  typedef ObservationReader::KernelBatch Chunk;
+
+  // Number of kernels read at once from the input files.
+  const size_t CHUNK_SIZE = 65536;
+
+  struct IsDropped
   {
-    std::auto_ptr<ObservationReader> reader;
-    if (inType == Observation::UNKNOWN)
-      reader = ObservationReader::createReader(*i);
-    else
-      reader = ObservationReader::createReader(*i, inType);
+    // @p dropped must be sorted.
+    IsDropped(const std::vector<const kernel::base*> &dropped) :
+      dropped_(dropped) {}
+    bool operator()(const kernel::base &k) const
+    { return std::binary_search(dropped_.begin(), dropped_.end(), &k); }
+  private:
+    const std::vector<const kernel::base*> &dropped_;
+  };
 
-    reader->addRegionOfInterest(roi);
-    readerType = reader->type();
+  // Removes from @p chunk the kernels whose flag in @p keep is 0.
+  void compact(Chunk &chunk, const std::vector<char> &keep)
+  {
+    std::vector<const kernel::base*> dropped;
+    for (size_t i = 0; i < chunk.size(); ++i)
+      if (!keep[i]) dropped.push_back(&chunk[i]);
+    if (dropped.empty()) return;
+    std::sort(dropped.begin(), dropped.end());
+    chunk.erase_if(IsDropped(dropped));
+  }
 
-    if (writer.get() == NULL)
+  class ConvertStage : boost::noncopyable
+  {
+  public:
+    ConvertStage() : next_(NULL) {}
+    virtual ~ConvertStage() {}
+
+    void setNext(ConvertStage *next) { next_ = next; }
+
+    /**
+     * @brief Processes the kernels of @p chunk. Kernels are passed on to the
+     * next stage, or kept by the stage, and @p chunk may be left in any
+     * state.
+     */
+    virtual void push(Chunk &chunk) = 0;
+    /** @brief Called once all the input has been pushed. */
+    virtual void finish() { next_->finish(); }
+
+  protected:
+    void forward(Chunk &chunk) { if (!chunk.empty()) next_->push(chunk); }
+
+    ConvertStage *next_;
+  };
+
+  /**
+   * @brief Stage that processes each kernel independently, in parallel.
+   */
+  class KernelStage : public ConvertStage
+  {
+  public:
+    void push(Chunk &chunk)
     {
-     
-      if (writerType == Observation::UNKNOWN)
-        writerType = reader->type();
-      
-      writer = ObservationWriter::createWriter(files.back(), writerType);
+      NUKLEI_TRACE_BEGIN();
+      std::vector<char> keep(chunk.size(), 1);
+      std::string error;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+      for (int i = 0; i < int(chunk.size()); ++i)
+      {
+        try {
+          keep[i] = apply(chunk, i);
+        } catch (std::exception &e) {
+#ifdef _OPENMP
+#pragma omp critical(nuklei_convert_error)
+#endif
+          error = e.what();
+        }
+      }
+      if (!error.empty()) NUKLEI_THROW(error);
+      compact(chunk, keep);
+      forward(chunk);
+      NUKLEI_TRACE_END();
     }
-    else
+
+  protected:
+    /**
+     * @brief Processes the @p i'th kernel of @p chunk, which may be replaced.
+     * Returns false if the kernel is to be dropped.
+     *
+     * Called concurrently for different kernels of a chunk.
+     */
+    virtual bool apply(Chunk &chunk, const size_t i) const = 0;
+  };
+
+  /**
+   * @brief Stage that keeps all the kernels until the input is exhausted.
+   */
+  class BufferStage : public ConvertStage
+  {
+  public:
+    void push(Chunk &chunk)
     {
-//      if (writerType != Observation::SERIAL &&
-//          (writer->type() != reader->type()))
-//        NUKLEI_WARN("Writer of type `" << nameFromType<Observation>(writer->type()) <<
-//                  "' may not be able to write observations of type `" <<
-//                  nameFromType<Observation>(reader->type()) << "'.");
+      buffer_.transfer(buffer_.end(), chunk);
     }
-    
-    std::auto_ptr<Observation> o;
-    while ( (o = reader->readObservation()).get() != NULL )
+
+    void finish()
     {
-      if (transfo != NULL || scale > 0)
-      {
-        kernel::base::ptr k = o->getKernel();
-        if (transfo != NULL) k->polyMakeTransformWith(*transfo);
-        if (scale > 0)
-        {
-          k->setLoc(k->getLoc()*scale);
-        }
-        o->setKernel(*k);
-      }
-      
-      if (uniformizeWeights)
+      NUKLEI_TRACE_BEGIN();
+      process();
+      forward(buffer_);
+      buffer_.clear();
+      ConvertStage::finish();
+      NUKLEI_TRACE_END();
+    }
+
+  protected:
+    /** @brief Processes the buffered kernels before they are passed on. */
+    virtual void process() = 0;
+
+    // Copies the location of the buffered kernels into @p kc.
+    void copyLocations(KernelCollection &kc) const
+    {
+      kc.clear();
+      kc.reserve(buffer_.size());
+      for (Chunk::const_iterator i = buffer_.begin(); i != buffer_.end(); ++i)
       {
-        kernel::base::ptr k = o->getKernel();
-        k->setWeight(1);
-        o->setKernel(*k);
+        kernel::r3 k;
+        k.loc_ = i->getLoc();
+        kc.add(k);
       }
-      
-      if (storeInKc)
-        observations.push_back(boost::shared_ptr<Observation>(o));
-      else
-        writer->writeObservation(*o);
     }
-  }
-  
-  if (files.size() > 2 && !uniformizeWeights &&
-      (readerType == Observation::NUKLEI || readerType == Observation::SERIAL))
+
+    Chunk buffer_;
+  };
+
+  class TransformStage : public KernelStage
   {
-    std::cout << "Warning: concatenating several files. "
-    "Keep in mind that weights may not be consistently mixed. "
-    "Use --uniformize_weights if appropriate." << std::endl;
-  }
-  
-  if (storeInKc)
+  public:
+    TransformStage(const kernel::se3* transfo, const double scale) :
+      transfo_(transfo), scale_(scale) {}
+  protected:
+    bool apply(Chunk &chunk, const size_t i) const
+    {
+      if (transfo_ != NULL) chunk[i].polyMakeTransformWith(*transfo_);
+      if (scale_ > 0) chunk[i].setLoc(chunk[i].getLoc()*scale_);
+      return true;
+    }
+  private:
+    const kernel::se3* transfo_;
+    const double scale_;
+  };
+
+  class UniformWeightStage : public KernelStage
   {
-    if (removePlane || !fittedPlaneFile.empty())
+  protected:
+    bool apply(Chunk &chunk, const size_t i) const
     {
-      KernelCollection kc;
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = observations.begin();
-           i != observations.end(); ++i)
+      chunk[i].setWeight(1);
+      return true;
+    }
+  };
+
+  class PlaneStage : public BufferStage
+  {
+  public:
+    PlaneStage(const bool removePlane, const int ransacIter,
+               const double inlierThreshold,
+               const std::string& fittedPlaneFile) :
+      removePlane_(removePlane), ransacIter_(ransacIter),
+      inlierThreshold_(inlierThreshold), fittedPlaneFile_(fittedPlaneFile) {}
+  protected:
+    void process()
+    {
+      NUKLEI_TRACE_BEGIN();
+      kernel::se3 k;
       {
-        kernel::r3 r3k;
-        r3k.loc_ = (*i)->getKernel()->getLoc();
-        kc.add(r3k);
+        KernelCollection kc;
+        copyLocations(kc);
+        k = kc.ransacPlaneFit(inlierThreshold_, ransacIter_);
       }
-      kernel::se3 k = kc.ransacPlaneFit(inlierThreshold, ransacIter);
       Plane3 plane(la::matrixCopy(k.ori_).GetColumn(2), k.loc_);
-      
-      std::vector< boost::shared_ptr<Observation> > tmp = observations;
-      observations.clear();
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = tmp.begin();
-           i != tmp.end(); ++i)
-      {
-        Vector3 loc = (*i)->getKernel()->getLoc();
-        if (removePlane && std::fabs(plane.DistanceTo(loc)) < inlierThreshold)
-          continue;
-        observations.push_back(*i);
-      }
-      
-      if (!fittedPlaneFile.empty())
+
+      if (removePlane_)
       {
-        writeSingleObservation(fittedPlaneFile, k, Observation::SERIAL);
+        std::vector<char> keep(buffer_.size());
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < int(buffer_.size()); ++i)
+          keep[i] = !(std::fabs(plane.DistanceTo(buffer_[i].getLoc())) <
+                      inlierThreshold_);
+        compact(buffer_, keep);
       }
+
+      if (!fittedPlaneFile_.empty())
+        writeSingleObservation(fittedPlaneFile_, k, Observation::SERIAL);
+      NUKLEI_TRACE_END();
     }
+  private:
+    const bool removePlane_;
+    const int ransacIter_;
+    const double inlierThreshold_;
+    const std::string fittedPlaneFile_;
+  };
 
-    if (!filterRGB.empty())
+  class ColorFilterStage : public KernelStage
+  {
+  public:
+    ColorFilterStage(const std::string &filterRGB) :
+      color_(RGBColor(numify<Vector3>(filterRGB))) {}
+  protected:
+    bool apply(Chunk &chunk, const size_t i) const
     {
-      Vector3 colorVector = numify<Vector3>(filterRGB);
-      RGBColor rgbColor(colorVector.X(), colorVector.Y(), colorVector.Z());
-      HSVConeColor hsvColor(rgbColor);
-      std::vector< boost::shared_ptr<Observation> > tmp = observations;
-      observations.clear();
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = tmp.begin();
-           i != tmp.end(); ++i)
-      {
-        if ((*i)->getKernel()->hasDescriptor())
-        {
-          kernel::base::ptr k = (*i)->getKernel();
-          ColorDescriptor* cDesc = dynamic_cast<ColorDescriptor*>(&k->getDescriptor());
-          HSVConeColor c(cDesc->getColor());
-          if (cDesc != NULL &&
-              (c.distanceTo(hsvColor) < HSVConeColor().getMaxDist() / 2))
-            observations.push_back(*i);
-        }
-      }
+      if (!chunk[i].hasDescriptor()) return false;
+      const ColorDescriptor* cDesc =
+        dynamic_cast<const ColorDescriptor*>(&chunk[i].getDescriptor());
+      if (cDesc == NULL) return false;
+      HSVConeColor c(cDesc->getColor());
+      return c.distanceTo(color_) < HSVConeColor().getMaxDist() / 2;
     }
+  private:
+    HSVConeColor color_;
+  };
 
-    if (removeNormals)
+  class RemoveNormalsStage : public KernelStage
+  {
+  protected:
+    bool apply(Chunk &chunk, const size_t i) const
     {
-      KernelCollection kc1;
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = observations.begin();
-           i != observations.end(); ++i)
-      {
-        kernel::r3 k;
-        k.loc_ = (*i)->getKernel()->getLoc();
-        k.setWeight((*i)->getKernel()->getWeight());
-        if ((*i)->getKernel()->hasDescriptor()) k.setDescriptor((*i)->getKernel()->getDescriptor());
-        kc1.add(k);
-      }
-      
-      observations.clear();
-      
-      for (KernelCollection::const_iterator i = as_const(kc1).begin();
-           i != as_const(kc1).end(); ++i)
-      {
-        observations.push_back(boost::shared_ptr<Observation>(new SerializedKernelObservation(*i)));
-      }
+      kernel::r3 k;
+      k.loc_ = chunk[i].getLoc();
+      k.setWeight(chunk[i].getWeight());
+      if (chunk[i].hasDescriptor()) k.setDescriptor(chunk[i].getDescriptor());
+      chunk.replace(i, k.clone().release());
+      return true;
     }
-    
-    if (makeR3xS2P)
+  };
+
+  class NormalsStage : public BufferStage
+  {
+  protected:
+    void process()
     {
-      NUKLEI_ASSERT(setRGB.empty());
-      if (!(writerType == Observation::SERIAL ||
-            writerType == Observation::NUKLEI ||
-            writerType == Observation::TXT ||
-            writerType == Observation::PCD))
-        NUKLEI_THROW("Normal computation only available when outputing " <<
-                     nameFromType<Observation>(Observation::SERIAL) << "or " <<
-                     nameFromType<Observation>(Observation::NUKLEI) << "or " <<
-                     nameFromType<Observation>(Observation::TXT) << "or " <<
-                     nameFromType<Observation>(Observation::PCD) << ".");
-    
-      KernelCollection kc1;
-      
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = observations.begin();
-           i != observations.end(); ++i)
-        kc1.add(*(*i)->getKernel());
-      
-      kc1.buildNeighborSearchTree();
-      kc1.computeSurfaceNormals();
-      
-      observations.clear();
-      
-      for (KernelCollection::const_iterator i = as_const(kc1).begin();
-           i != as_const(kc1).end(); ++i)
-      {
-        observations.push_back(boost::shared_ptr<Observation>(new SerializedKernelObservation(*i)));
-      }
+      NUKLEI_TRACE_BEGIN();
+      KernelCollection kc;
+      kc.transfer(buffer_);
+      kc.buildNeighborSearchTree();
+      kc.computeSurfaceNormals();
+      kc.release(buffer_);
+      NUKLEI_TRACE_END();
     }
-    
-    if (!setRGB.empty())
+  };
+
+  class SetColorStage : public KernelStage
+  {
+  public:
+    SetColorStage(const std::string &setRGB)
     {
-      NUKLEI_ASSERT(!makeR3xS2P);
-      RGBColor rgbColor;
       try {
         Vector3 colorVector = numify<Vector3>(setRGB);
-        rgbColor.setRGB(colorVector);
+        color_.setRGB(colorVector);
       } catch (Error & e) {
-        Serial::readObject(rgbColor, setRGB);
+        Serial::readObject(color_, setRGB);
       }
-      for (std::vector< boost::shared_ptr<Observation> >::iterator
-           i = observations.begin();
-           i != observations.end(); ++i)
+    }
+  protected:
+    bool apply(Chunk &chunk, const size_t i) const
+    {
+      if (chunk[i].hasDescriptor())
+        dynamic_cast<VisualDescriptor&>(chunk[i].getDescriptor()).setColor(color_);
+      else
       {
-        kernel::base::ptr k = (*i)->getKernel();
-        if (k->hasDescriptor())
-          dynamic_cast<VisualDescriptor&>(k->getDescriptor()).setColor(rgbColor);
-        else
-        {
-          ColorDescriptor cd;
-          cd.setColor(rgbColor);
-          k->setDescriptor(cd);
-        }
-        (*i)->setKernel(*k);
+        ColorDescriptor cd;
+        cd.setColor(color_);
+        chunk[i].setDescriptor(cd);
       }
+      return true;
     }
-  
-    if (normalizePose || !normalizingTransfoFile.empty())
+  private:
+    RGBColor color_;
+  };
+
+  class NormalizePoseStage : public BufferStage
+  {
+  public:
+    NormalizePoseStage(const bool normalizePose,
+                       const std::string& normalizingTransfoFile) :
+      normalizePose_(normalizePose),
+      normalizingTransfoFile_(normalizingTransfoFile) {}
+  protected:
+    void process()
     {
-      KernelCollection kc1;
-      
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = observations.begin();
-           i != observations.end(); ++i)
-        kc1.add(*(*i)->getKernel());
-      
-      kc1.uniformizeWeights();
-      kernel::se3 p = kc1.linearLeastSquarePlaneFit();
-      kernel::se3 origin;
-      kernel::se3 transfo = origin.transformationFrom(p);
-
-      if (!normalizingTransfoFile.empty())
+      NUKLEI_TRACE_BEGIN();
+      kernel::se3 transfo;
+      {
+        KernelCollection kc;
+        copyLocations(kc);
+        kc.uniformizeWeights();
+        kernel::se3 p = kc.linearLeastSquarePlaneFit();
+        kernel::se3 origin;
+        transfo = origin.transformationFrom(p);
+      }
+
+      if (!normalizingTransfoFile_.empty())
       {
-        Serial::writeObject(transfo, normalizingTransfoFile);
+        Serial::writeObject(transfo, normalizingTransfoFile_);
       }
 
-      if (normalizePose)
-      {        
+      if (normalizePose_)
+      {
         std::cout << "Normalizing translation: " << transfo.loc_ << "\n" <<
           "Normalizing quaternion: " << transfo.ori_ << std::endl;
 
-        for (std::vector< boost::shared_ptr<Observation> >::iterator
-             i = observations.begin();
-             i != observations.end(); ++i)
-        {
-          kernel::base::ptr k = (*i)->getKernel();
-          k->polyMakeTransformWith(transfo);
-          (*i)->setKernel(*k);
-        }
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < int(buffer_.size()); ++i)
+          buffer_[i].polyMakeTransformWith(transfo);
       }
+      NUKLEI_TRACE_END();
     }
-  
-    if (normalizeScale || !normalizingScaleFile.empty())
+  private:
+    const bool normalizePose_;
+    const std::string normalizingTransfoFile_;
+  };
+
+  class NormalizeScaleStage : public BufferStage
+  {
+  public:
+    NormalizeScaleStage(const bool normalizeScale,
+                        const std::string& normalizingScaleFile) :
+      normalizeScale_(normalizeScale),
+      normalizingScaleFile_(normalizingScaleFile) {}
+  protected:
+    void process()
     {
-      KernelCollection kc1;
-      
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = observations.begin();
-           i != observations.end(); ++i)
-        kc1.add(*(*i)->getKernel());
-      
-      kc1.uniformizeWeights();
-      coord_t stdev = kc1.moments()->getLocH();
-      
-      if (!normalizingScaleFile.empty())
+      NUKLEI_TRACE_BEGIN();
+      KernelCollection kc;
+      copyLocations(kc);
+      kc.uniformizeWeights();
+      coord_t stdev = kc.moments()->getLocH();
+
+      if (!normalizingScaleFile_.empty())
       {
-        std::ofstream ofs(normalizingScaleFile.c_str());
+        std::ofstream ofs(normalizingScaleFile_.c_str());
         ofs << 1./stdev << std::endl;
       }
-      
-      if (normalizeScale)
-      {        
+
+      if (normalizeScale_)
+      {
         std::cout << "Normalizing scale: " << 1./stdev << std::endl;
-        
-        for (std::vector< boost::shared_ptr<Observation> >::iterator
-             i = observations.begin();
-             i != observations.end(); ++i)
-        {
-          kernel::base::ptr k = (*i)->getKernel();
-          k->setLoc(k->getLoc()/stdev);
-          (*i)->setKernel(*k);
-        }
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < int(buffer_.size()); ++i)
+          buffer_[i].setLoc(buffer_[i].getLoc()/stdev);
       }
-      
+
+      copyLocations(kc);
+      kc.uniformizeWeights();
+      std::cout << kc.moments()->getLocH() << std::endl;
+      NUKLEI_TRACE_END();
+    }
+  private:
+    const bool normalizeScale_;
+    const std::string normalizingScaleFile_;
+  };
+
+  class ColorToLocStage : public KernelStage
+  {
+  public:
+    ColorToLocStage(const Color::Type colorToLoc) : colorToLoc_(colorToLoc) {}
+  protected:
+    bool apply(Chunk &chunk, const size_t i) const
+    {
+      NUKLEI_ASSERT(chunk[i].hasDescriptor());
+      const Color &icolor =
+        dynamic_cast<const ColorDescriptor&>(chunk[i].getDescriptor()).getColor();
+      std::auto_ptr<Color> ocolor;
+      switch (colorToLoc_)
       {
-        KernelCollection kc1;
-
-        for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-             i = observations.begin();
-             i != observations.end(); ++i)
-          kc1.add(*(*i)->getKernel());
-        
-        kc1.uniformizeWeights();
-        coord_t stdev = kc1.moments()->getLocH();
-        std::cout << stdev << std::endl;
+        case Color::RGB:
+          ocolor = std::auto_ptr<Color>(new RGBColor(icolor));
+          break;
+        case Color::HSV:
+          ocolor = std::auto_ptr<Color>(new HSVColor(icolor));
+          break;
+        case Color::HSVCONE:
+          ocolor = std::auto_ptr<Color>(new HSVConeColor(icolor));
+          break;
+        default:
+          NUKLEI_ASSERT(false);
+          break;
       }
-      
+
+      GVector v = ocolor->getVector();
+      kernel::r3 colorKernel;
+      for (int d = 0; d < 3; ++d)
+      {
+        colorKernel.loc_[d] = v[d];
+      }
+      colorKernel.setDescriptor(chunk[i].getDescriptor());
+      chunk.replace(i, colorKernel.clone().release());
+      return true;
     }
-    
-    if (colorToLoc != Color::UNKNOWN)
+  private:
+    const Color::Type colorToLoc_;
+  };
+
+  /**
+   * @brief Keeps kernels that are at least minDist away from all the
+   * kernels kept before them.
+   *
+   * Kept locations are hashed into a grid of cells of side minDist, so that
+   * each kernel is only compared to the kept kernels of the 27 surrounding
+   * cells. With a positive minDist, kernels are filtered as they come. With
+   * a minDist of -1, the maximum distance between two nearest neighbors is
+   * computed first, which requires buffering all the kernels.
+   */
+  class MinDistStage : public BufferStage
+  {
+  public:
+    MinDistStage(const double minDist) : minDist_(minDist) {}
+
+    void push(Chunk &chunk)
     {
-      std::vector< boost::shared_ptr<Observation> > tmp = observations;
-      observations.clear();
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = tmp.begin();
-           i != tmp.end(); ++i)
+      NUKLEI_TRACE_BEGIN();
+      if (minDist_ == -1)
+        BufferStage::push(chunk);
+      else
       {
-        kernel::base::ptr k = (*i)->getKernel();
-        NUKLEI_ASSERT(k->hasDescriptor());
-
-        Color &icolor = dynamic_cast<ColorDescriptor&>(k->getDescriptor()).getColor();
-        std::auto_ptr<Color> ocolor;
-        switch (colorToLoc)
-        {
-          case Color::RGB:
-            ocolor = std::auto_ptr<Color>(new RGBColor(icolor));
-            break;
-          case Color::HSV:
-            ocolor = std::auto_ptr<Color>(new HSVColor(icolor));
-            break;
-          case Color::HSVCONE:
-            ocolor = std::auto_ptr<Color>(new HSVConeColor(icolor));
-            break;
-          default:
-            NUKLEI_ASSERT(false);
-            break;
-        }
-        
-        GVector v = ocolor->getVector();
-        kernel::r3 colorKernel;
-        for (int d = 0; d < 3; ++d)
-        {
-          colorKernel.loc_[d] = v[d];
-        }
-        colorKernel.setDescriptor(k->getDescriptor());
-        observations.push_back(boost::shared_ptr<Observation>(new SerializedKernelObservation(colorKernel)));
+        filter(chunk);
+        forward(chunk);
       }
+      NUKLEI_TRACE_END();
     }
-    
-    double minDist2 = minDist;
-    
-    if (minDist2 == -1)
+
+  protected:
+    void process()
     {
-      std::vector<Vector3> posVec;
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = observations.begin();
-           i != observations.end(); ++i)
-        posVec.push_back((*i)->getKernel()->getLoc());
-      
-      ProgressIndicator pi(observations.size(),
-                           "Computing maximum distance between two nearest neighbors: ");
-      for (std::vector<Vector3>::const_iterator
-           i = posVec.begin();
-           i != posVec.end(); ++i)
+      NUKLEI_TRACE_BEGIN();
+      if (minDist_ != -1) return;
+      std::vector<double> nnDist(buffer_.size(), -1);
       {
-        double nnDist = -1;
-        for (std::vector<Vector3>::const_iterator
-             j = posVec.begin();
-             j != posVec.end(); ++j)
+        ProgressIndicator pi(buffer_.size(),
+                             "Computing maximum distance between two nearest neighbors: ");
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+        for (int i = 0; i < int(buffer_.size()); ++i)
         {
-          if (i == j) continue;
-          double d = (*i-*j).SquaredLength();
-          if ( nnDist == -1 || d < nnDist )
+          Vector3 iLoc = buffer_[i].getLoc();
+          for (int j = 0; j < int(buffer_.size()); ++j)
           {
-            nnDist = d;
+            if (i == j) continue;
+            double d = (iLoc - buffer_[j].getLoc()).SquaredLength();
+            if ( nnDist[i] == -1 || d < nnDist[i] )
+              nnDist[i] = d;
           }
+#ifdef _OPENMP
+#pragma omp critical(nuklei_convert_progress)
+#endif
+          pi.inc();
         }
-        nnDist = std::sqrt(nnDist);
-        if (minDist2 == -1 || nnDist > minDist2)
-          minDist2 = nnDist;
-        pi.inc();
       }
-      std::cout << "Max distance between two nearest neighbors: " << minDist2 << std::endl;
+      for (std::vector<double>::const_iterator i = nnDist.begin();
+           i != nnDist.end(); ++i)
+      {
+        double d = std::sqrt(*i);
+        if (minDist_ == -1 || d > minDist_)
+          minDist_ = d;
+      }
+      std::cout << "Max distance between two nearest neighbors: " << minDist_ << std::endl;
+      if (minDist_ > 0) filter(buffer_);
+      NUKLEI_TRACE_END();
     }
-    
-    if (minDist2 > 0)
+
+  private:
+    typedef boost::tuple<long, long, long> Cell;
+
+    struct CellHash
     {
-      std::vector< boost::shared_ptr<Observation> > tmp = observations;
-      observations.clear();
-      std::vector<Vector3> posVec;
-      ProgressIndicator pi(tmp.size(), "Filtering points: ");
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = tmp.begin();
-           i != tmp.end(); ++i)
+      std::size_t operator()(const Cell &c) const
       {
-        bool cnt = false;
-        Vector3 iLoc = (*i)->getKernel()->getLoc();
-        for (std::vector<Vector3>::const_iterator
-             j = posVec.begin();
-             j != posVec.end(); ++j)
-        {
-          if ( (iLoc - *j).SquaredLength() < minDist2*minDist2 )
+        std::size_t h = 0;
+        boost::hash_combine(h, c.get<0>());
+        boost::hash_combine(h, c.get<1>());
+        boost::hash_combine(h, c.get<2>());
+        return h;
+      }
+    };
+
+    typedef boost::unordered_map< Cell, std::vector<Vector3>, CellHash > Grid;
+
+    Cell cell(const Vector3 &v) const
+    {
+      return Cell(long(std::floor(v.X()/minDist_)),
+                  long(std::floor(v.Y()/minDist_)),
+                  long(std::floor(v.Z()/minDist_)));
+    }
+
+    bool isFarFromKept(const Vector3 &loc) const
+    {
+      Cell c = cell(loc);
+      for (long x = c.get<0>()-1; x <= c.get<0>()+1; ++x)
+        for (long y = c.get<1>()-1; y <= c.get<1>()+1; ++y)
+          for (long z = c.get<2>()-1; z <= c.get<2>()+1; ++z)
           {
-            cnt = true;
-            break;
+            Grid::const_iterator n = kept_.find(Cell(x, y, z));
+            if (n == kept_.end()) continue;
+            for (std::vector<Vector3>::const_iterator j = n->second.begin();
+                 j != n->second.end(); ++j)
+              if ( (loc - *j).SquaredLength() < minDist_*minDist_ )
+                return false;
           }
-        }
-        if (!cnt)
-        {
-          observations.push_back(*i);
-          posVec.push_back(iLoc);
-        }
-        pi.inc();
+      return true;
+    }
+
+    void filter(Chunk &chunk)
+    {
+      std::vector<char> keep(chunk.size());
+      for (size_t i = 0; i < chunk.size(); ++i)
+      {
+        Vector3 loc = chunk[i].getLoc();
+        keep[i] = isFarFromKept(loc);
+        if (keep[i]) kept_[cell(loc)].push_back(loc);
       }
+      compact(chunk, keep);
     }
-    
-    if (nObs >= 0)
+
+    double minDist_;
+    Grid kept_;
+  };
+
+  class SubsampleStage : public BufferStage
+  {
+  public:
+    SubsampleStage(const int nObs) : nObs_(nObs) {}
+  protected:
+    void process()
     {
-#if NUKLEI_TRSL_VERSION_NR < 100030000
-      typedef nuklei_trsl::is_picked_systematic<
-        boost::shared_ptr<Observation>,
-        weight_t,
-        nuklei_trsl::weight_accessor<weight_t, boost::shared_ptr<Observation> >
-      > is_picked;
-      typedef nuklei_trsl::ppfilter_iterator<
-        is_picked,
-        std::vector< boost::shared_ptr<Observation> >::iterator> sample_iterator;
-      sample_iterator i( is_picked(nObs, observations.size()),
-                         observations.begin(),
-                         observations.end());
-#else
-      typedef
-      nuklei_trsl::stl_vector< boost::shared_ptr<Observation> >::systematic_sample_iterator
-      sample_iterator;
-      sample_iterator i(observations, nObs);
-#endif
-      for (; i != i.end(); ++i)
-        writer->writeObservation(**i);
+      NUKLEI_TRACE_BEGIN();
+      KernelCollection kc;
+      kc.transfer(buffer_);
+      kc.computeKernelStatistics();
+      for (KernelCollection::const_sample_iterator i =
+           as_const(kc).sampleBegin(nObs_); i != i.end(); ++i)
+        buffer_.push_back(i->clone().release());
+      NUKLEI_TRACE_END();
+    }
+  private:
+    const int nObs_;
+  };
+
+  class WriterStage : public ConvertStage
+  {
+  public:
+    WriterStage(ObservationWriter &writer) :
+      writer_(writer), o_(writer.templateObservation()) {}
+
+    void push(Chunk &chunk)
+    {
+      NUKLEI_TRACE_BEGIN();
+      for (Chunk::const_iterator i = chunk.begin(); i != chunk.end(); ++i)
+      {
+        o_->setKernel(*i);
+        writer_.writeObservation(*o_);
+      }
+      NUKLEI_TRACE_END();
     }
+
+    void finish() { writer_.writeBuffer(); }
+
+  private:
+    ObservationWriter &writer_;
+    std::auto_ptr<Observation> o_;
+  };
+
+  // Same as ObservationWriter::createWriter, with the options of the
+  // writers that conv exposes.
+  std::auto_ptr<ObservationWriter> createWriter(const std::string &file,
+                                                const Observation::Type type,
+                                                const bool binary,
+                                                const double packedTolerance)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (binary && type != Observation::PLY && type != Observation::PCD)
+      NUKLEI_THROW("Binary output is only available for " <<
+                   nameFromType<Observation>(Observation::PLY) << " and " <<
+                   nameFromType<Observation>(Observation::PCD) << ".");
+    std::auto_ptr<ObservationWriter> writer;
+    if (binary && type == Observation::PLY)
+      writer.reset(new PLYWriter(file, PLYVertexLayout::BINARY_LITTLE_ENDIAN));
+    else if (binary && type == Observation::PCD)
+      writer.reset(new PCDWriter(file, PCDFieldLayout::BINARY));
+    else if (type == Observation::PACKED)
+      writer.reset(new PackedWriter(file, packedTolerance));
     else
+      return ObservationWriter::createWriter(file, type);
+    writer->init();
+    return writer;
+    NUKLEI_TRACE_END();
+  }
+
+  class ConvertPipeline
+  {
+  public:
+    void append(ConvertStage *stage)
     {
-      for (std::vector< boost::shared_ptr<Observation> >::const_iterator
-           i = observations.begin();
-           i != observations.end(); ++i)
+      if (!stages_.empty()) stages_.back().setNext(stage);
+      stages_.push_back(stage);
+    }
+
+    void push(Chunk &chunk) { if (!chunk.empty()) stages_.front().push(chunk); }
+    void finish() { stages_.front().finish(); }
+
+  private:
+    boost::ptr_vector<ConvertStage> stages_;
+  };
+
+}
+
+void convert(const std::vector<std::string>& files,
+             const kernel::se3* transfo = NULL,
+             const double scale = 0,
+             const bool normalizePose = false,
+             const std::string& normalizingTransfoFile = "",
+             const bool normalizeScale = false,
+             const std::string& normalizingScaleFile = "",
+             const bool uniformizeWeights = false,
+             const Observation::Type inType = Observation::UNKNOWN,
+             const Observation::Type outType = Observation::UNKNOWN,
+             boost::shared_ptr<RegionOfInterest> roi = boost::shared_ptr<RegionOfInterest>(),
+             const int nObs = -1,
+             const double minDist = 0,
+             const bool removePlane = false,
+             const int ransacIter = 100,
+             const double inlierThreshold = 8,
+             const std::string& fittedPlaneFile = "",
+             bool makeR3xS2P = false,
+             bool removeNormals = false,
+             const std::string &filterRGB = "",
+             const std::string &setRGB = "",
+             const Color::Type colorToLoc = Color::UNKNOWN,
+             const double voxelStride = 0,
+             const bool binaryOutput = false,
+             const double packedTolerance = PACKED_POSITION_TOLERANCE)
+{
+  std::auto_ptr<ObservationWriter> writer;
+  Observation::Type writerType = outType;
+  Observation::Type readerType = Observation::UNKNOWN;
+  ConvertPipeline pipeline;
+
+  // Sampling while reading is equivalent to SubsampleStage only if a
+  // single file is read, if the reader does not already sample on a voxel
+  // grid, and if no earlier stage drops kernels, changes weights, or
+  // depends on the whole cloud.
+  const bool sampleWhileReading = nObs >= 0 && files.size() == 2 &&
+    voxelStride <= 0 &&
+    !uniformizeWeights && !removePlane && fittedPlaneFile.empty() &&
+    filterRGB.empty() && !makeR3xS2P && !normalizePose &&
+    normalizingTransfoFile.empty() && !normalizeScale &&
+    normalizingScaleFile.empty() && minDist == 0;
+  boost::shared_ptr<SubsamplingPolicy> policy;
+  if (voxelStride > 0)
+    policy.reset(new VoxelSubsampling(voxelStride));
+
+  // When there are several input files, they are read concurrently, in
+  // windows of at most twice as many files as threads (which lets the
+  // dynamic schedule of readObservations() balance files of unequal
+  // sizes). The files of a window are pushed through the pipeline, in
+  // order, before the next window is read, so that at most one window is
+  // held in memory. A single remaining file, and files that share a voxel
+  // grid, are streamed by a reader that parses in parallel.
+  const unsigned nInputs = files.size() - 1;
+  unsigned window = 1;
+#ifdef _OPENMP
+  window = 2 * omp_get_max_threads();
+#endif
+  std::vector<ObservationFile> loaded;
+  unsigned loadedBegin = 0;
+
+  for (unsigned f = 0; f < nInputs; ++f)
+  {
+    if (!policy && window > 1 &&
+        f == loadedBegin + loaded.size() && f + 1 < nInputs)
+    {
+      loaded.clear();
+      for (unsigned i = f; i < std::min(f + window, nInputs); ++i)
+      {
+        loaded.push_back(ObservationFile(files.at(i), inType));
+        loaded.back().roi = roi;
+      }
+      readObservations(loaded);
+      loadedBegin = f;
+    }
+    ObservationFile* file = NULL;
+    if (f >= loadedBegin && f < loadedBegin + loaded.size())
+      file = &loaded.at(f - loadedBegin);
+
+    std::auto_ptr<ObservationReader> reader;
+    if (file == NULL)
+    {
+      if (inType == Observation::UNKNOWN)
+        reader = ObservationReader::createReader(files.at(f));
+      else
+        reader = ObservationReader::createReader(files.at(f), inType);
+
+      reader->addRegionOfInterest(roi);
+      if (sampleWhileReading)
+        policy.reset(new WeightedReservoirSampling(nObs));
+      if (policy) reader->setSubsamplingPolicy(policy);
+      readerType = reader->type();
+    }
+    else readerType = file->type;
+
+    if (writer.get() == NULL)
+    {
+      if (writerType == Observation::UNKNOWN)
+        writerType = readerType;
+
+      if (makeR3xS2P)
+      {
+        NUKLEI_ASSERT(setRGB.empty());
+        if (!(writerType == Observation::SERIAL ||
+              writerType == Observation::NUKLEI ||
+              writerType == Observation::TXT ||
+              writerType == Observation::PCD))
+          NUKLEI_THROW("Normal computation only available when outputing " <<
+                       nameFromType<Observation>(Observation::SERIAL) << "or " <<
+                       nameFromType<Observation>(Observation::NUKLEI) << "or " <<
+                       nameFromType<Observation>(Observation::TXT) << "or " <<
+                       nameFromType<Observation>(Observation::PCD) << ".");
+      }
+
+      writer = createWriter(files.back(), writerType, binaryOutput,
+                            packedTolerance);
+
+      // Stages are in the order in which the filters have always been
+      // applied.
+      if (transfo != NULL || scale > 0)
+        pipeline.append(new TransformStage(transfo, scale));
+      if (uniformizeWeights)
+        pipeline.append(new UniformWeightStage);
+      if (removePlane || !fittedPlaneFile.empty())
+        pipeline.append(new PlaneStage(removePlane, ransacIter,
+                                       inlierThreshold, fittedPlaneFile));
+      if (!filterRGB.empty())
+        pipeline.append(new ColorFilterStage(filterRGB));
+      if (removeNormals)
+        pipeline.append(new RemoveNormalsStage);
+      if (makeR3xS2P)
+        pipeline.append(new NormalsStage);
+      if (!setRGB.empty())
       {
-        writer->writeObservation(**i);
+        NUKLEI_ASSERT(!makeR3xS2P);
+        pipeline.append(new SetColorStage(setRGB));
       }
+      if (normalizePose || !normalizingTransfoFile.empty())
+        pipeline.append(new NormalizePoseStage(normalizePose,
+                                               normalizingTransfoFile));
+      if (normalizeScale || !normalizingScaleFile.empty())
+        pipeline.append(new NormalizeScaleStage(normalizeScale,
+                                                normalizingScaleFile));
+      if (colorToLoc != Color::UNKNOWN)
+        pipeline.append(new ColorToLocStage(colorToLoc));
+      if (minDist > 0 || minDist == -1)
+        pipeline.append(new MinDistStage(minDist));
+      if (nObs >= 0 && !sampleWhileReading)
+        pipeline.append(new SubsampleStage(nObs));
+      pipeline.append(new WriterStage(*writer));
+    }
+
+    if (reader.get() == NULL)
+    {
+      pipeline.push(file->kernels);
+      file->kernels.clear();
+      continue;
+    }
+
+    Chunk chunk;
+    while (reader->readKernels(chunk, CHUNK_SIZE) > 0)
+    {
+      pipeline.push(chunk);
+      chunk.clear();
     }
+    pipeline.push(chunk);
+  }
+  
+  if (files.size() > 2 && !uniformizeWeights &&
+      (readerType == Observation::NUKLEI || readerType == Observation::SERIAL))
+  {
+    std::cout << "Warning: concatenating several files. "
+    "Keep in mind that weights may not be consistently mixed. "
+    "Use --uniformize_weights if appropriate." << std::endl;
   }
 
-  writer->writeBuffer();
+  pipeline.finish();
 }
 
 int convert(int argc, char ** argv)
@@ -569,11 +923,28 @@ int convert(int argc, char ** argv)
      false, nameFromType<Observation>(Observation::UNKNOWN),
      listTypeNames<Observation>(), cmd);
 
+  TCLAP::SwitchArg binaryOutputArg
+    ("", "binary",
+     "Write PLY and PCD output in binary form instead of ASCII.", cmd);
+
+  TCLAP::ValueArg<double> packedToleranceArg
+    ("", "packed_tolerance",
+     "Quantization error allowed on the positions of packed output, "
+     "relative to the largest side of the bounding box.",
+     false, PACKED_POSITION_TOLERANCE, "float", cmd);
+
   TCLAP::ValueArg<int> nObsArg
     ("n", "num_obs",
      "Number of output observations.",
      false, -1, "int", cmd);
 
+  TCLAP::ValueArg<double> voxelStrideArg
+  ("", "voxel_stride",
+   "Keep only the first input point of each cubic voxel of this side. "
+   "Points are dropped while the input is read, before any other "
+   "filter.",
+   false, 0, "float", cmd);
+
   TCLAP::ValueArg<double> minDistArg
   ("", "min_dist",
    "In the output set, points are at least separated by the value of this "
@@ -760,7 +1131,10 @@ int convert(int argc, char ** argv)
           removeNormalsArg.getValue(),
           filterRGBArg.getValue(),
           setRGBColorArg.getValue(),
-          typeFromName<Color>(colorToLocArg.getValue()));
+          typeFromName<Color>(colorToLocArg.getValue()),
+          voxelStrideArg.getValue(),
+          binaryOutputArg.getValue(),
+          packedToleranceArg.getValue());
   
   return 0;
   
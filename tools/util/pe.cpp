@@ -88,11 +88,45 @@ int pe(int argc, char ** argv)
      "File containing XYZ of the camera.",
      false, "", "filename", cmd);
 
+    ValueArg<std::string> meshFileArg
+    ("", "mesh",
+     "OFF file containing a mesh of the model, for --partial. Partial views "
+     "computed from the mesh are cached next to it.",
+     false, "", "filename", cmd);
+
+    SwitchArg writeMeshArg
+    ("", "write_mesh",
+     "If the file given to --mesh does not exist, compute the mesh and "
+     "write it to that file.", cmd);
+
     ValueArg<double> meshVisibilityArg
     ("", "point_to_mesh_visibility_dist",
      "Sets the distance to the mesh at which a point is considered to be visible.",
      false, 4., "float", cmd);
     
+    ValueArg<std::string> icpArg
+    ("", "icp",
+     "Refine the best MCMC pose with ICP. "
+     "Accepted values: point (point-to-point) and plane (point-to-plane).",
+     false, "", "point|plane", cmd);
+    
+    ValueArg<int> icpIterationsArg
+    ("", "icp_iterations",
+     "Maximum number of ICP iterations.",
+     false, 10, "int", cmd);
+    
+    ValueArg<int> nStepsArg
+    ("", "n_steps",
+     "Number of steps of each MCMC chain. By default, 10 times the number of "
+     "model points (40 times with --partial).",
+     false, 0, "int", cmd);
+    
+    SwitchArg informativeSubsetArg
+    ("", "informative_subset",
+     "Score poses with a fixed subset of model points that covers the "
+     "model evenly and favors high-curvature regions, instead of a random "
+     "subset drawn at each step.", cmd);
+    
     ValueArg<std::string> groundTruthFileArg
     ("", "ground_truth_transfo",
      "File the ground truth transformation. The file must provide kernel bandwidth, "
@@ -115,10 +149,21 @@ int pe(int argc, char ** argv)
                      boost::shared_ptr<CustomIntegrandFactor>(),
                      partialviewArg.getValue());
     pe.setMeshToVisibilityTol(meshVisibilityArg.getValue());
+    pe.writeComputedMesh(writeMeshArg.getValue());
+    pe.setNumberOfSteps(nStepsArg.getValue());
+    pe.useInformativeSubset(informativeSubsetArg.getValue());
+    if (icpArg.getValue() == "point")
+      pe.setIcpRefinement(PoseEstimator::ICP_POINT_TO_POINT,
+                          icpIterationsArg.getValue());
+    else if (icpArg.getValue() == "plane")
+      pe.setIcpRefinement(PoseEstimator::ICP_POINT_TO_PLANE,
+                          icpIterationsArg.getValue());
+    else if (!icpArg.getValue().empty())
+      NUKLEI_THROW("Unknown ICP variant `" << icpArg.getValue() << "'.");
     
     pe.load(objectFileArg.getValue(),
             sceneFileArg.getValue(),
-            "",
+            meshFileArg.getValue(),
             viewpointFileArg.getValue(),
             !useWholeSceneCloudArg.getValue(),
             true);